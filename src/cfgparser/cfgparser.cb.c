@@ -80,8 +80,34 @@ bool cfg_options_callback(cfg_options_t *section)
     if ( section->groupname == NULL )
         section->groupname = cfg_default_string("feng");
 
-    if ( section->buffered_frames == 0 )
-        section->buffered_frames = 16;
+    if ( section->buffer_low_ms == 0 )
+        section->buffer_low_ms = 500;
+
+    if ( section->buffer_high_ms == 0 )
+        section->buffer_high_ms = 2000;
+
+    if ( section->buffer_low_ms > section->buffer_high_ms ) {
+        yyerror("buffer-low-ms is higher than buffer-high-ms");
+        return false;
+    }
+
+    if ( section->buffer_max_bytes == 0 )
+        section->buffer_max_bytes = 8*1024*1024;
+
+    if ( section->buffer_memory == 0 )
+        section->buffer_memory = 256;
+
+    if ( section->readahead_time == 0 )
+        section->readahead_time = 2000;
+
+    if ( section->packetizer_threads == 0 )
+        section->packetizer_threads = 4;
+
+    if ( section->prefetch_resources == 0 )
+        section->prefetch_resources = 16;
+
+    if ( section->prefetch_timeout == 0 )
+        section->prefetch_timeout = 5000;
 
     if ( section->log_level == 0 )
         section->log_level = FNC_LOG_WARN;
@@ -148,6 +174,33 @@ bool cfg_vhost_callback(cfg_vhost_t *section)
     if ( section->max_connections == 0 )
         section->max_connections = FENG_MAX_SESSION_DEFAULT;
 
+    if ( section->cache_segment_size == 0 )
+        section->cache_segment_size = 1024;
+
+    if ( section->cache_memory == 0 )
+        section->cache_memory = 64;
+
+    if ( section->cache_prefetch == 0 )
+        section->cache_prefetch = 2;
+
+    if ( section->cache_disk_admit == 0 )
+        section->cache_disk_admit = 2;
+
+    if ( section->hls_segment_duration == 0 )
+        section->hls_segment_duration = 6;
+
+    if ( section->hls_memory == 0 )
+        section->hls_memory = 64;
+
+    if ( section->hls_live_segments == 0 )
+        section->hls_live_segments = 6;
+
+    if ( section->archive_segment_duration == 0 )
+        section->archive_segment_duration = 600;
+
+    if ( section->archive_memory == 0 )
+        section->archive_memory = 32;
+
     configured_vhosts = g_list_append(configured_vhosts,
                                       g_slice_dup(cfg_vhost_t, section));
 
@@ -118,6 +118,20 @@ strings: | strings STRING { list = g_list_append(list, yylval.string); };
       <xsl:text>_set: </xsl:text>
       <xsl:value-of select="translate(@name, $tokenval, $tokennam)" />
       <xsl:text>_TOKEN '{' </xsl:text>
+      <!-- values with a default that can be overridden with 0 -->
+      <xsl:if test="value[@default]">
+        <xsl:text>{ </xsl:text>
+        <xsl:for-each select="value[@default]">
+          <xsl:text>cfg_current.</xsl:text>
+          <xsl:value-of select="translate(../@name, $tokenval, $setname)" />
+          <xsl:text>.</xsl:text>
+          <xsl:value-of select="translate(@name, $tokenval, $setname)" />
+          <xsl:text> = </xsl:text>
+          <xsl:value-of select="@default" />
+          <xsl:text>; </xsl:text>
+        </xsl:for-each>
+        <xsl:text>} </xsl:text>
+      </xsl:if>
       <xsl:value-of select="translate(@name, $tokenval, $setname)" />
       <xsl:text>_contents '}' ';'</xsl:text>
       <xsl:text> { if ( !cfg_</xsl:text>
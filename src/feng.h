@@ -74,6 +74,7 @@ void stats_init();
  * @{
  */
 gboolean feng_str_is_unreserved(const char *string);
+gboolean feng_path_is_safe(const char *path);
 
 #ifdef DOXYGEN
 void feng_assert_or_goto(gboolean condition, label label_name);
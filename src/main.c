@@ -285,6 +285,12 @@ static void command_environment(int argc, char **argv)
     progname = g_path_get_basename(argv[0]);
 
     fnc_log_init(progname);
+
+    if ( feng_srv.buffered_frames )
+        fnc_log(FNC_LOG_WARN,
+                "buffered-frames is deprecated, use buffer-low-ms and "
+                "buffer-high-ms; it is only used as a minimum amount of "
+                "packets to buffer");
 }
 
 int main(int argc, char **argv)
@@ -310,6 +316,12 @@ int main(int argc, char **argv)
 
     feng_drop_privs();
 
+#ifdef LIVE_STREAMING
+    /* after dropping the privileges, so that the archives are owned
+       by the configured user */
+    archive_init();
+#endif
+
     http_tunnel_initialise();
 
     clients_init();
@@ -319,6 +331,10 @@ int main(int argc, char **argv)
     /* This is explicit to send disconnections! */
     clients_cleanup();
 
+#ifdef LIVE_STREAMING
+    archive_cleanup();
+#endif
+
 #ifdef CLEANUP_DESTRUCTOR
     ev_loop_destroy(feng_loop);
 #endif
@@ -0,0 +1,232 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Audio frame aggregation
+ *
+ * Audio codecs produce small frames at a high rate; sending each one
+ * in its own RTP packet makes the headers and the per-packet costs
+ * dominate. The parsers of the formats allowing it hand their frames
+ * over to an aggregator instead, which gathers consecutive frames and
+ * builds the packet with the rules of the payload format (see @ref
+ * AggregateFormat) once it is full: when the next frame would not fit
+ * in the MTU, or would bring the packet past the audio-packet-time of
+ * the vhost or the limits of the format.
+ *
+ * The frames of a single demuxed packet are always allowed in the same
+ * RTP packet, so that with no audio-packet-time the packets are the
+ * same as without aggregation.
+ *
+ * The aggregator is flushed when the parsing of the packets handed
+ * over to the track is drained (see @ref pipeline_drain), and dropped
+ * when they are flushed for a seek.
+ */
+
+#include <config.h>
+
+#include <math.h>
+#include <string.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+struct Aggregator {
+    const AggregateFormat *format;
+
+    /** Frames gathered, back to back */
+    GByteArray *payload;
+    /** Size of each frame gathered (guint) */
+    GArray *sizes;
+
+    double timestamp;
+    double delivery;
+    double duration;
+
+    /** Presentation time of the demuxed packet of the first frame */
+    double packet_pts;
+
+    /** End of the last packet sent, NAN if none */
+    double last_end;
+};
+
+/**
+ * @brief Build the packet of the frames gathered
+ */
+void aggr_flush(Track *tr)
+{
+    struct Aggregator *ag = tr->aggregator;
+    struct MParserBuffer *buffer;
+    guint frames;
+
+    if ( ag == NULL || (frames = ag->sizes->len) == 0 )
+        return;
+
+    buffer = g_slice_new0(struct MParserBuffer);
+
+    buffer->timestamp = ag->timestamp;
+    buffer->delivery = ag->delivery;
+    buffer->duration = ag->duration;
+    buffer->marker = !ag->format->talkspurts || isnan(ag->last_end) ||
+        fabs(ag->timestamp - ag->last_end) > ag->duration / frames / 2;
+
+    buffer->data = g_malloc(ag->format->packet_size(frames, ag->payload->len));
+    buffer->data_size = ag->format->write(tr, buffer->data,
+                                          (guint*)ag->sizes->data, frames,
+                                          ag->payload->data);
+
+    ag->last_end = ag->timestamp + ag->duration;
+
+    track_write(tr, buffer);
+
+    if ( frames > 1 ) {
+        media_stat_add(MEDIA_STAT_AUDIO_AGGREGATED_PACKETS, 1);
+        media_stat_add(MEDIA_STAT_AUDIO_AGGREGATED_FRAMES, frames);
+    }
+
+    g_byte_array_set_size(ag->payload, 0);
+    g_array_set_size(ag->sizes, 0);
+}
+
+/**
+ * @brief Tells whether a frame can join the ones gathered
+ */
+static gboolean aggr_fits(Track *tr, struct Aggregator *ag,
+                          const uint8_t *data, size_t len,
+                          double timestamp, double duration)
+{
+    const guint frames = ag->sizes->len;
+    const double expected = ag->timestamp + ag->duration;
+    double max_time;
+
+    if ( frames >= ag->format->max_frames )
+        return false;
+
+    if ( ag->format->packet_size(frames + 1, ag->payload->len + len) > DEFAULT_MTU )
+        return false;
+
+    if ( ag->format->max_duration &&
+         ag->duration + duration > ag->format->max_duration + 1e-6 )
+        return false;
+
+    if ( ag->format->compatible &&
+         !ag->format->compatible(ag->payload->data, data) )
+        return false;
+
+    /* not the frame following the ones gathered */
+    if ( fabs(timestamp - expected) > duration / 2 )
+        return false;
+
+    /* the frames of a demuxed packet always go together */
+    max_time = feng_default_vhost->audio_packet_time / 1000.0;
+    if ( ag->packet_pts == tr->pts )
+        max_time = MAX(max_time, tr->frame_duration);
+
+    if ( ag->duration + duration > max_time + 1e-6 )
+        return false;
+
+    /* a GOP of the packet cache cannot end within the packet */
+    return pcache_same_gop(tr, ag->delivery, tr->dts);
+}
+
+/**
+ * @brief Hand a frame over to the aggregator of a track
+ *
+ * @param tr The track the frame belongs to
+ * @param format The payload format the packets are built with
+ * @param data The frame, which is copied
+ * @param len The size of @p data; the frame alone has to fit in a
+ *            packet
+ * @param offset Presentation time of the frame, from the one of the
+ *               track (for demuxed packets holding several frames)
+ * @param duration Duration of the frame
+ *
+ * The packet gathered so far is sent first if the frame cannot be
+ * added to it.
+ */
+void aggr_frame(Track *tr, const AggregateFormat *format,
+                const uint8_t *data, size_t len,
+                double offset, double duration)
+{
+    struct Aggregator *ag = tr->aggregator;
+    const double timestamp = tr->pts + offset;
+    const guint size = len;
+
+    if ( ag == NULL ) {
+        ag = tr->aggregator = g_slice_new0(struct Aggregator);
+        ag->payload = g_byte_array_new();
+        ag->sizes = g_array_new(false, false, sizeof(guint));
+        ag->last_end = NAN;
+    }
+
+    ag->format = format;
+
+    if ( ag->sizes->len && !aggr_fits(tr, ag, data, len, timestamp, duration) )
+        aggr_flush(tr);
+
+    if ( ag->sizes->len == 0 ) {
+        ag->timestamp = timestamp;
+        ag->delivery = tr->dts + offset;
+        ag->duration = 0;
+        ag->packet_pts = tr->pts;
+    }
+
+    g_byte_array_append(ag->payload, data, len);
+    g_array_append_val(ag->sizes, size);
+    ag->duration += duration;
+
+    /* last frame of the demuxed packet, and the next one would not
+     * fit in the time anyway: do not hold the packet back */
+    if ( timestamp + duration >= tr->pts + tr->frame_duration - 1e-6 &&
+         ag->duration + duration > feng_default_vhost->audio_packet_time / 1000.0 + 1e-6 )
+        aggr_flush(tr);
+}
+
+/**
+ * @brief Drop the frames gathered
+ */
+void aggr_reset(Track *tr)
+{
+    struct Aggregator *ag = tr->aggregator;
+
+    if ( ag == NULL )
+        return;
+
+    g_byte_array_set_size(ag->payload, 0);
+    g_array_set_size(ag->sizes, 0);
+    ag->last_end = NAN;
+}
+
+void aggr_free(Track *tr)
+{
+    struct Aggregator *ag = tr->aggregator;
+
+    if ( ag == NULL )
+        return;
+
+    g_byte_array_free(ag->payload, true);
+    g_array_free(ag->sizes, true);
+    g_slice_free(struct Aggregator, ag);
+
+    tr->aggregator = NULL;
+}
@@ -0,0 +1,601 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Archives of the live resources
+ *
+ * The tracks of the channels listed in @c archive-channels are
+ * recorded in @c archive-root, one rtpdump file per track, rotated
+ * every @c archive-segment-duration seconds of wall clock:
+ * @c archive-root/channel/track-YYYYmmdd-HHMMSS.rtpdump
+ *
+ * The packets are copied as they are received from flux into
+ * block-sized batches, which are handed over to a single writer
+ * thread running at idle I/O priority; the writer only issues writes
+ * of whole blocks, except for the tail of each file, and for the data
+ * kept back for more than @ref ARCHIVE_FLUSH_DELAY, which is written
+ * anyway so that a channel going quiet is still on disk. When the disk
+ * falls behind and the batches waiting for it exceed
+ * @c archive-memory, the new packets are dropped from the archive
+ * and accounted for, instead of slowing down the delivery.
+ *
+ * At shutdown the batches are handed to the writer, which writes
+ * them and closes the files.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+# include <sys/syscall.h>
+# include <sys/resource.h>
+#endif
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @brief Size of the batches handed to the writer, and of the writes
+ */
+#define ARCHIVE_BLOCK (64*1024)
+
+/**
+ * @brief Longest time the packets of an archive are kept in memory,
+ *        in seconds
+ */
+#define ARCHIVE_FLUSH_DELAY 1.0
+
+/** Size of the header of an RTP packet as archived */
+#define ARCHIVE_RTP_HEADER 12
+
+/** Size of the header of each packet in an rtpdump file */
+#define ARCHIVE_RECORD_HEADER 8
+
+static const char ARCHIVE_FILE_MAGIC[] = "#!rtpplay1.0 0.0.0.0/0\n";
+
+/**
+ * @brief A batch of packets waiting to be written
+ */
+typedef struct {
+    struct Archive *archive;
+
+    /** File the batch starts, or NULL if it continues the current one */
+    char *path;
+
+    /** Write the tail of the file too, not only whole blocks */
+    gboolean flush;
+
+    GByteArray *data;
+} ArchiveChunk;
+
+/**
+ * @brief Archive of a live track
+ */
+struct Archive {
+    Track *track;
+
+    /** Directory the files of the track are written to */
+    char *dir;
+
+    uint32_t ssrc;
+
+    /**
+     * @brief Lock of the batch being filled, taken by the thread
+     *        reading the track
+     */
+    GMutex *lock;
+
+    /** Batch being filled */
+    ArchiveChunk *pending;
+
+    /**
+     * @brief Set by @ref archive_cleanup once the last batch was
+     *        handed over to the writer
+     *
+     * A thread that fetched the archive from the track just before it
+     * was detached finds it set once it gets the lock, and drops its
+     * packet rather than queueing it for a writer that is gone.
+     */
+    gboolean closed;
+
+    /** Wall clock time the current file was started at */
+    ev_tstamp segment_start;
+
+    /** Wall clock time the current file has to be rotated at */
+    ev_tstamp segment_end;
+
+    /**
+     * @brief Wall clock time of the oldest packet not surely written
+     *        yet, 0 if none
+     *
+     * @see archive_timer_cb
+     */
+    ev_tstamp unflushed_since;
+
+    /**
+     * @defgroup archive_writer Writer state
+     *
+     * @brief Only used by the writer thread
+     *
+     * @{ */
+    int fd;
+    char *path;
+
+    /** Bytes not written yet, less than a block */
+    GByteArray *carry;
+    /** @} */
+};
+
+/** Batches to write, of type @ref ArchiveChunk */
+static GAsyncQueue *archive_queue;
+
+/** Bytes of the batches not written yet */
+static gint archive_queued;
+
+/** The archives of all the tracks recorded, of type @ref Archive */
+static GList *archives;
+
+static GThread *archive_writer_thread;
+static ev_timer archive_timer;
+
+/**
+ * @brief Give the writer thread the lowest priority
+ *
+ * The I/O priority is lowered to the idle class, so that the disk is
+ * only written when it is not being read for the stored resources.
+ */
+static void archive_lower_priority()
+{
+#if defined(__linux__) && defined(SYS_ioprio_set) && defined(SYS_gettid)
+    static const int IOPRIO_WHO_PROCESS = 1;
+    static const int IOPRIO_CLASS_IDLE = 3;
+    static const int IOPRIO_CLASS_SHIFT = 13;
+    const pid_t tid = syscall(SYS_gettid);
+
+    if ( syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                 IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0 )
+        fnc_log(FNC_LOG_WARN, "[archive] unable to lower the I/O priority: %s",
+                strerror(errno));
+
+    /* on Linux the nice value is per thread */
+    setpriority(PRIO_PROCESS, tid, 19);
+#endif
+}
+
+/**
+ * @brief Write all the bytes of a buffer to a file
+ *
+ * @return false on error, with errno set.
+ */
+static gboolean archive_write_all(int fd, const uint8_t *data, size_t len)
+{
+    while ( len > 0 ) {
+        const ssize_t written = write(fd, data, len);
+
+        if ( written < 0 && errno == EINTR )
+            continue;
+
+        if ( written <= 0 )
+            return false;
+
+        data += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Write the whole blocks buffered for a file
+ *
+ * @param all Write also the last partial block, as the file is
+ *            being closed
+ */
+static void archive_flush(struct Archive *ar, gboolean all)
+{
+    const size_t len = all ? ar->carry->len :
+        ar->carry->len - ar->carry->len % ARCHIVE_BLOCK;
+
+    if ( len == 0 )
+        return;
+
+    if ( ar->fd < 0 ) {
+        /* the file could not be written, the data is lost */
+        media_stat_add(MEDIA_STAT_ARCHIVE_DROPPED_BYTES, len);
+    } else if ( !archive_write_all(ar->fd, ar->carry->data, len) ) {
+        fnc_log(FNC_LOG_ERR, "[archive] unable to write %s: %s",
+                ar->path, strerror(errno));
+        media_stat_add(MEDIA_STAT_ARCHIVE_ERRORS, 1);
+        media_stat_add(MEDIA_STAT_ARCHIVE_DROPPED_BYTES, len);
+
+        close(ar->fd);
+        ar->fd = -1;
+    } else
+        media_stat_add(MEDIA_STAT_ARCHIVE_BYTES, len);
+
+    g_byte_array_remove_range(ar->carry, 0, len);
+}
+
+/**
+ * @brief Close the current file of an archive and open the next one
+ *
+ * @note Only called by the writer thread.
+ */
+static void archive_open_file(struct Archive *ar, char *path)
+{
+    archive_flush(ar, true);
+
+    if ( ar->fd >= 0 )
+        close(ar->fd);
+
+    g_free(ar->path);
+    ar->path = path;
+
+    if ( g_mkdir_with_parents(ar->dir, 0755) < 0 ||
+         (ar->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[archive] unable to create %s: %s",
+                path, strerror(errno));
+        media_stat_add(MEDIA_STAT_ARCHIVE_ERRORS, 1);
+        ar->fd = -1;
+        return;
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "[archive] recording %s", path);
+}
+
+/**
+ * @brief Write what is left of the files and close them
+ *
+ * @note Only called by the writer thread, once the last batch was
+ *       written.
+ */
+static void archive_close_files()
+{
+    GList *item;
+
+    for ( item = archives; item; item = item->next ) {
+        struct Archive *ar = item->data;
+
+        archive_flush(ar, true);
+
+        if ( ar->fd >= 0 )
+            close(ar->fd);
+        ar->fd = -1;
+    }
+}
+
+static gpointer archive_writer(ATTR_UNUSED gpointer unused)
+{
+    archive_lower_priority();
+
+    while ( true ) {
+        ArchiveChunk *chunk = g_async_queue_pop(archive_queue);
+        struct Archive *ar = chunk->archive;
+        size_t len;
+
+        /* shutdown request, see archive_cleanup */
+        if ( ar == NULL ) {
+            g_slice_free(ArchiveChunk, chunk);
+            archive_close_files();
+            return NULL;
+        }
+
+        len = chunk->data->len;
+
+        if ( chunk->path )
+            archive_open_file(ar, chunk->path);
+
+        g_byte_array_append(ar->carry, chunk->data->data, len);
+        archive_flush(ar, chunk->flush);
+
+        g_atomic_int_add(&archive_queued, -(gint)len);
+        media_stat_sub(MEDIA_STAT_ARCHIVE_QUEUED_BYTES, len);
+
+        g_byte_array_free(chunk->data, true);
+        g_slice_free(ArchiveChunk, chunk);
+    }
+}
+
+/**
+ * @brief Hand the batch being filled over to the writer
+ *
+ * @param flush Have the writer write all the data it holds for the
+ *              archive, including the last partial block
+ *
+ * @note The caller has to hold @ref Archive::lock.
+ */
+static void archive_push(struct Archive *ar, gboolean flush)
+{
+    if ( ar->pending->data->len == 0 && ar->pending->path == NULL && !flush )
+        return;
+
+    ar->pending->flush = flush;
+    if ( flush )
+        ar->unflushed_since = 0;
+
+    g_async_queue_push(archive_queue, ar->pending);
+
+    ar->pending = g_slice_new0(ArchiveChunk);
+    ar->pending->archive = ar;
+    ar->pending->data = g_byte_array_sized_new(ARCHIVE_BLOCK);
+}
+
+/**
+ * @brief Account bytes added to the batch being filled
+ */
+static void archive_queue_bytes(size_t len)
+{
+    g_atomic_int_add(&archive_queued, len);
+    media_stat_add(MEDIA_STAT_ARCHIVE_QUEUED_BYTES, len);
+}
+
+/**
+ * @brief Start a new file for an archive
+ *
+ * @note The caller has to hold @ref Archive::lock.
+ */
+static void archive_rotate(struct Archive *ar, ev_tstamp now)
+{
+    const unsigned int duration = feng_default_vhost->archive_segment_duration;
+    const time_t start = now;
+    uint32_t header[4];
+    char stamp[32];
+    struct tm tm;
+
+    archive_push(ar, false);
+
+    gmtime_r(&start, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    ar->pending->path = g_strdup_printf("%s/%s-%s.rtpdump",
+                                        ar->dir, ar->track->name, stamp);
+
+    /* files are cut at multiples of the duration on the clock */
+    ar->segment_start = now;
+    ar->segment_end = (start / duration + 1) * (ev_tstamp)duration;
+
+    header[0] = htonl(start);
+    header[1] = htonl((now - start) * 1000000);
+    header[2] = 0;              /* source address */
+    header[3] = 0;              /* source port, padding */
+
+    g_byte_array_append(ar->pending->data, (const guint8*)ARCHIVE_FILE_MAGIC,
+                        strlen(ARCHIVE_FILE_MAGIC));
+    g_byte_array_append(ar->pending->data, (const guint8*)header,
+                        sizeof(header));
+
+    archive_queue_bytes(strlen(ARCHIVE_FILE_MAGIC) + sizeof(header));
+}
+
+/**
+ * @brief Copy a buffer received for a live track to its archive
+ *
+ * @param tr The live track the buffer was received for
+ * @param buffer The buffer, holding an RTP payload; it is not kept
+ *
+ * This never waits for the disk: if too much data is already waiting
+ * to be written, the packet is dropped from the archive.
+ */
+void archive_write(Track *tr, const struct MParserBuffer *buffer)
+{
+    struct Archive *ar = g_atomic_pointer_get(&tr->archive);
+    const size_t limit = (size_t)feng_default_vhost->archive_memory * 1024 * 1024;
+    const size_t size = ARCHIVE_RECORD_HEADER + ARCHIVE_RTP_HEADER +
+        buffer->data_size;
+    const ev_tstamp now = ev_time();
+    uint8_t header[ARCHIVE_RECORD_HEADER + ARCHIVE_RTP_HEADER];
+    uint32_t offset;
+
+    if ( ar == NULL )
+        return;
+
+    /* rtpdump records have a 16-bit length */
+    if ( size > G_MAXUINT16 ||
+         (size_t)g_atomic_int_get(&archive_queued) + size > limit ) {
+        media_stat_add(MEDIA_STAT_ARCHIVE_DROPPED, 1);
+        media_stat_add(MEDIA_STAT_ARCHIVE_DROPPED_BYTES, size);
+        return;
+    }
+
+    g_mutex_lock(ar->lock);
+
+    if ( ar->closed ) {
+        g_mutex_unlock(ar->lock);
+        return;
+    }
+
+    if ( now >= ar->segment_end )
+        archive_rotate(ar, now);
+
+    offset = (now - ar->segment_start) * 1000;
+
+    header[0] = size >> 8;
+    header[1] = size;
+    header[2] = (size - ARCHIVE_RECORD_HEADER) >> 8;
+    header[3] = (size - ARCHIVE_RECORD_HEADER);
+    header[4] = offset >> 24;
+    header[5] = offset >> 16;
+    header[6] = offset >> 8;
+    header[7] = offset;
+
+    header[8] = 0x80;           /* version 2 */
+    header[9] = (buffer->marker ? 0x80 : 0) | (tr->payload_type & 0x7f);
+    header[10] = buffer->seq_no >> 8;
+    header[11] = buffer->seq_no;
+    header[12] = buffer->rtp_timestamp >> 24;
+    header[13] = buffer->rtp_timestamp >> 16;
+    header[14] = buffer->rtp_timestamp >> 8;
+    header[15] = buffer->rtp_timestamp;
+    header[16] = ar->ssrc >> 24;
+    header[17] = ar->ssrc >> 16;
+    header[18] = ar->ssrc >> 8;
+    header[19] = ar->ssrc;
+
+    g_byte_array_append(ar->pending->data, header, sizeof(header));
+    g_byte_array_append(ar->pending->data, buffer->data, buffer->data_size);
+    archive_queue_bytes(size);
+
+    if ( ar->unflushed_since == 0 )
+        ar->unflushed_since = now;
+
+    if ( ar->pending->data->len >= ARCHIVE_BLOCK )
+        archive_push(ar, false);
+
+    g_mutex_unlock(ar->lock);
+}
+
+static void archive_track_start(Track *tr, const char *channel)
+{
+    struct Archive *ar = g_slice_new0(struct Archive);
+
+    ar->track = tr;
+    ar->dir = g_build_filename(feng_default_vhost->archive_root, channel, NULL);
+    ar->ssrc = g_random_int();
+    ar->lock = g_mutex_new();
+    ar->fd = -1;
+    ar->carry = g_byte_array_sized_new(2 * ARCHIVE_BLOCK);
+
+    ar->pending = g_slice_new0(ArchiveChunk);
+    ar->pending->archive = ar;
+    ar->pending->data = g_byte_array_sized_new(ARCHIVE_BLOCK);
+
+    /* the first packet starts the first file */
+    ar->segment_end = 0;
+
+    archives = g_list_prepend(archives, ar);
+
+    g_atomic_pointer_set(&tr->archive, ar);
+}
+
+/**
+ * @brief Have the packets kept back for too long written
+ *
+ * Batches are handed to the writer when they fill a block, and the
+ * writer keeps the last partial block of the files: the packets of a
+ * quiet track would stay in memory indefinitely.
+ */
+static void archive_timer_cb(ATTR_UNUSED struct ev_loop *loop,
+                             ATTR_UNUSED ev_timer *w,
+                             ATTR_UNUSED int revents)
+{
+    const ev_tstamp now = ev_time();
+    GList *item;
+
+    for ( item = archives; item; item = item->next ) {
+        struct Archive *ar = item->data;
+
+        g_mutex_lock(ar->lock);
+        if ( ar->unflushed_since &&
+             now - ar->unflushed_since >= ARCHIVE_FLUSH_DELAY )
+            archive_push(ar, true);
+        g_mutex_unlock(ar->lock);
+    }
+}
+
+/**
+ * @brief Start recording the configured channels
+ *
+ * The live resources of the channels are opened, and kept open, so
+ * that they are read even when no client is playing them.
+ */
+void archive_init()
+{
+    GList *item;
+
+    if ( feng_default_vhost->archive_root == NULL ||
+         feng_default_vhost->archive_channels == NULL )
+        return;
+
+    archive_queue = g_async_queue_new();
+    archive_writer_thread = g_thread_create(archive_writer, NULL, true, NULL);
+
+    ev_timer_init(&archive_timer, archive_timer_cb,
+                  ARCHIVE_FLUSH_DELAY, ARCHIVE_FLUSH_DELAY);
+    ev_timer_start(feng_loop, &archive_timer);
+
+    for ( item = feng_default_vhost->archive_channels; item; item = item->next ) {
+        const char *channel = item->data;
+        char *path;
+        Resource *r;
+        GList *track;
+
+        if ( ! feng_path_is_safe(channel) || channel[0] == '/' ) {
+            fnc_log(FNC_LOG_ERR, "[archive] invalid channel name '%s'", channel);
+            continue;
+        }
+
+        path = g_strconcat("/virtual/", channel, NULL);
+        r = r_open(path);
+        g_free(path);
+
+        if ( r == NULL ) {
+            fnc_log(FNC_LOG_ERR, "[archive] unable to open channel '%s'", channel);
+            continue;
+        }
+
+        for ( track = r->tracks; track; track = track->next )
+            archive_track_start(track->data, channel);
+
+        fnc_log(FNC_LOG_INFO, "[archive] recording channel '%s' in %s",
+                channel, feng_default_vhost->archive_root);
+    }
+}
+
+/**
+ * @brief Write the packets received so far and close the archives
+ *
+ * The tracks are not archived anymore afterwards; this waits for the
+ * writer to be done with the disk.
+ */
+void archive_cleanup()
+{
+    ArchiveChunk *quit;
+    GList *item;
+
+    if ( archive_queue == NULL )
+        return;
+
+    ev_timer_stop(feng_loop, &archive_timer);
+
+    for ( item = archives; item; item = item->next ) {
+        struct Archive *ar = item->data;
+
+        g_mutex_lock(ar->lock);
+        g_atomic_pointer_set(&ar->track->archive, NULL);
+        archive_push(ar, true);
+        ar->closed = true;
+        g_mutex_unlock(ar->lock);
+    }
+
+    quit = g_slice_new0(ArchiveChunk);
+    g_async_queue_push(archive_queue, quit);
+
+    g_thread_join(archive_writer_thread);
+}
@@ -0,0 +1,273 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Edit lists (collage) parsing and timeline
+ *
+ * An edit list (".ds" file) describes a resource as a sequence of
+ * segments of other resources, one per line:
+ *
+ * @verbatim
+# comment
+file.mov 0.0 1.0
+other.mkv 12.5 20.0
+@endverbatim
+ *
+ * The file paths are relative to the directory the edit list is in;
+ * start and end times are in seconds.
+ *
+ * This file only takes care of the description and the layout of the
+ * timeline, the playback is implemented by @ref resource_edl.c.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "media/media.h"
+
+static void edl_segment_free(gpointer segment_p,
+                             ATTR_UNUSED gpointer user_data)
+{
+    EditListSegment *segment = segment_p;
+
+    g_free(segment->path);
+    g_slice_free(EditListSegment, segment);
+}
+
+/**
+ * @brief Parse a single line of an edit list
+ *
+ * @return A new segment, or NULL if the line is not valid.
+ *
+ * The two times are the last two fields of the line, so that the path
+ * can contain whitespace.
+ */
+static EditListSegment *edl_parse_line(char *line)
+{
+    EditListSegment *segment;
+    char *end_str, *start_str, *endptr;
+    double start, end;
+
+    g_strdelimit(line, "\t", ' ');
+    g_strstrip(line);
+
+    if ( (end_str = strrchr(line, ' ')) == NULL )
+        return NULL;
+    *end_str++ = '\0';
+    g_strchomp(line);
+
+    if ( (start_str = strrchr(line, ' ')) == NULL )
+        return NULL;
+    *start_str++ = '\0';
+    g_strchomp(line);
+
+    start = g_ascii_strtod(start_str, &endptr);
+    if ( *endptr != '\0' )
+        return NULL;
+
+    end = g_ascii_strtod(end_str, &endptr);
+    if ( *endptr != '\0' )
+        return NULL;
+
+    if ( *line == '\0' || start < 0 || end <= start )
+        return NULL;
+
+    segment = g_slice_new0(EditListSegment);
+    segment->path = g_strdup(line);
+    segment->start = start;
+    segment->end = end;
+
+    return segment;
+}
+
+/**
+ * @brief Parse an edit list
+ *
+ * @param contents The contents of the edit list file, NUL-terminated
+ *
+ * @return A new EditList, or NULL if the list is not valid or empty.
+ *
+ * Segments that continue the previous one (same file, starting where
+ * the previous ended) are merged together, since there is no cut to
+ * do between them.
+ *
+ * The timeline is laid out by @ref edl_layout before returning.
+ */
+EditList *edl_parse(const char *contents)
+{
+    EditList *edl = g_slice_new0(EditList);
+    gchar **lines = g_strsplit(contents, "\n", 0), **line;
+
+    edl->segments = g_ptr_array_new();
+
+    for ( line = lines; *line; line++ ) {
+        EditListSegment *segment, *last;
+
+        g_strstrip(*line);
+        if ( **line == '\0' || **line == '#' )
+            continue;
+
+        if ( (segment = edl_parse_line(*line)) == NULL )
+            goto error;
+
+        last = edl->segments->len ?
+            g_ptr_array_index(edl->segments, edl->segments->len-1) : NULL;
+
+        if ( last && last->end == segment->start &&
+             strcmp(last->path, segment->path) == 0 ) {
+            last->end = segment->end;
+            edl_segment_free(segment, NULL);
+            continue;
+        }
+
+        g_ptr_array_add(edl->segments, segment);
+    }
+
+    g_strfreev(lines);
+
+    if ( edl->segments->len == 0 ) {
+        edl_free(edl);
+        return NULL;
+    }
+
+    edl_layout(edl);
+
+    return edl;
+
+ error:
+    g_strfreev(lines);
+    edl_free(edl);
+    return NULL;
+}
+
+void edl_free(EditList *edl)
+{
+    if ( edl == NULL )
+        return;
+
+    g_ptr_array_foreach(edl->segments, edl_segment_free, NULL);
+    g_ptr_array_free(edl->segments, true);
+    g_slice_free(EditList, edl);
+}
+
+/**
+ * @brief Lay out the segments on the timeline
+ *
+ * Each segment is placed right after the previous one; this has to be
+ * called again whenever the start of a segment is changed, for
+ * instance to align it with a keyframe.
+ */
+void edl_layout(EditList *edl)
+{
+    double offset = 0;
+    guint i;
+
+    for ( i = 0; i < edl->segments->len; i++ ) {
+        EditListSegment *segment = g_ptr_array_index(edl->segments, i);
+
+        segment->offset = offset;
+        offset += segment->end - segment->start;
+    }
+
+    edl->duration = offset;
+}
+
+/**
+ * @brief Find the segment playing at a given time of the timeline
+ *
+ * @return The index of the segment; times past the end of the timeline
+ *         return the last segment.
+ */
+guint edl_find_segment(EditList *edl, double time)
+{
+    guint lo = 0, hi = edl->segments->len;
+
+    while ( hi - lo > 1 ) {
+        guint mid = (lo + hi) / 2;
+        EditListSegment *segment = g_ptr_array_index(edl->segments, mid);
+
+        if ( segment->offset <= time )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * @brief Map a time of the segment's file onto the timeline
+ */
+double edl_to_timeline(const EditListSegment *segment, double time)
+{
+    return time - segment->start + segment->offset;
+}
+
+/**
+ * @brief Offset mapping the packets of the segment's file onto the
+ *        timeline
+ *
+ * @param segment The segment
+ * @param start_time The stream time the file starts at: the times of
+ *                   the segment are from the start of the file, while
+ *                   its packets carry stream times
+ *
+ * @return The offset to add to the stream times of the packets.
+ */
+double edl_stream_offset(const EditListSegment *segment, double start_time)
+{
+    return segment->offset - segment->start - start_time;
+}
+
+/**
+ * @brief Find the segment playing at a given time, looping the
+ *        timeline
+ *
+ * @param edl The edit list
+ * @param time Time since the first start of the timeline; replaced
+ *             with the corresponding time within the segment's file
+ *
+ * @return The index of the segment.
+ *
+ * This is used by scheduled channels, which play their edit list over
+ * and over on the wall clock.
+ */
+guint edl_loop_segment(EditList *edl, double *time)
+{
+    double pos = fmod(*time, edl->duration);
+    EditListSegment *segment;
+    guint i;
+
+    if ( pos < 0 )
+        pos += edl->duration;
+
+    i = edl_find_segment(edl, pos);
+    segment = g_ptr_array_index(edl->segments, i);
+
+    *time = segment->start + (pos - segment->offset);
+
+    return i;
+}
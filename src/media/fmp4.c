@@ -0,0 +1,1002 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Fragmented MP4 (ISO/IEC 14496-12) writer
+ *
+ * Only what HLS needs is written: an initialization segment with the
+ * sample descriptions of the tracks and no samples, and media
+ * segments made of a single moof/mdat pair. Supported codecs are
+ * H.264, whose samples are stored with 4-byte NAL lengths (unless
+ * the avcC record given says otherwise), and AAC.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <math.h>
+
+#include "media/media.h"
+
+/** Flags of the samples that can be decoded on their own */
+#define FMP4_SAMPLE_SYNC 0x02000000
+/** Flags of the samples depending on others (sample_is_non_sync_sample) */
+#define FMP4_SAMPLE_NON_SYNC 0x01010000
+
+static const unsigned int aac_sample_rates[] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+    16000, 12000, 11025, 8000, 7350
+};
+
+/**
+ * @defgroup fmp4_bits Bitstream reading
+ *
+ * @{
+ */
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;     /*!< in bits */
+} BitReader;
+
+static unsigned int bits_read(BitReader *br, unsigned int count)
+{
+    unsigned int value = 0;
+
+    while ( count-- ) {
+        value <<= 1;
+        if ( br->pos < br->len * 8 )
+            value |= (br->data[br->pos / 8] >> (7 - br->pos % 8)) & 1;
+        br->pos++;
+    }
+
+    return value;
+}
+
+/** Exp-Golomb unsigned value (ue(v)) */
+static unsigned int bits_read_ue(BitReader *br)
+{
+    unsigned int zeros = 0;
+
+    while ( bits_read(br, 1) == 0 && zeros < 31 &&
+            br->pos < br->len * 8 )
+        zeros++;
+
+    return (1 << zeros) - 1 + bits_read(br, zeros);
+}
+
+/** Exp-Golomb signed value (se(v)) */
+static int bits_read_se(BitReader *br)
+{
+    unsigned int value = bits_read_ue(br);
+
+    return (value & 1) ? (int)(value + 1) / 2 : -(int)(value / 2);
+}
+
+/** @} */
+
+/**
+ * @brief Copy a NAL unit removing the emulation prevention bytes
+ */
+static GByteArray *nal_unescape(const uint8_t *nal, size_t len)
+{
+    GByteArray *rbsp = g_byte_array_sized_new(len);
+    size_t i;
+
+    for ( i = 0; i < len; i++ ) {
+        if ( i >= 2 && nal[i] == 3 && nal[i-1] == 0 && nal[i-2] == 0 ) {
+            /* the byte following a removed one cannot start a new
+               escape sequence */
+            if ( ++i == len )
+                break;
+        }
+
+        g_byte_array_append(rbsp, &nal[i], 1);
+    }
+
+    return rbsp;
+}
+
+static void scaling_list_skip(BitReader *br, int size)
+{
+    int last = 8, next = 8, i;
+
+    for ( i = 0; i < size; i++ ) {
+        if ( next != 0 )
+            next = (last + bits_read_se(br) + 256) % 256;
+        last = next == 0 ? last : next;
+    }
+}
+
+/**
+ * @brief Get the size of the pictures from an H.264 sequence
+ *        parameter set
+ *
+ * @param sps The NAL unit of the SPS, header included
+ * @param len Size of @p sps
+ * @param width Filled in with the width of the pictures
+ * @param height Filled in with the height of the pictures
+ *
+ * @return false if the SPS is not valid.
+ */
+gboolean fmp4_h264_sps_size(const uint8_t *sps, size_t len,
+                            int *width, int *height)
+{
+    GByteArray *rbsp;
+    BitReader br;
+    unsigned int profile, chroma = 1, frame_mbs_only;
+    unsigned int mbs_width, map_units_height;
+    unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    int crop_x, crop_y;
+    gboolean valid;
+
+    if ( len < 4 || (sps[0] & 0x1f) != 7 )
+        return false;
+
+    rbsp = nal_unescape(sps + 1, len - 1);
+    br.data = rbsp->data;
+    br.len = rbsp->len;
+    br.pos = 0;
+
+    profile = bits_read(&br, 8);
+    bits_read(&br, 16);         /* constraint flags, level */
+    bits_read_ue(&br);          /* seq_parameter_set_id */
+
+    switch ( profile ) {
+    case 100: case 110: case 122: case 244: case 44:
+    case 83: case 86: case 118: case 128: case 138:
+    case 139: case 134: case 135:
+        if ( (chroma = bits_read_ue(&br)) == 3 )
+            bits_read(&br, 1);  /* separate_colour_plane_flag */
+        bits_read_ue(&br);      /* bit_depth_luma_minus8 */
+        bits_read_ue(&br);      /* bit_depth_chroma_minus8 */
+        bits_read(&br, 1);      /* qpprime_y_zero_transform_bypass_flag */
+        if ( bits_read(&br, 1) ) {
+            int i;
+
+            for ( i = 0; i < (chroma == 3 ? 12 : 8); i++ )
+                if ( bits_read(&br, 1) )
+                    scaling_list_skip(&br, i < 6 ? 16 : 64);
+        }
+        break;
+    }
+
+    bits_read_ue(&br);          /* log2_max_frame_num_minus4 */
+
+    switch ( bits_read_ue(&br) ) {
+    case 0:
+        bits_read_ue(&br);      /* log2_max_pic_order_cnt_lsb_minus4 */
+        break;
+    case 1: {
+        unsigned int cycle, i;
+
+        bits_read(&br, 1);      /* delta_pic_order_always_zero_flag */
+        bits_read_se(&br);      /* offset_for_non_ref_pic */
+        bits_read_se(&br);      /* offset_for_top_to_bottom_field */
+        cycle = bits_read_ue(&br);
+        for ( i = 0; i < cycle && br.pos < br.len * 8; i++ )
+            bits_read_se(&br);
+        break;
+    }
+    }
+
+    bits_read_ue(&br);          /* max_num_ref_frames */
+    bits_read(&br, 1);          /* gaps_in_frame_num_value_allowed_flag */
+
+    mbs_width = bits_read_ue(&br) + 1;
+    map_units_height = bits_read_ue(&br) + 1;
+
+    if ( !(frame_mbs_only = bits_read(&br, 1)) )
+        bits_read(&br, 1);      /* mb_adaptive_frame_field_flag */
+
+    bits_read(&br, 1);          /* direct_8x8_inference_flag */
+
+    if ( bits_read(&br, 1) ) {
+        crop_left = bits_read_ue(&br);
+        crop_right = bits_read_ue(&br);
+        crop_top = bits_read_ue(&br);
+        crop_bottom = bits_read_ue(&br);
+    }
+
+    valid = br.pos <= br.len * 8;
+    g_byte_array_free(rbsp, true);
+
+    if ( !valid )
+        return false;
+
+    crop_x = chroma == 1 || chroma == 2 ? 2 : 1;
+    crop_y = (2 - frame_mbs_only) * (chroma == 1 ? 2 : 1);
+
+    *width = mbs_width * 16 - crop_x * (crop_left + crop_right);
+    *height = (2 - frame_mbs_only) * map_units_height * 16 -
+        crop_y * (crop_top + crop_bottom);
+
+    return *width > 0 && *height > 0;
+}
+
+/**
+ * @brief Find the next Annex B start code
+ *
+ * @return The offset of the start code in @p data, or @p len if
+ *         there is none; @p code_len is set to its length.
+ */
+static size_t annexb_next(const uint8_t *data, size_t len, size_t from,
+                          size_t *code_len)
+{
+    size_t i;
+
+    for ( i = from; i + 3 <= len; i++ ) {
+        if ( data[i] != 0 || data[i+1] != 0 )
+            continue;
+
+        if ( data[i+2] == 1 ) {
+            *code_len = 3;
+            return i;
+        }
+
+        if ( data[i+2] == 0 && i + 4 <= len && data[i+3] == 1 ) {
+            *code_len = 4;
+            return i;
+        }
+    }
+
+    *code_len = 0;
+    return len;
+}
+
+/**
+ * @brief Call a function for each NAL unit of an Annex B buffer
+ */
+static void annexb_foreach(const uint8_t *data, size_t len,
+                           void (*func)(const uint8_t *nal, size_t len,
+                                        gpointer user_data),
+                           gpointer user_data)
+{
+    size_t code_len, start = annexb_next(data, len, 0, &code_len);
+
+    while ( start < len ) {
+        size_t next_len, next;
+
+        start += code_len;
+        next = annexb_next(data, len, start, &next_len);
+
+        /* trailing zeros belong to the next start code */
+        if ( next > start )
+            func(data + start, next - start, user_data);
+
+        start = next;
+        code_len = next_len;
+    }
+}
+
+typedef struct {
+    const uint8_t *sps, *pps;
+    size_t sps_len, pps_len;
+} ParameterSets;
+
+static void annexb_find_parameter_sets(const uint8_t *nal, size_t len,
+                                       gpointer user_data)
+{
+    ParameterSets *ps = user_data;
+
+    switch ( nal[0] & 0x1f ) {
+    case 7:
+        if ( ps->sps == NULL ) {
+            ps->sps = nal;
+            ps->sps_len = len;
+        }
+        break;
+    case 8:
+        if ( ps->pps == NULL ) {
+            ps->pps = nal;
+            ps->pps_len = len;
+        }
+        break;
+    }
+}
+
+static void annexb_append_avcc(const uint8_t *nal, size_t len,
+                               gpointer user_data)
+{
+    GByteArray *out = user_data;
+    const uint8_t size[4] = { len >> 24, len >> 16, len >> 8, len };
+
+    g_byte_array_append(out, size, 4);
+    g_byte_array_append(out, nal, len);
+}
+
+/**
+ * @brief Create a new track to write
+ *
+ * @param id Identifier of the track within the file, starting from 1
+ * @param media_type Either MP_video (H.264) or MP_audio (AAC)
+ */
+FMP4Track *fmp4_track_new(guint id, MediaType media_type)
+{
+    FMP4Track *t = g_slice_new0(FMP4Track);
+
+    t->id = id;
+    t->media_type = media_type;
+    t->timescale = 90000;
+    t->config = g_byte_array_new();
+    t->samples = g_array_new(false, false, sizeof(FMP4Sample));
+    t->data = g_byte_array_new();
+
+    return t;
+}
+
+void fmp4_track_free(FMP4Track *t)
+{
+    if ( t == NULL )
+        return;
+
+    g_byte_array_free(t->config, true);
+    g_array_free(t->samples, true);
+    g_byte_array_free(t->data, true);
+    g_slice_free(FMP4Track, t);
+}
+
+/**
+ * @brief Set the parameter sets of an H.264 track
+ *
+ * @param t The track to configure
+ * @param sps The sequence parameter set NAL unit
+ * @param sps_len Size of @p sps
+ * @param pps The picture parameter set NAL unit
+ * @param pps_len Size of @p pps
+ *
+ * @return false if the SPS is not valid.
+ */
+gboolean fmp4_track_set_h264(FMP4Track *t,
+                             const uint8_t *sps, size_t sps_len,
+                             const uint8_t *pps, size_t pps_len)
+{
+    uint8_t header[8];
+
+    if ( !fmp4_h264_sps_size(sps, sps_len, &t->width, &t->height) )
+        return false;
+
+    header[0] = 1;              /* configurationVersion */
+    header[1] = sps[1];         /* AVCProfileIndication */
+    header[2] = sps[2];         /* profile_compatibility */
+    header[3] = sps[3];         /* AVCLevelIndication */
+    header[4] = 0xff;           /* 4-byte NAL lengths */
+    header[5] = 0xe1;           /* one SPS */
+    header[6] = sps_len >> 8;
+    header[7] = sps_len;
+
+    g_byte_array_set_size(t->config, 0);
+    g_byte_array_append(t->config, header, 8);
+    g_byte_array_append(t->config, sps, sps_len);
+
+    header[0] = 1;              /* one PPS */
+    header[1] = pps_len >> 8;
+    header[2] = pps_len;
+
+    g_byte_array_append(t->config, header, 3);
+    g_byte_array_append(t->config, pps, pps_len);
+
+    t->annexb = false;
+    return true;
+}
+
+/**
+ * @brief Set the codec data of an H.264 track as found in the
+ *        extradata of the demuxer
+ *
+ * @param t The track to configure
+ * @param extradata Either an avcC record, or the parameter sets in
+ *                  Annex B format; in the latter case the samples are
+ *                  converted to NAL lengths as they are added.
+ * @param len Size of @p extradata
+ *
+ * @return false if the codec data is not valid.
+ */
+gboolean fmp4_track_set_h264_extradata(FMP4Track *t,
+                                       const uint8_t *extradata, size_t len)
+{
+    ParameterSets ps = { NULL, NULL, 0, 0 };
+
+    if ( len >= 7 && extradata[0] == 1 ) {
+        size_t sps_len;
+
+        if ( (extradata[5] & 0x1f) == 0 ||
+             (sps_len = (extradata[6] << 8) | extradata[7]) + 8 > len ||
+             !fmp4_h264_sps_size(extradata + 8, sps_len,
+                                 &t->width, &t->height) )
+            return false;
+
+        g_byte_array_set_size(t->config, 0);
+        g_byte_array_append(t->config, extradata, len);
+        t->annexb = false;
+        return true;
+    }
+
+    annexb_foreach(extradata, len, annexb_find_parameter_sets, &ps);
+
+    if ( ps.sps == NULL || ps.pps == NULL ||
+         !fmp4_track_set_h264(t, ps.sps, ps.sps_len, ps.pps, ps.pps_len) )
+        return false;
+
+    t->annexb = true;
+    return true;
+}
+
+/**
+ * @brief Set the AudioSpecificConfig of an AAC track
+ *
+ * @return false if the configuration is not valid.
+ */
+gboolean fmp4_track_set_aac(FMP4Track *t, const uint8_t *config, size_t len)
+{
+    BitReader br = { config, len, 0 };
+    unsigned int index;
+
+    if ( len < 2 )
+        return false;
+
+    if ( bits_read(&br, 5) == 31 )
+        bits_read(&br, 6);
+
+    if ( (index = bits_read(&br, 4)) == 15 )
+        t->sample_rate = bits_read(&br, 24);
+    else if ( index < G_N_ELEMENTS(aac_sample_rates) )
+        t->sample_rate = aac_sample_rates[index];
+    else
+        return false;
+
+    t->channels = bits_read(&br, 4);
+
+    if ( t->sample_rate == 0 || br.pos > len * 8 )
+        return false;
+
+    /* sample durations are exact in the sampling rate */
+    t->timescale = t->sample_rate;
+
+    g_byte_array_set_size(t->config, 0);
+    g_byte_array_append(t->config, config, len);
+
+    return true;
+}
+
+static int64_t fmp4_ticks(const FMP4Track *t, double time)
+{
+    return llrint(time * t->timescale);
+}
+
+/**
+ * @brief Add a sample to a track
+ *
+ * @param t The track to add the sample to
+ * @param dts Decoding time of the sample, in seconds
+ * @param pts Presentation time of the sample, in seconds
+ * @param duration Duration of the sample, in seconds, used only if no
+ *                 other sample follows it; zero or NAN to use the
+ *                 duration of the previous sample.
+ * @param key Whether the sample can be decoded on its own
+ * @param data Payload of the sample (for H.264, the NAL units of an
+ *             access unit, in the format of the codec data)
+ * @param len Size of @p data
+ *
+ * Decoding times are kept from going back (and below zero, as the
+ * decoding time of the fragments is unsigned), the presentation times
+ * are stored as they are.
+ */
+void fmp4_track_add_sample(FMP4Track *t, double dts, double pts,
+                           double duration, gboolean key,
+                           const uint8_t *data, size_t len)
+{
+    FMP4Sample sample;
+    FMP4Sample *prev = t->samples->len ?
+        &g_array_index(t->samples, FMP4Sample, t->samples->len - 1) : NULL;
+
+    if ( isnan(dts) )
+        dts = pts;
+    if ( isnan(pts) )
+        pts = dts;
+
+    sample.dts = MAX(fmp4_ticks(t, dts), 0);
+    if ( prev && sample.dts < prev->dts )
+        sample.dts = prev->dts;
+    sample.cts_offset = fmp4_ticks(t, pts) - sample.dts;
+
+    if ( prev && sample.dts > prev->dts )
+        prev->duration = sample.dts - prev->dts;
+
+    if ( !isnan(duration) && duration > 0 )
+        sample.duration = fmp4_ticks(t, duration);
+    else
+        sample.duration = prev ? prev->duration : 0;
+
+    sample.key = key;
+    sample.offset = t->data->len;
+
+    if ( t->annexb )
+        annexb_foreach(data, len, annexb_append_avcc, t->data);
+    else
+        g_byte_array_append(t->data, data, len);
+
+    sample.size = t->data->len - sample.offset;
+
+    g_array_append_val(t->samples, sample);
+}
+
+/**
+ * @brief Remove the first samples of a track
+ */
+static void fmp4_track_shift(FMP4Track *t, guint count)
+{
+    size_t size;
+    guint i;
+
+    if ( count == 0 )
+        return;
+
+    size = count < t->samples->len ?
+        g_array_index(t->samples, FMP4Sample, count).offset : t->data->len;
+
+    g_array_remove_range(t->samples, 0, count);
+    g_byte_array_remove_range(t->data, 0, size);
+
+    for ( i = 0; i < t->samples->len; i++ )
+        g_array_index(t->samples, FMP4Sample, i).offset -= size;
+}
+
+/**
+ * @brief Count the samples of a track decoded before a given time
+ */
+static guint fmp4_track_count(const FMP4Track *t, double end)
+{
+    guint count = 0;
+
+    if ( isinf(end) )
+        return t->samples->len;
+
+    while ( count < t->samples->len &&
+            g_array_index(t->samples, FMP4Sample, count).dts <
+            fmp4_ticks(t, end) )
+        count++;
+
+    return count;
+}
+
+/**
+ * @brief Drop the samples of a track decoded before a given time
+ */
+void fmp4_track_trim(FMP4Track *t, double end)
+{
+    fmp4_track_shift(t, fmp4_track_count(t, end));
+}
+
+/**
+ * @brief Decoding time of the first sample of a track, in seconds
+ *
+ * @return NAN if the track has no sample.
+ */
+double fmp4_track_start(const FMP4Track *t)
+{
+    if ( t->samples->len == 0 )
+        return NAN;
+
+    return (double)g_array_index(t->samples, FMP4Sample, 0).dts / t->timescale;
+}
+
+/**
+ * @defgroup fmp4_boxes Boxes writing
+ *
+ * @{
+ */
+
+static void put_u8(GByteArray *b, uint8_t value)
+{
+    g_byte_array_append(b, &value, 1);
+}
+
+static void put_u16(GByteArray *b, uint16_t value)
+{
+    const uint8_t bytes[2] = { value >> 8, value };
+
+    g_byte_array_append(b, bytes, 2);
+}
+
+static void put_u32(GByteArray *b, uint32_t value)
+{
+    const uint8_t bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+
+    g_byte_array_append(b, bytes, 4);
+}
+
+static void put_u64(GByteArray *b, uint64_t value)
+{
+    put_u32(b, value >> 32);
+    put_u32(b, value);
+}
+
+static void put_zeros(GByteArray *b, size_t count)
+{
+    size_t len = b->len;
+
+    g_byte_array_set_size(b, len + count);
+    memset(b->data + len, 0, count);
+}
+
+static void set_u32(GByteArray *b, size_t pos, uint32_t value)
+{
+    b->data[pos] = value >> 24;
+    b->data[pos+1] = value >> 16;
+    b->data[pos+2] = value >> 8;
+    b->data[pos+3] = value;
+}
+
+/**
+ * @brief Start a box, whose size is written by @ref box_close
+ *
+ * @return The position of the box.
+ */
+static size_t box_open(GByteArray *b, const char type[4])
+{
+    size_t pos = b->len;
+
+    put_u32(b, 0);
+    g_byte_array_append(b, (const guint8*)type, 4);
+
+    return pos;
+}
+
+static size_t fullbox_open(GByteArray *b, const char type[4],
+                           uint8_t version, uint32_t flags)
+{
+    size_t pos = box_open(b, type);
+
+    put_u32(b, (version << 24) | flags);
+
+    return pos;
+}
+
+static void box_close(GByteArray *b, size_t pos)
+{
+    set_u32(b, pos, b->len - pos);
+}
+
+static void put_matrix(GByteArray *b)
+{
+    put_u32(b, 0x00010000);
+    put_zeros(b, 12);
+    put_u32(b, 0x00010000);
+    put_zeros(b, 12);
+    put_u32(b, 0x40000000);
+}
+
+/** @} */
+
+static void fmp4_write_avc1(GByteArray *b, const FMP4Track *t)
+{
+    size_t entry = box_open(b, "avc1"), avcc;
+
+    put_zeros(b, 6);
+    put_u16(b, 1);              /* data_reference_index */
+    put_zeros(b, 16);
+    put_u16(b, t->width);
+    put_u16(b, t->height);
+    put_u32(b, 0x00480000);     /* 72 dpi */
+    put_u32(b, 0x00480000);
+    put_u32(b, 0);
+    put_u16(b, 1);              /* frame_count */
+    put_zeros(b, 32);           /* compressorname */
+    put_u16(b, 0x0018);         /* depth */
+    put_u16(b, 0xffff);         /* pre_defined */
+
+    avcc = box_open(b, "avcC");
+    g_byte_array_append(b, t->config->data, t->config->len);
+    box_close(b, avcc);
+
+    box_close(b, entry);
+}
+
+/**
+ * @brief Write an ISO/IEC 14496-1 descriptor header
+ */
+static void put_descriptor(GByteArray *b, uint8_t tag, size_t len)
+{
+    put_u8(b, tag);
+    put_u8(b, 0x80 | ((len >> 21) & 0x7f));
+    put_u8(b, 0x80 | ((len >> 14) & 0x7f));
+    put_u8(b, 0x80 | ((len >> 7) & 0x7f));
+    put_u8(b, len & 0x7f);
+}
+
+static void fmp4_write_mp4a(GByteArray *b, const FMP4Track *t)
+{
+    const size_t dsi_len = t->config->len;
+    const size_t dcd_len = 13 + 5 + dsi_len;
+    const size_t es_len = 3 + 5 + dcd_len + 5 + 1;
+    size_t entry = box_open(b, "mp4a"), esds;
+
+    put_zeros(b, 6);
+    put_u16(b, 1);              /* data_reference_index */
+    put_zeros(b, 8);
+    put_u16(b, t->channels);
+    put_u16(b, 16);             /* samplesize */
+    put_zeros(b, 4);
+    put_u32(b, t->sample_rate < 0x10000 ? t->sample_rate << 16 : 0);
+
+    esds = fullbox_open(b, "esds", 0, 0);
+
+    put_descriptor(b, 0x03, es_len);        /* ES_Descriptor */
+    put_u16(b, t->id);
+    put_u8(b, 0);
+
+    put_descriptor(b, 0x04, dcd_len);       /* DecoderConfigDescriptor */
+    put_u8(b, 0x40);                        /* ISO/IEC 14496-3 audio */
+    put_u8(b, 0x15);                        /* audio stream */
+    put_zeros(b, 3 + 4 + 4);                /* buffer size, bitrates */
+
+    put_descriptor(b, 0x05, dsi_len);       /* DecoderSpecificInfo */
+    g_byte_array_append(b, t->config->data, dsi_len);
+
+    put_descriptor(b, 0x06, 1);             /* SLConfigDescriptor */
+    put_u8(b, 0x02);
+
+    box_close(b, esds);
+    box_close(b, entry);
+}
+
+static void fmp4_write_trak(GByteArray *b, const FMP4Track *t)
+{
+    const gboolean video = t->media_type == MP_video;
+    size_t trak = box_open(b, "trak");
+    size_t mdia, minf, dinf, stbl, box;
+    static const char *const empty_tables[] = { "stts", "stsc", "stco" };
+    guint i;
+
+    box = fullbox_open(b, "tkhd", 0, 0x000003);
+    put_zeros(b, 8);            /* creation, modification time */
+    put_u32(b, t->id);
+    put_zeros(b, 4 + 4 + 8);    /* reserved, duration, reserved */
+    put_u16(b, 0);              /* layer */
+    put_u16(b, 0);              /* alternate_group */
+    put_u16(b, video ? 0 : 0x0100);
+    put_u16(b, 0);
+    put_matrix(b);
+    put_u32(b, video ? t->width << 16 : 0);
+    put_u32(b, video ? t->height << 16 : 0);
+    box_close(b, box);
+
+    mdia = box_open(b, "mdia");
+
+    box = fullbox_open(b, "mdhd", 0, 0);
+    put_zeros(b, 8);
+    put_u32(b, t->timescale);
+    put_u32(b, 0);              /* duration */
+    put_u16(b, 0x55c4);         /* "und" */
+    put_u16(b, 0);
+    box_close(b, box);
+
+    box = fullbox_open(b, "hdlr", 0, 0);
+    put_u32(b, 0);
+    g_byte_array_append(b, (const guint8*)(video ? "vide" : "soun"), 4);
+    put_zeros(b, 12);
+    g_byte_array_append(b, (const guint8*)"feng", 5);
+    box_close(b, box);
+
+    minf = box_open(b, "minf");
+
+    if ( video ) {
+        box = fullbox_open(b, "vmhd", 0, 1);
+        put_zeros(b, 8);
+    } else {
+        box = fullbox_open(b, "smhd", 0, 0);
+        put_zeros(b, 4);
+    }
+    box_close(b, box);
+
+    dinf = box_open(b, "dinf");
+    box = fullbox_open(b, "dref", 0, 0);
+    put_u32(b, 1);
+    box_close(b, fullbox_open(b, "url ", 0, 1));
+    box_close(b, box);
+    box_close(b, dinf);
+
+    stbl = box_open(b, "stbl");
+
+    box = fullbox_open(b, "stsd", 0, 0);
+    put_u32(b, 1);
+    if ( video )
+        fmp4_write_avc1(b, t);
+    else
+        fmp4_write_mp4a(b, t);
+    box_close(b, box);
+
+    for ( i = 0; i < G_N_ELEMENTS(empty_tables); i++ ) {
+        box = fullbox_open(b, empty_tables[i], 0, 0);
+        put_u32(b, 0);
+        box_close(b, box);
+    }
+
+    box = fullbox_open(b, "stsz", 0, 0);
+    put_u32(b, 0);
+    put_u32(b, 0);
+    box_close(b, box);
+
+    box_close(b, stbl);
+    box_close(b, minf);
+    box_close(b, mdia);
+    box_close(b, trak);
+}
+
+/**
+ * @brief Write the initialization segment for a set of tracks
+ *
+ * @return A new byte array with the ftyp and moov boxes.
+ */
+GByteArray *fmp4_init_segment(FMP4Track *const *tracks, guint count)
+{
+    GByteArray *b = g_byte_array_new();
+    size_t moov, mvex, box;
+    guint i;
+
+    box = box_open(b, "ftyp");
+    g_byte_array_append(b, (const guint8*)"iso5", 4);
+    put_u32(b, 512);
+    g_byte_array_append(b, (const guint8*)"iso5iso6mp41", 12);
+    box_close(b, box);
+
+    moov = box_open(b, "moov");
+
+    box = fullbox_open(b, "mvhd", 0, 0);
+    put_zeros(b, 8);
+    put_u32(b, 1000);           /* timescale */
+    put_u32(b, 0);              /* duration */
+    put_u32(b, 0x00010000);     /* rate */
+    put_u16(b, 0x0100);         /* volume */
+    put_zeros(b, 10);
+    put_matrix(b);
+    put_zeros(b, 24);
+    put_u32(b, count + 1);      /* next_track_ID */
+    box_close(b, box);
+
+    for ( i = 0; i < count; i++ )
+        fmp4_write_trak(b, tracks[i]);
+
+    mvex = box_open(b, "mvex");
+    for ( i = 0; i < count; i++ ) {
+        box = fullbox_open(b, "trex", 0, 0);
+        put_u32(b, tracks[i]->id);
+        put_u32(b, 1);          /* default_sample_description_index */
+        put_zeros(b, 12);
+        box_close(b, box);
+    }
+    box_close(b, mvex);
+
+    box_close(b, moov);
+
+    return b;
+}
+
+/**
+ * @brief Write a media segment with the samples of a set of tracks
+ *
+ * @param tracks The tracks to take the samples from
+ * @param count The number of tracks
+ * @param sequence The sequence number of the fragment
+ * @param end Time the samples have to be decoded before to be
+ *            included, in seconds; INFINITY to include them all
+ *
+ * @return A new byte array with the moof and mdat boxes, or NULL if
+ *         there is no sample to write. The samples written are
+ *         removed from the tracks.
+ */
+GByteArray *fmp4_media_segment(FMP4Track *const *tracks, guint count,
+                               guint32 sequence, double end)
+{
+    GByteArray *b;
+    guint *samples = g_new0(guint, count);
+    size_t *offsets = g_new0(size_t, count);
+    size_t moof, traf, box, mdat_size = 8;
+    guint i, j;
+
+    for ( i = 0; i < count; i++ ) {
+        samples[i] = fmp4_track_count(tracks[i], end);
+
+        if ( samples[i] )
+            mdat_size += samples[i] < tracks[i]->samples->len ?
+                g_array_index(tracks[i]->samples, FMP4Sample, samples[i]).offset :
+                tracks[i]->data->len;
+    }
+
+    if ( mdat_size == 8 ) {
+        g_free(samples);
+        g_free(offsets);
+        return NULL;
+    }
+
+    b = g_byte_array_new();
+    moof = box_open(b, "moof");
+
+    box = fullbox_open(b, "mfhd", 0, 0);
+    put_u32(b, sequence);
+    box_close(b, box);
+
+    for ( i = 0; i < count; i++ ) {
+        const FMP4Track *t = tracks[i];
+
+        if ( samples[i] == 0 )
+            continue;
+
+        traf = box_open(b, "traf");
+
+        box = fullbox_open(b, "tfhd", 0, 0x020000); /* default-base-is-moof */
+        put_u32(b, t->id);
+        box_close(b, box);
+
+        box = fullbox_open(b, "tfdt", 1, 0);
+        put_u64(b, g_array_index(t->samples, FMP4Sample, 0).dts);
+        box_close(b, box);
+
+        /* data offset, sample duration, size, flags and composition
+           time offset */
+        box = fullbox_open(b, "trun", 1, 0x000f01);
+        put_u32(b, samples[i]);
+        offsets[i] = b->len;
+        put_u32(b, 0);
+
+        for ( j = 0; j < samples[i]; j++ ) {
+            const FMP4Sample *s = &g_array_index(t->samples, FMP4Sample, j);
+
+            put_u32(b, s->duration);
+            put_u32(b, s->size);
+            put_u32(b, s->key ? FMP4_SAMPLE_SYNC : FMP4_SAMPLE_NON_SYNC);
+            put_u32(b, s->cts_offset);
+        }
+        box_close(b, box);
+
+        box_close(b, traf);
+    }
+
+    box_close(b, moof);
+
+    put_u32(b, mdat_size);
+    g_byte_array_append(b, (const guint8*)"mdat", 4);
+
+    for ( i = 0; i < count; i++ ) {
+        size_t size;
+
+        if ( samples[i] == 0 )
+            continue;
+
+        size = samples[i] < tracks[i]->samples->len ?
+            g_array_index(tracks[i]->samples, FMP4Sample, samples[i]).offset :
+            tracks[i]->data->len;
+
+        set_u32(b, offsets[i], b->len - moof);
+        g_byte_array_append(b, tracks[i]->data->data, size);
+
+        fmp4_track_shift(tracks[i], samples[i]);
+    }
+
+    g_free(samples);
+    g_free(offsets);
+
+    return b;
+}
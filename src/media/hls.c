@@ -0,0 +1,1415 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief HLS playlists and fragmented MP4 segments
+ *
+ * The HLS files of a resource are found under its path:
+ * @c index.m3u8 is the playlist, @c init.mp4 the initialization
+ * segment and @c N.m4s the media segments; they carry the first H.264
+ * and the first AAC track of the resource.
+ *
+ * Stored resources are cut at the keyframes found by the keyframe
+ * index, into segments at least @c hls-segment-duration long; a
+ * segment is generated by seeking the resource to its first keyframe
+ * and collecting the demuxed packets instead of parsing them (see
+ * @ref hls_capture). The files are generated away from the client
+ * threads, once for all the requests that wait for them; they are then
+ * kept in memory, shared among all the HTTP clients, and evicted in
+ * LRU order.
+ *
+ * Live resources are segmented from the same RTP payloads that are
+ * queued for the RTSP clients, while their playlist keeps being
+ * requested; the last segments are kept in memory, and listed in a
+ * sliding playlist.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+extern Resource *avf_open(const char *url);
+extern double avf_start_time(Resource *r);
+
+#define HLS_PLAYLIST "index.m3u8"
+#define HLS_INIT "init.mp4"
+#define HLS_SEGMENT_SUFFIX ".m4s"
+
+static const char HLS_TYPE_PLAYLIST[] = "application/vnd.apple.mpegurl";
+static const char HLS_TYPE_MP4[] = "video/mp4";
+
+/**
+ * @brief Tolerance on the keyframe times the segments start at
+ */
+#define HLS_TIME_SLACK 0.001
+
+/**
+ * @brief Shortest last segment of a stored resource, in seconds,
+ *        shorter ones are merged with the previous one
+ */
+#define HLS_MIN_LAST_SEGMENT 1.0
+
+/**
+ * @brief Seconds without requests after which a live resource is no
+ *        longer segmented
+ */
+#define HLS_LIVE_IDLE 60.0
+
+/**
+ * @brief Segments of a live resource kept after they leave the
+ *        playlist, for the clients that are still fetching them
+ */
+#define HLS_LIVE_SPARE 2
+
+/** Samples of an AAC frame */
+#define HLS_AAC_FRAME 1024
+
+/**
+ * @defgroup hls_files Shared files
+ *
+ * @{
+ */
+
+static HLSFile *hls_file_new(const char *content_type, GByteArray *data,
+                             gboolean live)
+{
+    HLSFile *file = g_slice_new0(HLSFile);
+
+    file->refcount = 1;
+    file->content_type = content_type;
+    file->live = live;
+    file->data = data;
+
+    media_stat_add(MEDIA_STAT_HLS_BYTES, data->len);
+
+    return file;
+}
+
+static HLSFile *hls_file_ref(HLSFile *file)
+{
+    g_atomic_int_inc(&file->refcount);
+    return file;
+}
+
+void hls_file_unref(HLSFile *file)
+{
+    if ( file == NULL || !g_atomic_int_dec_and_test(&file->refcount) )
+        return;
+
+    media_stat_sub(MEDIA_STAT_HLS_BYTES, file->data->len);
+
+    g_byte_array_free(file->data, true);
+    g_slice_free(HLSFile, file);
+}
+
+/**
+ * @brief Write a playlist
+ *
+ * @param sequence Sequence number of the first segment
+ * @param durations Durations of the segments, in seconds
+ * @param count Amount of segments
+ * @param ended Whether no more segments are going to be added
+ */
+static GByteArray *hls_playlist_new(guint32 sequence, const double *durations,
+                                    guint count, gboolean ended)
+{
+    GString *m3u = g_string_new("#EXTM3U\n#EXT-X-VERSION:7\n");
+    GByteArray *data = g_byte_array_new();
+    int target = 1;
+    guint i;
+
+    for ( i = 0; i < count; i++ )
+        target = MAX(target, (int)(durations[i] + 0.5));
+
+    g_string_append_printf(m3u,
+                           "#EXT-X-TARGETDURATION:%d\n"
+                           "#EXT-X-MEDIA-SEQUENCE:%u\n"
+                           "%s"
+                           "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                           "#EXT-X-MAP:URI=\"" HLS_INIT "\"\n",
+                           target, sequence,
+                           ended ? "#EXT-X-PLAYLIST-TYPE:VOD\n" : "");
+
+    for ( i = 0; i < count; i++ )
+        g_string_append_printf(m3u, "#EXTINF:%.3f,\n%u" HLS_SEGMENT_SUFFIX "\n",
+                               durations[i], sequence + i);
+
+    if ( ended )
+        g_string_append(m3u, "#EXT-X-ENDLIST\n");
+
+    g_byte_array_append(data, (const guint8*)m3u->str, m3u->len);
+    g_string_free(m3u, true);
+
+    return data;
+}
+
+/**
+ * @brief Parse the name of a media segment
+ *
+ * @return false if @p name is not the name of a segment.
+ */
+static gboolean hls_segment_number(const char *name, guint32 *number)
+{
+    char *end;
+
+    if ( !g_ascii_isdigit(name[0]) )
+        return false;
+
+    *number = strtoul(name, &end, 10);
+
+    return strcmp(end, HLS_SEGMENT_SUFFIX) == 0;
+}
+
+/** @} */
+
+/**
+ * @defgroup hls_cache Memory cache
+ *
+ * @brief Files of the stored resources, in LRU order
+ *
+ * @{
+ */
+
+typedef struct {
+    char *key;
+    HLSFile *file;
+} HLSCacheEntry;
+
+static GStaticMutex hls_cache_lock = G_STATIC_MUTEX_INIT;
+
+/** Entries by key, of type @ref HLSCacheEntry */
+static GHashTable *hls_cache;
+
+/** Links to the entries, the most recently used first */
+static GQueue hls_cache_lru = G_QUEUE_INIT;
+
+static size_t hls_cache_bytes;
+
+/**
+ * @note The caller has to hold @ref hls_cache_lock.
+ */
+static void hls_cache_remove(GList *link)
+{
+    HLSCacheEntry *entry = link->data;
+
+    g_hash_table_remove(hls_cache, entry->key);
+    g_queue_delete_link(&hls_cache_lru, link);
+
+    hls_cache_bytes -= entry->file->data->len;
+
+    hls_file_unref(entry->file);
+    g_free(entry->key);
+    g_slice_free(HLSCacheEntry, entry);
+}
+
+/**
+ * @return A new reference to the file cached with the given key, or
+ *         NULL if there is none.
+ */
+static HLSFile *hls_cache_lookup(const char *key)
+{
+    HLSFile *file = NULL;
+    GList *link;
+
+    g_static_mutex_lock(&hls_cache_lock);
+
+    if ( hls_cache && (link = g_hash_table_lookup(hls_cache, key)) != NULL ) {
+        g_queue_unlink(&hls_cache_lru, link);
+        g_queue_push_head_link(&hls_cache_lru, link);
+
+        file = hls_file_ref(((HLSCacheEntry *)link->data)->file);
+    }
+
+    g_static_mutex_unlock(&hls_cache_lock);
+
+    return file;
+}
+
+/**
+ * @brief Add a file to the cache, evicting the least recently used
+ *        ones to stay within the configured memory
+ *
+ * @param key The key of the file, now owned by the cache
+ * @param file The file, whose reference is now owned by the cache
+ */
+static void hls_cache_insert(char *key, HLSFile *file)
+{
+    const size_t limit = (size_t)feng_default_vhost->hls_memory * 1024 * 1024;
+    HLSCacheEntry *entry = g_slice_new(HLSCacheEntry);
+    GList *link;
+
+    entry->key = key;
+    entry->file = file;
+
+    g_static_mutex_lock(&hls_cache_lock);
+
+    if ( ! hls_cache )
+        hls_cache = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( (link = g_hash_table_lookup(hls_cache, key)) != NULL )
+        hls_cache_remove(link);
+
+    g_queue_push_head(&hls_cache_lru, entry);
+    g_hash_table_insert(hls_cache, key, hls_cache_lru.head);
+    hls_cache_bytes += file->data->len;
+
+    /* the file just added is kept even if it is bigger than the limit,
+       it is being sent */
+    while ( hls_cache_bytes > limit && hls_cache_lru.length > 1 )
+        hls_cache_remove(hls_cache_lru.tail);
+
+    g_static_mutex_unlock(&hls_cache_lock);
+}
+
+/** @} */
+
+/**
+ * @defgroup hls_stored Stored resources
+ *
+ * @{
+ */
+
+/**
+ * @brief Segment being collected from the demuxed packets
+ *
+ * Video starts from the first keyframe at the start of the segment,
+ * and ends at the first keyframe at or past its end, which starts the
+ * next one; audio is cut by presentation time.
+ */
+struct HLSCapture {
+    Track *tracks[2];
+    FMP4Track *out[2];
+    guint count;
+
+    double start;
+    double end;
+
+    gboolean video_started;
+    gboolean video_ended;
+};
+
+/**
+ * @brief A stored resource opened to generate its HLS files
+ */
+typedef struct {
+    Resource *resource;
+    struct HLSCapture capture;
+
+    /** Start times of the segments, followed by the end of the last */
+    GArray *bounds;
+} HLSStored;
+
+/**
+ * @brief Collect a demuxed packet in the segment being generated
+ *
+ * Called by the demuxer instead of parsing the packet, while @ref
+ * Resource::stored::hls is set.
+ */
+int hls_capture(struct HLSCapture *cap, Track *tr, const uint8_t *data,
+                size_t len, double dts, double pts, double duration,
+                gboolean key)
+{
+    const double time = isnan(pts) ? dts : pts;
+    guint i;
+
+    for ( i = 0; i < cap->count; i++ )
+        if ( cap->tracks[i] == tr )
+            break;
+
+    if ( i == cap->count || isnan(time) )
+        return RESOURCE_OK;
+
+    if ( tr->media_type == MP_video ) {
+        if ( cap->video_ended )
+            return RESOURCE_OK;
+
+        if ( !cap->video_started ) {
+            if ( !key || time < cap->start - HLS_TIME_SLACK )
+                return RESOURCE_OK;
+            cap->video_started = true;
+        } else if ( key && time >= cap->end - HLS_TIME_SLACK ) {
+            cap->video_ended = true;
+            return RESOURCE_OK;
+        }
+    } else {
+        if ( time < cap->start || time >= cap->end )
+            return RESOURCE_OK;
+
+        /* AAC in MPEG-TS comes with ADTS headers */
+        if ( len > 7 && data[0] == 0xff && (data[1] & 0xf6) == 0xf0 ) {
+            const size_t header = (data[1] & 0x01) ? 7 : 9;
+
+            data += header;
+            len -= header;
+        }
+    }
+
+    fmp4_track_add_sample(cap->out[i], isnan(dts) ? time : dts, time,
+                          duration, key, data, len);
+
+    return RESOURCE_OK;
+}
+
+static void hls_stored_close(HLSStored *st)
+{
+    guint i;
+
+    for ( i = 0; i < st->capture.count; i++ )
+        fmp4_track_free(st->capture.out[i]);
+
+    if ( st->bounds )
+        g_array_free(st->bounds, true);
+
+    r_close(st->resource);
+}
+
+/**
+ * @brief Add a track of a stored resource to the HLS output
+ *
+ * @return false if the codec of the track is not supported.
+ */
+static gboolean hls_stored_add_track(HLSStored *st, Track *tr)
+{
+    struct HLSCapture *cap = &st->capture;
+    FMP4Track *out;
+    gboolean valid;
+    guint i;
+
+    for ( i = 0; i < cap->count; i++ )
+        if ( cap->tracks[i]->media_type == tr->media_type )
+            return false;
+
+    if ( tr->media_type == MP_video &&
+         g_ascii_strcasecmp(tr->encoding_name, "H264") == 0 ) {
+        out = fmp4_track_new(cap->count + 1, MP_video);
+        valid = fmp4_track_set_h264_extradata(out, tr->extradata,
+                                              tr->extradata_len);
+    } else if ( tr->media_type == MP_audio &&
+                g_ascii_strcasecmp(tr->encoding_name, "mpeg4-generic") == 0 ) {
+        out = fmp4_track_new(cap->count + 1, MP_audio);
+        valid = fmp4_track_set_aac(out, tr->extradata, tr->extradata_len);
+    } else
+        return false;
+
+    if ( !valid ) {
+        fnc_log(FNC_LOG_WARN, "[hls] %s: invalid codec data for track %s",
+                st->resource->mrl, tr->name);
+        fmp4_track_free(out);
+        return false;
+    }
+
+    cap->tracks[cap->count] = tr;
+    cap->out[cap->count++] = out;
+
+    return true;
+}
+
+/**
+ * @brief Open a stored resource and lay out its segments
+ */
+static int hls_stored_open(const char *path, HLSStored *st)
+{
+    GArray *times;
+    GList *item;
+    double start, end, last;
+    guint i;
+
+    memset(st, 0, sizeof(*st));
+
+    if ( (st->resource = avf_open(path)) == NULL )
+        return HLS_NOT_FOUND;
+
+    /* video first, so that it is the first track of the files */
+    for ( item = st->resource->tracks; item; item = item->next )
+        if ( ((Track *)item->data)->media_type == MP_video )
+            hls_stored_add_track(st, item->data);
+
+    for ( item = st->resource->tracks; item; item = item->next )
+        if ( ((Track *)item->data)->media_type == MP_audio )
+            hls_stored_add_track(st, item->data);
+
+    if ( st->capture.count == 0 ) {
+        fnc_log(FNC_LOG_INFO, "[hls] %s: no H.264 nor AAC track",
+                st->resource->mrl);
+        return HLS_NOT_FOUND;
+    }
+
+    /* the keyframe index is built in background for files that were
+       never indexed before */
+    if ( (times = kfi_times(st->resource->stored.kfindex)) == NULL )
+        return st->resource->seek ? HLS_NOT_READY : HLS_NOT_FOUND;
+
+    start = avf_start_time(st->resource);
+    end = start + st->resource->duration;
+    last = g_array_index(times, double, 0);
+
+    if ( !isfinite(end) || end <= last )
+        end = g_array_index(times, double, times->len - 1) +
+            feng_default_vhost->hls_segment_duration;
+
+    st->bounds = g_array_new(false, false, sizeof(double));
+    g_array_append_val(st->bounds, last);
+
+    for ( i = 1; i < times->len; i++ ) {
+        const double time = g_array_index(times, double, i);
+
+        if ( time >= end )
+            break;
+
+        if ( time - last >= feng_default_vhost->hls_segment_duration ) {
+            g_array_append_val(st->bounds, time);
+            last = time;
+        }
+    }
+
+    if ( end - last < HLS_MIN_LAST_SEGMENT && st->bounds->len > 1 )
+        g_array_index(st->bounds, double, st->bounds->len - 1) = end;
+    else
+        g_array_append_val(st->bounds, end);
+
+    g_array_free(times, true);
+
+    return HLS_OK;
+}
+
+static GByteArray *hls_stored_playlist(HLSStored *st)
+{
+    const guint count = st->bounds->len - 1;
+    double *durations = g_new(double, count);
+    GByteArray *data;
+    guint i;
+
+    for ( i = 0; i < count; i++ )
+        durations[i] = g_array_index(st->bounds, double, i + 1) -
+            g_array_index(st->bounds, double, i);
+
+    data = hls_playlist_new(0, durations, count, true);
+    g_free(durations);
+
+    return data;
+}
+
+/**
+ * @brief Generate a media segment of a stored resource
+ *
+ * @return The segment, or NULL if it could not be read.
+ */
+static GByteArray *hls_stored_segment(HLSStored *st, guint32 number)
+{
+    struct HLSCapture *cap = &st->capture;
+    Resource *r = st->resource;
+    Track *audio = NULL, *video = NULL;
+    double time;
+    int ret;
+    guint i;
+
+    cap->start = g_array_index(st->bounds, double, number);
+    cap->end = g_array_index(st->bounds, double, number + 1);
+
+    for ( i = 0; i < cap->count; i++ ) {
+        if ( cap->tracks[i]->media_type == MP_video )
+            video = cap->tracks[i];
+        else
+            audio = cap->tracks[i];
+    }
+
+    /* the packets go to the capture from the seek on, so that they do
+       not get parsed nor cached */
+    r->stored.hls = cap;
+
+    /* land on the keyframe starting the segment, not on the previous one */
+    time = cap->start - avf_start_time(r) + HLS_TIME_SLACK;
+    if ( r_seek(r, &time) != 0 ) {
+        fnc_log(FNC_LOG_ERR, "[hls] %s: unable to seek to %f",
+                r->mrl, cap->start);
+        r->stored.hls = NULL;
+        return NULL;
+    }
+
+    r_set_clip(r, cap->start - avf_start_time(r),
+               cap->end - avf_start_time(r), 0);
+
+    do {
+        ret = r->read_packet(r);
+    } while ( ret == RESOURCE_OK &&
+              !((video == NULL || cap->video_ended) &&
+                (audio == NULL || audio->clipped)) );
+
+    r->stored.hls = NULL;
+
+    if ( ret == RESOURCE_ERR ) {
+        fnc_log(FNC_LOG_ERR, "[hls] %s: unable to read segment %u",
+                r->mrl, number);
+        return NULL;
+    }
+
+    return fmp4_media_segment(cap->out, cap->count, number + 1, INFINITY);
+}
+
+static int hls_stored_generate(const char *path, const char *name,
+                               HLSFile **file)
+{
+    HLSStored st;
+    GByteArray *data = NULL;
+    const char *content_type = HLS_TYPE_MP4;
+    guint32 number;
+    int ret;
+
+    if ( (ret = hls_stored_open(path, &st)) != HLS_OK )
+        goto end;
+
+    if ( strcmp(name, HLS_PLAYLIST) == 0 ) {
+        data = hls_stored_playlist(&st);
+        content_type = HLS_TYPE_PLAYLIST;
+    } else if ( strcmp(name, HLS_INIT) == 0 )
+        data = fmp4_init_segment(st.capture.out, st.capture.count);
+    else if ( hls_segment_number(name, &number) &&
+              number < st.bounds->len - 1 )
+        data = hls_stored_segment(&st, number);
+
+    if ( data == NULL )
+        ret = HLS_NOT_FOUND;
+    else
+        *file = hls_file_new(content_type, data, false);
+
+ end:
+    hls_stored_close(&st);
+    return ret;
+}
+
+/**
+ * @brief Threads generating the files of the stored resources
+ */
+#define HLS_GENERATE_THREADS 2
+
+/**
+ * @brief Request waiting for a file being generated
+ */
+typedef struct {
+    HLSReadyFunc ready;
+    gpointer user_data;
+} HLSWaiter;
+
+/**
+ * @brief File of a stored resource being generated
+ *
+ * The requests for a file already being generated wait for the same
+ * generation instead of starting another one.
+ */
+typedef struct {
+    /** The key the file is going to be cached with */
+    char *key;
+    char *path;
+    char *name;
+
+    /** Requests to answer once the file is ready, of type @ref HLSWaiter */
+    GSList *waiters;
+} HLSGeneration;
+
+static GStaticMutex hls_generating_lock = G_STATIC_MUTEX_INIT;
+
+/** Files being generated by key, of type @ref HLSGeneration */
+static GHashTable *hls_generating;
+
+static GThreadPool *hls_generators;
+
+static void hls_generate_cb(gpointer gen_p, ATTR_UNUSED gpointer user_data)
+{
+    HLSGeneration *gen = gen_p;
+    HLSFile *file = NULL;
+    GSList *waiter;
+    int ret;
+
+    if ( (ret = hls_stored_generate(gen->path, gen->name, &file)) == HLS_OK )
+        hls_cache_insert(g_strdup(gen->key), hls_file_ref(file));
+
+    /* the file is cached before the generation is dropped, so that the
+       requests coming meanwhile find either of them */
+    g_static_mutex_lock(&hls_generating_lock);
+    g_hash_table_remove(hls_generating, gen->key);
+    g_static_mutex_unlock(&hls_generating_lock);
+
+    for ( waiter = gen->waiters; waiter; waiter = waiter->next ) {
+        HLSWaiter *w = waiter->data;
+
+        w->ready(ret, file ? hls_file_ref(file) : NULL, w->user_data);
+        g_slice_free(HLSWaiter, w);
+    }
+
+    hls_file_unref(file);
+
+    g_slist_free(gen->waiters);
+    g_free(gen->key);
+    g_free(gen->path);
+    g_free(gen->name);
+    g_slice_free(HLSGeneration, gen);
+}
+
+static int hls_stored_get(const char *path, const char *name, HLSFile **file,
+                          HLSReadyFunc ready, gpointer user_data)
+{
+    char *mrl = g_strjoin("/", feng_default_vhost->document_root, path, NULL);
+    HLSGeneration *gen;
+    HLSWaiter *waiter;
+    char *key;
+    time_t mtime;
+
+    if ( !rio_stat(mrl, &mtime) ) {
+        g_free(mrl);
+        return HLS_NOT_FOUND;
+    }
+
+    /* a changed file does not reuse the files generated before */
+    key = g_strdup_printf("%s\n%ld\n%s", mrl, (long)mtime, name);
+    g_free(mrl);
+
+    if ( (*file = hls_cache_lookup(key)) != NULL ) {
+        media_stat_add(MEDIA_STAT_HLS_HITS, 1);
+        g_free(key);
+        return HLS_OK;
+    }
+
+    waiter = g_slice_new(HLSWaiter);
+    waiter->ready = ready;
+    waiter->user_data = user_data;
+
+    g_static_mutex_lock(&hls_generating_lock);
+
+    if ( ! hls_generating )
+        hls_generating = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( (gen = g_hash_table_lookup(hls_generating, key)) != NULL ) {
+        gen->waiters = g_slist_prepend(gen->waiters, waiter);
+        g_static_mutex_unlock(&hls_generating_lock);
+
+        g_free(key);
+        return HLS_PENDING;
+    }
+
+    /* the generation might have ended since the lookup */
+    if ( (*file = hls_cache_lookup(key)) != NULL ) {
+        g_static_mutex_unlock(&hls_generating_lock);
+
+        media_stat_add(MEDIA_STAT_HLS_HITS, 1);
+        g_slice_free(HLSWaiter, waiter);
+        g_free(key);
+        return HLS_OK;
+    }
+
+    gen = g_slice_new(HLSGeneration);
+    gen->key = key;
+    gen->path = g_strdup(path);
+    gen->name = g_strdup(name);
+    gen->waiters = g_slist_prepend(NULL, waiter);
+
+    g_hash_table_insert(hls_generating, key, gen);
+
+    if ( ! hls_generators )
+        hls_generators = g_thread_pool_new(hls_generate_cb, NULL,
+                                           HLS_GENERATE_THREADS, false, NULL);
+    g_thread_pool_push(hls_generators, gen, NULL);
+
+    g_static_mutex_unlock(&hls_generating_lock);
+
+    media_stat_add(MEDIA_STAT_HLS_MISSES, 1);
+
+    return HLS_PENDING;
+}
+
+/** @} */
+
+/**
+ * @defgroup hls_live Live resources
+ *
+ * @{
+ */
+
+typedef struct {
+    guint32 sequence;
+    double duration;
+    HLSFile *file;
+} HLSLiveSegment;
+
+typedef struct HLSLive {
+    /**
+     * @brief Lock of the segmenter, taken by the threads feeding its
+     *        tracks and by the requests
+     */
+    GMutex *lock;
+
+    Resource *resource;
+
+    /**
+     * @brief Tracks segmented; the first one is the one segments are
+     *        cut on, at its keyframes
+     */
+    struct HLSLiveTrack *tracks[2];
+    guint count;
+
+    /** Time of the first frame of the segments, NAN until known */
+    double origin;
+
+    /** Start of the segment being collected, since @ref origin */
+    double segment_start;
+
+    /** Sequence number of the next segment */
+    guint32 sequence;
+
+    /** Segments available, of type @ref HLSLiveSegment, oldest first */
+    GQueue *segments;
+
+    HLSFile *init;
+
+    /** Time of the last request for the resource */
+    ev_tstamp last_request;
+} HLSLive;
+
+struct HLSLiveTrack {
+    HLSLive *live;
+    Track *track;
+    FMP4Track *out;
+    gboolean h264;
+
+    /** Access unit being assembled, with 4-byte NAL lengths */
+    GByteArray *frame;
+    gboolean in_frame;
+    gboolean frame_key;
+    uint32_t frame_rtp_timestamp;
+    double frame_time;
+
+    /** Fragmented NAL unit being assembled (FU-A) */
+    GByteArray *fragment;
+
+    /** The parameter sets were found, in the SDP or in band */
+    gboolean configured;
+    GByteArray *sps;
+    GByteArray *pps;
+};
+
+static GStaticMutex hls_live_lock = G_STATIC_MUTEX_INIT;
+
+/** Live segmenters by path of the resource */
+static GHashTable *hls_live_resources;
+
+/**
+ * @brief Find a parameter in the fmtp attribute of a track
+ *
+ * @return A new string with the value, or NULL if not found.
+ */
+static char *hls_fmtp_param(Track *tr, const char *name)
+{
+    const char *fmtp = strstr(tr->sdp_description->str, "a=fmtp:");
+    const size_t name_len = strlen(name);
+
+    if ( fmtp == NULL || (fmtp = strchr(fmtp, ' ')) == NULL )
+        return NULL;
+
+    while ( *fmtp == ' ' || *fmtp == ';' ) {
+        fmtp++;
+
+        while ( *fmtp == ' ' )
+            fmtp++;
+
+        if ( g_ascii_strncasecmp(fmtp, name, name_len) == 0 &&
+             fmtp[name_len] == '=' ) {
+            fmtp += name_len + 1;
+            return g_strndup(fmtp, strcspn(fmtp, "; \r\n"));
+        }
+
+        fmtp += strcspn(fmtp, "; \r\n");
+    }
+
+    return NULL;
+}
+
+static void hls_live_h264_configure(struct HLSLiveTrack *lt)
+{
+    if ( lt->configured || lt->sps->len == 0 || lt->pps->len == 0 )
+        return;
+
+    lt->configured = fmp4_track_set_h264(lt->out,
+                                         lt->sps->data, lt->sps->len,
+                                         lt->pps->data, lt->pps->len);
+}
+
+/**
+ * @brief Keep the parameter sets, and add the other NAL units to the
+ *        access unit being assembled
+ */
+static void hls_live_h264_nal(struct HLSLiveTrack *lt,
+                              const uint8_t *nal, size_t len)
+{
+    uint8_t size[4];
+
+    if ( len == 0 )
+        return;
+
+    switch ( nal[0] & 0x1f ) {
+    case 7:
+    case 8:
+        /* the parameter sets changing mid-stream are not followed */
+        if ( !lt->configured ) {
+            GByteArray *ps = (nal[0] & 0x1f) == 7 ? lt->sps : lt->pps;
+
+            g_byte_array_set_size(ps, 0);
+            g_byte_array_append(ps, nal, len);
+            hls_live_h264_configure(lt);
+        }
+        return;
+    case 9:                     /* access unit delimiter */
+        return;
+    case 5:
+        lt->frame_key = true;
+        break;
+    }
+
+    size[0] = len >> 24;
+    size[1] = len >> 16;
+    size[2] = len >> 8;
+    size[3] = len;
+
+    g_byte_array_append(lt->frame, size, 4);
+    g_byte_array_append(lt->frame, nal, len);
+}
+
+static void hls_live_frame(struct HLSLiveTrack *lt, double time,
+                           double duration, gboolean key,
+                           const uint8_t *data, size_t len);
+
+static void hls_live_h264_frame(struct HLSLiveTrack *lt)
+{
+    if ( lt->frame->len && lt->configured )
+        hls_live_frame(lt, lt->frame_time, NAN, lt->frame_key,
+                       lt->frame->data, lt->frame->len);
+
+    g_byte_array_set_size(lt->frame, 0);
+    g_byte_array_set_size(lt->fragment, 0);
+    lt->in_frame = false;
+}
+
+/**
+ * @brief Depacketize an H.264 RTP payload (RFC 6184)
+ *
+ * Single NAL units, STAP-A and FU-A packets are supported; access
+ * units end at the marker bit, or when the RTP timestamp changes.
+ */
+static void hls_live_h264(struct HLSLiveTrack *lt,
+                          const struct MParserBuffer *buffer)
+{
+    const uint8_t *data = buffer->data;
+    const size_t len = buffer->data_size;
+    size_t pos;
+
+    if ( lt->in_frame && buffer->rtp_timestamp != lt->frame_rtp_timestamp )
+        hls_live_h264_frame(lt);
+
+    if ( !lt->in_frame ) {
+        lt->in_frame = true;
+        lt->frame_key = false;
+        lt->frame_rtp_timestamp = buffer->rtp_timestamp;
+        lt->frame_time = buffer->delivery;
+    }
+
+    if ( len < 1 )
+        return;
+
+    switch ( data[0] & 0x1f ) {
+    case 24:                    /* STAP-A */
+        for ( pos = 1; pos + 2 <= len; ) {
+            const size_t size = (data[pos] << 8) | data[pos+1];
+
+            pos += 2;
+            if ( pos + size > len )
+                break;
+
+            hls_live_h264_nal(lt, data + pos, size);
+            pos += size;
+        }
+        break;
+
+    case 28:                    /* FU-A */
+        if ( len < 2 )
+            break;
+
+        if ( data[1] & 0x80 ) {
+            const uint8_t header = (data[0] & 0xe0) | (data[1] & 0x1f);
+
+            g_byte_array_set_size(lt->fragment, 0);
+            g_byte_array_append(lt->fragment, &header, 1);
+        } else if ( lt->fragment->len == 0 )
+            break;              /* the start was lost */
+
+        g_byte_array_append(lt->fragment, data + 2, len - 2);
+
+        if ( data[1] & 0x40 ) {
+            hls_live_h264_nal(lt, lt->fragment->data, lt->fragment->len);
+            g_byte_array_set_size(lt->fragment, 0);
+        }
+        break;
+
+    default:
+        if ( (data[0] & 0x1f) >= 1 && (data[0] & 0x1f) <= 23 )
+            hls_live_h264_nal(lt, data, len);
+        break;
+    }
+
+    if ( buffer->marker )
+        hls_live_h264_frame(lt);
+}
+
+/**
+ * @brief Depacketize an AAC RTP payload (RFC 3640, AAC-hbr mode)
+ */
+static void hls_live_aac(struct HLSLiveTrack *lt,
+                         const struct MParserBuffer *buffer)
+{
+    const uint8_t *data = buffer->data;
+    const size_t len = buffer->data_size;
+    const double frame_duration = (double)HLS_AAC_FRAME / lt->out->sample_rate;
+    size_t headers, pos;
+    guint i;
+
+    if ( len < 2 )
+        return;
+
+    /* 16-bit AU headers: 13 bits of size, 3 of index */
+    headers = ((data[0] << 8) | data[1]) / 16;
+    pos = 2 + headers * 2;
+
+    for ( i = 0; i < headers && pos <= len; i++ ) {
+        const size_t size = ((data[2 + i*2] << 8) | data[3 + i*2]) >> 3;
+
+        if ( pos + size > len )
+            break;
+
+        hls_live_frame(lt, buffer->delivery + i * frame_duration,
+                       frame_duration, true, data + pos, size);
+        pos += size;
+    }
+}
+
+/**
+ * @brief Close the segment being collected
+ *
+ * @param end Time the segment ends at, since the origin
+ *
+ * @note The caller has to hold @ref HLSLive::lock.
+ */
+static void hls_live_cut(HLSLive *live, double end)
+{
+    FMP4Track *out[2];
+    HLSLiveSegment *segment;
+    GByteArray *data;
+    guint i;
+
+    for ( i = 0; i < live->count; i++ )
+        out[i] = live->tracks[i]->out;
+
+    /* the frames are only collected once all the tracks are configured */
+    if ( live->init == NULL )
+        live->init = hls_file_new(HLS_TYPE_MP4,
+                                  fmp4_init_segment(out, live->count), true);
+
+    data = fmp4_media_segment(out, live->count, live->sequence + 1, end);
+    if ( data == NULL )
+        return;
+
+    segment = g_slice_new(HLSLiveSegment);
+    segment->sequence = live->sequence++;
+    segment->duration = end - live->segment_start;
+    segment->file = hls_file_new(HLS_TYPE_MP4, data, true);
+
+    g_queue_push_tail(live->segments, segment);
+    live->segment_start = end;
+
+    while ( g_queue_get_length(live->segments) >
+            feng_default_vhost->hls_live_segments + HLS_LIVE_SPARE ) {
+        segment = g_queue_pop_head(live->segments);
+        hls_file_unref(segment->file);
+        g_slice_free(HLSLiveSegment, segment);
+    }
+}
+
+/**
+ * @brief Add a frame to the segment being collected
+ *
+ * Segments start at a keyframe of the first track, and are cut at the
+ * first of its keyframes found after the configured duration. Only
+ * decoding times are known from RTP, so the frames are expected to be
+ * in presentation order (no B-frames).
+ *
+ * @note The caller has to hold @ref HLSLive::lock.
+ */
+static void hls_live_frame(struct HLSLiveTrack *lt, double time,
+                           double duration, gboolean key,
+                           const uint8_t *data, size_t len)
+{
+    HLSLive *live = lt->live;
+    const gboolean cutter = lt == live->tracks[0];
+    guint i;
+
+    if ( isnan(live->origin) ) {
+        if ( !cutter || !key )
+            return;
+
+        for ( i = 0; i < live->count; i++ )
+            if ( live->tracks[i]->h264 && !live->tracks[i]->configured )
+                return;
+
+        live->origin = time;
+        live->segment_start = 0;
+    }
+
+    time -= live->origin;
+    if ( time < 0 )
+        return;
+
+    fmp4_track_add_sample(lt->out, time, time, duration, key, data, len);
+
+    if ( cutter && key &&
+         time - live->segment_start >= feng_default_vhost->hls_segment_duration )
+        hls_live_cut(live, time);
+}
+
+/**
+ * @brief Drop the segments of a live resource that was not requested
+ *        for a while, to start again from the current frames
+ *
+ * @note The caller has to hold @ref HLSLive::lock.
+ */
+static void hls_live_reset(HLSLive *live)
+{
+    HLSLiveSegment *segment;
+    guint i;
+
+    while ( (segment = g_queue_pop_head(live->segments)) != NULL ) {
+        hls_file_unref(segment->file);
+        g_slice_free(HLSLiveSegment, segment);
+    }
+
+    for ( i = 0; i < live->count; i++ ) {
+        struct HLSLiveTrack *lt = live->tracks[i];
+
+        fmp4_track_trim(lt->out, INFINITY);
+        g_byte_array_set_size(lt->frame, 0);
+        g_byte_array_set_size(lt->fragment, 0);
+        lt->in_frame = false;
+    }
+
+    live->origin = NAN;
+    live->segment_start = NAN;
+}
+
+/**
+ * @brief Set up the segmentation of a live track
+ *
+ * @return The new segmenter track, or NULL if the codec is not
+ *         supported or its configuration is not known.
+ */
+static struct HLSLiveTrack *hls_live_track_new(HLSLive *live, Track *tr)
+{
+    struct HLSLiveTrack *lt = g_slice_new0(struct HLSLiveTrack);
+    char *param;
+
+    lt->live = live;
+    lt->track = tr;
+    lt->frame = g_byte_array_new();
+    lt->fragment = g_byte_array_new();
+    lt->sps = g_byte_array_new();
+    lt->pps = g_byte_array_new();
+
+    if ( tr->media_type == MP_video &&
+         g_ascii_strcasecmp(tr->encoding_name, "H264") == 0 ) {
+        lt->h264 = true;
+        lt->out = fmp4_track_new(live->count + 1, MP_video);
+
+        /* the parameter sets are also looked for in band */
+        if ( (param = hls_fmtp_param(tr, "sprop-parameter-sets")) != NULL ) {
+            gchar **sets = g_strsplit(param, ",", 0), **set;
+
+            for ( set = sets; *set; set++ ) {
+                gsize len;
+                guchar *nal = g_base64_decode(*set, &len);
+
+                hls_live_h264_nal(lt, nal, len);
+                g_free(nal);
+            }
+
+            g_strfreev(sets);
+            g_free(param);
+        }
+    } else if ( tr->media_type == MP_audio &&
+                g_ascii_strcasecmp(tr->encoding_name, "mpeg4-generic") == 0 &&
+                (param = hls_fmtp_param(tr, "config")) != NULL ) {
+        GByteArray *config = g_byte_array_new();
+        const char *hex;
+
+        for ( hex = param; g_ascii_isxdigit(hex[0]) && g_ascii_isxdigit(hex[1]); hex += 2 ) {
+            const uint8_t byte = (g_ascii_xdigit_value(hex[0]) << 4) |
+                g_ascii_xdigit_value(hex[1]);
+
+            g_byte_array_append(config, &byte, 1);
+        }
+
+        lt->out = fmp4_track_new(live->count + 1, MP_audio);
+        lt->configured = fmp4_track_set_aac(lt->out, config->data, config->len);
+
+        g_byte_array_free(config, true);
+        g_free(param);
+
+        if ( !lt->configured )
+            fnc_log(FNC_LOG_WARN, "[hls] %s: invalid AAC configuration for track %s",
+                    live->resource->mrl, tr->name);
+    }
+
+    if ( lt->out == NULL || (!lt->h264 && !lt->configured) ) {
+        fmp4_track_free(lt->out);
+        g_byte_array_free(lt->frame, true);
+        g_byte_array_free(lt->fragment, true);
+        g_byte_array_free(lt->sps, true);
+        g_byte_array_free(lt->pps, true);
+        g_slice_free(struct HLSLiveTrack, lt);
+        return NULL;
+    }
+
+    return lt;
+}
+
+/**
+ * @brief Get the segmenter of a live resource, creating it the first
+ *        time the resource is requested
+ *
+ * The segmenters are never freed, like the live resources themselves.
+ */
+static HLSLive *hls_live_open(const char *path)
+{
+    HLSLive *live;
+    Resource *r;
+    GList *item;
+    guint i;
+
+    g_static_mutex_lock(&hls_live_lock);
+
+    if ( ! hls_live_resources )
+        hls_live_resources = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( (live = g_hash_table_lookup(hls_live_resources, path)) != NULL ||
+         (r = r_open(path)) == NULL )
+        goto end;
+
+    live = g_slice_new0(HLSLive);
+    live->lock = g_mutex_new();
+    live->resource = r;
+    live->origin = NAN;
+    live->segment_start = NAN;
+    live->segments = g_queue_new();
+
+    /* video first, to cut the segments on its keyframes */
+    for ( i = 0; i < 2; i++ )
+        for ( item = r->tracks; item && live->count < 2; item = item->next ) {
+            Track *tr = item->data;
+            struct HLSLiveTrack *lt;
+
+            if ( tr->media_type != (i == 0 ? MP_video : MP_audio) )
+                continue;
+
+            if ( (lt = hls_live_track_new(live, tr)) != NULL ) {
+                live->tracks[live->count++] = lt;
+                break;
+            }
+        }
+
+    if ( live->count == 0 ) {
+        fnc_log(FNC_LOG_INFO, "[hls] %s: no H.264 nor AAC track",
+                r->mrl);
+        g_queue_free(live->segments);
+        g_mutex_free(live->lock);
+        g_slice_free(HLSLive, live);
+        r_close(r);
+        live = NULL;
+        goto end;
+    }
+
+    for ( i = 0; i < live->count; i++ )
+        g_atomic_pointer_set(&live->tracks[i]->track->hls, live->tracks[i]);
+
+    g_hash_table_insert(hls_live_resources, g_strdup(path), live);
+
+ end:
+    g_static_mutex_unlock(&hls_live_lock);
+    return live;
+}
+
+static int hls_live_get(const char *path, const char *name, HLSFile **file)
+{
+    HLSLive *live = hls_live_open(path);
+    const ev_tstamp now = ev_time();
+    guint32 number;
+    int ret = HLS_NOT_FOUND;
+    GList *item;
+
+    if ( live == NULL )
+        return HLS_NOT_FOUND;
+
+    g_mutex_lock(live->lock);
+
+    if ( now - live->last_request >= HLS_LIVE_IDLE )
+        hls_live_reset(live);
+    live->last_request = now;
+
+    if ( strcmp(name, HLS_PLAYLIST) == 0 ) {
+        const guint available = g_queue_get_length(live->segments);
+        const guint count = MIN(available, feng_default_vhost->hls_live_segments);
+        double *durations = g_new(double, count + 1);
+        guint32 first = 0;
+        guint i = 0;
+
+        for ( item = g_queue_peek_nth_link(live->segments, available - count);
+              item; item = item->next ) {
+            HLSLiveSegment *segment = item->data;
+
+            if ( i == 0 )
+                first = segment->sequence;
+            durations[i++] = segment->duration;
+        }
+
+        if ( count > 0 ) {
+            *file = hls_file_new(HLS_TYPE_PLAYLIST,
+                                 hls_playlist_new(first, durations, count, false),
+                                 true);
+            ret = HLS_OK;
+        } else
+            ret = HLS_NOT_READY;
+
+        g_free(durations);
+    } else if ( strcmp(name, HLS_INIT) == 0 ) {
+        if ( live->init ) {
+            *file = hls_file_ref(live->init);
+            ret = HLS_OK;
+        } else
+            ret = HLS_NOT_READY;
+    } else if ( hls_segment_number(name, &number) ) {
+        for ( item = live->segments->head; item; item = item->next ) {
+            HLSLiveSegment *segment = item->data;
+
+            if ( segment->sequence == number ) {
+                *file = hls_file_ref(segment->file);
+                ret = HLS_OK;
+                break;
+            }
+        }
+    }
+
+    g_mutex_unlock(live->lock);
+
+    if ( ret == HLS_OK )
+        media_stat_add(MEDIA_STAT_HLS_HITS, 1);
+
+    return ret;
+}
+
+/**
+ * @brief Tells whether the frames of a live track are being segmented
+ *
+ * Live tracks are read even without RTSP consumers as long as this is
+ * true.
+ */
+gboolean hls_live_wanted(Track *tr)
+{
+    struct HLSLiveTrack *lt = g_atomic_pointer_get(&tr->hls);
+    gboolean wanted;
+
+    if ( lt == NULL )
+        return false;
+
+    g_mutex_lock(lt->live->lock);
+    wanted = ev_time() - lt->live->last_request < HLS_LIVE_IDLE;
+    g_mutex_unlock(lt->live->lock);
+
+    return wanted;
+}
+
+/**
+ * @brief Feed a buffer received for a live track to its segmenter
+ *
+ * @param tr The live track the buffer was received for
+ * @param buffer The buffer, holding an RTP payload; it is not kept
+ */
+void hls_live_write(Track *tr, const struct MParserBuffer *buffer)
+{
+    struct HLSLiveTrack *lt = g_atomic_pointer_get(&tr->hls);
+
+    if ( lt == NULL )
+        return;
+
+    g_mutex_lock(lt->live->lock);
+
+    if ( ev_time() - lt->live->last_request < HLS_LIVE_IDLE ) {
+        if ( lt->h264 )
+            hls_live_h264(lt, buffer);
+        else
+            hls_live_aac(lt, buffer);
+    }
+
+    g_mutex_unlock(lt->live->lock);
+}
+
+/** @} */
+
+/**
+ * @brief Get an HLS file of a resource
+ *
+ * @param path The path of the resource, within the vhost
+ * @param name The name of the file: @c index.m3u8, @c init.mp4 or
+ *             @c N.m4s
+ * @param file Filled in with a new reference to the file, to release
+ *             with @ref hls_file_unref
+ * @param ready Function called with the file once it is generated,
+ *              when @ref HLS_PENDING is returned
+ * @param user_data Passed to @p ready
+ *
+ * @retval HLS_OK The file was found.
+ * @retval HLS_NOT_FOUND The resource or the file do not exist, or
+ *                       the resource has no track that can be sent.
+ * @retval HLS_NOT_READY The file is not available yet: the keyframe
+ *                       index of a stored resource is being built, or
+ *                       a live resource has no segment yet.
+ * @retval HLS_PENDING The file of a stored resource is being
+ *                     generated, by one of a few threads shared with
+ *                     the other requests for it; @p ready is called
+ *                     from that thread once it is done.
+ */
+int hls_get(const char *path, const char *name, HLSFile **file,
+            HLSReadyFunc ready, gpointer user_data)
+{
+    if ( g_str_has_prefix(path, "/virtual/") )
+        return hls_live_get(path, name, file);
+
+    return hls_stored_get(path, name, file, ready, user_data);
+}
@@ -0,0 +1,618 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Shared keyframe index for stored resources
+ *
+ * Seeking through libavformat alone lands "somewhere before" the
+ * requested time, and for containers that carry no index (MPEG-TS,
+ * MPEG-PS, raw elementary streams) it has to bisect the file, so the
+ * latency of a seek grows with the size of the file.
+ *
+ * The keyframe index records timestamp and position of each keyframe
+ * of the reference stream of a file; it is built once per file and
+ * shared among all the sessions streaming it, so that a seek resolves
+ * directly to a keyframe boundary, and the time of that keyframe can
+ * be reported back to the client.
+ *
+ * For containers that already carry an index (mov/mp4, matroska with
+ * cues, ...) the entries are taken from the demuxer right away;
+ * otherwise the file is scanned in background, and the result is saved
+ * in a sidecar file next to the resource, so that it is not scanned
+ * again until it changes.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+#include <libavformat/avformat.h>
+
+#define KFI_MAGIC "FKFI"
+#define KFI_VERSION 1
+#define KFI_SUFFIX ".kfi"
+
+typedef struct {
+    int64_t timestamp;  /*!< keyframe timestamp, in the stream time base */
+    int64_t pos;        /*!< byte position in the file, -1 if unknown */
+} KeyframeEntry;
+
+struct KeyframeIndex {
+    gint refcount;
+
+    /**
+     * @brief Set once the entries are complete
+     *
+     * @note Do not change this to gboolean, it is used through
+     *       g_atomic_int_get/g_atomic_int_set; once set, @ref entries
+     *       is never modified again.
+     */
+    gint ready;
+
+    /**
+     * @brief Set if the file could not be scanned
+     *
+     * A failed index is removed from @ref kfi_table, so that the next
+     * session opening the file tries to build it again; the sessions
+     * still holding it fall back to plain seeks.
+     */
+    gint failed;
+
+    char *mrl;
+    time_t mtime;
+
+    int stream_index;
+    AVRational time_base;
+    int64_t start_time; /*!< start time of the file, in AV_TIME_BASE units */
+
+    GArray *entries;
+};
+
+/**
+ * @brief Header of the sidecar file
+ *
+ * The entries follow the header, @ref count of them; all the values
+ * are in host byte order, since the sidecar is not meant to be moved
+ * among different hosts (if it is, it is discarded and rebuilt).
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    int64_t mtime;
+    int32_t stream_index;
+    int32_t tb_num;
+    int32_t tb_den;
+    uint32_t count;
+} KeyframeIndexHeader;
+
+/**
+ * @brief Lock for @ref kfi_table
+ */
+static GStaticMutex kfi_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Table of the indexes in use, by mrl
+ *
+ * The table does not hold any reference to the indexes, they are
+ * removed from it when the last session using them releases them.
+ */
+static GHashTable *kfi_table;
+
+/**
+ * @brief Pool of one thread scanning files that need an index built
+ *
+ * A single thread is used so that building indexes for many files at
+ * once does not steal I/O bandwidth from the sessions.
+ */
+static GThreadPool *kfi_builders;
+
+static int kfi_reference_stream(AVFormatContext *avfc)
+{
+    unsigned int i;
+
+    for ( i = 0; i < avfc->nb_streams; i++ )
+        if ( avfc->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO )
+            return i;
+
+    return 0;
+}
+
+static void kfi_free(struct KeyframeIndex *idx)
+{
+    if ( idx->entries )
+        g_array_free(idx->entries, true);
+    g_free(idx->mrl);
+    g_slice_free(struct KeyframeIndex, idx);
+}
+
+/**
+ * @brief Append a keyframe to a list of entries
+ *
+ * Entries are kept sorted by timestamp; keyframes that are not after
+ * the last one are ignored.
+ */
+static void kfi_entries_append(GArray *entries, int64_t timestamp, int64_t pos)
+{
+    KeyframeEntry entry = { timestamp, pos };
+
+    if ( timestamp == AV_NOPTS_VALUE )
+        return;
+
+    if ( entries->len &&
+         g_array_index(entries, KeyframeEntry, entries->len-1).timestamp >= timestamp )
+        return;
+
+    g_array_append_val(entries, entry);
+}
+
+/**
+ * @brief Check that the entries are sorted by timestamp
+ *
+ * The lookup in @ref kfi_seek is a binary search, so entries read
+ * back from a sidecar have to be in the same order @ref
+ * kfi_entries_append keeps them in.
+ */
+static gboolean kfi_entries_sorted(const GArray *entries)
+{
+    const KeyframeEntry *entry = (const KeyframeEntry *)entries->data;
+    guint i;
+
+    for ( i = 0; i < entries->len; i++ )
+        if ( entry[i].timestamp == AV_NOPTS_VALUE ||
+             (i > 0 && entry[i].timestamp <= entry[i-1].timestamp) )
+            return false;
+
+    return true;
+}
+
+/**
+ * @brief Collect the keyframes from the index of the demuxer
+ *
+ * @return The number of keyframes found.
+ */
+static guint kfi_from_demuxer(struct KeyframeIndex *idx, AVFormatContext *avfc)
+{
+    AVStream *st = avfc->streams[idx->stream_index];
+    GArray *entries = g_array_new(false, false, sizeof(KeyframeEntry));
+    int i;
+
+    for ( i = 0; i < st->nb_index_entries; i++ )
+        if ( st->index_entries[i].flags & AVINDEX_KEYFRAME )
+            kfi_entries_append(entries,
+                               st->index_entries[i].timestamp,
+                               st->index_entries[i].pos);
+
+    /* a single entry is what most demuxers produce just by opening
+       the file, it's not an index at all. */
+    if ( entries->len < 2 ) {
+        g_array_free(entries, true);
+        return 0;
+    }
+
+    idx->entries = entries;
+    return entries->len;
+}
+
+static gboolean kfi_load(struct KeyframeIndex *idx)
+{
+    gchar *path = g_strconcat(idx->mrl, KFI_SUFFIX, NULL);
+    KeyframeIndexHeader header;
+    GArray *entries = NULL;
+    struct stat st;
+    FILE *f;
+
+    if ( (f = fopen(path, "rb")) == NULL )
+        goto end;
+
+    if ( fread(&header, sizeof(header), 1, f) != 1 ||
+         memcmp(header.magic, KFI_MAGIC, 4) != 0 ||
+         header.version != KFI_VERSION ||
+         header.mtime != idx->mtime ||
+         header.stream_index != idx->stream_index ||
+         header.tb_num != idx->time_base.num ||
+         header.tb_den != idx->time_base.den ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] %s is stale, ignoring", path);
+        goto end;
+    }
+
+    if ( header.count == 0 ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] %s is empty, ignoring", path);
+        goto end;
+    }
+
+    /* do not trust the count before allocating the entries */
+    if ( fstat(fileno(f), &st) < 0 ||
+         (guint64)st.st_size <
+         sizeof(header) + (guint64)header.count * sizeof(KeyframeEntry) ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] %s is truncated, ignoring", path);
+        goto end;
+    }
+
+    entries = g_array_sized_new(false, false, sizeof(KeyframeEntry), header.count);
+    g_array_set_size(entries, header.count);
+
+    if ( fread(entries->data, sizeof(KeyframeEntry), header.count, f) != header.count ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] %s is truncated, ignoring", path);
+        g_array_free(entries, true);
+        entries = NULL;
+        goto end;
+    }
+
+    if ( ! kfi_entries_sorted(entries) ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] %s is not sorted, ignoring", path);
+        g_array_free(entries, true);
+        entries = NULL;
+        goto end;
+    }
+
+    idx->entries = entries;
+
+ end:
+    if ( f )
+        fclose(f);
+    g_free(path);
+
+    return entries != NULL;
+}
+
+/**
+ * @brief Save the index in the sidecar file
+ *
+ * The index is written to a temporary file that is then renamed, so
+ * that a concurrent process never reads a partial index. Failures are
+ * not fatal, since the document root might very well be read-only.
+ */
+static void kfi_save(struct KeyframeIndex *idx)
+{
+    gchar *path = g_strconcat(idx->mrl, KFI_SUFFIX, NULL);
+    gchar *tmppath = g_strconcat(path, ".tmp", NULL);
+    KeyframeIndexHeader header = {
+        .version = KFI_VERSION,
+        .mtime = idx->mtime,
+        .stream_index = idx->stream_index,
+        .tb_num = idx->time_base.num,
+        .tb_den = idx->time_base.den,
+        .count = idx->entries->len
+    };
+    FILE *f;
+
+    memcpy(header.magic, KFI_MAGIC, 4);
+
+    if ( (f = fopen(tmppath, "wb")) == NULL ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] unable to write %s: %s",
+                tmppath, strerror(errno));
+        goto end;
+    }
+
+    if ( fwrite(&header, sizeof(header), 1, f) != 1 ||
+         fwrite(idx->entries->data, sizeof(KeyframeEntry),
+                idx->entries->len, f) != idx->entries->len ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] unable to write %s: %s",
+                tmppath, strerror(errno));
+        fclose(f);
+        unlink(tmppath);
+        goto end;
+    }
+
+    fclose(f);
+
+    if ( rename(tmppath, path) < 0 ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] unable to rename %s: %s",
+                tmppath, strerror(errno));
+        unlink(tmppath);
+    }
+
+ end:
+    g_free(tmppath);
+    g_free(path);
+}
+
+/**
+ * @brief Threadpool callback building an index by scanning the file
+ *
+ * @param idx_p The index to build; a reference is held by the job.
+ * @param user_data Unused
+ *
+ * The file is opened with a private demuxer instance so that the
+ * sessions are not disturbed; all the streams but the reference one
+ * are discarded, to keep the scan as cheap as possible.
+ */
+static void kfi_build_cb(gpointer idx_p, ATTR_UNUSED gpointer user_data)
+{
+    struct KeyframeIndex *idx = idx_p;
+    AVFormatContext *avfc = NULL;
+    GArray *entries = NULL;
+    AVPacket pkt;
+    unsigned int i;
+
+    if ( avf_open_input(&avfc, idx->mrl) != 0 ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] Cannot open %s", idx->mrl);
+        goto end;
+    }
+
+    if ( avformat_find_stream_info(avfc, NULL) < 0 ||
+         (unsigned int)idx->stream_index >= avfc->nb_streams ) {
+        fnc_log(FNC_LOG_DEBUG, "[kfi] Cannot find streams in file %s",
+                idx->mrl);
+        goto end;
+    }
+
+    for ( i = 0; i < avfc->nb_streams; i++ )
+        if ( i != (unsigned int)idx->stream_index )
+            avfc->streams[i]->discard = AVDISCARD_ALL;
+
+    entries = g_array_new(false, false, sizeof(KeyframeEntry));
+
+    while ( av_read_frame(avfc, &pkt) >= 0 ) {
+        if ( pkt.stream_index == idx->stream_index &&
+             (pkt.flags & AV_PKT_FLAG_KEY) )
+            kfi_entries_append(entries,
+                               pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts,
+                               pkt.pos);
+        av_free_packet(&pkt);
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "[kfi] %u keyframes found in %s",
+            entries->len, idx->mrl);
+
+    if ( entries->len == 0 ) {
+        g_array_free(entries, true);
+        entries = NULL;
+        goto end;
+    }
+
+    idx->entries = entries;
+    g_atomic_int_set(&idx->ready, 1);
+
+    media_stat_add(MEDIA_STAT_KFI_BUILT, 1);
+
+    kfi_save(idx);
+
+ end:
+    avf_close_input(&avfc);
+
+    if ( entries == NULL ) {
+        g_static_mutex_lock(&kfi_lock);
+        g_atomic_int_set(&idx->failed, 1);
+        if ( g_hash_table_lookup(kfi_table, idx->mrl) == idx )
+            g_hash_table_remove(kfi_table, idx->mrl);
+        g_static_mutex_unlock(&kfi_lock);
+    }
+
+    kfi_release(idx);
+}
+
+/**
+ * @brief Get the keyframe index for a stored resource
+ *
+ * @param avfc The demuxer context opened for the resource, used to
+ *             choose the reference stream and, if possible, to fill
+ *             the index right away.
+ * @param mrl The full path of the resource.
+ * @param mtime The modification time of the resource, an index built
+ *              for a different time is not reused.
+ *
+ * @return A new reference to the index; it might not be ready yet if
+ *         the file has to be scanned, in which case @ref kfi_seek
+ *         will refuse to use it until it is.
+ *
+ * @note This function will lock the @ref kfi_lock mutex, but not
+ *       while reading the sidecar file.
+ */
+struct KeyframeIndex *kfi_acquire(AVFormatContext *avfc,
+                                  const char *mrl, time_t mtime)
+{
+    struct KeyframeIndex *idx, *found;
+    gboolean loaded = false;
+
+    g_static_mutex_lock(&kfi_lock);
+
+    if ( ! kfi_table )
+        kfi_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( (idx = g_hash_table_lookup(kfi_table, mrl)) != NULL &&
+         idx->mtime == mtime && ! g_atomic_int_get(&idx->failed) ) {
+        g_atomic_int_inc(&idx->refcount);
+        g_static_mutex_unlock(&kfi_lock);
+        return idx;
+    }
+
+    g_static_mutex_unlock(&kfi_lock);
+
+    idx = g_slice_new0(struct KeyframeIndex);
+    idx->refcount = 1;
+    idx->mrl = g_strdup(mrl);
+    idx->mtime = mtime;
+    idx->stream_index = kfi_reference_stream(avfc);
+    idx->time_base = avfc->streams[idx->stream_index]->time_base;
+    idx->start_time = avfc->start_time != AV_NOPTS_VALUE ? avfc->start_time : 0;
+
+    /* the index is not published yet, no lock is needed to fill it */
+    if ( kfi_from_demuxer(idx, avfc) ) {
+        idx->ready = 1;
+    } else if ( kfi_load(idx) ) {
+        idx->ready = 1;
+        loaded = true;
+    }
+
+    g_static_mutex_lock(&kfi_lock);
+
+    /* another session opened the same file in the meantime */
+    if ( (found = g_hash_table_lookup(kfi_table, mrl)) != NULL &&
+         found->mtime == mtime && ! g_atomic_int_get(&found->failed) ) {
+        g_atomic_int_inc(&found->refcount);
+        g_static_mutex_unlock(&kfi_lock);
+
+        kfi_free(idx);
+        return found;
+    }
+
+    /* this replaces a stale index, if any; the sessions still using it
+       will release it without finding it in the table. */
+    g_hash_table_replace(kfi_table, idx->mrl, idx);
+
+    if ( ! idx->ready ) {
+        if ( ! kfi_builders )
+            kfi_builders = g_thread_pool_new(kfi_build_cb, NULL,
+                                             1, false, NULL);
+
+        /* reference for the build job */
+        g_atomic_int_inc(&idx->refcount);
+        g_thread_pool_push(kfi_builders, idx, NULL);
+    }
+
+    g_static_mutex_unlock(&kfi_lock);
+
+    if ( loaded )
+        media_stat_add(MEDIA_STAT_KFI_LOADED, 1);
+
+    return idx;
+}
+
+/**
+ * @brief Release a reference to a keyframe index
+ *
+ * @param idx The index to release, can be NULL.
+ *
+ * @note This function will lock the @ref kfi_lock mutex.
+ */
+void kfi_release(struct KeyframeIndex *idx)
+{
+    if ( idx == NULL )
+        return;
+
+    g_static_mutex_lock(&kfi_lock);
+
+    if ( g_atomic_int_dec_and_test(&idx->refcount) ) {
+        if ( g_hash_table_lookup(kfi_table, idx->mrl) == idx )
+            g_hash_table_remove(kfi_table, idx->mrl);
+        kfi_free(idx);
+    }
+
+    g_static_mutex_unlock(&kfi_lock);
+}
+
+/**
+ * @brief Seek a demuxer to the keyframe preceding the requested time
+ *
+ * @param idx The keyframe index of the resource
+ * @param avfc The demuxer context of the session to seek
+ * @param time_sec Pointer to the requested time, relative to the
+ *                 start of the resource; replaced with the time of the
+ *                 keyframe that was seeked to.
+ *
+ * @retval true The seek was done through the index.
+ * @retval false The index is not ready, or the seek failed; the
+ *               caller should fall back to a plain seek.
+ */
+gboolean kfi_seek(struct KeyframeIndex *idx, AVFormatContext *avfc,
+                  double *time_sec)
+{
+    AVStream *st;
+    const KeyframeEntry *entries, *entry;
+    int64_t target;
+    guint lo, hi;
+
+    if ( idx == NULL || ! g_atomic_int_get(&idx->ready) ||
+         idx->entries->len == 0 )
+        return false;
+
+    st = avfc->streams[idx->stream_index];
+    entries = (const KeyframeEntry *)idx->entries->data;
+
+    /* Generic-index demuxers can jump straight to the keyframe once
+       they know where it is, so hand them our entries first. */
+    if ( (avfc->iformat->flags & AVFMT_GENERIC_INDEX) &&
+         (guint)st->nb_index_entries < idx->entries->len ) {
+        guint i;
+        for ( i = 0; i < idx->entries->len; i++ )
+            if ( entries[i].pos >= 0 )
+                av_add_index_entry(st, entries[i].pos, entries[i].timestamp,
+                                   0, 0, AVINDEX_KEYFRAME);
+    }
+
+    target = av_rescale_q(*time_sec * AV_TIME_BASE + idx->start_time,
+                          AV_TIME_BASE_Q, idx->time_base);
+
+    /* find the last keyframe not after the target */
+    lo = 0;
+    hi = idx->entries->len;
+    while ( hi - lo > 1 ) {
+        guint mid = (lo + hi) / 2;
+        if ( entries[mid].timestamp <= target )
+            lo = mid;
+        else
+            hi = mid;
+    }
+    entry = &entries[lo];
+
+    if ( av_seek_frame(avfc, idx->stream_index, entry->timestamp,
+                       AVSEEK_FLAG_BACKWARD) < 0 )
+        return false;
+
+    *time_sec = av_q2d(idx->time_base) * entry->timestamp -
+        (double)idx->start_time / AV_TIME_BASE;
+    if ( *time_sec < 0 )
+        *time_sec = 0;
+
+    media_stat_add(MEDIA_STAT_INDEXED_SEEKS, 1);
+
+    return true;
+}
+
+/**
+ * @brief Times of the keyframes of the reference stream
+ *
+ * @return A new array of the keyframe times, in seconds in the time
+ *         base of the stream (the same the packets are timestamped
+ *         in), or NULL if the index is not ready yet.
+ */
+GArray *kfi_times(struct KeyframeIndex *idx)
+{
+    const KeyframeEntry *entries;
+    GArray *times;
+    guint i;
+
+    if ( idx == NULL || ! g_atomic_int_get(&idx->ready) ||
+         idx->entries->len == 0 )
+        return NULL;
+
+    entries = (const KeyframeEntry *)idx->entries->data;
+    times = g_array_sized_new(false, false, sizeof(double),
+                              idx->entries->len);
+
+    for ( i = 0; i < idx->entries->len; i++ ) {
+        double time = av_q2d(idx->time_base) * entries[i].timestamp;
+        g_array_append_val(times, time);
+    }
+
+    return times;
+}
@@ -82,3 +82,173 @@ void sdp_descr_append_rtpmap(Track *track)
                            track->clock_rate,
                            track->audio_channels);
 }
+
+/**
+ * @brief Names of the counters as reported by the statistics
+ *
+ * @note Keep in the same order as @ref MediaStat.
+ */
+static const char *const media_stat_names[MEDIA_STAT_COUNT] = {
+    [MEDIA_STAT_SEEKS]          = "seeks",
+    [MEDIA_STAT_SEEK_USEC]      = "seek_usec",
+    [MEDIA_STAT_SEEK_MAX_USEC]  = "seek_max_usec",
+    [MEDIA_STAT_INDEXED_SEEKS]  = "indexed_seeks",
+    [MEDIA_STAT_KFI_BUILT]      = "keyframe_index_built",
+    [MEDIA_STAT_KFI_LOADED]     = "keyframe_index_loaded",
+    [MEDIA_STAT_IO_READS]       = "io_reads",
+    [MEDIA_STAT_IO_BYTES]       = "io_bytes",
+    [MEDIA_STAT_IO_DIRECT_OPENS] = "io_direct_opens",
+    [MEDIA_STAT_IO_DIRECT_BYTES] = "io_direct_bytes",
+    [MEDIA_STAT_BYTES_DELIVERED] = "bytes_delivered",
+    [MEDIA_STAT_H264_STAP_PACKETS] = "h264_stap_packets",
+    [MEDIA_STAT_H264_STAP_NALS] = "h264_stap_nals",
+    [MEDIA_STAT_AUDIO_AGGREGATED_PACKETS] = "audio_aggregated_packets",
+    [MEDIA_STAT_AUDIO_AGGREGATED_FRAMES] = "audio_aggregated_frames",
+    [MEDIA_STAT_ZERO_COPY_BYTES] = "zero_copy_bytes",
+    [MEDIA_STAT_EDL_CUTS]       = "edl_cuts",
+    [MEDIA_STAT_EDL_STALL_USEC] = "edl_stall_usec",
+    [MEDIA_STAT_EDL_GAP_USEC]   = "edl_gap_usec",
+    [MEDIA_STAT_PCACHE_HITS]    = "packet_cache_hits",
+    [MEDIA_STAT_PCACHE_MISSES]  = "packet_cache_misses",
+    [MEDIA_STAT_PCACHE_BYTES]   = "packet_cache_bytes",
+    [MEDIA_STAT_PCACHE_SAVED_USEC] = "packet_cache_saved_usec",
+    [MEDIA_STAT_BUFFER_BYTES]   = "buffer_bytes",
+    [MEDIA_STAT_BUFFER_UNDERRUNS] = "buffer_underruns",
+    [MEDIA_STAT_BUFFER_GROWS]   = "buffer_grows",
+    [MEDIA_STAT_BUFFER_SHRINKS] = "buffer_shrinks",
+    [MEDIA_STAT_PREFETCH_STARTED] = "prefetch_started",
+    [MEDIA_STAT_PREFETCH_USED]  = "prefetch_used",
+    [MEDIA_STAT_PREFETCH_EXPIRED] = "prefetch_expired",
+    [MEDIA_STAT_HLS_HITS]       = "hls_hits",
+    [MEDIA_STAT_HLS_MISSES]     = "hls_misses",
+    [MEDIA_STAT_HLS_BYTES]      = "hls_bytes",
+    [MEDIA_STAT_ARCHIVE_BYTES]  = "archive_bytes",
+    [MEDIA_STAT_ARCHIVE_QUEUED_BYTES] = "archive_queued_bytes",
+    [MEDIA_STAT_ARCHIVE_DROPPED] = "archive_dropped",
+    [MEDIA_STAT_ARCHIVE_DROPPED_BYTES] = "archive_dropped_bytes",
+    [MEDIA_STAT_ARCHIVE_ERRORS] = "archive_errors",
+    [MEDIA_STAT_CHANNEL_CUTS] = "channel_cuts",
+    [MEDIA_STAT_CHANNEL_ERRORS] = "channel_errors",
+};
+
+/** Largest update applied without taking the lock */
+#define MEDIA_STAT_FAST_MAX (1 << 20)
+/** Pending amount past which it is folded in the total */
+#define MEDIA_STAT_FOLD (1 << 28)
+
+static guint64 media_stats[MEDIA_STAT_COUNT];
+
+/**
+ * @brief Amounts not yet folded in @ref media_stats
+ *
+ * Counters are updated on every packet by the fill and sender
+ * threads: the updates go to a 32-bit atomic value per counter,
+ * folded into the 64-bit total under the lock only when it grows past
+ * @ref MEDIA_STAT_FOLD, or when the counter is read.
+ */
+static volatile gint media_stats_pending[MEDIA_STAT_COUNT];
+static GStaticMutex media_stats_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Move the pending amount of a counter to its total
+ *
+ * @note To be called with media_stats_lock held.
+ */
+static void media_stat_fold(MediaStat stat)
+{
+    gint pending;
+
+    do {
+        pending = g_atomic_int_get(&media_stats_pending[stat]);
+    } while ( !g_atomic_int_compare_and_exchange(&media_stats_pending[stat],
+                                                  pending, 0) );
+
+    if ( pending < 0 )
+        media_stats[stat] -= MIN((guint64)-(gint64)pending, media_stats[stat]);
+    else
+        media_stats[stat] += pending;
+}
+
+/**
+ * @brief Add a signed amount to a counter
+ */
+static void media_stat_update(MediaStat stat, gint64 value)
+{
+    gint previous;
+
+    if ( value > MEDIA_STAT_FAST_MAX || value < -MEDIA_STAT_FAST_MAX ) {
+        g_static_mutex_lock(&media_stats_lock);
+        media_stat_fold(stat);
+        if ( value < 0 )
+            media_stats[stat] -= MIN((guint64)-value, media_stats[stat]);
+        else
+            media_stats[stat] += value;
+        g_static_mutex_unlock(&media_stats_lock);
+        return;
+    }
+
+    previous = g_atomic_int_exchange_and_add(&media_stats_pending[stat], value);
+
+    if ( previous + value > MEDIA_STAT_FOLD || previous + value < -MEDIA_STAT_FOLD ) {
+        g_static_mutex_lock(&media_stats_lock);
+        media_stat_fold(stat);
+        g_static_mutex_unlock(&media_stats_lock);
+    }
+}
+
+/**
+ * @brief Increase one of the media backend counters
+ *
+ * @param stat The counter to increase
+ * @param value The amount to add to the counter
+ */
+void media_stat_add(MediaStat stat, guint64 value)
+{
+    media_stat_update(stat, MIN(value, (guint64)G_MAXINT64));
+}
+
+/**
+ * @brief Raise one of the media backend counters to a given value
+ *
+ * @param stat The counter to raise
+ * @param value The new value, used only if higher than the current one
+ */
+void media_stat_max(MediaStat stat, guint64 value)
+{
+    g_static_mutex_lock(&media_stats_lock);
+    media_stat_fold(stat);
+    if ( value > media_stats[stat] )
+        media_stats[stat] = value;
+    g_static_mutex_unlock(&media_stats_lock);
+}
+
+/**
+ * @brief Decrease one of the media backend counters
+ *
+ * @param stat The counter to decrease, reporting an amount currently
+ *             held
+ * @param value The amount released
+ *
+ * @note The counter is clamped at zero when the amount is folded.
+ */
+void media_stat_sub(MediaStat stat, guint64 value)
+{
+    media_stat_update(stat, -(gint64)MIN(value, (guint64)G_MAXINT64));
+}
+
+guint64 media_stat_get(MediaStat stat)
+{
+    guint64 value;
+
+    g_static_mutex_lock(&media_stats_lock);
+    media_stat_fold(stat);
+    value = media_stats[stat];
+    g_static_mutex_unlock(&media_stats_lock);
+
+    return value;
+}
+
+const char *media_stat_name(MediaStat stat)
+{
+    return media_stat_names[stat];
+}
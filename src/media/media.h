@@ -34,10 +34,23 @@
 struct feng;
 struct RTP_session;
 struct AVFormatContext;
+struct AVIOContext;
+struct KeyframeIndex;
+struct PrefetchJob;
+struct EDLPlayback;
+struct SyntheticSource;
+struct MP2TMux;
+struct HLSCapture;
+struct HLSLiveTrack;
+struct Archive;
+struct ChannelSchedule;
+struct Aggregator;
+struct PacketRef;
 
 #define RESOURCE_OK 0
 #define RESOURCE_ERR -1
 #define RESOURCE_EOF -2
+#define RESOURCE_CLIP_END -3
 #define DEFAULT_MTU 1440
 
 typedef enum {
@@ -60,6 +73,17 @@ typedef GList *TrackList;
 typedef struct Resource Resource;
 typedef struct Track Track;
 
+/**
+ * @brief Range of a stored resource to play
+ *
+ * @see r_queue_range
+ */
+typedef struct ResourceRange {
+    double begin;
+    double end;
+    double offset;
+} ResourceRange;
+
 /**
  * @brief Descriptor structure of a resource
  * @ingroup resources
@@ -87,7 +111,15 @@ struct Resource {
     double duration;
 
     int (*read_packet)(Resource *);
-    int (*seek)(Resource *, double time_sec);
+
+    /**
+     * @brief Seek method
+     *
+     * The requested time is passed by reference, so that the backend
+     * can replace it with the time it actually seeked to (for
+     * instance the timestamp of the keyframe it landed on).
+     */
+    int (*seek)(Resource *, double *time_sec);
     GDestroyNotify uninit;
 
     /* Multiformat related things */
@@ -104,12 +136,170 @@ struct Resource {
              * It is not defined for non-virtual resources.
              */
             gint count;
+
+            /**
+             * @brief Schedule of the stored files played, for
+             *        scheduled channels
+             *
+             * @see channel_open
+             */
+            struct ChannelSchedule *channel;
         } live;
 
         struct {
             struct AVFormatContext *avfc;
             Track **tracks;
 
+            /**
+             * @brief Keyframe index of the file, shared among sessions
+             *
+             * @see kfi_acquire
+             */
+            struct KeyframeIndex *kfindex;
+
+            /**
+             * @brief Window of the resource to play
+             *
+             * Packets past @ref clip_end are dropped, and once all the
+             * tracks reached it, @ref Resource::read_packet returns
+             * @ref RESOURCE_CLIP_END; packets before @ref clip_start
+             * are dropped, except for video, so that the keyframe the
+             * resource was seeked to is still sent.
+             *
+             * The window is in seconds from the start of the resource,
+             * the time base of @ref Resource::seek, whatever the first
+             * timestamp of the stream is.
+             *
+             * @ref timeline_offset is added to the timestamps of all
+             * the packets that are played.
+             *
+             * @see r_set_clip
+             */
+            double clip_start;
+            double clip_end;
+            double timeline_offset;
+
+            /**
+             * @brief Playback state of edit list resources
+             */
+            struct EDLPlayback *edl;
+
+            /**
+             * @brief Generator state of synthetic resources
+             */
+            struct SyntheticSource *synthetic;
+
+            /**
+             * @brief MPEG-TS muxer the demuxed packets are handed to
+             *
+             * Set for resources opened with the .mp2t suffix, whose
+             * elementary tracks are @ref Track::muxed.
+             */
+            struct MP2TMux *mux;
+
+            /**
+             * @brief HLS segment the demuxed packets are collected in
+             *
+             * Set while an HLS media segment is generated from the
+             * resource, see @ref hls_capture.
+             */
+            struct HLSCapture *hls;
+
+            /**
+             * @brief Packet cache state of the resource
+             *
+             * @ref cache_gop is the GOP to look up in the cache at the
+             * next read, or -1 if the packets are to be demuxed;
+             * @ref cache_hit is set once a GOP was played from the
+             * cache since the last seek.
+             */
+            struct PacketCacheFile *pcache;
+            gint cache_gop;
+            gboolean cache_hit;
+
+            /**
+             * @brief Ranges queued to play after the current one
+             *
+             * Elements are @ref ResourceRange; when the current window
+             * ends, the resource is seeked to the next range, which is
+             * played back to back with the previous one.
+             *
+             * @see r_queue_range
+             */
+            GQueue *ranges;
+
+            /**
+             * @brief Ranges played since the last seek
+             *
+             * Array of @ref ResourceRange, with the offset each range
+             * was played with; used to map times of the timeline back
+             * to times within the stream.
+             *
+             * @see r_range_at
+             */
+            GArray *played;
+
+            /**
+             * @brief The last range queued ended
+             *
+             * Reading stops until a new range is queued; once the
+             * queues are sent, the delivery is over.
+             *
+             * @see r_ended
+             */
+            gboolean ranges_ended;
+
+            /**
+             * @brief Buffering watermarks, in milliseconds
+             *
+             * The fill thread is started once a consumer has less than
+             * @ref buffer_low of media left to send, and keeps reading
+             * until it has @ref buffer_high queued; both start from the
+             * configured values and are tuned by the fill thread,
+             * growing after underruns and shrinking under memory
+             * pressure.
+             *
+             * @ref buffer_low is read atomically by @ref r_fill.
+             *
+             * @see r_buffer_underrun
+             */
+            gint buffer_low;
+            gint buffer_high;
+
+            /**
+             * @brief Consumers that found their queue empty
+             *
+             * Increased atomically by @ref r_buffer_underrun;
+             * @ref underruns_seen is the value the watermarks were last
+             * tuned for.
+             */
+            gint underruns;
+            gint underruns_seen;
+
+            /** Time the watermarks were last changed */
+            double buffer_tuned;
+
+            /**
+             * @brief Warm-up state of the resource
+             *
+             * @ref prefetch tells whether @ref r_prefetch is reading
+             * ahead, and is protected by @ref Resource::lock, with
+             * @ref prefetch_cond signalled when it stops; @ref
+             * prefetch_job is the warm-up pushed to the pool, until it
+             * ends.
+             *
+             * @ref warm is set while the tracks hold the data read
+             * from @ref warm_time, the time the resource landed on
+             * when asked to seek to @ref warm_requested; a seek to the
+             * same time keeps it instead of reading it again.
+             */
+            gint prefetch;
+            GCond *prefetch_cond;
+            struct PrefetchJob *prefetch_job;
+            gboolean warm;
+            double warm_requested;
+            double warm_time;
+
             /**
              * @brief Pool of one thread for filling up data for the session
              *
@@ -204,6 +394,13 @@ struct Track {
      */
     gulong queue_serial;
 
+    /**
+     * @brief Size of the payload of the buffers in the queue
+     *
+     * Also accounted globally in @ref MEDIA_STAT_BUFFER_BYTES.
+     */
+    size_t queue_bytes;
+
     /**
      * @brief Count of registered consumers
      *
@@ -225,6 +422,29 @@ struct Track {
 
     Resource *parent;
 
+    /**
+     * @brief Track the buffers are actually written to
+     *
+     * When set, @ref track_write queues the buffers produced for this
+     * track on the sink track instead; this is used by resources
+     * composed of other resources (like edit lists) to have their
+     * parsers feed the tracks that are actually consumed.
+     */
+    Track *sink;
+
+    /**
+     * @brief The track reached @ref Resource::stored::clip_end
+     */
+    bool clipped;
+
+    /**
+     * @brief The track is only sent muxed in the MPEG-TS track
+     *
+     * Muxed tracks are neither described nor can be set up, see
+     * @ref Resource::stored::mux.
+     */
+    bool muxed;
+
     /**
      * @brief Track name
      *
@@ -272,6 +492,48 @@ struct Track {
      */
     void (*uninit)(Track *track);
 
+    /**
+     * @brief Packets waiting to be parsed
+     *
+     * @see pipeline_submit
+     */
+    struct TrackPipeline *pipeline;
+
+    /**
+     * @brief Demuxed packet being parsed, if it can be referenced
+     *
+     * @see track_buffer_new
+     */
+    struct PacketRef *packet;
+
+    /**
+     * @brief Recorder of the buffers produced, for the packet cache
+     *
+     * @see pcache_record
+     */
+    struct PacketRecorder *recorder;
+
+    /**
+     * @brief Audio frames waiting to be sent together
+     *
+     * @see aggr_frame
+     */
+    struct Aggregator *aggregator;
+
+    /**
+     * @brief HLS segmenter the buffers of a live track are fed to
+     *
+     * @see hls_live_write
+     */
+    struct HLSLiveTrack *hls;
+
+    /**
+     * @brief Archive writer the buffers of a live track are copied to
+     *
+     * @see archive_write
+     */
+    struct Archive *archive;
+
     /** @} */
 
     /**
@@ -302,12 +564,27 @@ struct Track {
             uint8_t nal_length_size; // used in avc
         } h264;
 
+        struct {
+            bool is_hvcc;
+            uint8_t nal_length_size; // used in hvcC
+        } h265;
+
+        struct {
+            uint16_t picture_id;
+        } vp9;
+
         struct {
             char *mq_path;
         } live;
     };
 };
 
+/**
+ * @brief Largest payload header of the buffers referencing a demuxed
+ *        packet (see @ref MParserBuffer::ref)
+ */
+#define MPARSER_HEADER_MAX 4
+
 /**
  * @brief Buffer passed between parsers and RTP sessions
  *
@@ -339,19 +616,51 @@ struct MParserBuffer {
 
     size_t data_size;   /*!< packet size */
     uint8_t *data;      /*!< actual packet data */
+
+    /**
+     * @brief Demuxed packet the payload is taken from
+     *
+     * When set, the packet is made of the @ref header_size bytes of
+     * @ref header followed by the rest of it at @ref payload, inside
+     * the demuxed packet, which is kept alive until the buffer is
+     * freed; @ref data is NULL. Use @ref mparser_buffer_copy to read
+     * such a buffer.
+     */
+    struct PacketRef *ref;
+    const uint8_t *payload;
+    uint8_t header[MPARSER_HEADER_MAX];
+    uint8_t header_size;
+
+    /**
+     * @brief Layer metadata, for the payloads telling them
+     *
+     * Set by the VP9 and AV1 packetizers so that the delivery can
+     * tell which packets it can do without; zero for the others.
+     */
+    gboolean keyframe;      /*!< part of a frame decodable on its own */
+    uint8_t temporal_id;    /*!< temporal layer of the packet */
+    uint8_t spatial_id;     /*!< spatial layer of the packet */
 };
 
 // --- functions --- //
 
 Resource *r_open(const char *inner_path);
+Resource *r_open_client(const char *inner_path);
 
 int r_read(Resource *resource);
-int r_seek(Resource *resource, double time);
+int r_seek(Resource *resource, double *time);
+void r_set_clip(Resource *resource, double start, double end, double offset);
+void r_queue_range(Resource *resource, double begin, double end);
+guint r_range_at(Resource *resource, double *time);
 
 void r_close(Resource *resource);
 void r_pause(Resource *resource);
 void r_resume(Resource *resource);
 void r_fill(Resource *resource, struct RTP_session *consumer);
+void r_buffer_underrun(Resource *resource);
+gboolean r_ended(Resource *resource);
+gboolean r_prefetch(Resource *resource, double time);
+void r_prefetch_stop(Resource *resource);
 
 Track *r_find_track(Resource *, const char *);
 
@@ -359,19 +668,583 @@ Track *track_new(char *name);
 void track_free(Track *track);
 void track_reset_queue(struct Track *);
 void track_write(Track *tr, struct MParserBuffer *buffer);
+void track_write_frame(Track *tr, GQueue *frame);
+struct MParserBuffer *track_buffer_copy(Track *tr,
+                                        const uint8_t *data, size_t size);
+struct MParserBuffer *track_buffer_new(Track *tr,
+                                       const uint8_t *header, size_t header_size,
+                                       const uint8_t *payload, size_t payload_size);
+struct MParserBuffer *track_pop(Track *tr);
+bool track_wanted(Track *tr);
+double track_buffered(Track *tr);
 
 struct MParserBuffer *bq_consumer_get(struct RTP_session *consumer);
 gulong bq_consumer_unseen(struct RTP_session *consumer);
+double bq_consumer_buffered(struct RTP_session *consumer);
 gboolean bq_consumer_move(struct RTP_session *consumer);
 gboolean bq_consumer_stopped(struct RTP_session *consumer);
 void bq_consumer_free(struct RTP_session *consumer);
 
+struct PacketRef *packet_ref_new(gpointer packet, GDestroyNotify free_packet);
+struct PacketRef *packet_ref(struct PacketRef *ref);
+void packet_unref(struct PacketRef *ref);
+
+void mparser_buffer_free(struct MParserBuffer *buffer);
+void mparser_buffer_copy(const struct MParserBuffer *buffer, uint8_t *dest);
+void mparser_buffer_flatten(struct MParserBuffer *buffer);
+
 void sdp_descr_append_config(Track *track);
 void sdp_descr_append_rtpmap(Track *track);
 
 void bq_init();
 void ffmpeg_init(void);
 
+/**
+ * @defgroup resource_io Resource I/O layer
+ *
+ * @brief Access to the bytes of stored resources
+ *
+ * Stored resources are not read through the file protocol of
+ * libavformat but through this layer, which chooses the most fitting
+ * strategy for the storage the file is on (see @ref
+ * ResourceIOBackend), and is handed over to the demuxer as a custom
+ * I/O context by @ref avf_open_input.
+ *
+ * @{ */
+
+typedef struct ResourceIO ResourceIO;
+
+/**
+ * @brief Methods of a resource I/O backend
+ */
+typedef struct ResourceIOBackend {
+    const char *name;
+
+    /**
+     * @brief Read data at the current position
+     *
+     * @return The amount of bytes copied into the buffer, zero at the
+     *         end of the file or a negative value on error. The
+     *         position is advanced by the caller.
+     */
+    int (*read)(ResourceIO *rio, uint8_t *buf, int size);
+
+    /**
+     * @brief Optional notification that the position changed
+     */
+    void (*seek)(ResourceIO *rio);
+
+    void (*close)(ResourceIO *rio);
+} ResourceIOBackend;
+
+struct ResourceIO {
+    const ResourceIOBackend *backend;
+
+    char *path;
+    int64_t size;
+    int64_t pos;
+    time_t mtime;
+
+    /**
+     * @brief Amount of data to read ahead of the current position
+     *
+     * Computed from the bitrate of the resource and the configured
+     * readahead time, see @ref rio_set_bitrate.
+     */
+    size_t window;
+
+    void *priv;
+};
+
+ResourceIO *rio_open(const char *path);
+void rio_count_open(const char *path);
+gboolean rio_stat(const char *path, time_t *mtime);
+int rio_read(ResourceIO *rio, uint8_t *buf, int size);
+int64_t rio_seek(ResourceIO *rio, int64_t offset, int whence);
+void rio_set_bitrate(ResourceIO *rio, int64_t bit_rate);
+void rio_close(ResourceIO *rio);
+
+int avf_open_input(struct AVFormatContext **avfc, const char *mrl);
+void avf_close_input(struct AVFormatContext **avfc);
+
+/** @} */
+
+/**
+ * @defgroup segment_cache Segment cache
+ *
+ * @brief Pull-through cache of the files of a remote or slower origin,
+ *        in memory and in a local directory
+ *
+ * @see rio_segment_cache
+ *
+ * @{ */
+
+typedef struct SegmentCache SegmentCache;
+
+/**
+ * @brief Counters of a segment cache
+ */
+typedef struct SegmentCacheStats {
+    guint64 ram_hits;       /*!< reads served from memory */
+    guint64 disk_hits;      /*!< segments loaded from the cache directory */
+    guint64 misses;         /*!< segments fetched from the origin */
+    guint64 coalesced;      /*!< reads that waited for a segment being fetched */
+    guint64 prefetches;     /*!< segments fetched ahead of the readers */
+    guint64 errors;         /*!< segments that could not be fetched */
+    guint64 origin_bytes;   /*!< bytes fetched from the origin */
+    guint64 disk_stores;    /*!< segments stored in the cache directory */
+    guint64 disk_evictions; /*!< segments removed from the cache directory */
+    guint64 disk_bytes;     /*!< bytes in the cache directory */
+} SegmentCacheStats;
+
+SegmentCache *segcache_new(const char *origin, const char *cache_dir,
+                           size_t segment_size, size_t memory,
+                           guint prefetch);
+void segcache_set_disk_policy(SegmentCache *sc, size_t disk_size,
+                              guint disk_admit);
+void segcache_free(SegmentCache *sc);
+gboolean segcache_stat(SegmentCache *sc, const char *path,
+                       int64_t *size, time_t *mtime);
+int segcache_read(SegmentCache *sc, const char *path, time_t mtime,
+                  int64_t size, int64_t offset, uint8_t *buf, int len);
+void segcache_touch(SegmentCache *sc, const char *path, time_t mtime,
+                    int64_t offset, gint64 *cursor);
+void segcache_get_stats(SegmentCache *sc, SegmentCacheStats *stats);
+
+SegmentCache *rio_segment_cache(void);
+SegmentCache *rio_segment_cache_peek(void);
+
+/** @} */
+
+/**
+ * @defgroup pipeline Packetization pipeline
+ *
+ * @brief Parsing of the demuxed packets on a shared pool of threads
+ *
+ * @{ */
+
+/**
+ * @brief A demuxed packet to parse
+ *
+ * The timestamps are set on the track before parsing; NAN leaves the
+ * value of the track unchanged.
+ */
+typedef struct ParseJob {
+    uint8_t *data;
+    ssize_t len;
+
+    double pts;
+    double dts;
+    double duration;
+
+    /** Opaque packet holding @ref data, referenced by the buffers
+     *  built out of it (see @ref track_buffer_new) */
+    gpointer packet;
+    GDestroyNotify free_packet;
+} ParseJob;
+
+int pipeline_submit(Track *tr, const ParseJob *job);
+void pipeline_drain(Track *tr);
+void pipeline_flush(Track *tr);
+void pipeline_free(Track *tr);
+
+/** @} */
+
+/**
+ * @defgroup aggregate Audio frame aggregation
+ *
+ * @brief Packing of consecutive audio frames in the same RTP packet
+ *
+ * @{ */
+
+/**
+ * @brief Multi-frame rules of a payload format
+ */
+typedef struct AggregateFormat {
+    /** Most frames a packet can carry */
+    guint max_frames;
+
+    /** Longest duration a packet can carry, or 0 for no limit */
+    double max_duration;
+
+    /**
+     * @brief Size of the packet carrying @p frames frames, of @p bytes
+     *        in total
+     *
+     * This can be an upper bound, the actual size being returned by
+     * @ref write.
+     */
+    size_t (*packet_size)(guint frames, size_t bytes);
+
+    /**
+     * @brief Write the packet
+     *
+     * @param tr The track the packet is for
+     * @param dest The packet, of the size given by @ref packet_size
+     * @param sizes The size of each frame
+     * @param frames The number of frames
+     * @param payload The frames, back to back
+     *
+     * @return The size of the packet.
+     */
+    size_t (*write)(Track *tr, uint8_t *dest, const guint *sizes, guint frames,
+                    const uint8_t *payload);
+
+    /**
+     * @brief Tells whether a frame can be sent with the first one
+     *        gathered (optional)
+     */
+    gboolean (*compatible)(const uint8_t *first, const uint8_t *frame);
+
+    /**
+     * @brief Set the marker bit only on the first packet following a
+     *        gap, rather than on all the packets
+     */
+    gboolean talkspurts;
+} AggregateFormat;
+
+void aggr_frame(Track *tr, const AggregateFormat *format,
+                const uint8_t *data, size_t len,
+                double offset, double duration);
+void aggr_flush(Track *tr);
+void aggr_reset(Track *tr);
+void aggr_free(Track *tr);
+
+/** @} */
+
+/**
+ * @defgroup editlist Edit lists
+ *
+ * @brief Description and timeline of edit list (collage) resources
+ *
+ * @{ */
+
+typedef struct EditListSegment {
+    char *path;         /*!< path of the file, relative to the edit list */
+    double start;       /*!< start of the segment within the file */
+    double end;         /*!< end of the segment within the file */
+    double offset;      /*!< start of the segment within the timeline */
+} EditListSegment;
+
+typedef struct EditList {
+    GPtrArray *segments;
+    double duration;
+} EditList;
+
+EditList *edl_parse(const char *contents);
+void edl_free(EditList *edl);
+void edl_layout(EditList *edl);
+guint edl_find_segment(EditList *edl, double time);
+double edl_to_timeline(const EditListSegment *segment, double time);
+double edl_stream_offset(const EditListSegment *segment, double start_time);
+guint edl_loop_segment(EditList *edl, double *time);
+
+/** @} */
+
+/**
+ * @defgroup packet_cache Packet cache
+ *
+ * @brief Cache of the packets of stored resources, shared among sessions
+ *
+ * @{ */
+
+typedef struct PacketCacheFile PacketCacheFile;
+
+PacketCacheFile *pcache_file_new(const char *mrl, time_t mtime, GArray *gops);
+void pcache_file_free(PacketCacheFile *pcf);
+gint pcache_file_gop(PacketCacheFile *pcf, double time);
+gboolean pcache_file_gop_bounds(PacketCacheFile *pcf, gint gop,
+                                double *start, double *end);
+
+void pcache_track_attach(Track *tr, PacketCacheFile *pcf);
+void pcache_track_reset(Track *tr);
+void pcache_track_free(Track *tr);
+void pcache_record(Track *tr, const struct MParserBuffer *buffer);
+void pcache_record_cost(Track *tr, double seconds);
+gboolean pcache_same_gop(Track *tr, double a, double b);
+
+gboolean pcache_play(Resource *r, PacketCacheFile *pcf, gint gop);
+
+/** @} */
+
+/**
+ * @defgroup keyframe_index Keyframe index
+ *
+ * @brief Shared index of the keyframes of stored resources
+ *
+ * @{ */
+
+struct KeyframeIndex *kfi_acquire(struct AVFormatContext *avfc,
+                                  const char *mrl, time_t mtime);
+void kfi_release(struct KeyframeIndex *idx);
+gboolean kfi_seek(struct KeyframeIndex *idx, struct AVFormatContext *avfc,
+                  double *time_sec);
+GArray *kfi_times(struct KeyframeIndex *idx);
+
+/** @} */
+
+/**
+ * @defgroup mp2t MPEG-TS output
+ *
+ * @brief Single-session output of all the tracks of a resource
+ *
+ * @{ */
+
+int mp2t_mux(struct MP2TMux *mux, Track *tr, const uint8_t *data,
+             size_t len, double dts, double pts, gboolean key);
+void mp2t_flush(struct MP2TMux *mux);
+void mp2t_reset(struct MP2TMux *mux);
+void mp2t_free(struct MP2TMux *mux);
+
+/** @} */
+
+/**
+ * @defgroup fmp4 Fragmented MP4
+ *
+ * @brief Initialization and media segments of fragmented MP4 files
+ *
+ * @{ */
+
+/**
+ * @brief A sample of a fragmented MP4 track
+ *
+ * Times are in the timescale of the track.
+ */
+typedef struct FMP4Sample {
+    int64_t dts;
+    int32_t cts_offset;     /*!< presentation time minus decoding time */
+    uint32_t duration;
+    gboolean key;
+    size_t offset;          /*!< offset of the payload in FMP4Track::data */
+    size_t size;
+} FMP4Sample;
+
+/**
+ * @brief A track of a fragmented MP4 file, with the samples waiting
+ *        to be written
+ */
+typedef struct FMP4Track {
+    guint id;
+    MediaType media_type;   /*!< MP_video for H.264, MP_audio for AAC */
+    uint32_t timescale;
+
+    /** avcC record for H.264, AudioSpecificConfig for AAC */
+    GByteArray *config;
+
+    /** The samples added are in Annex B format and are converted */
+    gboolean annexb;
+
+    int width;
+    int height;
+    int channels;
+    int sample_rate;
+
+    GArray *samples;        /*!< of FMP4Sample */
+    GByteArray *data;
+} FMP4Track;
+
+FMP4Track *fmp4_track_new(guint id, MediaType media_type);
+void fmp4_track_free(FMP4Track *t);
+gboolean fmp4_track_set_h264(FMP4Track *t,
+                             const uint8_t *sps, size_t sps_len,
+                             const uint8_t *pps, size_t pps_len);
+gboolean fmp4_track_set_h264_extradata(FMP4Track *t,
+                                       const uint8_t *extradata, size_t len);
+gboolean fmp4_track_set_aac(FMP4Track *t, const uint8_t *config, size_t len);
+void fmp4_track_add_sample(FMP4Track *t, double dts, double pts,
+                           double duration, gboolean key,
+                           const uint8_t *data, size_t len);
+void fmp4_track_trim(FMP4Track *t, double end);
+double fmp4_track_start(const FMP4Track *t);
+
+GByteArray *fmp4_init_segment(FMP4Track *const *tracks, guint count);
+GByteArray *fmp4_media_segment(FMP4Track *const *tracks, guint count,
+                               guint32 sequence, double end);
+
+gboolean fmp4_h264_sps_size(const uint8_t *sps, size_t len,
+                            int *width, int *height);
+
+/** @} */
+
+/**
+ * @defgroup hls HLS output
+ *
+ * @brief Playlists and fragmented MP4 segments served over HTTP
+ *
+ * @{ */
+
+#define HLS_OK 0
+#define HLS_NOT_FOUND -1
+#define HLS_NOT_READY -2
+#define HLS_PENDING -3
+
+/**
+ * @brief A playlist or segment, shared among the HTTP clients
+ */
+typedef struct HLSFile {
+    gint refcount;
+    const char *content_type;
+
+    /** The file belongs to a live resource and changes over time */
+    gboolean live;
+
+    GByteArray *data;
+} HLSFile;
+
+/**
+ * @brief Function receiving a generated HLS file
+ *
+ * @param ret @ref HLS_OK, or the error that prevented the generation
+ * @param file A new reference to the file, or NULL on error
+ * @param user_data The pointer passed to @ref hls_get
+ */
+typedef void (*HLSReadyFunc)(int ret, HLSFile *file, gpointer user_data);
+
+int hls_get(const char *path, const char *name, HLSFile **file,
+            HLSReadyFunc ready, gpointer user_data);
+void hls_file_unref(HLSFile *file);
+
+int hls_capture(struct HLSCapture *cap, Track *tr, const uint8_t *data,
+                size_t len, double dts, double pts, double duration,
+                gboolean key);
+
+gboolean hls_live_wanted(Track *tr);
+void hls_live_write(Track *tr, const struct MParserBuffer *buffer);
+
+/** @} */
+
+/**
+ * @defgroup archive Live archives
+ *
+ * @brief Recording of live resources to rotated files on disk
+ *
+ * @{ */
+
+void archive_init();
+void archive_cleanup();
+void archive_write(Track *tr, const struct MParserBuffer *buffer);
+
+/** @} */
+
+/**
+ * @defgroup live Live resources
+ *
+ * @brief Fan-out of the buffers of the live tracks, shared by the
+ *        clients of a virtual resource
+ *
+ * @{ */
+
+gboolean live_track_wanted(Track *tr);
+void live_track_write(Track *tr, struct MParserBuffer *buffer);
+
+/** @} */
+
+/**
+ * @defgroup media_stats Media backend counters
+ *
+ * @brief Process-wide counters exported through the statistics
+ *
+ * Most counters are only ever incremented (or raised, for the
+ * maximum values); the ones reporting an amount currently held, such
+ * as the bytes queued for the archives, are also decreased through
+ * @ref media_stat_sub when it is released. They are reported as they
+ * are by @ref feng_send_statistics, so that averages and rates can be
+ * computed by whoever is collecting them.
+ *
+ * @{ */
+
+typedef enum {
+    MEDIA_STAT_SEEKS,           /*!< seeks requested */
+    MEDIA_STAT_SEEK_USEC,       /*!< total time spent seeking */
+    MEDIA_STAT_SEEK_MAX_USEC,   /*!< slowest seek */
+    MEDIA_STAT_INDEXED_SEEKS,   /*!< seeks resolved through the keyframe index */
+    MEDIA_STAT_KFI_BUILT,       /*!< keyframe indexes built by scanning a file */
+    MEDIA_STAT_KFI_LOADED,      /*!< keyframe indexes loaded from a sidecar */
+    MEDIA_STAT_IO_READS,        /*!< read operations issued to the storage */
+    MEDIA_STAT_IO_BYTES,        /*!< bytes requested from the storage */
+    MEDIA_STAT_IO_DIRECT_OPENS, /*!< files opened bypassing the page cache */
+    MEDIA_STAT_IO_DIRECT_BYTES, /*!< bytes read bypassing the page cache */
+    MEDIA_STAT_BYTES_DELIVERED, /*!< payload bytes sent to the clients */
+    MEDIA_STAT_H264_STAP_PACKETS, /*!< H.264 STAP-A packets sent */
+    MEDIA_STAT_H264_STAP_NALS,  /*!< H.264 NAL units aggregated in STAP-A packets */
+    MEDIA_STAT_AUDIO_AGGREGATED_PACKETS, /*!< RTP packets carrying several audio frames */
+    MEDIA_STAT_AUDIO_AGGREGATED_FRAMES, /*!< audio frames sent in those packets */
+    MEDIA_STAT_ZERO_COPY_BYTES, /*!< payload bytes referenced in the demuxed packets instead of copied */
+    MEDIA_STAT_EDL_CUTS,        /*!< cuts between edit list segments */
+    MEDIA_STAT_EDL_STALL_USEC,  /*!< time spent waiting for the next segment at cuts */
+    MEDIA_STAT_EDL_GAP_USEC,    /*!< timeline left without media at cuts */
+    MEDIA_STAT_PCACHE_HITS,     /*!< GOPs played from the packet cache */
+    MEDIA_STAT_PCACHE_MISSES,   /*!< GOPs that had to be demuxed after a cache lookup */
+    MEDIA_STAT_PCACHE_BYTES,    /*!< bytes currently held by the packet cache */
+    MEDIA_STAT_PCACHE_SAVED_USEC, /*!< packetization time saved by the cache hits */
+    MEDIA_STAT_BUFFER_BYTES,    /*!< bytes currently queued on the tracks */
+    MEDIA_STAT_BUFFER_UNDERRUNS, /*!< consumers that found their queue empty */
+    MEDIA_STAT_BUFFER_GROWS,    /*!< watermarks raised after underruns */
+    MEDIA_STAT_BUFFER_SHRINKS,  /*!< watermarks lowered */
+    MEDIA_STAT_PREFETCH_STARTED, /*!< resources warmed up after DESCRIBE */
+    MEDIA_STAT_PREFETCH_USED,   /*!< warmed up resources played without seeking */
+    MEDIA_STAT_PREFETCH_EXPIRED, /*!< warmed up resources never set up */
+    MEDIA_STAT_HLS_HITS,        /*!< HLS files served from memory */
+    MEDIA_STAT_HLS_MISSES,      /*!< HLS files generated for a request */
+    MEDIA_STAT_HLS_BYTES,       /*!< bytes currently held by the HLS files */
+    MEDIA_STAT_ARCHIVE_BYTES,   /*!< bytes written to the archives */
+    MEDIA_STAT_ARCHIVE_QUEUED_BYTES, /*!< bytes currently waiting to be archived */
+    MEDIA_STAT_ARCHIVE_DROPPED, /*!< packets not archived because the disk was behind */
+    MEDIA_STAT_ARCHIVE_DROPPED_BYTES, /*!< bytes of the packets not archived */
+    MEDIA_STAT_ARCHIVE_ERRORS,  /*!< archive files that could not be written */
+    MEDIA_STAT_CHANNEL_CUTS,    /*!< segments started by the scheduled channels */
+    MEDIA_STAT_CHANNEL_ERRORS,  /*!< files of the scheduled channels that could not be read */
+    MEDIA_STAT_COUNT
+} MediaStat;
+
+void media_stat_add(MediaStat stat, guint64 value);
+void media_stat_max(MediaStat stat, guint64 value);
+void media_stat_sub(MediaStat stat, guint64 value);
+guint64 media_stat_get(MediaStat stat);
+const char *media_stat_name(MediaStat stat);
+
+/** @} */
+
+/**
+ * @defgroup startcode Start code scanning
+ *
+ * @brief Search of the 00 00 01 start codes of the H.264 and MPEG
+ *        video bitstreams, vectorized when the CPU allows it
+ *
+ * @{ */
+
+typedef const uint8_t *(*StartcodeFunc)(const uint8_t *p, const uint8_t *end);
+
+typedef struct StartcodeScanner {
+    const char *name;
+    StartcodeFunc find;
+} StartcodeScanner;
+
+const StartcodeScanner *startcode_scanners();
+const uint8_t *startcode_find(const uint8_t *p, const uint8_t *end);
+
+/** @} */
+
+/**
+ * @defgroup payloads VP9 and AV1 payloads
+ *
+ * @brief Packetization of VP9 frames (RFC 9628) and AV1 temporal units
+ *        (AOM RTP specification)
+ *
+ * The packets are appended to a queue of buffers with their data,
+ * marker and layer metadata set; the parsers fill in the timing before
+ * writing them to the track as a frame.
+ *
+ * @{ */
+
+void vp9_payload(GQueue *packets, const uint8_t *data, size_t len,
+                 uint16_t picture_id);
+gboolean av1_payload(GQueue *packets, const uint8_t *data, size_t len,
+                     const uint8_t *config, size_t config_len);
+void payload_free(GQueue *packets);
+
+/** @} */
+
 /**
  * @defgroup parsers
  *
@@ -389,15 +1262,24 @@ int aac_parse(Track *track, uint8_t *data, ssize_t len);
 int amr_init(Track *track);
 int amr_parse(Track *track, uint8_t *data, ssize_t len);
 
+int av1_init(Track *track);
+int av1_parse(Track *track, uint8_t *data, ssize_t len);
+
 int h263_init(Track *track);
 int h263_parse(Track *track, uint8_t *data, ssize_t len);
 
 int h264_init(Track *track);
 int h264_parse(Track *track, uint8_t *data, ssize_t len);
 
+int h265_init(Track *track);
+int h265_parse(Track *track, uint8_t *data, ssize_t len);
+
 int mp4ves_init(Track *track);
 int mp4ves_parse(Track *track, uint8_t *data, ssize_t len);
 
+int opus_init(Track *track);
+int opus_parse(Track *track, uint8_t *data, ssize_t len);
+
 int mpa_parse(Track *track, uint8_t *data, ssize_t len);
 
 int mpv_parse(Track *track, uint8_t *data, ssize_t len);
@@ -407,6 +1289,9 @@ int speex_parse(Track *track, uint8_t *data, ssize_t len);
 int vp8_init(Track *track);
 int vp8_parse(Track *track, uint8_t *data, ssize_t len);
 
+int vp9_init(Track *track);
+int vp9_parse(Track *track, uint8_t *data, ssize_t len);
+
 /**
  * @defgroup parsers_xiph
  *
@@ -0,0 +1,649 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief MPEG transport stream output
+ *
+ * When a stored resource is requested with the .mp2t suffix appended
+ * to its path, all its tracks are muxed into a single MPEG-TS track,
+ * sent as MP2T (static payload type 33, RFC 2250) with seven TS
+ * packets per RTP packet, so that a client needs a single RTP session
+ * for audio and video.
+ *
+ * The demuxed packets are handed to the muxer instead of the parsers
+ * of the elementary tracks, which are kept in the resource (flagged
+ * as @ref Track::muxed) only to follow the clip window; the TS packets
+ * are queued on the MP2T track like any other buffer.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <math.h>
+
+#include "fnc_log.h"
+#include "media/media.h"
+
+extern Resource *avf_open(const char *url);
+
+/** Suffix of the path selecting the MPEG-TS output */
+#define MP2T_SUFFIX ".mp2t"
+
+#define MP2T_PACKET_SIZE 188
+#define MP2T_PACKETS_PER_BUFFER 7
+
+#define MP2T_PAT_PID 0x0000
+#define MP2T_PMT_PID 0x1000
+#define MP2T_FIRST_PID 0x0100
+
+/** Interval between two PAT/PMT pairs, in seconds */
+#define MP2T_PSI_INTERVAL 0.1
+
+/** Maximum interval between two PCRs, in seconds */
+#define MP2T_PCR_INTERVAL 0.04
+
+/**
+ * @brief Time the frames are presented after their delivery, in
+ *        seconds
+ *
+ * The PCR follows the delivery time of the packets, while the
+ * timestamps are delayed by this amount, which gives the decoders
+ * room to buffer the frames.
+ */
+#define MP2T_DELAY 0.5
+
+/** Size reserved in front of the PES payload for its header */
+#define MP2T_PES_HEADER_MAX 19
+
+#define MP2T_TS_MASK ((G_GINT64_CONSTANT(1) << 33) - 1)
+
+typedef struct MP2TStream {
+    Track *track;
+
+    guint16 pid;
+    guint8 stream_type;
+    guint8 stream_id;
+    guint8 cc;
+
+    /**
+     * @brief Length of the NAL size fields of H.264 in AVC format, zero
+     *        for Annex B streams
+     */
+    guint8 nal_length_size;
+
+    /** SPS and PPS in Annex B format, sent before keyframes */
+    GByteArray *headers;
+
+    /** AAC AudioSpecificConfig fields, for the ADTS headers */
+    guint8 aac_profile;
+    guint8 aac_rate;
+    guint8 aac_channels;
+} MP2TStream;
+
+struct MP2TMux {
+    Track *track;
+
+    MP2TStream *streams;
+    guint count;
+
+    guint16 pcr_pid;
+    guint8 pat_cc;
+    guint8 pmt_cc;
+
+    double last_psi;
+    double last_pcr;
+
+    /** Delivery time of the buffers being filled */
+    double delivery;
+
+    /** PES packet being built */
+    GByteArray *pes;
+
+    uint8_t out[MP2T_PACKETS_PER_BUFFER * MP2T_PACKET_SIZE];
+    guint packets;
+};
+
+static guint32 mp2t_crc32(const uint8_t *data, size_t len)
+{
+    guint32 crc = 0xffffffff;
+
+    while ( len-- ) {
+        int i;
+
+        crc ^= (guint32)*data++ << 24;
+        for ( i = 0; i < 8; i++ )
+            crc = (crc << 1) ^ (crc & 0x80000000 ? 0x04c11db7 : 0);
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Queue the TS packets collected so far on the MP2T track
+ */
+void mp2t_flush(struct MP2TMux *mux)
+{
+    struct MParserBuffer *buffer;
+
+    if ( mux == NULL || mux->packets == 0 )
+        return;
+
+    buffer = g_slice_new0(struct MParserBuffer);
+
+    buffer->timestamp = mux->delivery;
+    buffer->delivery = mux->delivery;
+
+    buffer->data_size = mux->packets * MP2T_PACKET_SIZE;
+    buffer->data = g_memdup(mux->out, buffer->data_size);
+
+    track_write(mux->track, buffer);
+
+    mux->packets = 0;
+}
+
+static uint8_t *mp2t_packet(struct MP2TMux *mux)
+{
+    if ( mux->packets == MP2T_PACKETS_PER_BUFFER )
+        mp2t_flush(mux);
+
+    return mux->out + MP2T_PACKET_SIZE * mux->packets++;
+}
+
+/**
+ * @brief Split a payload in TS packets
+ *
+ * @param pcr The PCR to send in the first packet, in 27MHz units, or
+ *            -1 for none
+ * @param rai Set the random access indicator in the first packet
+ *
+ * The last packet is filled up with an adaptation field.
+ */
+static void mp2t_write_ts(struct MP2TMux *mux, guint16 pid, guint8 *cc,
+                          const uint8_t *data, size_t len,
+                          gint64 pcr, gboolean rai)
+{
+    gboolean start = true;
+
+    while ( len > 0 ) {
+        uint8_t *p = mp2t_packet(mux), *q = p + 4;
+        gboolean has_af = start && (pcr >= 0 || rai);
+        size_t af = has_af ? 1 + (pcr >= 0 ? 6 : 0) : 0;
+        size_t room = 184 - (has_af ? 1 + af : 0);
+
+        if ( len < room ) {
+            if ( has_af )
+                af += room - len;
+            else {
+                has_af = true;
+                af = room - len - 1;
+            }
+        }
+
+        p[0] = 0x47;
+        p[1] = (start ? 0x40 : 0) | ((pid >> 8) & 0x1f);
+        p[2] = pid & 0xff;
+        p[3] = (has_af ? 0x30 : 0x10) | (*cc & 0x0f);
+        (*cc)++;
+
+        if ( has_af ) {
+            uint8_t *end;
+
+            *q++ = af;
+            end = q + af;
+
+            if ( af > 0 ) {
+                const gboolean with_pcr = start && pcr >= 0;
+
+                *q++ = (with_pcr ? 0x10 : 0) | (start && rai ? 0x40 : 0);
+
+                if ( with_pcr ) {
+                    const gint64 base = pcr / 300, ext = pcr % 300;
+
+                    *q++ = base >> 25;
+                    *q++ = base >> 17;
+                    *q++ = base >> 9;
+                    *q++ = base >> 1;
+                    *q++ = ((base & 1) << 7) | 0x7e | (ext >> 8);
+                    *q++ = ext & 0xff;
+                }
+
+                memset(q, 0xff, end - q);
+                q = end;
+            }
+        }
+
+        room = p + MP2T_PACKET_SIZE - q;
+        memcpy(q, data, room);
+
+        data += room;
+        len -= room;
+        start = false;
+    }
+}
+
+/**
+ * @brief Write a PSI section, padding its packet with 0xff
+ */
+static void mp2t_write_section(struct MP2TMux *mux, guint16 pid, guint8 *cc,
+                               uint8_t *section, size_t len)
+{
+    uint8_t payload[184];
+    const guint32 crc = mp2t_crc32(section, len - 4);
+
+    section[len - 4] = crc >> 24;
+    section[len - 3] = crc >> 16;
+    section[len - 2] = crc >> 8;
+    section[len - 1] = crc;
+
+    memset(payload, 0xff, sizeof(payload));
+    payload[0] = 0; /* pointer field */
+    memcpy(payload + 1, section, len);
+
+    mp2t_write_ts(mux, pid, cc, payload, sizeof(payload), -1, false);
+}
+
+static void mp2t_write_psi(struct MP2TMux *mux)
+{
+    uint8_t pat[16] = {
+        0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0x00, 0x01, 0xe0 | (MP2T_PMT_PID >> 8), MP2T_PMT_PID & 0xff
+    };
+    uint8_t pmt[183];
+    size_t len = 12;
+    guint i;
+
+    mp2t_write_section(mux, MP2T_PAT_PID, &mux->pat_cc, pat, sizeof(pat));
+
+    pmt[0] = 0x02;
+    pmt[3] = 0x00;
+    pmt[4] = 0x01;
+    pmt[5] = 0xc1;
+    pmt[6] = 0x00;
+    pmt[7] = 0x00;
+    pmt[8] = 0xe0 | (mux->pcr_pid >> 8);
+    pmt[9] = mux->pcr_pid & 0xff;
+    pmt[10] = 0xf0;
+    pmt[11] = 0x00;
+
+    for ( i = 0; i < mux->count; i++ ) {
+        pmt[len++] = mux->streams[i].stream_type;
+        pmt[len++] = 0xe0 | (mux->streams[i].pid >> 8);
+        pmt[len++] = mux->streams[i].pid & 0xff;
+        pmt[len++] = 0xf0;
+        pmt[len++] = 0x00;
+    }
+
+    len += 4;
+    pmt[1] = 0xb0 | ((len - 3) >> 8);
+    pmt[2] = (len - 3) & 0xff;
+
+    mp2t_write_section(mux, MP2T_PMT_PID, &mux->pmt_cc, pmt, len);
+}
+
+static void mp2t_timestamp(uint8_t *p, int prefix, gint64 ts)
+{
+    p[0] = (prefix << 4) | ((ts >> 29) & 0x0e) | 1;
+    p[1] = ts >> 22;
+    p[2] = ((ts >> 14) & 0xfe) | 1;
+    p[3] = ts >> 7;
+    p[4] = ((ts << 1) & 0xfe) | 1;
+}
+
+/**
+ * @brief Append a frame of H.264 in Annex B format, preceded by an
+ *        access unit delimiter and, for keyframes, by the parameter sets
+ */
+static void mp2t_h264_payload(MP2TStream *s, GByteArray *pes,
+                              const uint8_t *data, size_t len,
+                              gboolean key)
+{
+    static const uint8_t aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+    static const uint8_t startcode[] = { 0x00, 0x00, 0x00, 0x01 };
+
+    g_byte_array_append(pes, aud, sizeof(aud));
+
+    if ( key && s->headers )
+        g_byte_array_append(pes, s->headers->data, s->headers->len);
+
+    if ( s->nal_length_size == 0 ) {
+        g_byte_array_append(pes, data, len);
+        return;
+    }
+
+    while ( len >= s->nal_length_size ) {
+        size_t nal = 0;
+        guint i;
+
+        for ( i = 0; i < s->nal_length_size; i++ )
+            nal = (nal << 8) | data[i];
+
+        data += s->nal_length_size;
+        len -= s->nal_length_size;
+
+        if ( nal > len )
+            break;
+
+        g_byte_array_append(pes, startcode, sizeof(startcode));
+        g_byte_array_append(pes, data, nal);
+
+        data += nal;
+        len -= nal;
+    }
+}
+
+/**
+ * @brief Append a raw AAC frame with an ADTS header
+ */
+static void mp2t_aac_payload(MP2TStream *s, GByteArray *pes,
+                             const uint8_t *data, size_t len)
+{
+    const size_t frame_len = len + 7;
+    uint8_t adts[7];
+
+    /* the frames read from ADTS files keep their header */
+    if ( len >= 2 && data[0] == 0xff && (data[1] & 0xf0) == 0xf0 ) {
+        g_byte_array_append(pes, data, len);
+        return;
+    }
+
+    adts[0] = 0xff;
+    adts[1] = 0xf1;
+    adts[2] = (s->aac_profile << 6) | (s->aac_rate << 2) | (s->aac_channels >> 2);
+    adts[3] = ((s->aac_channels & 3) << 6) | ((frame_len >> 11) & 0x03);
+    adts[4] = (frame_len >> 3) & 0xff;
+    adts[5] = ((frame_len & 7) << 5) | 0x1f;
+    adts[6] = 0xfc;
+
+    g_byte_array_append(pes, adts, sizeof(adts));
+    g_byte_array_append(pes, data, len);
+}
+
+/**
+ * @brief Mux a demuxed packet
+ *
+ * @param mux The muxer of the resource
+ * @param tr The elementary track the packet belongs to
+ * @param data The packet
+ * @param len Length of @p data
+ * @param dts Delivery time of the packet on the timeline
+ * @param pts Presentation time of the packet on the timeline
+ * @param key The packet is a keyframe
+ *
+ * @return @ref RESOURCE_OK; packets of tracks that are not muxed are
+ *         ignored.
+ */
+int mp2t_mux(struct MP2TMux *mux, Track *tr, const uint8_t *data,
+             size_t len, double dts, double pts, gboolean key)
+{
+    MP2TStream *s = NULL;
+    GByteArray *pes = mux->pes;
+    size_t header_len, pes_len;
+    uint8_t *h;
+    gint64 pcr = -1;
+    guint i;
+
+    for ( i = 0; i < mux->count; i++ )
+        if ( mux->streams[i].track == tr )
+            s = &mux->streams[i];
+
+    if ( s == NULL )
+        return RESOURCE_OK;
+
+    if ( isnan(dts) )
+        dts = isnan(pts) ? mux->delivery : pts;
+    if ( isnan(pts) )
+        pts = dts;
+
+    mux->delivery = MAX(mux->delivery, dts);
+
+    if ( mux->delivery - mux->last_psi >= MP2T_PSI_INTERVAL ) {
+        mp2t_write_psi(mux);
+        mux->last_psi = mux->delivery;
+    }
+
+    if ( s->pid == mux->pcr_pid &&
+         (key || mux->delivery - mux->last_pcr >= MP2T_PCR_INTERVAL) ) {
+        pcr = llrint(mux->delivery * 27e6) % ((MP2T_TS_MASK + 1) * 300);
+        mux->last_pcr = mux->delivery;
+    }
+
+    g_byte_array_set_size(pes, MP2T_PES_HEADER_MAX);
+
+    switch ( s->stream_type ) {
+    case 0x1b:
+        mp2t_h264_payload(s, pes, data, len, key);
+        break;
+    case 0x0f:
+        mp2t_aac_payload(s, pes, data, len);
+        break;
+    default:
+        g_byte_array_append(pes, data, len);
+        break;
+    }
+
+    /* the PES header goes right before the payload */
+    header_len = (dts != pts) ? 10 : 5;
+    h = pes->data + MP2T_PES_HEADER_MAX - 9 - header_len;
+    pes_len = pes->len - MP2T_PES_HEADER_MAX + 3 + header_len;
+
+    h[0] = 0x00;
+    h[1] = 0x00;
+    h[2] = 0x01;
+    h[3] = s->stream_id;
+    h[4] = (pes_len > 0xffff || s->stream_id == 0xe0) ? 0 : pes_len >> 8;
+    h[5] = (pes_len > 0xffff || s->stream_id == 0xe0) ? 0 : pes_len & 0xff;
+    h[6] = 0x80;
+    h[7] = (dts != pts) ? 0xc0 : 0x80;
+    h[8] = header_len;
+
+    mp2t_timestamp(h + 9, (dts != pts) ? 0x3 : 0x2,
+                   llrint((pts + MP2T_DELAY) * 90000) & MP2T_TS_MASK);
+    if ( dts != pts )
+        mp2t_timestamp(h + 14, 0x1,
+                       llrint((dts + MP2T_DELAY) * 90000) & MP2T_TS_MASK);
+
+    mp2t_write_ts(mux, s->pid, &s->cc, h, pes->data + pes->len - h,
+                  pcr, key);
+
+    return RESOURCE_OK;
+}
+
+/**
+ * @brief Drop the TS packets not yet queued, after a seek
+ *
+ * The tables are sent again before the following packets.
+ */
+void mp2t_reset(struct MP2TMux *mux)
+{
+    if ( mux == NULL )
+        return;
+
+    mux->packets = 0;
+    mux->delivery = 0;
+    mux->last_psi = -HUGE_VAL;
+    mux->last_pcr = -HUGE_VAL;
+}
+
+void mp2t_free(struct MP2TMux *mux)
+{
+    guint i;
+
+    if ( mux == NULL )
+        return;
+
+    for ( i = 0; i < mux->count; i++ )
+        if ( mux->streams[i].headers )
+            g_byte_array_free(mux->streams[i].headers, true);
+
+    g_free(mux->streams);
+    g_byte_array_free(mux->pes, true);
+    g_slice_free(struct MP2TMux, mux);
+}
+
+/**
+ * @brief Collect the SPS and PPS of an avcC record in Annex B format
+ */
+static gboolean mp2t_h264_setup(MP2TStream *s, const uint8_t *ed, size_t len)
+{
+    static const uint8_t startcode[] = { 0x00, 0x00, 0x00, 0x01 };
+    const uint8_t *end = ed + len, *p;
+    int n, sets;
+
+    /* Annex B extradata is sent in band already */
+    if ( len < 7 || ed[0] != 1 )
+        return true;
+
+    s->nal_length_size = (ed[4] & 0x03) + 1;
+    s->headers = g_byte_array_new();
+
+    p = ed + 5;
+    for ( sets = 0; sets < 2; sets++ ) {
+        if ( p >= end )
+            return false;
+
+        n = *p++ & (sets ? 0xff : 0x1f);
+
+        while ( n-- > 0 ) {
+            size_t size;
+
+            if ( p + 2 > end )
+                return false;
+
+            size = (p[0] << 8) | p[1];
+            p += 2;
+
+            if ( p + size > end )
+                return false;
+
+            g_byte_array_append(s->headers, startcode, sizeof(startcode));
+            g_byte_array_append(s->headers, p, size);
+            p += size;
+        }
+    }
+
+    return true;
+}
+
+static gboolean mp2t_stream_setup(MP2TStream *s, Track *tr)
+{
+    s->track = tr;
+    s->stream_id = tr->media_type == MP_video ? 0xe0 : 0xc0;
+
+    if ( strcmp(tr->encoding_name, "H264") == 0 ) {
+        s->stream_type = 0x1b;
+        return mp2t_h264_setup(s, tr->extradata, tr->extradata_len);
+    } else if ( strcmp(tr->encoding_name, "mpeg4-generic") == 0 ) {
+        if ( tr->extradata_len < 2 )
+            return false;
+
+        s->stream_type = 0x0f;
+        s->aac_profile = (tr->extradata[0] >> 3) - 1;
+        s->aac_rate = ((tr->extradata[0] & 0x07) << 1) | (tr->extradata[1] >> 7);
+        s->aac_channels = (tr->extradata[1] >> 3) & 0x0f;
+        return true;
+    } else if ( strcmp(tr->encoding_name, "MPA") == 0 ) {
+        s->stream_type = 0x03;
+        return true;
+    } else if ( strcmp(tr->encoding_name, "MPV") == 0 ) {
+        s->stream_type = 0x02;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Open a stored resource to be sent as a single MPEG-TS track
+ *
+ * @param url The path of the resource, with the .mp2t suffix
+ *
+ * @return The resource, whose only track offered to the clients is
+ *         the MP2T one, or NULL if none of its tracks can be muxed.
+ */
+Resource *mp2t_open(const char *url)
+{
+    char *path = g_strndup(url, strlen(url) - strlen(MP2T_SUFFIX));
+    Resource *r = avf_open(path);
+    struct MP2TMux *mux;
+    gboolean pcr_video = false;
+    Track *track;
+    GList *item;
+
+    g_free(path);
+
+    if ( r == NULL )
+        return NULL;
+
+    mux = g_slice_new0(struct MP2TMux);
+    mux->streams = g_new0(MP2TStream, g_list_length(r->tracks));
+    mux->pes = g_byte_array_new();
+    mp2t_reset(mux);
+
+    for ( item = r->tracks; item; item = item->next ) {
+        Track *tr = item->data;
+        MP2TStream *s = &mux->streams[mux->count];
+
+        tr->muxed = true;
+
+        if ( mux->count >= (184 - 16) / 5 ||
+             !mp2t_stream_setup(s, tr) ) {
+            fnc_log(FNC_LOG_WARN, "[mp2t] %s: track %s (%s) not muxed",
+                    r->mrl, tr->name, tr->encoding_name);
+            if ( s->headers )
+                g_byte_array_free(s->headers, true);
+            memset(s, 0, sizeof(*s));
+            continue;
+        }
+
+        s->pid = MP2T_FIRST_PID + mux->count++;
+
+        /* the clock follows the first video stream, if any */
+        if ( mux->pcr_pid == 0 ||
+             (tr->media_type == MP_video && !pcr_video) ) {
+            mux->pcr_pid = s->pid;
+            pcr_video = tr->media_type == MP_video;
+        }
+    }
+
+    if ( mux->count == 0 ) {
+        fnc_log(FNC_LOG_ERR, "[mp2t] %s: no track can be muxed", r->mrl);
+        mp2t_free(mux);
+        r_close(r);
+        return NULL;
+    }
+
+    track = track_new(g_strdup("mp2t"));
+    track->parent = r;
+    track->encoding_name = g_strdup("MP2T");
+    track->payload_type = 33;
+    track->clock_rate = 90000;
+    track->media_type = MP_video;
+    track->frame_duration = MP2T_PCR_INTERVAL;
+    sdp_descr_append_rtpmap(track);
+
+    mux->track = track;
+    r->tracks = g_list_append(r->tracks, track);
+    r->stored.mux = mux;
+
+    return r;
+}
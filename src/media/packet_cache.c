@@ -0,0 +1,532 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Packet cache
+ *
+ * Sessions playing the same file produce the same packets; the packet
+ * cache keeps the buffers produced for each track of a file, one entry
+ * per GOP (the packets between two keyframes of the reference stream,
+ * as listed by the keyframe index), so that sessions seeking to a GOP
+ * already in the cache can skip both demuxing and packetization.
+ *
+ * Entries are keyed by file, modification time, track and GOP; the
+ * buffers of a track are assigned to the GOP their delivery time falls
+ * in, and an entry is only stored if the previous GOP of the same
+ * track was recorded as well, so that no buffer of the GOP can have
+ * been missed because of the interleaving of the file.
+ *
+ * The cache is bounded in size (see the packet-cache-size option, 0
+ * disables it and no buffer is recorded); when full, the least
+ * recently used entries are evicted, preferring among the oldest ones
+ * those that were hit the least.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <math.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @brief Number of least recently used entries considered for eviction
+ */
+#define PCACHE_EVICT_WINDOW 8
+
+struct PacketCacheFile {
+    char *mrl;
+    time_t mtime;
+
+    /** Start times of the GOPs, in the time base of the packets */
+    GArray *gops;
+};
+
+struct PacketRecorder {
+    PacketCacheFile *pcf;
+
+    /** GOP being recorded, -1 if none */
+    gint gop;
+
+    /** The previous GOP was recorded too */
+    gboolean complete;
+
+    /** Copies of the buffers produced so far for the GOP */
+    GPtrArray *buffers;
+    size_t bytes;
+
+    /** Time spent packetizing the GOP */
+    double cost;
+};
+
+typedef struct {
+    char *key;
+    GPtrArray *buffers;
+    size_t bytes;
+    double cost;
+    guint hits;
+
+    /** Link in @ref pcache_lru */
+    GList *link;
+} PacketCacheEntry;
+
+/**
+ * @brief Lock for @ref pcache_table, @ref pcache_lru and the entries
+ */
+static GStaticMutex pcache_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *pcache_table;
+static GQueue pcache_lru = G_QUEUE_INIT;
+static size_t pcache_bytes;
+
+static struct MParserBuffer *pcache_buffer_dup(const struct MParserBuffer *buffer,
+                                               double shift)
+{
+    struct MParserBuffer *copy = g_slice_dup(struct MParserBuffer, buffer);
+
+    copy->seen = 0;
+    copy->seq_no = 0;
+    copy->timestamp += shift;
+    copy->delivery += shift;
+
+    /* the copy shares the demuxed packet of the buffer, if any */
+    if ( buffer->ref )
+        packet_ref(buffer->ref);
+    else
+        copy->data = g_memdup(buffer->data, buffer->data_size);
+
+    return copy;
+}
+
+static void pcache_buffer_free(gpointer buffer_p,
+                               ATTR_UNUSED gpointer user_data)
+{
+    mparser_buffer_free(buffer_p);
+}
+
+static char *pcache_key(PacketCacheFile *pcf, Track *tr, gint gop)
+{
+    return g_strdup_printf("%s:%ld:%s:%d",
+                           pcf->mrl, (long)pcf->mtime, tr->name, gop);
+}
+
+/**
+ * @brief Describe a file whose packets can be cached
+ *
+ * @param mrl Path of the file
+ * @param mtime Modification time of the file
+ * @param gops Start times of the GOPs of the file, see @ref kfi_times;
+ *             the array is owned by the returned object
+ */
+PacketCacheFile *pcache_file_new(const char *mrl, time_t mtime, GArray *gops)
+{
+    PacketCacheFile *pcf = g_slice_new0(PacketCacheFile);
+
+    pcf->mrl = g_strdup(mrl);
+    pcf->mtime = mtime;
+    pcf->gops = gops;
+
+    return pcf;
+}
+
+void pcache_file_free(PacketCacheFile *pcf)
+{
+    if ( pcf == NULL )
+        return;
+
+    g_free(pcf->mrl);
+    g_array_free(pcf->gops, true);
+    g_slice_free(PacketCacheFile, pcf);
+}
+
+/**
+ * @brief Find the GOP a time falls in
+ *
+ * @return The index of the GOP, or -1 if the time is before the first
+ *         keyframe.
+ */
+gint pcache_file_gop(PacketCacheFile *pcf, double time)
+{
+    const double *gops = (const double *)pcf->gops->data;
+    guint lo = 0, hi = pcf->gops->len;
+
+    /* allow for the rounding of the times converted from the time
+       base of the stream */
+    time += 1e-6;
+
+    if ( hi == 0 || time < gops[0] )
+        return -1;
+
+    while ( hi - lo > 1 ) {
+        guint mid = (lo + hi) / 2;
+
+        if ( gops[mid] <= time )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * @brief Get the start and end times of a GOP
+ *
+ * @return false if the GOP does not exist.
+ *
+ * The last GOP of the file has no known end, @p end is set to
+ * HUGE_VAL; since no GOP follows it, it is never cached.
+ */
+gboolean pcache_file_gop_bounds(PacketCacheFile *pcf, gint gop,
+                                double *start, double *end)
+{
+    if ( gop < 0 || (guint)gop >= pcf->gops->len )
+        return false;
+
+    *start = g_array_index(pcf->gops, double, gop);
+    *end = (guint)gop + 1 < pcf->gops->len ?
+        g_array_index(pcf->gops, double, gop + 1) : HUGE_VAL;
+
+    return true;
+}
+
+static void pcache_entry_free(PacketCacheEntry *entry)
+{
+    g_ptr_array_foreach(entry->buffers, pcache_buffer_free, NULL);
+    g_ptr_array_free(entry->buffers, true);
+    g_free(entry->key);
+    g_slice_free(PacketCacheEntry, entry);
+}
+
+/**
+ * @brief Evict entries until the cache fits its size
+ *
+ * @note The caller has to hold @ref pcache_lock.
+ */
+static void pcache_evict()
+{
+    const size_t limit = (size_t)feng_srv.packet_cache_size << 20;
+
+    while ( pcache_bytes > limit && pcache_lru.head ) {
+        PacketCacheEntry *victim = pcache_lru.head->data;
+        GList *item;
+        int i;
+
+        for ( item = pcache_lru.head->next, i = 1;
+              item && i < PCACHE_EVICT_WINDOW;
+              item = item->next, i++ ) {
+            PacketCacheEntry *entry = item->data;
+
+            if ( entry->hits < victim->hits )
+                victim = entry;
+        }
+
+        g_queue_delete_link(&pcache_lru, victim->link);
+        g_hash_table_remove(pcache_table, victim->key);
+
+        pcache_bytes -= victim->bytes;
+        media_stat_sub(MEDIA_STAT_PCACHE_BYTES, victim->bytes);
+
+        pcache_entry_free(victim);
+    }
+}
+
+/**
+ * @brief Store the GOP recorded for a track in the cache
+ *
+ * The buffers are moved to the cache entry; if another session cached
+ * the same GOP in the meantime they are dropped.
+ */
+static void pcache_commit(Track *tr, struct PacketRecorder *rec)
+{
+    PacketCacheEntry *entry;
+    char *key = pcache_key(rec->pcf, tr, rec->gop);
+
+    g_static_mutex_lock(&pcache_lock);
+
+    if ( pcache_table == NULL )
+        pcache_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( g_hash_table_lookup(pcache_table, key) != NULL ) {
+        g_static_mutex_unlock(&pcache_lock);
+        g_free(key);
+        return;
+    }
+
+    entry = g_slice_new0(PacketCacheEntry);
+    entry->key = key;
+    entry->buffers = rec->buffers;
+    entry->bytes = rec->bytes;
+    entry->cost = rec->cost;
+
+    g_queue_push_tail(&pcache_lru, entry);
+    entry->link = pcache_lru.tail;
+    g_hash_table_insert(pcache_table, entry->key, entry);
+
+    pcache_bytes += entry->bytes;
+    media_stat_add(MEDIA_STAT_PCACHE_BYTES, entry->bytes);
+
+    pcache_evict();
+
+    g_static_mutex_unlock(&pcache_lock);
+
+    rec->buffers = g_ptr_array_new();
+    rec->bytes = 0;
+}
+
+static void pcache_recorder_clear(struct PacketRecorder *rec)
+{
+    g_ptr_array_foreach(rec->buffers, pcache_buffer_free, NULL);
+    g_ptr_array_set_size(rec->buffers, 0);
+    rec->bytes = 0;
+    rec->cost = 0;
+}
+
+/**
+ * @brief Start recording the buffers produced for a track
+ */
+void pcache_track_attach(Track *tr, PacketCacheFile *pcf)
+{
+    struct PacketRecorder *rec = g_slice_new0(struct PacketRecorder);
+
+    rec->pcf = pcf;
+    rec->gop = -1;
+    rec->buffers = g_ptr_array_new();
+
+    pcache_track_free(tr);
+    tr->recorder = rec;
+}
+
+/**
+ * @brief Drop the GOP being recorded for a track
+ *
+ * This has to be called whenever the buffers produced for the track
+ * stop being contiguous, for instance after a seek.
+ */
+void pcache_track_reset(Track *tr)
+{
+    struct PacketRecorder *rec = tr->recorder;
+
+    if ( rec == NULL )
+        return;
+
+    pcache_recorder_clear(rec);
+    rec->gop = -1;
+    rec->complete = false;
+}
+
+void pcache_track_free(Track *tr)
+{
+    struct PacketRecorder *rec = tr->recorder;
+
+    if ( rec == NULL )
+        return;
+
+    pcache_recorder_clear(rec);
+    g_ptr_array_free(rec->buffers, true);
+    g_slice_free(struct PacketRecorder, rec);
+
+    tr->recorder = NULL;
+}
+
+/**
+ * @brief Record a buffer produced for a track
+ *
+ * @param tr The track the buffer was produced for
+ * @param buffer The buffer, which is copied
+ *
+ * When the buffer belongs to the GOP following the one being recorded,
+ * the latter is complete and is stored in the cache.
+ */
+void pcache_record(Track *tr, const struct MParserBuffer *buffer)
+{
+    struct PacketRecorder *rec = tr->recorder;
+    const double offset = tr->parent->stored.timeline_offset;
+    gint gop = pcache_file_gop(rec->pcf, buffer->delivery - offset);
+
+    if ( gop != rec->gop ) {
+        gboolean contiguous = rec->gop >= 0 && gop == rec->gop + 1;
+
+        if ( contiguous && rec->complete && rec->buffers->len )
+            pcache_commit(tr, rec);
+
+        pcache_recorder_clear(rec);
+        rec->complete = contiguous;
+        rec->gop = gop;
+    }
+
+    if ( gop < 0 )
+        return;
+
+    g_ptr_array_add(rec->buffers, pcache_buffer_dup(buffer, -offset));
+    rec->bytes += buffer->data_size + sizeof(struct MParserBuffer);
+}
+
+/**
+ * @brief Tells whether two delivery times fall in the same GOP
+ *
+ * A buffer recorded for a track cannot hold data of two GOPs, or the
+ * data past the end of the first one would be played twice when the
+ * following GOP is not cached.
+ */
+gboolean pcache_same_gop(Track *tr, double a, double b)
+{
+    struct PacketRecorder *rec = tr->recorder;
+    double offset;
+
+    if ( rec == NULL )
+        return true;
+
+    offset = tr->parent->stored.timeline_offset;
+
+    return pcache_file_gop(rec->pcf, a - offset) ==
+        pcache_file_gop(rec->pcf, b - offset);
+}
+
+/**
+ * @brief Account the time spent producing the buffers of a track
+ */
+void pcache_record_cost(Track *tr, double seconds)
+{
+    if ( tr->recorder )
+        tr->recorder->cost += seconds;
+}
+
+/**
+ * @brief Play a GOP from the cache
+ *
+ * @param r The resource to play the GOP for
+ * @param pcf The description of the resource's file
+ * @param gop The GOP to play
+ *
+ * @retval true The GOP was cached for all the consumed tracks of the
+ *              resource, and its buffers were queued on them.
+ * @retval false At least one of the tracks did not have the GOP
+ *               cached; nothing was queued.
+ *
+ * The buffers are queued with the current timeline offset of the
+ * resource; the cached buffers are not recorded again.
+ */
+gboolean pcache_play(Resource *r, PacketCacheFile *pcf, gint gop)
+{
+    const double offset = r->stored.timeline_offset;
+    GPtrArray *entries = g_ptr_array_new(), *copies;
+    GList *item;
+    double saved = 0;
+    guint i;
+
+    g_static_mutex_lock(&pcache_lock);
+
+    for ( item = r->tracks; item; item = item->next ) {
+        Track *tr = item->data;
+        PacketCacheEntry *entry;
+        char *key;
+
+        if ( !track_wanted(tr) )
+            continue;
+
+        key = pcache_key(pcf, tr, gop);
+        entry = pcache_table ? g_hash_table_lookup(pcache_table, key) : NULL;
+        g_free(key);
+
+        if ( entry == NULL ) {
+            g_static_mutex_unlock(&pcache_lock);
+            g_ptr_array_free(entries, true);
+            media_stat_add(MEDIA_STAT_PCACHE_MISSES, 1);
+            return false;
+        }
+
+        g_ptr_array_add(entries, entry);
+    }
+
+    if ( entries->len == 0 ) {
+        g_static_mutex_unlock(&pcache_lock);
+        g_ptr_array_free(entries, true);
+        return false;
+    }
+
+    /* copy the buffers while holding the lock, the entries might be
+       evicted as soon as it is released */
+    copies = g_ptr_array_sized_new(entries->len);
+    for ( i = 0; i < entries->len; i++ ) {
+        PacketCacheEntry *entry = g_ptr_array_index(entries, i);
+        GPtrArray *buffers = g_ptr_array_sized_new(entry->buffers->len);
+        guint j;
+
+        entry->hits++;
+        saved += entry->cost;
+
+        g_queue_unlink(&pcache_lru, entry->link);
+        g_queue_push_tail_link(&pcache_lru, entry->link);
+
+        for ( j = 0; j < entry->buffers->len; j++ )
+            g_ptr_array_add(buffers,
+                            pcache_buffer_dup(g_ptr_array_index(entry->buffers, j),
+                                              offset));
+
+        g_ptr_array_add(copies, buffers);
+    }
+
+    g_static_mutex_unlock(&pcache_lock);
+
+    g_ptr_array_free(entries, true);
+
+    for ( item = r->tracks, i = 0; item; item = item->next ) {
+        Track *tr = item->data;
+        struct PacketRecorder *rec = tr->recorder;
+        GQueue frame = G_QUEUE_INIT;
+        GPtrArray *buffers;
+        guint j;
+
+        if ( !track_wanted(tr) )
+            continue;
+
+        buffers = g_ptr_array_index(copies, i++);
+
+        /* the cached buffers are queued at once */
+        tr->recorder = NULL;
+        for ( j = 0; j < buffers->len; j++ ) {
+            struct MParserBuffer *buffer = g_ptr_array_index(buffers, j);
+
+            tr->pts = buffer->timestamp;
+            tr->dts = buffer->delivery;
+            tr->frame_duration = buffer->duration;
+
+            g_queue_push_tail(&frame, buffer);
+        }
+        track_write_frame(tr, &frame);
+        tr->recorder = rec;
+
+        pcache_track_reset(tr);
+
+        g_ptr_array_free(buffers, true);
+    }
+
+    g_ptr_array_free(copies, true);
+
+    media_stat_add(MEDIA_STAT_PCACHE_HITS, 1);
+    media_stat_add(MEDIA_STAT_PCACHE_SAVED_USEC, saved * 1000000);
+
+    return true;
+}
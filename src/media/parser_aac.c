@@ -48,9 +48,55 @@ int aac_init(Track *track)
 #define HEADER_SIZE 4
 #define MAX_PAYLOAD_SIZE (DEFAULT_MTU - HEADER_SIZE)
 
+static size_t aac_packet_size(guint frames, size_t bytes)
+{
+    return 2 + 2 * frames + bytes;
+}
+
+/**
+ * @brief Write an AAC-hbr packet: the AU headers length, one 16-bit
+ *        AU header per frame (13 bits of size, a zero index delta),
+ *        then the frames
+ */
+static size_t aac_packet_write(ATTR_UNUSED Track *tr, uint8_t *dest,
+                               const guint *sizes, guint frames,
+                               const uint8_t *payload)
+{
+    size_t bytes = 0;
+    guint i;
+
+    dest[0] = (frames * 16) >> 8;
+    dest[1] = (frames * 16) & 0xff;
+
+    for ( i = 0; i < frames; i++ ) {
+        dest[2 + 2*i] = (sizes[i] & 0x1fe0) >> 5;
+        dest[3 + 2*i] = (sizes[i] & 0x1f) << 3;
+        bytes += sizes[i];
+    }
+
+    memcpy(dest + 2 + 2 * frames, payload, bytes);
+
+    return 2 + 2 * frames + bytes;
+}
+
+static const AggregateFormat aac_format = {
+    .max_frames = 0xffff / 16,
+    .packet_size = aac_packet_size,
+    .write = aac_packet_write,
+};
+
 int aac_parse(Track *tr, uint8_t *data, ssize_t len)
 {
     const uint8_t prefix[HEADER_SIZE] = { 0x00, 0x10, (len & 0x1fe0) >> 5, (len & 0x1f) << 3 };
+    GQueue frame = G_QUEUE_INIT;
+
+    if ( len <= MAX_PAYLOAD_SIZE ) {
+        aggr_frame(tr, &aac_format, data, len, 0, tr->frame_duration);
+        return 0;
+    }
+
+    /* fragments of a single access unit */
+    aggr_flush(tr);
 
     do {
         struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
@@ -67,11 +113,13 @@ int aac_parse(Track *tr, uint8_t *data, ssize_t len)
         memcpy(buffer->data + HEADER_SIZE, data,
                buffer->data_size - HEADER_SIZE);
 
-        track_write(tr, buffer);
+        g_queue_push_tail(&frame, buffer);
 
         len -= MAX_PAYLOAD_SIZE;
         data += MAX_PAYLOAD_SIZE;
     } while(len > 0);
 
+    track_write_frame(tr, &frame);
+
     return 0;
 }
@@ -46,89 +46,80 @@ int amr_init(Track *track)
 }
 
 /* AMR Payload Header (RFC3267)
-    0  1 2 3 4 5   6 7
-   +-+-+-+-+-+-+
-   | CMR  |   RR     |
-   +-+-+-+-+-+-+
-   +-+-+-+-+-+-+
-   |F|  FT    |Q  PP |
-   +-+-+-+-+-+-+
+    0 1 2 3 4 5 6 7
+   +-+-+-+-+-+-+-+-+
+   |  CMR  |R|R|R|R|
+   +-+-+-+-+-+-+-+-+
+
+   Table of contents entry, one per frame
+    0 1 2 3 4 5 6 7
+   +-+-+-+-+-+-+-+-+
+   |F|  FT   |Q|P P|
+   +-+-+-+-+-+-+-+-+
 */
 
-typedef struct
+#define AMR_CMR 0xf0
+#define AMR_TOC_F 0x80
+#define AMR_FRAME_DURATION 0.020
+
+static size_t amr_packet_size(ATTR_UNUSED guint frames, size_t bytes)
 {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-    uint8_t p:2;       /* padding bits */
-    uint8_t q:1;       /* Frame quality indicator. */
-    uint8_t ft:4;      /* Frame type index */
-    uint8_t f:1;       /*If set to 1, indicates that this frame is followed by
-                                another speech frame in this payload; if set to 0, indicates that
-                                this frame is the last frame in this payload. */
-#elif G_BYTE_ORDER == G_BIG_ENDIAN
-    uint8_t f:1;       /*If set to 1, indicates that this frame is followed by
-                                another speech frame in this payload; if set to 0, indicates that
-                                this frame is the last frame in this payload. */
-    uint8_t ft:4;      /* Frame type index */
-    uint8_t q:1;       /* Frame quality indicator. */
-    uint8_t p:2;       /* padding bits */
-#else
-#error Neither big nor little
-#endif
-} toc;
+    return 1 + bytes;
+}
 
-#define AMR_CMR 0xf0
+/**
+ * @brief Write an octet-aligned packet: the CMR, the table of contents
+ *        with the F bit set on all the entries but the last one, then
+ *        the speech data of the frames
+ *
+ * The frames are given with their own table of contents entry first.
+ */
+static size_t amr_packet_write(ATTR_UNUSED Track *tr, uint8_t *dest,
+                               const guint *sizes, guint frames,
+                               const uint8_t *payload)
+{
+    uint8_t *body = dest + 1 + frames;
+    guint i;
+
+    dest[0] = AMR_CMR;
+
+    for ( i = 0; i < frames; i++ ) {
+        dest[1 + i] = payload[0] & ~AMR_TOC_F;
+        if ( i < frames - 1 )
+            dest[1 + i] |= AMR_TOC_F;
+
+        memcpy(body, payload + 1, sizes[i] - 1);
+        body += sizes[i] - 1;
+        payload += sizes[i];
+    }
+
+    return body - dest;
+}
+
+static const AggregateFormat amr_format = {
+    .max_frames = DEFAULT_MTU,
+    .packet_size = amr_packet_size,
+    .write = amr_packet_write,
+};
 
 int amr_parse(Track *tr, uint8_t *data, ssize_t len)
 {
-    uint8_t *packet = g_slice_alloc0(DEFAULT_MTU);
     static const uint32_t packet_size[] = {12, 13, 15, 17, 19, 20, 26, 31, 5, 0, 0, 0, 0, 0, 0, 0};
+    guint frames = 0;
 
     while (len > 0) {
-        struct MParserBuffer *buffer;
-
-        uint32_t read_offset = 0, frames = 0;
-        uint32_t body_len, i, off;
-        toc tocv;
-
-        /* Count the number of frames that fit into the packet */
-        while (read_offset < len) {
-            memcpy(&tocv, &data[read_offset], 1);
-            body_len = packet_size[tocv.ft];
-            if (read_offset + 1 + body_len > len)
-                break; /* Not enough speech data */
-            if (read_offset + 1 + body_len > DEFAULT_MTU - 1)
-                break; /* This frame doesn't fit into the current packet */
-            read_offset += 1 + body_len;
-            frames++;
-        }
-        if (frames <= 0) /* No frames - bad trailing data? */
-            break;
-
-        buffer = g_slice_new0(struct MParserBuffer);
-
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
-
-        buffer->data = g_malloc(DEFAULT_MTU);
-        buffer->data[0] = AMR_CMR;
-
-        off = 1 + frames; /* Write the body data at this offset */
-        for (i = 0; i < frames; i++) {
-            memcpy(&tocv, data, 1);
-            body_len = packet_size[tocv.ft];
-            tocv.f = i < frames - 1;
-            memcpy(buffer->data + 1 + i, &tocv, 1);
-            memcpy(buffer->data + off, &data[1], body_len);
-            off  +=     body_len;
-            data += 1 + body_len;
-            len  -= 1 + body_len;
-        }
-
-        buffer->data_size = off;
-        track_write(tr, buffer);
+        const uint32_t body_len = packet_size[(data[0] >> 3) & 0x0f];
+
+        if (1 + body_len > len)
+            break; /* Not enough speech data */
+
+        aggr_frame(tr, &amr_format, data, 1 + body_len,
+                   frames * AMR_FRAME_DURATION, AMR_FRAME_DURATION);
+
+        data += 1 + body_len;
+        len  -= 1 + body_len;
+        frames++;
     }
 
-    g_slice_free1(DEFAULT_MTU, packet);
     return 0;
 }
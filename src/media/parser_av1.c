@@ -0,0 +1,90 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief AV1 packetizer (AOM RTP specification)
+ *
+ * The packetization itself is done by @ref av1_payload; the av1C box
+ * of the extradata, when present, gives the profile for the SDP and
+ * the sequence header for the keyframes lacking one.
+ */
+
+#include <config.h>
+
+#include "media/media.h"
+#include "fnc_log.h"
+
+/** Size of the av1C box before its configOBUs */
+#define AV1C_HEADER_SIZE 4
+
+static gboolean av1_has_av1c(Track *track)
+{
+    return track->extradata_len >= AV1C_HEADER_SIZE &&
+        track->extradata[0] == 0x81;
+}
+
+int av1_init(Track *track)
+{
+    sdp_descr_append_rtpmap(track);
+
+    if ( av1_has_av1c(track) )
+        g_string_append_printf(track->sdp_description,
+                               "a=fmtp:%u profile=%u;level-idx=%u;tier=%u\r\n",
+                               track->payload_type,
+                               track->extradata[1] >> 5,
+                               track->extradata[1] & 0x1f,
+                               track->extradata[2] >> 7);
+
+    return 0;
+}
+
+int av1_parse(Track *tr, uint8_t *data, ssize_t len)
+{
+    GQueue frame = G_QUEUE_INIT;
+    gboolean valid;
+    GList *item;
+
+    if ( av1_has_av1c(tr) )
+        valid = av1_payload(&frame, data, len,
+                            tr->extradata + AV1C_HEADER_SIZE,
+                            tr->extradata_len - AV1C_HEADER_SIZE);
+    else
+        valid = av1_payload(&frame, data, len, NULL, 0);
+
+    if ( !valid ) {
+        fnc_log(FNC_LOG_VERBOSE, "[av1] malformed temporal unit");
+        return 0;
+    }
+
+    for ( item = frame.head; item; item = item->next ) {
+        struct MParserBuffer *buffer = item->data;
+
+        buffer->timestamp = tr->pts;
+        buffer->delivery = tr->dts;
+        buffer->duration = tr->frame_duration;
+    }
+
+    track_write_frame(tr, &frame);
+
+    return 0;
+}
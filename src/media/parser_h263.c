@@ -37,6 +37,7 @@ static const uint8_t gob_start_code[] = { 0x04, 0x00 };
 
 int h263_parse(Track *tr, uint8_t *data, ssize_t len)
 {
+    GQueue frame = G_QUEUE_INIT;
     size_t cur = 0;
     int found_gob = 0;
 
@@ -53,7 +54,7 @@ int h263_parse(Track *tr, uint8_t *data, ssize_t len)
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
 
-        buffer->data = g_malloc(buffer->data_size);
+        buffer->data = g_malloc(DEFAULT_MTU);
 
         if (cur == 0 && found_gob) {
             payload = MIN(DEFAULT_MTU, len);
@@ -70,9 +71,11 @@ int h263_parse(Track *tr, uint8_t *data, ssize_t len)
         buffer->marker = (cur + payload >= len);
         buffer->data_size = payload + header_len;
 
-        track_write(tr, buffer);
+        g_queue_push_tail(&frame, buffer);
         cur += payload;
     }
 
+    track_write_frame(tr, &frame);
+
     return 0;
 }
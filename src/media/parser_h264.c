@@ -45,7 +45,50 @@
  *  +---------------+
  */
 
-static void frag_fu_a(uint8_t *nal, int fragsize, Track *tr)
+/*  STAP-A packet
+ *  +---------------+---------------+---------------+-----
+ *  | NAL header    | NALU 1 size (16 bits)         | NALU 1 ...
+ *  | (type 24)     |                               |
+ *  +---------------+---------------+---------------+-----
+ */
+
+/**
+ * @brief State of the packetization of an access unit
+ *
+ * Consecutive NAL units small enough are aggregated in a STAP-A
+ * packet (RFC 6184, section 5.7.1), up to the MTU, so that parameter
+ * sets, SEI, delimiters and small slices do not cost a packet each.
+ * The packets are written to the track together once the access unit
+ * is complete, with the marker bit set on the last one.
+ */
+typedef struct {
+    Track *tr;
+    GQueue packets;                 /*!< packets of the access unit */
+
+    uint8_t stap[DEFAULT_MTU];      /*!< STAP-A packet being built */
+    size_t stap_size;
+    guint stap_count;               /*!< NAL units in the STAP-A packet */
+} H264Packetizer;
+
+/**
+ * @brief Queue a packet of the access unit
+ */
+static void h264_push(H264Packetizer *pk, struct MParserBuffer *buffer)
+{
+    g_queue_push_tail(&pk->packets, buffer);
+}
+
+/**
+ * @brief Send a NAL unit of the demuxed packet in its own packet
+ */
+static void h264_single(H264Packetizer *pk, const uint8_t *nal, size_t size)
+{
+    h264_push(pk, track_buffer_new(pk->tr, NULL, 0, nal, size));
+
+    fnc_log(FNC_LOG_VERBOSE, "[h264] single NAL %d", nal[0] & 0x1f);
+}
+
+static void frag_fu_a(H264Packetizer *pk, const uint8_t *nal, size_t fragsize)
 {
     int start = 1;
     const uint8_t fu_indicator = (nal[0] & 0xe0) | 28;
@@ -58,38 +101,103 @@ static void frag_fu_a(uint8_t *nal, int fragsize, Track *tr)
 
     while(fragsize>0) {
         const size_t fraglen = MIN(DEFAULT_MTU-2, fragsize);
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
-
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
-
-        buffer->data_size = fraglen + 2;
-        buffer->data = g_malloc(buffer->data_size);
-
-        buffer->data[0] = fu_indicator;
-        buffer->data[1] = fu_header;
+        uint8_t header[2] = { fu_indicator, fu_header };
 
         if ( start ) {
-            buffer->data[1] |= (1<<7);
+            header[1] |= (1<<7);
             start = 0;
         }
 
-        if (fraglen == fragsize) {
-            buffer->marker = true;
-            buffer->data[1] |= (1<<6);
-        }
+        if (fraglen == fragsize)
+            header[1] |= (1<<6);
 
-        memcpy(buffer->data + 2, nal, fraglen);
-        fnc_log(FNC_LOG_VERBOSE, "[h264] Frag %02x%02x", buffer->data[0], buffer->data[1]);
+        fnc_log(FNC_LOG_VERBOSE, "[h264] Frag %02x%02x", header[0], header[1]);
 
-        track_write(tr, buffer);
+        h264_push(pk, track_buffer_new(pk->tr, header, 2, nal, fraglen));
 
         fragsize -= fraglen;
         nal      += fraglen;
     }
 }
 
+/**
+ * @brief Send the NAL units aggregated so far
+ *
+ * A lone NAL unit is sent as is, as the STAP-A header would only add
+ * to it.
+ */
+static void h264_stap_flush(H264Packetizer *pk)
+{
+    switch ( pk->stap_count ) {
+    case 0:
+        return;
+    case 1:
+        /* the unit was already copied, it is not in the packet anymore */
+        h264_push(pk, track_buffer_copy(pk->tr, pk->stap + 3, pk->stap_size - 3));
+        break;
+    default:
+        h264_push(pk, track_buffer_copy(pk->tr, pk->stap, pk->stap_size));
+
+        media_stat_add(MEDIA_STAT_H264_STAP_PACKETS, 1);
+        media_stat_add(MEDIA_STAT_H264_STAP_NALS, pk->stap_count);
+
+        fnc_log(FNC_LOG_VERBOSE, "[h264] STAP-A of %u NALs", pk->stap_count);
+        break;
+    }
+
+    pk->stap_size = 0;
+    pk->stap_count = 0;
+}
+
+/**
+ * @brief Packetize a NAL unit of the access unit
+ */
+static void h264_nal(H264Packetizer *pk, const uint8_t *nal, size_t size)
+{
+    if ( size == 0 )
+        return;
+
+    if ( pk->stap_size + 2 + size > DEFAULT_MTU )
+        h264_stap_flush(pk);
+
+    if ( 1 + 2 + size > DEFAULT_MTU ) {
+        if ( size > DEFAULT_MTU )
+            frag_fu_a(pk, nal, size);
+        else
+            h264_single(pk, nal, size);
+        return;
+    }
+
+    if ( pk->stap_count == 0 ) {
+        pk->stap[0] = 24;
+        pk->stap_size = 1;
+    }
+
+    /* F is set if any aggregated unit has it, NRI is the highest one */
+    pk->stap[0] |= nal[0] & 0x80;
+    if ( (nal[0] & 0x60) > (pk->stap[0] & 0x60) )
+        pk->stap[0] = (pk->stap[0] & ~0x60) | (nal[0] & 0x60);
+
+    pk->stap[pk->stap_size++] = size >> 8;
+    pk->stap[pk->stap_size++] = size & 0xff;
+    memcpy(pk->stap + pk->stap_size, nal, size);
+    pk->stap_size += size;
+    pk->stap_count++;
+}
+
+/**
+ * @brief Complete the access unit, setting the marker on its last packet
+ */
+static void h264_finish(H264Packetizer *pk)
+{
+    h264_stap_flush(pk);
+
+    if ( !g_queue_is_empty(&pk->packets) ) {
+        ((struct MParserBuffer*)g_queue_peek_tail(&pk->packets))->marker = true;
+        track_write_frame(pk->tr, &pk->packets);
+    }
+}
+
 #define RB16(x) ((((uint8_t*)(x))[0] << 8) | ((uint8_t*)(x))[1])
 
 static char *encode_avc1_header(uint8_t *p, unsigned int len, int packet_mode)
@@ -150,48 +258,8 @@ static char *encode_avc1_header(uint8_t *p, unsigned int len, int packet_mode)
     return NULL;
 }
 
-//Ripped directly from ffmpeg...
-
-static const uint8_t *find_startcode_internal(const uint8_t *p,
-                                             const uint8_t *end)
-{
-        const uint8_t *a = p + 4 - ((intptr_t)p & 3);
-
-    for (end -= 3; p < a && p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    for (end -= 3; p < end; p += 4) {
-        uint32_t x = *(const uint32_t*)p;
-//      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
-//      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
-        if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
-            if (p[1] == 0) {
-                if (p[0] == 0 && p[2] == 1)
-                    return p;
-                if (p[2] == 0 && p[3] == 1)
-                    return p+1;
-            }
-            if (p[3] == 0) {
-                if (p[2] == 0 && p[4] == 1)
-                    return p+2;
-                if (p[4] == 0 && p[5] == 1)
-                    return p+3;
-            }
-        }
-    }
-
-    for (end += 3; p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    return end + 3;
-}
-
 static const uint8_t *find_startcode(const uint8_t *p, const uint8_t *end){
-    const uint8_t *out = find_startcode_internal(p, end);
+    const uint8_t *out = startcode_find(p, end);
     if(p<out && out<end && !out[-1]) out--;
     return out;
 }
@@ -234,6 +302,7 @@ static char *encode_header(uint8_t *p, unsigned int len, int packet_mode)
     return sprop;
 }
 
+/* non-interleaved mode: single NAL units, STAP-A and FU-A */
 #define FU_A 1
 
 int h264_init(Track *track)
@@ -270,27 +339,27 @@ int h264_init(Track *track)
 }
 
 // h264 has provisions for
-//  - collating NALS
-//  - fragmenting
+//  - collating NALS (STAP-A)
+//  - fragmenting (FU-A)
 //  - feed a single NAL as is.
 
 int h264_parse(Track *tr, uint8_t *data, ssize_t len)
 {
 //    double nal_time; // see page 9 and 7.4.1.2
     size_t nalsize = 0, index = 0;
-    uint8_t *p, *q;
+    H264Packetizer pk = { .tr = tr, .packets = G_QUEUE_INIT };
 
     if (tr->h264.is_avc) {
         const size_t nal_length_size = tr->h264.nal_length_size;
 
         while (1) {
             unsigned int i;
-            if(index >= len) break;
+            if(index + nal_length_size > len) break;
             //get the nal size
             nalsize = 0;
             for(i = 0; i < nal_length_size; i++)
                 nalsize = (nalsize << 8) | data[index++];
-            if(nalsize <= 1 || nalsize > len) {
+            if(nalsize <= 1 || nalsize > len - index) {
                 if(nalsize == 1) {
                     index++;
                     continue;
@@ -299,91 +368,30 @@ int h264_parse(Track *tr, uint8_t *data, ssize_t len)
                     break;
                 }
             }
-            if (DEFAULT_MTU >= nalsize) {
-                struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
-
-                buffer->timestamp = tr->pts;
-                buffer->delivery = tr->dts;
-                buffer->duration = tr->frame_duration;
-                buffer->marker = true;
-
-                buffer->data_size = nalsize;
-                buffer->data = g_memdup(data + index, buffer->data_size);
-
-                track_write(tr, buffer);
-
-                fnc_log(FNC_LOG_VERBOSE, "[h264] single NAL");
-            } else {
-            // single NAL, to be fragmented, FU-A;
-                frag_fu_a(data + index, nalsize, tr);
-            }
+            h264_nal(&pk, data + index, nalsize);
             index += nalsize;
         }
     } else {
-        //seek to the first startcode
-        for (p = data; p<data + len - 3; p++) {
-            if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
-                break;
-            }
-        }
-        if (p >= data + len) return -1;
-
-        while (1) {
-        //seek to the next startcode [0 0 1]
-            for (q = p; q<data+len-3;q++) {
-                if (q[0] == 0 && q[1] == 0 && q[2] == 1) {
-                    break;
-                }
-            }
-
-            if (q >= data + len) break;
+        const uint8_t *end = data + len;
+        const uint8_t *p = find_startcode(data, end);
 
-            if (DEFAULT_MTU >= q - p) {
-                struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        if (p >= end) return -1;
 
-                buffer->timestamp = tr->pts;
-                buffer->delivery = tr->dts;
-                buffer->duration = tr->frame_duration;
-                buffer->marker = true;
+        while (p < end) {
+            const uint8_t *q;
 
-                buffer->data_size = q - p;
-                buffer->data = g_memdup(p, buffer->data_size);
-
-                track_write(tr, buffer);
-
-                fnc_log(FNC_LOG_VERBOSE, "[h264] Sending single NAL %d",p[0]&0x1f);
-            } else {
-                //FU-A
-                fnc_log(FNC_LOG_VERBOSE, "[h264] frags");
-                frag_fu_a(p, q - p, tr);
-            }
+            // skip the start code
+            while (p < end && !*p) p++;
+            if (++p >= end) break;
 
+            q = find_startcode(p, end);
+            h264_nal(&pk, p, q - p);
             p = q;
-
-        }
-        // last NAL
-        fnc_log(FNC_LOG_VERBOSE, "[h264] last NAL %d",p[0]&0x1f);
-        if (DEFAULT_MTU >= len - (p - data)) {
-            struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
-
-            buffer->timestamp = tr->pts;
-            buffer->delivery = tr->dts;
-            buffer->duration = tr->frame_duration;
-            buffer->marker = true;
-
-            buffer->data_size = len - (p - data);
-            buffer->data = g_memdup(p, buffer->data_size);
-
-            track_write(tr, buffer);
-
-            fnc_log(FNC_LOG_VERBOSE, "[h264] no frags");
-        } else {
-            //FU-A
-            fnc_log(FNC_LOG_VERBOSE, "[h264] frags");
-            frag_fu_a(p, len - (p - data), tr);
         }
     }
 
+    h264_finish(&pk);
+
     fnc_log(FNC_LOG_VERBOSE, "[h264] Frame completed");
     return 0;
 }
@@ -0,0 +1,381 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief H.265 packetizer (RFC 7798)
+ *
+ * Access units are sent as single NAL unit packets, aggregation
+ * packets (AP) gathering the small NAL units, and fragmentation units
+ * (FU) splitting the ones larger than the MTU, the same way @ref
+ * h264_parse does with STAP-A and FU-A. Decoding order numbers are
+ * never sent, as the NAL units are sent in decoding order
+ * (sprop-max-don-diff is 0).
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "fnc_log.h"
+#include "media/media.h"
+
+/* NAL unit header
+ *  +---------------+---------------+
+ *  |0|1|2|3|4|5|6|7|0|1|2|3|4|5|6|7|
+ *  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *  |F|   Type    |  LayerId  | TID |
+ *  +-------------+-----------------+
+ */
+#define H265_NAL_TYPE(nal) (((nal)[0] >> 1) & 0x3f)
+
+#define H265_NAL_VPS 32
+#define H265_NAL_SPS 33
+#define H265_NAL_PPS 34
+#define H265_NAL_AP  48
+#define H265_NAL_FU  49
+
+/**
+ * @brief State of the packetization of an access unit
+ *
+ * @see H264Packetizer
+ */
+typedef struct {
+    Track *tr;
+    GQueue packets;                 /*!< packets of the access unit */
+
+    uint8_t ap[DEFAULT_MTU];        /*!< aggregation packet being built */
+    size_t ap_size;
+    guint ap_count;                 /*!< NAL units in the aggregation packet */
+} H265Packetizer;
+
+/**
+ * @brief Queue a packet of the access unit
+ */
+static void h265_push(H265Packetizer *pk, struct MParserBuffer *buffer)
+{
+    g_queue_push_tail(&pk->packets, buffer);
+}
+
+/**
+ * @brief Send a NAL unit of the demuxed packet in its own packet
+ */
+static void h265_single(H265Packetizer *pk, const uint8_t *nal, size_t size)
+{
+    h265_push(pk, track_buffer_new(pk->tr, NULL, 0, nal, size));
+}
+
+/* FU header
+ *  +---------------+
+ *  |0|1|2|3|4|5|6|7|
+ *  +-+-+-+-+-+-+-+-+
+ *  |S|E|  FuType   |
+ *  +---------------+
+ */
+static void h265_fragment(H265Packetizer *pk, const uint8_t *nal, size_t size)
+{
+    uint8_t header[3] = {
+        (nal[0] & 0x81) | (H265_NAL_FU << 1),
+        nal[1],
+        (1 << 7) | H265_NAL_TYPE(nal)
+    };
+
+    /* the NAL unit header is rebuilt from the payload header */
+    nal += 2;
+    size -= 2;
+
+    while ( size > 0 ) {
+        const size_t fraglen = MIN(DEFAULT_MTU - 3, size);
+
+        if ( fraglen == size )
+            header[2] |= (1 << 6);
+
+        h265_push(pk, track_buffer_new(pk->tr, header, 3, nal, fraglen));
+
+        header[2] &= ~(1 << 7);
+        size -= fraglen;
+        nal += fraglen;
+    }
+}
+
+/**
+ * @brief Send the NAL units aggregated so far
+ *
+ * A lone NAL unit is sent as is.
+ */
+static void h265_ap_flush(H265Packetizer *pk)
+{
+    switch ( pk->ap_count ) {
+    case 0:
+        return;
+    case 1:
+        /* the unit was already copied, it is not in the packet anymore */
+        h265_push(pk, track_buffer_copy(pk->tr, pk->ap + 4, pk->ap_size - 4));
+        break;
+    default:
+        h265_push(pk, track_buffer_copy(pk->tr, pk->ap, pk->ap_size));
+
+        fnc_log(FNC_LOG_VERBOSE, "[h265] AP of %u NALs", pk->ap_count);
+        break;
+    }
+
+    pk->ap_size = 0;
+    pk->ap_count = 0;
+}
+
+/**
+ * @brief Packetize a NAL unit of the access unit
+ */
+static void h265_nal(H265Packetizer *pk, const uint8_t *nal, size_t size)
+{
+    if ( size < 3 )
+        return;
+
+    if ( pk->ap_size + 2 + size > DEFAULT_MTU )
+        h265_ap_flush(pk);
+
+    if ( 2 + 2 + size > DEFAULT_MTU ) {
+        if ( size > DEFAULT_MTU )
+            h265_fragment(pk, nal, size);
+        else
+            h265_single(pk, nal, size);
+        return;
+    }
+
+    if ( pk->ap_count == 0 ) {
+        /* F is set if any aggregated unit has it; LayerId and TID are
+         * the lowest ones */
+        pk->ap[0] = (nal[0] & 0x81) | (H265_NAL_AP << 1);
+        pk->ap[1] = nal[1];
+        pk->ap_size = 2;
+    } else {
+        const guint layer = MIN(((pk->ap[0] & 0x01) << 5) | (pk->ap[1] >> 3),
+                                ((nal[0] & 0x01) << 5) | (nal[1] >> 3));
+        const guint tid = MIN(pk->ap[1] & 0x07, nal[1] & 0x07);
+
+        pk->ap[0] = (pk->ap[0] & 0x80) | (nal[0] & 0x80) |
+            (H265_NAL_AP << 1) | (layer >> 5);
+        pk->ap[1] = ((layer & 0x1f) << 3) | tid;
+    }
+
+    pk->ap[pk->ap_size++] = size >> 8;
+    pk->ap[pk->ap_size++] = size & 0xff;
+    memcpy(pk->ap + pk->ap_size, nal, size);
+    pk->ap_size += size;
+    pk->ap_count++;
+}
+
+/**
+ * @brief Complete the access unit, setting the marker on its last packet
+ */
+static void h265_finish(H265Packetizer *pk)
+{
+    h265_ap_flush(pk);
+
+    if ( !g_queue_is_empty(&pk->packets) ) {
+        ((struct MParserBuffer*)g_queue_peek_tail(&pk->packets))->marker = true;
+        track_write_frame(pk->tr, &pk->packets);
+    }
+}
+
+/**
+ * @brief Parameter sets found in the extradata, base64 encoded
+ */
+typedef struct {
+    GString *vps, *sps, *pps;
+} H265ParameterSets;
+
+static void h265_add_parameter_set(H265ParameterSets *ps,
+                                   const uint8_t *nal, size_t size)
+{
+    GString *list;
+    gchar *b64;
+
+    if ( size < 2 )
+        return;
+
+    switch ( H265_NAL_TYPE(nal) ) {
+    case H265_NAL_VPS: list = ps->vps; break;
+    case H265_NAL_SPS: list = ps->sps; break;
+    case H265_NAL_PPS: list = ps->pps; break;
+    default: return;
+    }
+
+    b64 = g_base64_encode(nal, size);
+    if ( list->len )
+        g_string_append_c(list, ',');
+    g_string_append(list, b64);
+    g_free(b64);
+}
+
+#define RB16(x) ((((uint8_t*)(x))[0] << 8) | ((uint8_t*)(x))[1])
+
+/**
+ * @brief Read the parameter sets of an hvcC box
+ *
+ * @return false if the box is truncated.
+ */
+static gboolean h265_parse_hvcc(const uint8_t *p, size_t len,
+                                H265ParameterSets *ps)
+{
+    const uint8_t *end = p + len;
+    guint arrays, i;
+
+    if ( len < 23 )
+        return false;
+
+    arrays = p[22];
+    p += 23;
+
+    for ( i = 0; i < arrays; i++ ) {
+        guint count, j;
+
+        if ( end - p < 3 )
+            return false;
+
+        count = RB16(p + 1);
+        p += 3;
+
+        for ( j = 0; j < count; j++ ) {
+            size_t size;
+
+            if ( end - p < 2 )
+                return false;
+
+            size = RB16(p);
+            p += 2;
+
+            if ( (size_t)(end - p) < size )
+                return false;
+
+            h265_add_parameter_set(ps, p, size);
+            p += size;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read the parameter sets of Annex B extradata
+ */
+static void h265_parse_annexb(const uint8_t *p, size_t len,
+                              H265ParameterSets *ps)
+{
+    const uint8_t *end = p + len;
+
+    p = startcode_find(p, end);
+
+    while ( p < end ) {
+        const uint8_t *q;
+
+        p += 3;
+        q = startcode_find(p, end);
+
+        /* the leading zero of a four bytes start code */
+        h265_add_parameter_set(ps, p, q - p - (q < end && !q[-1]));
+        p = q;
+    }
+}
+
+int h265_init(Track *track)
+{
+    H265ParameterSets ps = {
+        g_string_new(NULL), g_string_new(NULL), g_string_new(NULL)
+    };
+    int ret = -1;
+
+    if ( track->extradata_len > 0 && track->extradata[0] == 1 ) {
+        if ( !h265_parse_hvcc(track->extradata, track->extradata_len, &ps) )
+            goto err_alloc;
+
+        track->h265.nal_length_size = (track->extradata[21] & 0x03) + 1;
+        track->h265.is_hvcc = true;
+    } else
+        h265_parse_annexb(track->extradata, track->extradata_len, &ps);
+
+    if ( ps.vps->len == 0 || ps.sps->len == 0 || ps.pps->len == 0 ) {
+        fnc_log(FNC_LOG_ERR, "[h265] missing parameter sets");
+        goto err_alloc;
+    }
+
+    sdp_descr_append_rtpmap(track);
+    g_string_append_printf(track->sdp_description,
+                           "a=fmtp:%u sprop-vps=%s; sprop-sps=%s; sprop-pps=%s\r\n",
+                           track->payload_type,
+                           ps.vps->str, ps.sps->str, ps.pps->str);
+
+    ret = 0;
+
+ err_alloc:
+    g_string_free(ps.vps, true);
+    g_string_free(ps.sps, true);
+    g_string_free(ps.pps, true);
+    return ret;
+}
+
+int h265_parse(Track *tr, uint8_t *data, ssize_t len)
+{
+    H265Packetizer pk = { .tr = tr, .packets = G_QUEUE_INIT };
+    const uint8_t *end = data + len;
+
+    if ( tr->h265.is_hvcc ) {
+        const size_t nal_length_size = tr->h265.nal_length_size;
+        const uint8_t *p = data;
+
+        while ( (size_t)(end - p) >= nal_length_size ) {
+            size_t size = 0;
+            guint i;
+
+            for ( i = 0; i < nal_length_size; i++ )
+                size = (size << 8) | *p++;
+
+            if ( size > (size_t)(end - p) ) {
+                fnc_log(FNC_LOG_VERBOSE, "[h265] hvcC: nal size %zu", size);
+                break;
+            }
+
+            h265_nal(&pk, p, size);
+            p += size;
+        }
+    } else {
+        const uint8_t *p = startcode_find(data, end);
+
+        if ( p >= end )
+            return -1;
+
+        while ( p < end ) {
+            const uint8_t *q;
+
+            p += 3;
+            q = startcode_find(p, end);
+
+            h265_nal(&pk, p, q - p - (q < end && !q[-1]));
+            p = q;
+        }
+    }
+
+    h265_finish(&pk);
+
+    return 0;
+}
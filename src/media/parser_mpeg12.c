@@ -27,35 +27,23 @@
 
 #include "media/media.h"
 
-// Stolen from ffmpeg (mpegvideo.c)
+/**
+ * @brief Find the next start code
+ *
+ * @return The byte following the start code, with @p state set to the
+ *         start code, or @p end if there is none.
+ */
 static uint8_t *find_start_code(uint8_t *p, uint8_t *end, uint32_t *state)
 {
-    int i;
+    const uint8_t *q = startcode_find(p, end);
 
-    if(p>=end)
+    if ( end - q < 4 ) {
+        *state = -1;
         return end;
-
-    for(i=0; i<3; i++){
-        uint32_t tmp= *state << 8;
-        *state= tmp + *(p++);
-        if(tmp == 0x100 || p==end)
-            return p;
     }
 
-    while(p<end){
-        if     (p[-1] > 1      ) p+= 3;
-        else if(p[-2]          ) p+= 2;
-        else if(p[-3]|(p[-1]-1)) p++;
-        else{
-            p++;
-            break;
-        }
-    }
-
-    p= MIN(p, end)-4;
-    *state= (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | (p[3]);
-
-    return p+4;
+    *state = 0x100 | q[3];
+    return (uint8_t*)q + 4;
 }
 
 /* Source code taken from ff_rtp_send_mpegvideo (ffmpeg libavformat) and
@@ -69,6 +57,7 @@ int mpv_parse(Track *tr, uint8_t *data, ssize_t len)
     uint8_t *r, *r1 = data;
     uint8_t *end = data + len;
     uint32_t start_code;
+    GQueue frame = G_QUEUE_INIT;
 
     while (1) {
         start_code = -1;
@@ -157,7 +146,7 @@ int mpv_parse(Track *tr, uint8_t *data, ssize_t len)
             memcpy(buffer->data, &header_n, sizeof(header_n));
             memcpy(buffer->data + 4, data, payload);
 
-            track_write(tr, buffer);
+            g_queue_push_tail(&frame, buffer);
 
             b = e;
             e = 0;
@@ -167,5 +156,7 @@ int mpv_parse(Track *tr, uint8_t *data, ssize_t len)
         } else rem = 0;
     }
 
+    track_write_frame(tr, &frame);
+
     return 0;
 }
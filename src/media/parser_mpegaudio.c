@@ -28,39 +28,58 @@
 #include "media/media.h"
 #include "fnc_log.h"
 
-int mpa_parse(Track *tr, uint8_t *data, ssize_t len)
+static size_t mpa_packet_size(ATTR_UNUSED guint frames, size_t bytes)
 {
-    ssize_t rem = len;
+    return 4 + bytes;
+}
 
-    if (DEFAULT_MTU >= len + 4) {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+/**
+ * @brief Write a packet of whole frames, after a zero fragment offset
+ */
+static size_t mpa_packet_write(ATTR_UNUSED Track *tr, uint8_t *dest,
+                               const guint *sizes, guint frames,
+                               const uint8_t *payload)
+{
+    size_t bytes = 0;
+    guint i;
 
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
-        buffer->marker = true;
+    for ( i = 0; i < frames; i++ )
+        bytes += sizes[i];
 
-        buffer->data_size = len + 4;
-        buffer->data = g_malloc(buffer->data_size);
+    memset(dest, 0, 4);
+    memcpy(dest + 4, payload, bytes);
+
+    return 4 + bytes;
+}
 
-        memset(buffer->data, 0, 4);
-        memcpy(buffer->data + 4, data, len);
+static const AggregateFormat mpa_format = {
+    .max_frames = G_MAXUINT,
+    .packet_size = mpa_packet_size,
+    .write = mpa_packet_write,
+};
 
-        track_write(tr, buffer);
+int mpa_parse(Track *tr, uint8_t *data, ssize_t len)
+{
+    GQueue frame = G_QUEUE_INIT;
+    ssize_t rem = len;
 
+    if (DEFAULT_MTU >= len + 4) {
+        aggr_frame(tr, &mpa_format, data, len, 0, tr->frame_duration);
         fnc_log(FNC_LOG_VERBOSE, "[mp3] no frags");
 
         return 0;
     }
 
-    do {
-        int32_t offset = len - rem;
-        struct MParserBuffer *buffer;
+    /* the fragment offset is 16 bits */
+    if (len > 0xffff)
+        return -1;
 
-        if (offset & 0xffff0000)
-            return -1;
+    aggr_flush(tr);
 
-        offset = htonl(offset & 0xffff);
+    do {
+        const int32_t offset = len - rem;
+        const uint32_t header = htonl(offset);
+        struct MParserBuffer *buffer;
 
         buffer = g_slice_new0(struct MParserBuffer);
 
@@ -72,15 +91,17 @@ int mpa_parse(Track *tr, uint8_t *data, ssize_t len)
         buffer->data_size = MIN(DEFAULT_MTU, rem + 4);
         buffer->data = g_malloc(buffer->data_size);
 
-        memcpy(buffer->data, &offset, 4);
+        memcpy(buffer->data, &header, 4);
         memcpy(buffer->data + 4, data + offset, buffer->data_size - 4);
 
-        track_write(tr, buffer);
+        g_queue_push_tail(&frame, buffer);
 
         rem -= DEFAULT_MTU - 4;
         fnc_log(FNC_LOG_VERBOSE, "[mp3] frags");
     } while (rem >= 0);
 
+    track_write_frame(tr, &frame);
+
     fnc_log(FNC_LOG_VERBOSE, "[mp3]Frames completed");
 
     return 0;
@@ -0,0 +1,314 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Opus packetizer (RFC 7587)
+ *
+ * An RTP packet carries a single Opus packet, which can itself hold
+ * up to 120ms of frames sharing the same configuration (RFC 6716,
+ * section 3.2). The demuxed packets are split in their frames, which
+ * are handed over to the aggregator (see @ref aggr_frame): the frames
+ * gathered are sent as one Opus packet, with a single TOC byte.
+ *
+ * Packets made of empty frames only are the ones an encoder produces
+ * during silence when DTX is enabled; they are not sent, and the
+ * marker bit is set on the first packet of each talkspurt.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "media/media.h"
+#include "fnc_log.h"
+
+/* TOC byte
+ *  +-+-+-+-+-+-+-+-+
+ *  |0|1|2|3|4|5|6|7|
+ *  +-+-+-+-+-+-+-+-+
+ *  | config  |s| c |
+ *  +-+-+-+-+-+-+-+-+
+ */
+#define OPUS_TOC_CODE 0x03
+
+/** Longest frame (RFC 6716, section 3.4) */
+#define OPUS_MAX_FRAME 1275
+/** Most frames in an Opus packet */
+#define OPUS_MAX_FRAMES 48
+
+int opus_init(Track *track)
+{
+    if ( track->audio_channels > 2 ) {
+        fnc_log(FNC_LOG_ERR, "[opus] %d channels not supported",
+                track->audio_channels);
+        return -1;
+    }
+
+    /* the rtpmap is always 48000/2, whatever the actual stream */
+    g_string_append_printf(track->sdp_description,
+                           "a=rtpmap:%u opus/48000/2\r\n"
+                           "a=fmtp:%u sprop-stereo=%d\r\n",
+                           track->payload_type,
+                           track->payload_type,
+                           track->audio_channels == 2);
+
+    return 0;
+}
+
+/**
+ * @brief Duration of the frames of a configuration, in seconds
+ */
+static double opus_frame_duration(uint8_t toc)
+{
+    const guint config = toc >> 3;
+
+    if ( config < 12 )          /* SILK: 10, 20, 40, 60ms */
+        return (config & 3) == 3 ? 0.060 : 0.010 * (1 << (config & 3));
+    else if ( config < 16 )     /* hybrid: 10, 20ms */
+        return 0.010 * (1 << (config & 1));
+    else                        /* CELT: 2.5, 5, 10, 20ms */
+        return 0.0025 * (1 << (config & 3));
+}
+
+/**
+ * @brief Read a frame length
+ *
+ * @return The number of bytes read, 0 if the data is truncated.
+ */
+static size_t opus_read_length(const uint8_t *p, const uint8_t *end,
+                               size_t *len)
+{
+    if ( p >= end )
+        return 0;
+
+    if ( p[0] < 252 ) {
+        *len = p[0];
+        return 1;
+    }
+
+    if ( end - p < 2 )
+        return 0;
+
+    *len = p[0] + 4 * p[1];
+    return 2;
+}
+
+static size_t opus_write_length(uint8_t *p, size_t len)
+{
+    if ( len < 252 ) {
+        p[0] = len;
+        return 1;
+    }
+
+    p[0] = 252 + ((len - 252) & 3);
+    p[1] = (len - p[0]) >> 2;
+    return 2;
+}
+
+/**
+ * @brief Split an Opus packet in its frames
+ *
+ * @return The number of frames, 0 if the packet is malformed.
+ */
+static guint opus_split(const uint8_t *data, size_t len,
+                        const uint8_t *frames[OPUS_MAX_FRAMES],
+                        size_t sizes[OPUS_MAX_FRAMES])
+{
+    const uint8_t *p = data + 1, *end = data + len;
+    gboolean vbr, padded;
+    guint count, i;
+    size_t n;
+
+    if ( len < 1 )
+        return 0;
+
+    switch ( data[0] & OPUS_TOC_CODE ) {
+    case 0:
+        frames[0] = p;
+        sizes[0] = end - p;
+        return 1;
+
+    case 1:
+        if ( (end - p) % 2 )
+            return 0;
+
+        frames[0] = p;
+        frames[1] = p + (end - p) / 2;
+        sizes[0] = sizes[1] = (end - p) / 2;
+        return 2;
+
+    case 2:
+        if ( (n = opus_read_length(p, end, &sizes[0])) == 0 ||
+             sizes[0] > (size_t)(end - p - n) )
+            return 0;
+
+        frames[0] = p + n;
+        frames[1] = frames[0] + sizes[0];
+        sizes[1] = end - frames[1];
+        return 2;
+    }
+
+    /* code 3: frame count byte, padding, then the lengths if VBR */
+    if ( p >= end || (count = p[0] & 0x3f) == 0 || count > OPUS_MAX_FRAMES )
+        return 0;
+
+    vbr = p[0] & 0x80;
+    padded = p[0] & 0x40;
+    p++;
+
+    if ( padded ) {
+        size_t padding = 0;
+
+        do {
+            if ( p >= end )
+                return 0;
+            padding += *p == 255 ? 254 : *p;
+        } while ( *p++ == 255 );
+
+        if ( padding > (size_t)(end - p) )
+            return 0;
+
+        end -= padding;
+    }
+
+    if ( !vbr ) {
+        if ( (end - p) % count )
+            return 0;
+
+        for ( i = 0; i < count; i++ ) {
+            sizes[i] = (end - p) / count;
+            frames[i] = p + i * sizes[i];
+        }
+        return count;
+    }
+
+    for ( i = 0; i < count - 1; i++ ) {
+        if ( (n = opus_read_length(p, end, &sizes[i])) == 0 )
+            return 0;
+        p += n;
+    }
+
+    for ( i = 0; i < count - 1; i++ ) {
+        if ( sizes[i] > (size_t)(end - p) )
+            return 0;
+        frames[i] = p;
+        p += sizes[i];
+    }
+
+    frames[count - 1] = p;
+    sizes[count - 1] = end - p;
+    return count;
+}
+
+static size_t opus_packet_size(guint frames, size_t bytes)
+{
+    /* each frame is gathered with its TOC byte */
+    if ( frames == 1 )
+        return bytes;
+
+    return 2 + 2 * (frames - 1) + (bytes - frames);
+}
+
+/**
+ * @brief Write an Opus packet: a single frame as code 0, more frames
+ *        as code 3 with their lengths
+ */
+static size_t opus_packet_write(ATTR_UNUSED Track *tr, uint8_t *dest,
+                                const guint *sizes, guint frames,
+                                const uint8_t *payload)
+{
+    uint8_t *p = dest;
+    const uint8_t *q;
+    guint i;
+
+    if ( frames == 1 ) {
+        memcpy(dest, payload, sizes[0]);
+        return sizes[0];
+    }
+
+    *p++ = payload[0] | 3;
+    *p++ = 0x80 | frames;       /* VBR, no padding */
+
+    for ( i = 0; i < frames - 1; i++ )
+        p += opus_write_length(p, sizes[i] - 1);
+
+    for ( i = 0, q = payload; i < frames; q += sizes[i], i++ ) {
+        memcpy(p, q + 1, sizes[i] - 1);
+        p += sizes[i] - 1;
+    }
+
+    return p - dest;
+}
+
+static gboolean opus_compatible(const uint8_t *first, const uint8_t *frame)
+{
+    return first[0] == frame[0];
+}
+
+static const AggregateFormat opus_format = {
+    .max_frames = OPUS_MAX_FRAMES,
+    .max_duration = 0.120,
+    .packet_size = opus_packet_size,
+    .write = opus_packet_write,
+    .compatible = opus_compatible,
+    .talkspurts = true,
+};
+
+int opus_parse(Track *tr, uint8_t *data, ssize_t len)
+{
+    const uint8_t *frames[OPUS_MAX_FRAMES];
+    size_t sizes[OPUS_MAX_FRAMES];
+    uint8_t unit[1 + OPUS_MAX_FRAME];
+    double duration;
+    size_t total = 0;
+    guint count, i;
+
+    if ( (count = opus_split(data, len, frames, sizes)) == 0 ) {
+        fnc_log(FNC_LOG_VERBOSE, "[opus] malformed packet");
+        return 0;
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        if ( sizes[i] > OPUS_MAX_FRAME ) {
+            fnc_log(FNC_LOG_VERBOSE, "[opus] frame too large");
+            return 0;
+        }
+        total += sizes[i];
+    }
+
+    /* DTX: nothing worth sending */
+    if ( total == 0 )
+        return 0;
+
+    duration = opus_frame_duration(data[0]);
+    unit[0] = data[0] & ~OPUS_TOC_CODE;
+
+    for ( i = 0; i < count; i++ ) {
+        memcpy(unit + 1, frames[i], sizes[i]);
+        aggr_frame(tr, &opus_format, unit, 1 + sizes[i],
+                   i * duration, duration);
+    }
+
+    return 0;
+}
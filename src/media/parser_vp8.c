@@ -56,23 +56,16 @@ int vp8_init(Track *track)
 int vp8_parse(Track *tr, uint8_t *data, ssize_t len)
 {
     uint8_t prefix[HEADER_SIZE] = { (data[0] & 1 ? 0 : 2) | VP8_START_PACKET };
+    GQueue frame = G_QUEUE_INIT;
 
     do {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            track_buffer_new(tr, prefix, HEADER_SIZE,
+                             data, MIN(MAX_PAYLOAD_SIZE, len));
 
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
         buffer->marker = (len <= MAX_PAYLOAD_SIZE);
 
-        buffer->data_size = MIN(MAX_PAYLOAD_SIZE, len) + HEADER_SIZE;
-        buffer->data = g_malloc(buffer->data_size);
-
-        memcpy(buffer->data, &prefix[0], HEADER_SIZE);
-        memcpy(buffer->data + HEADER_SIZE, data,
-               buffer->data_size - HEADER_SIZE);
-
-        track_write(tr, buffer);
+        g_queue_push_tail(&frame, buffer);
 
         len -= MAX_PAYLOAD_SIZE;
         data += MAX_PAYLOAD_SIZE;
@@ -80,5 +73,7 @@ int vp8_parse(Track *tr, uint8_t *data, ssize_t len)
         prefix[0] &= ~VP8_START_PACKET;
     } while (len > 0);
 
+    track_write_frame(tr, &frame);
+
     return 0;
 }
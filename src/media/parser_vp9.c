@@ -0,0 +1,66 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief VP9 packetizer (RFC 9628)
+ *
+ * The packetization itself is done by @ref vp9_payload; each frame gets
+ * the next picture ID.
+ */
+
+#include <config.h>
+
+#include "media/media.h"
+
+int vp9_init(Track *track)
+{
+    sdp_descr_append_rtpmap(track);
+
+    track->vp9.picture_id = g_random_int_range(0, 0x8000);
+
+    return 0;
+}
+
+int vp9_parse(Track *tr, uint8_t *data, ssize_t len)
+{
+    GQueue frame = G_QUEUE_INIT;
+    GList *item;
+
+    if ( len <= 0 )
+        return 0;
+
+    vp9_payload(&frame, data, len, tr->vp9.picture_id);
+    tr->vp9.picture_id = (tr->vp9.picture_id + 1) & 0x7fff;
+
+    for ( item = frame.head; item; item = item->next ) {
+        struct MParserBuffer *buffer = item->data;
+
+        buffer->timestamp = tr->pts;
+        buffer->delivery = tr->dts;
+        buffer->duration = tr->frame_duration;
+    }
+
+    track_write_frame(tr, &frame);
+
+    return 0;
+}
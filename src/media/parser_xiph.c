@@ -34,10 +34,59 @@
 #define HEADER_SIZE 6
 #define MAX_PAYLOAD_SIZE (DEFAULT_MTU - HEADER_SIZE)
 
+static size_t xiph_packet_size(guint frames, size_t bytes)
+{
+    return 4 + 2 * frames + bytes;
+}
+
+/**
+ * @brief Write a packet of whole Xiph packets: the ident, their count,
+ *        then each one preceded by its length
+ */
+static size_t xiph_packet_write(Track *tr, uint8_t *dest, const guint *sizes,
+                                guint frames, const uint8_t *payload)
+{
+    const uint8_t *start = dest;
+    guint i;
+
+    dest[0] = tr->xiph.ident[0];
+    dest[1] = tr->xiph.ident[1];
+    dest[2] = tr->xiph.ident[2];
+    dest[3] = frames;           /* not fragmented, raw payload */
+    dest += 4;
+
+    for ( i = 0; i < frames; i++ ) {
+        dest[0] = sizes[i] >> 8;
+        dest[1] = sizes[i] & 0xff;
+        memcpy(dest + 2, payload, sizes[i]);
+
+        dest += 2 + sizes[i];
+        payload += sizes[i];
+    }
+
+    return dest - start;
+}
+
+static const AggregateFormat xiph_format = {
+    .max_frames = 15,
+    .packet_size = xiph_packet_size,
+    .write = xiph_packet_write,
+};
+
 int xiph_parse(Track *tr, uint8_t *data, ssize_t len)
 {
+    GQueue frame = G_QUEUE_INIT;
     uint8_t fragment = 0;
 
+    /* the packets of a video frame share its timestamp, do not gather
+     * them with the following frames */
+    if ( tr->media_type == MP_audio && len <= MAX_PAYLOAD_SIZE ) {
+        aggr_frame(tr, &xiph_format, data, len, 0, tr->frame_duration);
+        return 0;
+    }
+
+    aggr_flush(tr);
+
     do {
         uint16_t payload_size;
 
@@ -74,12 +123,14 @@ int xiph_parse(Track *tr, uint8_t *data, ssize_t len)
         memcpy(buffer->data + HEADER_SIZE, data,
                buffer->data_size - HEADER_SIZE);
 
-        track_write(tr, buffer);
+        g_queue_push_tail(&frame, buffer);
 
         len -= MAX_PAYLOAD_SIZE;
         data += MAX_PAYLOAD_SIZE;
     } while(len > 0);
 
+    track_write_frame(tr, &frame);
+
     return 0;
 }
 
@@ -0,0 +1,522 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief VP9 and AV1 payloads
+ *
+ * Unlike the older payload formats, these two tell the receiver (and
+ * any middlebox) whether a packet belongs to a keyframe and to which
+ * layer, so that the packets of the upper layers can be dropped
+ * without decoding anything. The same information is stored in the
+ * buffers (see @ref MParserBuffer::keyframe) for the delivery to use.
+ *
+ * The packetization does not depend on the tracks, so that it can be
+ * tested on sample bitstreams.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "media/media.h"
+
+/**
+ * @brief MSB first reader of the uncompressed frame headers
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;     /*!< in bits */
+} PayloadBits;
+
+static guint payload_bits(PayloadBits *b, guint n)
+{
+    guint value = 0;
+
+    while ( n-- ) {
+        value <<= 1;
+        if ( b->pos < b->len * 8 )
+            value |= (b->data[b->pos / 8] >> (7 - b->pos % 8)) & 1;
+        b->pos++;
+    }
+
+    return value;
+}
+
+static gboolean payload_bits_overrun(const PayloadBits *b)
+{
+    return b->pos > b->len * 8;
+}
+
+static struct MParserBuffer *payload_buffer_new(const uint8_t *data,
+                                                size_t len)
+{
+    struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+
+    buffer->data_size = len;
+    buffer->data = g_memdup(data, len);
+
+    return buffer;
+}
+
+/**
+ * @brief Free the packets of a queue not written to a track
+ */
+void payload_free(GQueue *packets)
+{
+    struct MParserBuffer *buffer;
+
+    while ( (buffer = g_queue_pop_head(packets)) != NULL ) {
+        g_free(buffer->data);
+        g_slice_free(struct MParserBuffer, buffer);
+    }
+}
+
+/* VP9 payload descriptor, as sent (non-flexible mode, no layer indices)
+ *  +-+-+-+-+-+-+-+-+
+ *  |I|P|L|F|B|E|V|Z|
+ *  +-+-+-+-+-+-+-+-+
+ *  |M| PICTURE ID  |
+ *  +-+-+-+-+-+-+-+-+
+ *  |   PICTURE ID  |
+ *  +-+-+-+-+-+-+-+-+
+ *  |   SS (if V)   |
+ *  +-+-+-+-+-+-+-+-+
+ */
+#define VP9_I 0x80
+#define VP9_P 0x40
+#define VP9_B 0x08
+#define VP9_E 0x04
+#define VP9_V 0x02
+
+/** Scalability structure: a single layer, with its resolution */
+#define VP9_SS_SIZE 5
+
+/**
+ * @brief Read the uncompressed header of the first frame
+ *
+ * @return true if it is a keyframe, with its size in @p width and @p
+ *         height.
+ */
+static gboolean vp9_keyframe(const uint8_t *data, size_t len,
+                             guint *width, guint *height)
+{
+    PayloadBits b = { data, len, 0 };
+    guint profile;
+
+    if ( payload_bits(&b, 2) != 2 )         /* frame_marker */
+        return false;
+
+    profile = payload_bits(&b, 1);
+    profile |= payload_bits(&b, 1) << 1;
+    if ( profile == 3 )
+        payload_bits(&b, 1);
+
+    if ( payload_bits(&b, 1) )              /* show_existing_frame */
+        return false;
+    if ( payload_bits(&b, 1) )              /* frame_type: not KEY_FRAME */
+        return false;
+
+    payload_bits(&b, 2);                    /* show_frame, error_resilient_mode */
+    if ( payload_bits(&b, 24) != 0x498342 ) /* frame_sync_code */
+        return false;
+
+    /* color_config */
+    if ( profile >= 2 )
+        payload_bits(&b, 1);
+    if ( payload_bits(&b, 3) != 7 ) {       /* color_space, not CS_RGB */
+        payload_bits(&b, 1);
+        if ( profile == 1 || profile == 3 )
+            payload_bits(&b, 3);
+    } else if ( profile == 1 || profile == 3 )
+        payload_bits(&b, 1);
+
+    *width = payload_bits(&b, 16) + 1;
+    *height = payload_bits(&b, 16) + 1;
+
+    return !payload_bits_overrun(&b);
+}
+
+/**
+ * @brief Split a VP9 frame in RTP packets
+ *
+ * @param packets The queue to append the packets to
+ * @param data The frame, or superframe, which is sent whole
+ * @param len The size of @p data
+ * @param picture_id The picture ID of the frame (15 bits)
+ */
+void vp9_payload(GQueue *packets, const uint8_t *data, size_t len,
+                 uint16_t picture_id)
+{
+    uint8_t packet[DEFAULT_MTU];
+    guint width = 0, height = 0;
+    const gboolean keyframe = vp9_keyframe(data, len, &width, &height);
+    uint8_t flags = VP9_I | VP9_B | (keyframe ? VP9_V : VP9_P);
+
+    do {
+        struct MParserBuffer *buffer;
+        size_t header = 3, chunk;
+
+        packet[0] = flags;
+        packet[1] = 0x80 | ((picture_id >> 8) & 0x7f);
+        packet[2] = picture_id & 0xff;
+
+        if ( flags & VP9_V ) {
+            packet[3] = 0x10;   /* N_S = 0, Y, no G */
+            packet[4] = width >> 8;
+            packet[5] = width & 0xff;
+            packet[6] = height >> 8;
+            packet[7] = height & 0xff;
+            header += VP9_SS_SIZE;
+        }
+
+        chunk = MIN(len, sizeof(packet) - header);
+        if ( chunk == len )
+            packet[0] |= VP9_E;
+
+        memcpy(packet + header, data, chunk);
+
+        buffer = payload_buffer_new(packet, header + chunk);
+        buffer->marker = chunk == len;
+        buffer->keyframe = keyframe;
+        g_queue_push_tail(packets, buffer);
+
+        data += chunk;
+        len -= chunk;
+        flags &= ~(VP9_B | VP9_V);
+    } while ( len > 0 );
+}
+
+/* OBU header
+ *  +-+-+-+-+-+-+-+-+
+ *  |F| type  |X|S|-|
+ *  +-+-+-+-+-+-+-+-+
+ *  | T | S |  -    |   (if X)
+ *  +-+-+-+-+-+-+-+-+
+ */
+#define AV1_OBU_TYPE(h) (((h) >> 3) & 0x0f)
+#define AV1_OBU_EXTENSION 0x04
+#define AV1_OBU_HAS_SIZE 0x02
+
+#define AV1_OBU_SEQUENCE_HEADER 1
+#define AV1_OBU_TEMPORAL_DELIMITER 2
+#define AV1_OBU_FRAME_HEADER 3
+#define AV1_OBU_FRAME 6
+#define AV1_OBU_TILE_LIST 8
+#define AV1_OBU_PADDING 15
+
+/* aggregation header
+ *  +-+-+-+-+-+-+-+-+
+ *  |Z|Y| W |N|-|-|-|
+ *  +-+-+-+-+-+-+-+-+
+ */
+#define AV1_Z 0x80
+#define AV1_Y 0x40
+#define AV1_N 0x08
+
+/**
+ * @brief An OBU to send, with its size field removed
+ */
+typedef struct {
+    uint8_t header[2];
+    size_t header_len;
+    const uint8_t *payload;
+    size_t size;
+} Av1Obu;
+
+static size_t leb128_read(const uint8_t *p, const uint8_t *end, size_t *value)
+{
+    size_t i;
+
+    *value = 0;
+    for ( i = 0; i < 8 && p + i < end; i++ ) {
+        *value |= (size_t)(p[i] & 0x7f) << (7 * i);
+        if ( !(p[i] & 0x80) )
+            return i + 1;
+    }
+
+    return 0;
+}
+
+static size_t leb128_write(uint8_t *p, size_t value)
+{
+    size_t i = 0;
+
+    do {
+        p[i] = value & 0x7f;
+        value >>= 7;
+        if ( value )
+            p[i] |= 0x80;
+        i++;
+    } while ( value );
+
+    return i;
+}
+
+/**
+ * @brief Split a temporal unit in its OBUs
+ *
+ * Temporal delimiters, tile lists and padding are not sent.
+ *
+ * @return false if the data is malformed.
+ */
+static gboolean av1_split(const uint8_t *p, size_t len, GArray *obus)
+{
+    const uint8_t *end = p + len;
+
+    while ( p < end ) {
+        Av1Obu obu = { { p[0] & ~AV1_OBU_HAS_SIZE, 0 }, 1, NULL, 0 };
+        const guint type = AV1_OBU_TYPE(p[0]);
+        const gboolean has_size = p[0] & AV1_OBU_HAS_SIZE;
+
+        if ( p[0] & AV1_OBU_EXTENSION ) {
+            if ( end - p < 2 )
+                return false;
+            obu.header[1] = p[1];
+            obu.header_len = 2;
+        }
+        p += obu.header_len;
+
+        if ( has_size ) {
+            const size_t n = leb128_read(p, end, &obu.size);
+
+            if ( n == 0 || obu.size > (size_t)(end - p - n) )
+                return false;
+            p += n;
+        } else
+            obu.size = end - p;
+
+        obu.payload = p;
+        p += obu.size;
+
+        switch ( type ) {
+        case AV1_OBU_TEMPORAL_DELIMITER:
+        case AV1_OBU_TILE_LIST:
+        case AV1_OBU_PADDING:
+            break;
+        default:
+            g_array_append_val(obus, obu);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Tell whether a temporal unit starts with a keyframe
+ */
+static gboolean av1_keyframe(GArray *obus, gboolean *has_sequence_header)
+{
+    gboolean reduced = false;
+    guint i;
+
+    *has_sequence_header = false;
+
+    for ( i = 0; i < obus->len; i++ ) {
+        const Av1Obu *obu = &g_array_index(obus, Av1Obu, i);
+        PayloadBits b = { obu->payload, obu->size, 0 };
+
+        switch ( AV1_OBU_TYPE(obu->header[0]) ) {
+        case AV1_OBU_SEQUENCE_HEADER:
+            *has_sequence_header = true;
+            payload_bits(&b, 4);        /* seq_profile, still_picture */
+            reduced = payload_bits(&b, 1);
+            break;
+
+        case AV1_OBU_FRAME_HEADER:
+        case AV1_OBU_FRAME:
+            /* a reduced still picture header has no frame type */
+            if ( reduced )
+                return true;
+
+            /* show_existing_frame, frame_type */
+            return obu->size > 0 && payload_bits(&b, 1) == 0 &&
+                payload_bits(&b, 2) == 0;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief State of the packetization of a temporal unit
+ */
+typedef struct {
+    GQueue *packets;
+    gboolean keyframe;
+
+    uint8_t packet[DEFAULT_MTU];
+    size_t size;
+    guint count;            /*!< OBU elements in the packet */
+
+    gboolean layered;       /*!< an OBU with extension is in the packet */
+    uint8_t layer;          /*!< its extension byte */
+} Av1Packetizer;
+
+static void av1_packet_start(Av1Packetizer *pk, uint8_t aggregation)
+{
+    pk->packet[0] = aggregation;
+    pk->size = 1;
+    pk->count = 0;
+    pk->layered = false;
+}
+
+static void av1_packet_end(Av1Packetizer *pk, gboolean continued)
+{
+    struct MParserBuffer *buffer;
+
+    if ( continued )
+        pk->packet[0] |= AV1_Y;
+
+    buffer = payload_buffer_new(pk->packet, pk->size);
+    buffer->keyframe = pk->keyframe;
+    if ( pk->layered ) {
+        buffer->temporal_id = pk->layer >> 5;
+        buffer->spatial_id = (pk->layer >> 3) & 0x03;
+    }
+
+    g_queue_push_tail(pk->packets, buffer);
+}
+
+/**
+ * @brief Copy part of an OBU, header included
+ */
+static void av1_obu_copy(uint8_t *dest, const Av1Obu *obu,
+                         size_t offset, size_t len)
+{
+    while ( len && offset < obu->header_len ) {
+        *dest++ = obu->header[offset++];
+        len--;
+    }
+
+    memcpy(dest, obu->payload + offset - obu->header_len, len);
+}
+
+/**
+ * @brief Add an OBU to the packets, fragmenting it if needed
+ *
+ * Each OBU element is preceded by its length (W is always 0). An OBU
+ * that fits in a packet of its own is never fragmented.
+ */
+static void av1_obu(Av1Packetizer *pk, const Av1Obu *obu)
+{
+    const size_t len = obu->header_len + obu->size;
+    const gboolean extension = obu->header[0] & AV1_OBU_EXTENSION;
+    size_t offset = 0;
+
+    /* the OBUs of a packet must all be in the same layer */
+    if ( pk->count && extension && pk->layered &&
+         (pk->layer & 0xf8) != (obu->header[1] & 0xf8) ) {
+        av1_packet_end(pk, false);
+        av1_packet_start(pk, 0);
+    }
+
+    if ( pk->count && pk->size + 2 + len > DEFAULT_MTU &&
+         1 + 2 + len <= DEFAULT_MTU ) {
+        av1_packet_end(pk, false);
+        av1_packet_start(pk, 0);
+    }
+
+    while ( offset < len ) {
+        const size_t left = DEFAULT_MTU - pk->size;
+        size_t chunk;
+
+        if ( left < 2 ) {
+            av1_packet_end(pk, offset > 0);
+            av1_packet_start(pk, offset > 0 ? AV1_Z : 0);
+            continue;
+        }
+
+        chunk = MIN(len - offset, left - (left - 1 < 128 ? 1 : 2));
+
+        pk->size += leb128_write(pk->packet + pk->size, chunk);
+        av1_obu_copy(pk->packet + pk->size, obu, offset, chunk);
+        pk->size += chunk;
+        pk->count++;
+        offset += chunk;
+
+        if ( extension ) {
+            pk->layered = true;
+            pk->layer = obu->header[1];
+        }
+
+        if ( offset < len ) {
+            av1_packet_end(pk, true);
+            av1_packet_start(pk, AV1_Z);
+        }
+    }
+}
+
+/**
+ * @brief Split an AV1 temporal unit in RTP packets
+ *
+ * @param packets The queue to append the packets to
+ * @param data The temporal unit, in the low overhead bitstream format
+ * @param len The size of @p data
+ * @param config The configOBUs of the av1C box, sent before the
+ *               keyframes not carrying a sequence header; can be NULL
+ * @param config_len The size of @p config
+ *
+ * @return false if the data is malformed, with no packet appended.
+ */
+gboolean av1_payload(GQueue *packets, const uint8_t *data, size_t len,
+                     const uint8_t *config, size_t config_len)
+{
+    GArray *obus = g_array_new(false, false, sizeof(Av1Obu));
+    Av1Packetizer *pk = g_slice_new0(Av1Packetizer);
+    gboolean has_sequence_header, ret = false;
+    guint i;
+
+    if ( !av1_split(data, len, obus) || obus->len == 0 )
+        goto end;
+
+    pk->packets = packets;
+    pk->keyframe = av1_keyframe(obus, &has_sequence_header);
+
+    if ( pk->keyframe && !has_sequence_header && config_len ) {
+        GArray *prefix = g_array_new(false, false, sizeof(Av1Obu));
+
+        if ( av1_split(config, config_len, prefix) ) {
+            g_array_prepend_vals(obus, prefix->data, prefix->len);
+            has_sequence_header = prefix->len > 0;
+        }
+
+        g_array_free(prefix, true);
+    }
+
+    av1_packet_start(pk, pk->keyframe && has_sequence_header ? AV1_N : 0);
+
+    for ( i = 0; i < obus->len; i++ )
+        av1_obu(pk, &g_array_index(obus, Av1Obu, i));
+
+    av1_packet_end(pk, false);
+    ((struct MParserBuffer*)g_queue_peek_tail(packets))->marker = true;
+
+    ret = true;
+
+ end:
+    g_slice_free(Av1Packetizer, pk);
+    g_array_free(obus, true);
+    return ret;
+}
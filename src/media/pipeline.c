@@ -0,0 +1,265 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Packetization pipeline
+ *
+ * Demuxing and packetization of stored resources are split in two
+ * stages: the fill thread of the resource only demuxes, and hands the
+ * packets over to the tracks, whose parsers run on a shared pool of
+ * threads.
+ *
+ * Each track has its own bounded queue of packets, which is processed
+ * by a single thread at a time, so that the buffers of a track are
+ * produced in the same order as before; different tracks are
+ * packetized in parallel. When the queue of a track is full, the
+ * demuxer waits for the parser to catch up.
+ */
+
+#include <config.h>
+
+#include <math.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @brief Maximum amount of packets queued for parsing, per track
+ */
+#define PIPELINE_MAX_JOBS 32
+
+struct TrackPipeline {
+    GMutex *lock;
+    GCond *cond;
+
+    /** Packets waiting to be parsed (ParseJob) */
+    GQueue *jobs;
+
+    /** A thread of the pool is parsing the packets of the track */
+    gboolean running;
+
+    /** Last error returned by the parser */
+    int error;
+};
+
+static GThreadPool *pipeline_pool;
+static GStaticMutex pipeline_pool_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Parse a single packet with the timestamps it was demuxed with
+ */
+static int pipeline_job_run(Track *tr, ParseJob *job)
+{
+    ev_tstamp start = ev_time();
+    int ret;
+
+    if ( !isnan(job->dts) )
+        tr->dts = job->dts;
+    if ( !isnan(job->pts) )
+        tr->pts = job->pts;
+    if ( !isnan(job->duration) )
+        tr->frame_duration = job->duration;
+
+    /* the buffers of the parser can keep referencing the packet */
+    if ( job->free_packet )
+        tr->packet = packet_ref_new(job->packet, job->free_packet);
+
+    ret = tr->parse(tr, job->data, job->len);
+
+    pcache_record_cost(tr, ev_time() - start);
+
+    if ( tr->packet ) {
+        packet_unref(tr->packet);
+        tr->packet = NULL;
+    }
+
+    return ret;
+}
+
+static void pipeline_job_free(gpointer job_p,
+                              ATTR_UNUSED gpointer user_data)
+{
+    ParseJob *job = job_p;
+
+    if ( job->free_packet )
+        job->free_packet(job->packet);
+
+    g_slice_free(ParseJob, job);
+}
+
+/**
+ * @brief Threadpool callback parsing the queued packets of a track
+ *
+ * The thread keeps parsing until the queue of the track is empty, so
+ * that a single thread processes a track at any given time.
+ */
+static void pipeline_run_cb(gpointer track_p,
+                            ATTR_UNUSED gpointer user_data)
+{
+    Track *tr = track_p;
+    struct TrackPipeline *pl = tr->pipeline;
+    ParseJob *job;
+
+    g_mutex_lock(pl->lock);
+    while ( (job = g_queue_pop_head(pl->jobs)) != NULL ) {
+        int ret;
+
+        g_cond_broadcast(pl->cond);
+        g_mutex_unlock(pl->lock);
+
+        ret = pipeline_job_run(tr, job);
+        g_slice_free(ParseJob, job);
+
+        g_mutex_lock(pl->lock);
+        if ( ret != RESOURCE_OK )
+            pl->error = ret;
+    }
+
+    pl->running = false;
+    g_cond_broadcast(pl->cond);
+    g_mutex_unlock(pl->lock);
+}
+
+/**
+ * @brief Hand a demuxed packet over to the parser of a track
+ *
+ * @param tr The track the packet belongs to
+ * @param job The packet and its timestamps; the structure is copied
+ *            and the packet will be freed with @ref ParseJob::free_packet
+ *            once parsed or dropped.
+ *
+ * @return The last error returned by the parser of the track, if any,
+ *         or @ref RESOURCE_OK.
+ *
+ * This function blocks while the queue of the track is full.
+ */
+int pipeline_submit(Track *tr, const ParseJob *job)
+{
+    struct TrackPipeline *pl;
+    gboolean start;
+    int ret;
+
+    g_static_mutex_lock(&pipeline_pool_lock);
+    if ( pipeline_pool == NULL )
+        pipeline_pool = g_thread_pool_new(pipeline_run_cb, NULL,
+                                          feng_srv.packetizer_threads,
+                                          false, NULL);
+    g_static_mutex_unlock(&pipeline_pool_lock);
+
+    if ( (pl = tr->pipeline) == NULL ) {
+        pl = tr->pipeline = g_slice_new0(struct TrackPipeline);
+        pl->lock = g_mutex_new();
+        pl->cond = g_cond_new();
+        pl->jobs = g_queue_new();
+    }
+
+    g_mutex_lock(pl->lock);
+
+    while ( g_queue_get_length(pl->jobs) >= PIPELINE_MAX_JOBS )
+        g_cond_wait(pl->cond, pl->lock);
+
+    g_queue_push_tail(pl->jobs, g_slice_dup(ParseJob, job));
+
+    start = !pl->running;
+    pl->running = true;
+
+    ret = pl->error;
+    pl->error = RESOURCE_OK;
+
+    g_mutex_unlock(pl->lock);
+
+    if ( start )
+        g_thread_pool_push(pipeline_pool, tr, NULL);
+
+    return ret;
+}
+
+/**
+ * @brief Wait for all the packets handed over to a track to be parsed
+ *
+ * This has to be called before relying on the timestamps of the
+ * track, or before another producer writes to the same queue (as it
+ * happens at the cuts of an edit list). The audio frames still waiting
+ * to be aggregated are sent as well.
+ */
+void pipeline_drain(Track *tr)
+{
+    struct TrackPipeline *pl = tr->pipeline;
+
+    if ( pl == NULL )
+        return;
+
+    g_mutex_lock(pl->lock);
+    while ( pl->running )
+        g_cond_wait(pl->cond, pl->lock);
+    g_mutex_unlock(pl->lock);
+
+    aggr_flush(tr);
+}
+
+/**
+ * @brief Drop the packets waiting to be parsed for a track
+ *
+ * The packet being parsed, if any, is completed before returning, so
+ * that nothing is written to the track's queue afterwards; used when
+ * seeking. The audio frames waiting to be aggregated are dropped too.
+ */
+void pipeline_flush(Track *tr)
+{
+    struct TrackPipeline *pl = tr->pipeline;
+
+    if ( pl == NULL )
+        return;
+
+    g_mutex_lock(pl->lock);
+    g_queue_foreach(pl->jobs, pipeline_job_free, NULL);
+    g_queue_clear(pl->jobs);
+    pl->error = RESOURCE_OK;
+
+    while ( pl->running )
+        g_cond_wait(pl->cond, pl->lock);
+    g_mutex_unlock(pl->lock);
+
+    aggr_reset(tr);
+}
+
+/**
+ * @brief Free the pipeline of a track, dropping the pending packets
+ */
+void pipeline_free(Track *tr)
+{
+    struct TrackPipeline *pl = tr->pipeline;
+
+    if ( pl == NULL )
+        return;
+
+    pipeline_flush(tr);
+
+    g_queue_free(pl->jobs);
+    g_cond_free(pl->cond);
+    g_mutex_free(pl->lock);
+    g_slice_free(struct TrackPipeline, pl);
+
+    tr->pipeline = NULL;
+}
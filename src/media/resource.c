@@ -23,10 +23,12 @@
 #include <glib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 
 #include "media/media.h"
 #include "feng.h"
 #include "fnc_log.h"
+#include "network/rtp.h"
 
 /**
  * @defgroup resources Media backend resources handling
@@ -49,6 +51,8 @@ static Resource *sd2_open(const char *url)
 
 #ifdef HAVE_AVFORMAT
 extern Resource *avf_open(const char *url);
+extern Resource *edl_open(const char *url);
+extern Resource *mp2t_open(const char *url);
 #else
 static Resource *avf_open(const char *url);
 {
@@ -58,6 +62,27 @@ static Resource *avf_open(const char *url);
 
     return false;
 }
+
+static Resource *edl_open(const char *url)
+{
+    return avf_open(url);
+}
+
+static Resource *mp2t_open(const char *url)
+{
+    return avf_open(url);
+}
+#endif
+
+extern Resource *synth_open(const char *url);
+
+#if defined(LIVE_STREAMING) && defined(HAVE_AVFORMAT)
+extern Resource *channel_open(const char *url);
+#else
+static Resource *channel_open(const char *url)
+{
+    return NULL;
+}
 #endif
 
 /**
@@ -101,6 +126,9 @@ static inline void r_virtual_unlock()
  *
  * @param url The resolved URL of the resource within the virtual/ path.
  *
+ * Scheduled channels (see @ref channel_open) take precedence over the
+ * live sources of the same name.
+ *
  * @return Pointer to the Resource designed by @p url or NULL in case
  *         of error.
  *
@@ -122,7 +150,8 @@ static Resource *r_open_virtual(const char *url)
     if ( (r = g_hash_table_lookup(virtual_resources, url)) != NULL )
         g_atomic_int_inc(&r->live.count);
     else {
-        r = sd2_open(url);
+        if ( (r = channel_open(url)) == NULL )
+            r = sd2_open(url);
         g_hash_table_insert(virtual_resources, g_strdup(url), r);
     }
 
@@ -153,10 +182,49 @@ Resource *r_open(const char *url)
 {
     if ( g_str_has_prefix(url, "/virtual/") )
         return r_open_virtual(url + strlen("/virtual/"));
+    else if ( g_str_has_prefix(url, "/synthetic/") )
+        return synth_open(url + strlen("/synthetic/"));
+    else if ( g_str_has_suffix(url, ".ds") )
+        return edl_open(url);
+    else if ( g_str_has_suffix(url, ".mp2t") )
+        return mp2t_open(url);
     else
         return avf_open(url);
 }
 
+/**
+ * @brief Retrieve or create the resource for a URL requested by a
+ *        client
+ *
+ * @param url The resolved URL of the resource within the vhost.
+ *
+ * Same as @ref r_open, but the request counts toward the popularity
+ * of the file being streamed (see @ref rio_count_open); the opens
+ * made by the server by itself go through @ref r_open instead.
+ */
+Resource *r_open_client(const char *url)
+{
+#ifdef HAVE_AVFORMAT
+    if ( ! g_str_has_prefix(url, "/virtual/") &&
+         ! g_str_has_prefix(url, "/synthetic/") &&
+         ! g_str_has_suffix(url, ".ds") ) {
+        /* the .mp2t resources stream the file without the suffix */
+        const size_t len = g_str_has_suffix(url, ".mp2t") ?
+            strlen(url) - strlen(".mp2t") : strlen(url);
+        gchar *file = g_strndup(url, len);
+        gchar *mrl = g_strjoin("/", feng_default_vhost->document_root,
+                               file, NULL);
+
+        rio_count_open(mrl);
+
+        g_free(mrl);
+        g_free(file);
+    }
+#endif
+
+    return r_open(url);
+}
+
 /**
  * @brief Comparison function to compare a Track to a name
  *
@@ -170,6 +238,10 @@ Resource *r_open(const char *url)
  */
 static gint r_find_track_cmp_name(gconstpointer a, gconstpointer b)
 {
+    /* muxed tracks cannot be set up on their own */
+    if ( ((Track *)a)->muxed )
+        return -1;
+
     return strcmp( ((Track *)a)->name, (const char *)b);
 }
 
@@ -217,30 +289,425 @@ static void r_track_producer_reset_queue(gpointer element,
     track_reset_queue(t);
 }
 
+/**
+ * @brief Drop the data queued for a track nobody set up
+ *
+ * @param element The Track element from the list
+ * @param user_data Unused, for compatibility with g_list_foreach().
+ *
+ * The tracks of a warmed up resource are all filled, but only the
+ * ones with consumers free their buffers as they are sent.
+ */
+static void r_track_drop_unwanted(gpointer element,
+                                  ATTR_UNUSED gpointer user_data) {
+    Track *t = (Track*)element;
+
+    if ( !track_wanted(t) )
+        track_reset_queue(t);
+}
+
+/**
+ * @brief Reset the clipped flag for a given track
+ *
+ * @param element The Track element from the list
+ * @param user_data Unused, for compatibility with g_list_foreach().
+ */
+static void r_track_unclip(gpointer element,
+                           ATTR_UNUSED gpointer user_data) {
+    Track *t = (Track*)element;
+
+    t->clipped = false;
+}
+
+/**
+ * @brief Set the window of a stored resource to play
+ *
+ * @param resource The Resource to set the window of
+ * @param start Time in seconds from the start of the resource where
+ *              the window starts, as for @ref r_seek
+ * @param end Time in seconds from the start of the resource where the
+ *            window ends, HUGE_VAL for no limit
+ * @param offset Time in seconds to add to the timestamps of the
+ *               packets played, which are stream times: they start
+ *               from the start time of the file rather than from 0
+ *
+ * @note The caller is responsible for holding @ref Resource::lock if
+ *       the resource is being read from.
+ */
+void r_set_clip(Resource *resource, double start, double end, double offset)
+{
+    g_assert(resource->source != LIVE_SOURCE);
+
+    resource->stored.clip_start = start;
+    resource->stored.clip_end = end;
+    resource->stored.timeline_offset = offset;
+
+    g_list_foreach(resource->tracks, r_track_unclip, NULL);
+}
+
+static void r_range_free(gpointer element,
+                         ATTR_UNUSED gpointer user_data)
+{
+    g_slice_free(ResourceRange, element);
+}
+
+/**
+ * @brief Drop the queued ranges and restart the timeline
+ *
+ * @param resource The Resource to reset the ranges of
+ * @param time The time within the stream the resource was seeked to
+ *
+ * @note The caller has to hold @ref Resource::lock.
+ */
+static void r_ranges_reset(Resource *resource, double time)
+{
+    const ResourceRange first = { time, HUGE_VAL, 0 };
+
+    if ( resource->stored.ranges == NULL ) {
+        resource->stored.ranges = g_queue_new();
+        resource->stored.played = g_array_new(false, false,
+                                              sizeof(ResourceRange));
+    }
+
+    g_queue_foreach(resource->stored.ranges, r_range_free, NULL);
+    g_queue_clear(resource->stored.ranges);
+
+    g_array_set_size(resource->stored.played, 0);
+    g_array_append_val(resource->stored.played, first);
+
+    resource->stored.ranges_ended = false;
+
+    r_set_clip(resource, time, HUGE_VAL, 0);
+}
+
+/**
+ * @brief Timeline time where the data read so far ends
+ *
+ * @note The caller has to hold @ref Resource::lock.
+ */
+static double r_timeline_end(Resource *resource)
+{
+    double end = 0;
+    GList *item;
+
+    if ( resource->stored.clip_end != HUGE_VAL )
+        return resource->stored.clip_end + resource->stored.timeline_offset;
+
+    for ( item = resource->tracks; item; item = item->next ) {
+        Track *tr = item->data;
+
+        end = MAX(end, tr->dts + tr->frame_duration);
+    }
+
+    return end;
+}
+
+/**
+ * @brief Start playing the next queued range
+ *
+ * @return false if there is no range queued, or the resource could not
+ *         be seeked to it; in that case @ref Resource::ranges_ended is
+ *         set.
+ *
+ * The range is placed on the timeline right where the previous one
+ * ended, so that the two are played back to back; its beginning is
+ * moved to the keyframe the resource landed on.
+ *
+ * @note The caller has to hold @ref Resource::lock.
+ */
+static gboolean r_next_range(Resource *resource)
+{
+    ResourceRange *range;
+    double timeline;
+
+    if ( resource->stored.ranges == NULL ||
+         (range = g_queue_pop_head(resource->stored.ranges)) == NULL ) {
+        g_atomic_int_set(&resource->stored.ranges_ended, true);
+        return false;
+    }
+
+    timeline = r_timeline_end(resource);
+
+    if ( resource->seek(resource, &range->begin) != 0 ) {
+        fnc_log(FNC_LOG_ERR, "%s: unable to seek to queued range %f",
+                resource->mrl, range->begin);
+        g_slice_free(ResourceRange, range);
+        g_atomic_int_set(&resource->stored.ranges_ended, true);
+        return false;
+    }
+
+    range->offset = timeline - range->begin;
+    r_set_clip(resource, range->begin, range->end, range->offset);
+
+    g_array_append_val(resource->stored.played, *range);
+    g_slice_free(ResourceRange, range);
+
+    g_atomic_int_set(&resource->stored.ranges_ended, false);
+
+    fnc_log(FNC_LOG_DEBUG, "%s: playing queued range %f at %f",
+            resource->mrl, resource->stored.clip_start, timeline);
+
+    return true;
+}
+
+/**
+ * @brief Queue a range to play once the current one ends
+ *
+ * @param resource The Resource to queue the range for
+ * @param begin Time in seconds within the stream to start at
+ * @param end Time in seconds within the stream to stop at, HUGE_VAL
+ *            for no limit
+ *
+ * This implements the queued PLAY requests of RFC 2326 Section 10.5:
+ * the fill thread seeks to the next range as soon as it reads the end
+ * of the current one, so that the seek happens while the buffered
+ * data of the current range is still being sent and the two ranges
+ * are played without gaps.
+ *
+ * @note This function will lock the @ref Resource::lock mutex.
+ */
+void r_queue_range(Resource *resource, double begin, double end)
+{
+    ResourceRange *range;
+
+    if ( resource->source == LIVE_SOURCE || resource->seek == NULL )
+        return;
+
+    range = g_slice_new0(ResourceRange);
+    range->begin = begin;
+    range->end = end;
+
+    g_mutex_lock(resource->lock);
+
+    if ( resource->stored.ranges == NULL )
+        r_ranges_reset(resource, 0);
+
+    g_queue_push_tail(resource->stored.ranges, range);
+
+    /* reading stopped at the end of the last range, restart it */
+    if ( resource->stored.ranges_ended )
+        r_next_range(resource);
+
+    g_mutex_unlock(resource->lock);
+}
+
+/**
+ * @brief Find the played range containing a time of the timeline
+ *
+ * @param resource The Resource to look into
+ * @param time Pointer to a time of the timeline; it is replaced with
+ *             the corresponding time within the stream.
+ *
+ * @return The number of ranges played before the one containing
+ *         @p time, since the last seek.
+ *
+ * @note This function will lock the @ref Resource::lock mutex.
+ */
+guint r_range_at(Resource *resource, double *time)
+{
+    GArray *played = resource->stored.played;
+    guint i = 0;
+
+    if ( resource->source == LIVE_SOURCE || played == NULL )
+        return 0;
+
+    g_mutex_lock(resource->lock);
+
+    for ( i = played->len; i > 1; i-- ) {
+        ResourceRange *range = &g_array_index(played, ResourceRange, i-1);
+
+        if ( range->begin + range->offset <= *time )
+            break;
+    }
+
+    if ( i > 0 )
+        *time -= g_array_index(played, ResourceRange, i-1).offset;
+
+    g_mutex_unlock(resource->lock);
+
+    return i > 0 ? i-1 : 0;
+}
+
 /**
  * @brief Seek a resource to a given time in stream
  *
  * @param resource The Resource to seek
- * @param time The time in seconds within the stream to seek to
+ * @param time Pointer to the time in seconds within the stream to
+ *             seek to; it is replaced with the time the resource was
+ *             actually seeked to (usually the closest keyframe).
  *
  * @return The value returned by @ref Resource::seek
  *
+ * The time spent seeking is accounted in the @ref MEDIA_STAT_SEEK_USEC
+ * and @ref MEDIA_STAT_SEEK_MAX_USEC counters.
+ *
  * @note This function will lock the @ref Resource::lock mutex.
  */
-int r_seek(Resource *resource, double time) {
+int r_seek(Resource *resource, double *time) {
     int res;
+    ev_tstamp start = ev_time();
+    guint64 elapsed;
+
+    r_prefetch_stop(resource);
 
     g_mutex_lock(resource->lock);
 
-    res = resource->seek(resource, time);
+    if ( resource->stored.warm &&
+         *time == resource->stored.warm_requested ) {
+        /* warmed up already at this very position */
+        *time = resource->stored.warm_time;
+        res = 0;
+
+        g_list_foreach(resource->tracks, r_track_drop_unwanted, NULL);
+        media_stat_add(MEDIA_STAT_PREFETCH_USED, 1);
+    } else {
+        res = resource->seek(resource, time);
+
+        g_list_foreach(resource->tracks, r_track_producer_reset_queue, NULL);
+    }
 
-    g_list_foreach(resource->tracks, r_track_producer_reset_queue, NULL);
+    resource->stored.warm = false;
+    r_ranges_reset(resource, *time);
 
     g_mutex_unlock(resource->lock);
 
+    elapsed = (ev_time() - start) * 1000000;
+    media_stat_add(MEDIA_STAT_SEEKS, 1);
+    media_stat_add(MEDIA_STAT_SEEK_USEC, elapsed);
+    media_stat_max(MEDIA_STAT_SEEK_MAX_USEC, elapsed);
+
     return res;
 }
 
+/**
+ * @brief Maximum factor the buffering watermarks can grow by
+ */
+#define BUFFER_MAX_GROWTH 4
+
+/**
+ * @brief Seconds without underruns before the watermarks are moved
+ *        back towards the configured values
+ */
+#define BUFFER_DECAY_INTERVAL 30.0
+
+/**
+ * @brief Tells whether the resource will not produce more buffers
+ *
+ * @param resource The resource to check
+ *
+ * This is the case at the end of the resource, and for stored
+ * resources once the last range queued has been read entirely, until
+ * another range is queued (see @ref r_queue_range): the consumers
+ * end the delivery once their queue is empty.
+ */
+gboolean r_ended(Resource *resource)
+{
+    if ( g_atomic_int_get(&resource->eor) )
+        return true;
+
+    return resource->source != LIVE_SOURCE &&
+        g_atomic_int_get(&resource->stored.ranges_ended);
+}
+
+/**
+ * @brief Report that a consumer found its queue empty
+ *
+ * @param resource The resource the consumer is playing
+ *
+ * This is called by the RTP sessions, and only counts the underrun;
+ * the watermarks are tuned by the fill thread, see @ref r_buffer_tune.
+ */
+void r_buffer_underrun(Resource *resource)
+{
+    /* nothing more is coming, the queue is not going to fill up */
+    if ( resource->source == LIVE_SOURCE || r_ended(resource) )
+        return;
+
+    g_atomic_int_inc(&resource->stored.underruns);
+    media_stat_add(MEDIA_STAT_BUFFER_UNDERRUNS, 1);
+}
+
+/**
+ * @brief Tune the buffering watermarks of a resource
+ *
+ * The high watermark grows by half after underruns, up to @ref
+ * BUFFER_MAX_GROWTH times the configured value, and shrinks by a
+ * quarter, down to the configured low watermark, while the queues of
+ * all the tracks exceed the buffer-memory option. Otherwise it slowly
+ * returns to the configured value. The low watermark keeps the
+ * configured ratio to the high one.
+ *
+ * @note This is only called by the fill thread, which is the only
+ *       writer of the watermarks.
+ */
+static void r_buffer_tune(Resource *resource)
+{
+    const gint cfg_low = feng_srv.buffer_low_ms;
+    const gint cfg_high = feng_srv.buffer_high_ms;
+    const gint underruns = g_atomic_int_get(&resource->stored.underruns);
+    const gint old = resource->stored.buffer_high;
+    const ev_tstamp now = ev_time();
+    gint high = old;
+
+    if ( underruns != resource->stored.underruns_seen ) {
+        resource->stored.underruns_seen = underruns;
+        high = MIN(high * 3 / 2, cfg_high * BUFFER_MAX_GROWTH);
+    } else if ( media_stat_get(MEDIA_STAT_BUFFER_BYTES) >
+                (guint64)feng_srv.buffer_memory * 1024 * 1024 ) {
+        high = MAX(high * 3 / 4, cfg_low);
+    } else if ( now - resource->stored.buffer_tuned >= BUFFER_DECAY_INTERVAL ) {
+        if ( high > cfg_high )
+            high = MAX(high * 9 / 10, cfg_high);
+        else if ( high < cfg_high )
+            high = MIN(high * 10 / 9 + 1, cfg_high);
+    }
+
+    if ( high == old )
+        return;
+
+    media_stat_add(high > old ?
+                   MEDIA_STAT_BUFFER_GROWS : MEDIA_STAT_BUFFER_SHRINKS, 1);
+
+    fnc_log(FNC_LOG_DEBUG, "[%s] buffering watermark %dms -> %dms",
+            resource->mrl, old, high);
+
+    resource->stored.buffer_high = high;
+    g_atomic_int_set(&resource->stored.buffer_low,
+                     (gint64)high * cfg_low / cfg_high);
+    resource->stored.buffer_tuned = now;
+}
+
+/**
+ * @brief Tells whether a consumer has enough data queued
+ *
+ * The queue is full once it holds @ref Resource::stored::buffer_high of
+ * media or the buffer-max-bytes option's worth of data; when the
+ * queues of all the tracks exceed the buffer-memory option, the low
+ * watermark is enough.
+ *
+ * The deprecated buffered-frames option, if set, is the minimum
+ * amount of packets to queue.
+ */
+static gboolean r_buffer_full(Resource *resource,
+                              struct RTP_session *consumer)
+{
+    const double buffered = bq_consumer_buffered(consumer) * 1000;
+
+    if ( feng_srv.buffered_frames &&
+         bq_consumer_unseen(consumer) < feng_srv.buffered_frames )
+        return false;
+
+    if ( buffered >= resource->stored.buffer_high )
+        return true;
+
+    if ( consumer->track->queue_bytes >= feng_srv.buffer_max_bytes )
+        return true;
+
+    return buffered >= resource->stored.buffer_low &&
+        media_stat_get(MEDIA_STAT_BUFFER_BYTES) >
+        (guint64)feng_srv.buffer_memory * 1024 * 1024;
+}
+
 /**
  * @brief Callback for the queue filling for the resource
  *
@@ -264,11 +731,12 @@ static void r_read_cb(gpointer consumer_p, gpointer resource_p)
 {
     Resource *resource = (Resource*)resource_p;
     struct RTP_session *consumer = (struct RTP_session*)consumer_p;
-    const gulong buffered_frames = feng_srv.buffered_frames;
 
     g_assert(resource->source != LIVE_SOURCE);
     g_assert(consumer != GINT_TO_POINTER(-1));
 
+    r_buffer_tune(resource);
+
     do {
         /* setting this to NULL with an atomic, non-locking operation
            is our "stop" signal. */
@@ -278,7 +746,11 @@ static void r_read_cb(gpointer consumer_p, gpointer resource_p)
         /* Only check for enough buffered frames if we're not doing
            live; otherwise keep on filling; we also assume that
            consumer will be NULL in that case. */
-        if ( bq_consumer_unseen(consumer) >= buffered_frames )
+        if ( r_buffer_full(resource, consumer) )
+            return;
+
+        /* Wait for a new range to be queued */
+        if ( g_atomic_int_get(&resource->stored.ranges_ended) )
             return;
 
         //        fprintf(stderr, "r_read_cb(%p)\n", resource);
@@ -287,7 +759,13 @@ static void r_read_cb(gpointer consumer_p, gpointer resource_p)
         switch( resource->read_packet(resource) ) {
         case RESOURCE_OK:
             break;
+        case RESOURCE_CLIP_END:
+            r_next_range(resource);
+            break;
         case RESOURCE_EOF:
+            if ( r_next_range(resource) )
+                break;
+
             fnc_log(FNC_LOG_INFO,
                     "r_read_unlocked: %s read_packet() end of file.",
                     resource->mrl);
@@ -336,11 +814,21 @@ void r_close(Resource *resource)
         return;
     }
 
+    r_prefetch_stop(resource);
+
     if ( (pool = resource->stored.fill_pool) ) {
         g_atomic_pointer_set(&resource->stored.fill_pool, NULL);
         g_thread_pool_free(pool, true, true);
     }
 
+    if ( resource->stored.prefetch_cond )
+        g_cond_free(resource->stored.prefetch_cond);
+
+    if ( resource->stored.underruns )
+        fnc_log(FNC_LOG_INFO, "[%s] %d buffer underruns, watermarks %d-%dms",
+                resource->mrl, resource->stored.underruns,
+                resource->stored.buffer_low, resource->stored.buffer_high);
+
     if (resource->lock)
         g_mutex_free(resource->lock);
 
@@ -349,6 +837,12 @@ void r_close(Resource *resource)
     if ( resource->uninit != NULL )
         resource->uninit(resource);
 
+    if ( resource->stored.ranges ) {
+        g_queue_foreach(resource->stored.ranges, r_range_free, NULL);
+        g_queue_free(resource->stored.ranges);
+        g_array_free(resource->stored.played, true);
+    }
+
     if (resource->tracks) {
         g_list_foreach(resource->tracks, free_track, NULL);
         g_list_free(resource->tracks);
@@ -413,6 +907,14 @@ void r_resume(Resource *resource)
          g_atomic_pointer_get(&resource->read_packet) == NULL )
         return;
 
+    r_prefetch_stop(resource);
+
+    if ( resource->stored.buffer_high == 0 ) {
+        resource->stored.buffer_low = feng_srv.buffer_low_ms;
+        resource->stored.buffer_high = feng_srv.buffer_high_ms;
+        resource->stored.buffer_tuned = ev_time();
+    }
+
     pool = g_thread_pool_new(r_read_cb, resource,
                              1, true, NULL);
 
@@ -427,7 +929,8 @@ void r_resume(Resource *resource)
  *
  * This function will create a new thread (or push a new one to be
  * executed afterwars) so that the consumer gets enough frames to send
- * the client.
+ * the client; nothing is done while the consumer has more than the
+ * low buffering watermark queued.
  *
  * @note This function is no-op for live streams as they take care of
  *       the filling themselves.
@@ -440,6 +943,11 @@ void r_fill(Resource *resource, struct RTP_session *consumer)
     if ( resource->source == LIVE_SOURCE )
         return;
 
+    /* still above the low watermark */
+    if ( bq_consumer_buffered(consumer) * 1000 >=
+         g_atomic_int_get(&resource->stored.buffer_low) )
+        return;
+
     g_mutex_lock(resource->lock);
 
     if ( resource->stored.fill_pool == NULL )
@@ -452,6 +960,234 @@ void r_fill(Resource *resource, struct RTP_session *consumer)
     g_mutex_unlock(resource->lock);
 }
 
+enum {
+    PREFETCH_IDLE,
+    PREFETCH_RUNNING,
+    PREFETCH_CANCEL
+};
+
+/**
+ * @brief Warm-up pushed to the pool of @ref r_prefetch
+ *
+ * @note Protected by @ref prefetch_lock
+ */
+typedef struct PrefetchJob {
+    /** The resource to warm up, NULL if cancelled before starting */
+    Resource *resource;
+
+    /** The job was picked up by a thread of the pool */
+    gboolean started;
+
+    /** The time the resource is expected to be played from */
+    double time;
+} PrefetchJob;
+
+static GStaticMutex prefetch_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Warm-ups started and not yet stopped, at most as many as the
+ *        prefetch-resources option
+ */
+static gint prefetch_count;
+
+/**
+ * @brief Tells whether all the tracks of a warming up resource are
+ *        filled
+ *
+ * Each track is filled up to the low buffering watermark, which is
+ * what the session needs to start sending right away, or up to the
+ * buffer-max-bytes option.
+ */
+static gboolean r_prefetch_done(Resource *resource)
+{
+    GList *item;
+
+    for ( item = resource->tracks; item; item = item->next ) {
+        Track *tr = item->data;
+
+        if ( tr->muxed )
+            continue;
+
+        if ( track_buffered(tr) * 1000 < feng_srv.buffer_low_ms &&
+             tr->queue_bytes < feng_srv.buffer_max_bytes )
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Threadpool callback warming up a resource
+ *
+ * The resource is seeked here rather than by @ref r_prefetch, so that
+ * the client describing it is not kept waiting.
+ *
+ * @note The lock is released after each packet, so that @ref
+ *       r_prefetch_stop can interrupt the warm-up.
+ */
+static void r_prefetch_cb(gpointer job_p,
+                          ATTR_UNUSED gpointer user_data)
+{
+    PrefetchJob *job = job_p;
+    Resource *resource;
+    double time = job->time;
+
+    g_static_mutex_lock(&prefetch_lock);
+    if ( (resource = job->resource) != NULL )
+        job->started = true;
+    g_static_mutex_unlock(&prefetch_lock);
+
+    /* cancelled while queued, the slot was released already */
+    if ( resource == NULL ) {
+        g_slice_free(PrefetchJob, job);
+        return;
+    }
+
+    g_mutex_lock(resource->lock);
+
+    if ( resource->seek != NULL &&
+         resource->stored.prefetch == PREFETCH_RUNNING ) {
+        if ( resource->seek(resource, &time) == 0 ) {
+            g_list_foreach(resource->tracks, r_track_producer_reset_queue, NULL);
+            r_ranges_reset(resource, time);
+
+            resource->stored.warm = true;
+            resource->stored.warm_time = time;
+        } else
+            resource->stored.prefetch = PREFETCH_CANCEL;
+    }
+
+    while ( resource->stored.prefetch == PREFETCH_RUNNING &&
+            !r_prefetch_done(resource) ) {
+        if ( resource->read_packet(resource) != RESOURCE_OK )
+            break;
+
+        g_mutex_unlock(resource->lock);
+        g_mutex_lock(resource->lock);
+    }
+
+    g_static_mutex_lock(&prefetch_lock);
+    resource->stored.prefetch_job = NULL;
+    g_static_mutex_unlock(&prefetch_lock);
+
+    g_slice_free(PrefetchJob, job);
+    g_atomic_int_add(&prefetch_count, -1);
+
+    /* the resource can be closed as soon as this is seen */
+    resource->stored.prefetch = PREFETCH_IDLE;
+    g_cond_broadcast(resource->stored.prefetch_cond);
+
+    g_mutex_unlock(resource->lock);
+}
+
+/**
+ * @brief Warm up a stored resource before it is played
+ *
+ * @param resource The resource to warm up
+ * @param time The time the resource is expected to be played from
+ *
+ * @retval true The resource is being warmed up
+ * @retval false The resource cannot be warmed up, or too many are
+ *               being warmed up already
+ *
+ * The resource is seeked to @p time, and its tracks are filled in
+ * background by a pool of threads shared by all the resources, as
+ * large as the prefetch-resources option; no more warm-ups than that
+ * are started until the running ones stop, so that none waits in the
+ * queue of the pool. If the resource is then seeked to the same time
+ * by @ref r_seek, the data already read is kept.
+ *
+ * @see r_prefetch_stop
+ */
+gboolean r_prefetch(Resource *resource, double time)
+{
+    static GThreadPool *pool;
+    PrefetchJob *job;
+
+    if ( resource->source == LIVE_SOURCE ||
+         resource->read_packet == NULL ||
+         resource->stored.fill_pool != NULL ||
+         (resource->seek == NULL && time > 0) )
+        return false;
+
+    if ( g_atomic_int_exchange_and_add(&prefetch_count, 1) >=
+         (gint)feng_srv.prefetch_resources ) {
+        g_atomic_int_add(&prefetch_count, -1);
+        return false;
+    }
+
+    if ( resource->stored.prefetch_cond == NULL )
+        resource->stored.prefetch_cond = g_cond_new();
+
+    g_mutex_lock(resource->lock);
+    resource->stored.warm = false;
+    resource->stored.warm_requested = time;
+    resource->stored.prefetch = PREFETCH_RUNNING;
+    g_mutex_unlock(resource->lock);
+
+    job = g_slice_new0(PrefetchJob);
+    job->resource = resource;
+    job->time = time;
+
+    g_static_mutex_lock(&prefetch_lock);
+    if ( pool == NULL )
+        pool = g_thread_pool_new(r_prefetch_cb, NULL,
+                                 feng_srv.prefetch_resources,
+                                 false, NULL);
+
+    resource->stored.prefetch_job = job;
+    g_thread_pool_push(pool, job, NULL);
+    g_static_mutex_unlock(&prefetch_lock);
+
+    media_stat_add(MEDIA_STAT_PREFETCH_STARTED, 1);
+
+    return true;
+}
+
+/**
+ * @brief Stop warming up a resource
+ *
+ * @param resource The resource to stop the warm-up of
+ *
+ * A warm-up still queued is cancelled right away; otherwise this waits
+ * for the packet being read, if any. The data read so far is left in
+ * the tracks.
+ *
+ * @note This function will lock the @ref Resource::lock mutex, if the
+ *       resource is being warmed up.
+ */
+void r_prefetch_stop(Resource *resource)
+{
+    PrefetchJob *job;
+
+    if ( resource->source == LIVE_SOURCE ||
+         g_atomic_int_get(&resource->stored.prefetch) == PREFETCH_IDLE )
+        return;
+
+    g_static_mutex_lock(&prefetch_lock);
+    if ( (job = resource->stored.prefetch_job) != NULL && !job->started ) {
+        /* the job frees itself once it is picked up */
+        job->resource = NULL;
+        resource->stored.prefetch_job = NULL;
+        g_atomic_int_add(&prefetch_count, -1);
+
+        g_atomic_int_set(&resource->stored.prefetch, PREFETCH_IDLE);
+        g_static_mutex_unlock(&prefetch_lock);
+        return;
+    }
+    g_static_mutex_unlock(&prefetch_lock);
+
+    g_mutex_lock(resource->lock);
+
+    if ( resource->stored.prefetch == PREFETCH_RUNNING )
+        resource->stored.prefetch = PREFETCH_CANCEL;
+
+    while ( resource->stored.prefetch != PREFETCH_IDLE )
+        g_cond_wait(resource->stored.prefetch_cond, resource->lock);
+
+    g_mutex_unlock(resource->lock);
+}
+
 /**
  * @}
  */
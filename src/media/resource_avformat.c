@@ -25,6 +25,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
 
 #include "feng.h"
 #include "fnc_log.h"
@@ -33,7 +34,16 @@
 
 #include <libavformat/avformat.h>
 
-static int avf_seek(Resource * r, double time_sec);
+/*
+ * Codecs whose ID is more recent than the oldest libavcodec supported
+ * (see configure.ac); they are not streamed with older versions.
+ */
+#define AVF_HAVE_OPUS (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(54, 86, 100))
+#define AVF_HAVE_HEVC (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 39, 100))
+#define AVF_HAVE_VP9  (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 39, 100))
+#define AVF_HAVE_AV1  (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 107, 100))
+
+static int avf_seek(Resource * r, double *time_sec);
 static void avf_uninit(gpointer rgen);
 static int avf_read_packet(Resource * r);
 
@@ -71,6 +81,97 @@ void ffmpeg_init(void)
  * safe, and needs lock-protection;
  */
 
+/**
+ * @brief Size of the buffer of the custom I/O context
+ *
+ * This only sets the size of the reads that libavformat requests to
+ * @ref rio_read; the actual I/O is sized by the resource I/O layer.
+ */
+#define AVF_IO_BUFFER_SIZE 32768
+
+static int avf_io_read(void *opaque, uint8_t *buf, int size)
+{
+    int len = rio_read(opaque, buf, size);
+
+    return len == 0 ? AVERROR_EOF : len;
+}
+
+static int64_t avf_io_seek(void *opaque, int64_t offset, int whence)
+{
+    ResourceIO *rio = opaque;
+
+    if ( whence == AVSEEK_SIZE )
+        return rio->size;
+
+    return rio_seek(rio, offset, whence & ~AVSEEK_FORCE);
+}
+
+/**
+ * @brief Open a stored resource with libavformat through the resource
+ *        I/O layer
+ *
+ * @param avfc Pointer to the context to open; if it points to NULL a
+ *             new context is allocated.
+ * @param mrl The full path of the resource to open
+ *
+ * @return 0 on success, a negative value on failure, in which case
+ *         @p avfc is freed and set to NULL as avformat_open_input()
+ *         would.
+ *
+ * @see avf_close_input
+ */
+int avf_open_input(AVFormatContext **avfc, const char *mrl)
+{
+    ResourceIO *rio;
+    AVIOContext *pb;
+
+    if ( (rio = rio_open(mrl)) == NULL ) {
+        if ( *avfc )
+            avformat_free_context(*avfc);
+        *avfc = NULL;
+        return -1;
+    }
+
+    pb = avio_alloc_context(av_malloc(AVF_IO_BUFFER_SIZE), AVF_IO_BUFFER_SIZE,
+                            0, rio, avf_io_read, NULL, avf_io_seek);
+
+    if ( *avfc == NULL )
+        *avfc = avformat_alloc_context();
+    (*avfc)->pb = pb;
+
+    /* avformat_open_input() frees the context on failure, but a
+       custom I/O context is left to us. */
+    if ( avformat_open_input(avfc, mrl, NULL, NULL) != 0 ) {
+        av_free(pb->buffer);
+        av_free(pb);
+        rio_close(rio);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Close a resource opened with @ref avf_open_input
+ */
+void avf_close_input(AVFormatContext **avfc)
+{
+    AVIOContext *pb;
+
+    if ( *avfc == NULL )
+        return;
+
+    pb = (*avfc)->pb;
+
+    avformat_close_input(avfc);
+
+    if ( pb ) {
+        rio_close(pb->opaque);
+        av_free(pb->buffer);
+        av_free(pb);
+    }
+}
+
 Resource *avf_open(const char *url)
 {
     Resource *r = NULL;
@@ -79,7 +180,7 @@ Resource *avf_open(const char *url)
     unsigned int j;
     gchar *mrl;
 
-    struct stat filestat;
+    time_t mtime;
 
     fnc_log(FNC_LOG_DEBUG,
             "opening resource '%s' through libavformat",
@@ -90,20 +191,8 @@ Resource *avf_open(const char *url)
                      url,
                      NULL);
 
-    if ( access(mrl, R_OK) != 0 ) {
-        fnc_perror("access");
+    if ( !rio_stat(mrl, &mtime) )
         goto err_alloc;
-    }
-
-    if (stat(mrl, &filestat) < 0 ) {
-        fnc_perror("stat");
-        goto err_alloc;
-    }
-
-    if ( ! S_ISREG(filestat.st_mode) ) {
-        fnc_log(FNC_LOG_ERR, "%s: not a file", mrl);
-        goto err_alloc;
-    }
 
     r = g_slice_new0(Resource);
 
@@ -111,7 +200,7 @@ Resource *avf_open(const char *url)
 
     r->stored.avfc->flags |= AVFMT_FLAG_GENPTS;
 
-    i =  avformat_open_input(&r->stored.avfc, mrl, NULL, NULL);
+    i = avf_open_input(&r->stored.avfc, mrl);
 
     if ( i != 0 ) {
         fnc_log(FNC_LOG_DEBUG, "[avf] Cannot open %s", mrl);
@@ -126,6 +215,8 @@ Resource *avf_open(const char *url)
         goto err_alloc;
     }
 
+    rio_set_bitrate(r->stored.avfc->pb->opaque, r->stored.avfc->bit_rate);
+
     r->stored.tracks = g_new0(Track*, r->stored.avfc->nb_streams);
 
     for(j=0; j<r->stored.avfc->nb_streams; j++) {
@@ -160,6 +251,18 @@ Resource *avf_open(const char *url)
             track->parse = h264_parse;
             break;
 
+#if AVF_HAVE_HEVC
+        case AV_CODEC_ID_HEVC:
+            if (!codec->extradata_size)
+                goto err_alloc;
+
+            encoding_name = "H265";
+            parser_init = h265_init;
+
+            track->parse = h265_parse;
+            break;
+#endif
+
         case AV_CODEC_ID_MP2:
         case AV_CODEC_ID_MP3:
             track->payload_type = 14;
@@ -248,6 +351,16 @@ Resource *avf_open(const char *url)
             track->parse = amr_parse;
             break;
 
+#if AVF_HAVE_OPUS
+        case AV_CODEC_ID_OPUS:
+            encoding_name = "opus";
+            parser_init = opus_init;
+
+            track->clock_rate = 48000;
+            track->parse = opus_parse;
+            break;
+#endif
+
         case AV_CODEC_ID_VP8:
             encoding_name = "VP8";
             parser_init = vp8_init;
@@ -255,6 +368,24 @@ Resource *avf_open(const char *url)
             track->parse = vp8_parse;
             break;
 
+#if AVF_HAVE_VP9
+        case AV_CODEC_ID_VP9:
+            encoding_name = "VP9";
+            parser_init = vp9_init;
+
+            track->parse = vp9_parse;
+            break;
+#endif
+
+#if AVF_HAVE_AV1
+        case AV_CODEC_ID_AV1:
+            encoding_name = "AV1";
+            parser_init = av1_init;
+
+            track->parse = av1_parse;
+            break;
+#endif
+
         default:
             goto discard;
         }
@@ -320,16 +451,21 @@ Resource *avf_open(const char *url)
 
     r->mrl = mrl;
     r->lock = g_mutex_new();
-    r->mtime = filestat.st_mtime;
+    r->mtime = mtime;
 
     r->read_packet = avf_read_packet;
     r->uninit = avf_uninit;
 
+    r_set_clip(r, 0, HUGE_VAL, 0);
+    r->stored.cache_gop = -1;
+
     /* Try seeking to make sure that we can seek, as libavformat might
        not implement seeking for the format we're using here; if it
        doesn't, do not set a seek method */
-    if ( !av_seek_frame(r->stored.avfc, -1, 0, 0) )
+    if ( !av_seek_frame(r->stored.avfc, -1, 0, 0) ) {
         r->seek = avf_seek;
+        r->stored.kfindex = kfi_acquire(r->stored.avfc, mrl, r->mtime);
+    }
 
     r->duration = (double)r->stored.avfc->duration /AV_TIME_BASE;
     fnc_log(FNC_LOG_DEBUG, "[avf] duration %f", r->duration);
@@ -347,7 +483,7 @@ Resource *avf_open(const char *url)
         if ( r->stored.avfc ) {
             for(j = 0; j < r->stored.avfc->nb_streams; j++)
                 track_free(r->stored.tracks[j]);
-            avformat_close_input(&r->stored.avfc);
+            avf_close_input(&r->stored.avfc);
         }
 
         g_free(r->stored.tracks);
@@ -359,6 +495,207 @@ Resource *avf_open(const char *url)
     return false;
 }
 
+double avf_start_time(Resource *r)
+{
+    return r->stored.avfc->start_time != AV_NOPTS_VALUE ?
+        (double)r->stored.avfc->start_time / AV_TIME_BASE : 0;
+}
+
+/**
+ * @brief Time a track can go past the end of the clip before the
+ *        clip is considered over regardless of the other tracks
+ *
+ * This covers tracks that have no more packets within the clip
+ * (sparse streams, or streams ending before the others).
+ */
+#define AVF_CLIP_SLACK 1.0
+
+/**
+ * @brief Check whether a packet falls outside the clip window
+ *
+ * @param dts Filled in with the delivery time of the packet from the
+ *            start of the resource, the time base of the window
+ *
+ * @return true if the packet is to be dropped; if it is past the end
+ *         of the window, the track is marked as clipped.
+ */
+static bool avf_clip(Resource *r, Track *tr, AVStream *stream, AVPacket *pkt,
+                     double *dts)
+{
+    const double time_base = av_q2d(stream->time_base);
+    const double start_time = avf_start_time(r);
+
+    *dts = pkt->dts * time_base - start_time;
+
+    if ( pkt->dts != AV_NOPTS_VALUE && *dts >= r->stored.clip_end ) {
+        tr->clipped = true;
+        return true;
+    }
+
+    /* Video is not dropped so that the decoding can start from the
+       keyframe the resource was seeked to. */
+    return tr->media_type != MP_video &&
+        pkt->pts != AV_NOPTS_VALUE &&
+        pkt->pts * time_base - start_time < r->stored.clip_start;
+}
+
+/**
+ * @brief Check whether the end of the clip window was reached
+ *
+ * @param r The resource to check
+ * @param dts The delivery time of the packet that was just clipped
+ */
+static bool avf_clip_reached(Resource *r, double dts)
+{
+    unsigned int j;
+
+    if ( dts >= r->stored.clip_end + AVF_CLIP_SLACK )
+        return true;
+
+    for(j = 0; j < r->stored.avfc->nb_streams; j++)
+        if ( r->stored.tracks[j] && !r->stored.tracks[j]->clipped &&
+             r->stored.avfc->streams[j]->discard != AVDISCARD_ALL )
+            return false;
+
+    return true;
+}
+
+static void avf_packet_free(gpointer pkt)
+{
+    av_free_packet(pkt);
+    g_slice_free(AVPacket, pkt);
+}
+
+/**
+ * @brief Wait for the packets read so far to be parsed
+ *
+ * This is done at the end of the stream or of the clip, so that the
+ * timestamps of the tracks are final, and no buffer is written to
+ * their queue once the resource reports it is over.
+ */
+static void avf_drain(Resource *r)
+{
+    g_list_foreach(r->tracks, (GFunc)pipeline_drain, NULL);
+    mp2t_flush(r->stored.mux);
+}
+
+/**
+ * @brief Drop the packets read but not yet parsed
+ */
+static void avf_flush(Resource *r)
+{
+    g_list_foreach(r->tracks, (GFunc)pipeline_flush, NULL);
+    mp2t_reset(r->stored.mux);
+}
+
+/**
+ * @brief Start recording the packets of the resource in the packet
+ *        cache, as soon as its keyframe index is ready
+ */
+static void avf_cache_attach(Resource *r)
+{
+    GArray *times;
+    GList *item;
+
+    /* the cache holds packetized buffers, muxed resources have none;
+       the buffers are not even copied when the cache is disabled */
+    if ( feng_srv.packet_cache_size == 0 ||
+         r->stored.pcache != NULL || r->stored.mux != NULL ||
+         r->stored.hls != NULL ||
+         (times = kfi_times(r->stored.kfindex)) == NULL )
+        return;
+
+    /* the parsers record the buffers they produce */
+    avf_drain(r);
+
+    r->stored.pcache = pcache_file_new(r->mrl, r->mtime, times);
+
+    for ( item = r->tracks; item; item = item->next )
+        pcache_track_attach(item->data, r->stored.pcache);
+}
+
+/**
+ * @brief Play the next GOP from the packet cache
+ *
+ * @retval 0 The GOP was played from the cache.
+ * @retval 1 The GOP is not cached, it has to be demuxed; the demuxer
+ *           was moved to its start if some GOPs were played from the
+ *           cache, and the cache is not looked up again until the
+ *           next seek.
+ * @retval RESOURCE_ERR The demuxer could not be moved to the GOP.
+ */
+static int avf_play_cached(Resource *r)
+{
+    gint gop = r->stored.cache_gop;
+    double start, end, time;
+
+    r->stored.cache_gop = -1;
+
+    if ( !pcache_file_gop_bounds(r->stored.pcache, gop, &start, &end) )
+        return 1;
+
+    /* the bounds are stream times, the window is from the start */
+    start -= avf_start_time(r);
+    end -= avf_start_time(r);
+
+    if ( end <= r->stored.clip_end &&
+         pcache_play(r, r->stored.pcache, gop) ) {
+        r->stored.cache_gop = gop + 1;
+        r->stored.cache_hit = true;
+        return 0;
+    }
+
+    if ( !r->stored.cache_hit )
+        return 1;
+
+    /* the demuxer is still where the resource was seeked to */
+    time = start;
+    if ( !kfi_seek(r->stored.kfindex, r->stored.avfc, &time) ) {
+        fnc_log(FNC_LOG_ERR, "[avf] %s: unable to resume demuxing at %f",
+                r->mrl, start);
+        return RESOURCE_ERR;
+    }
+
+    /* the packets of the other tracks interleaved before the keyframe
+       were played from the cache already */
+    r->stored.clip_start = start;
+
+    return 1;
+}
+
+/**
+ * @brief Enable only the streams of the tracks that are consumed
+ *
+ * Streams whose track has no consumer are discarded by the demuxer, so
+ * that they are neither read (when the format allows skipping them)
+ * nor parsed; they are enabled again as soon as a consumer is
+ * registered for their track.
+ *
+ * If no track is consumed at all (which happens for instance while
+ * the resource is being described) every stream is kept enabled.
+ */
+static void avf_select_streams(Resource *r)
+{
+    AVFormatContext *avfc = r->stored.avfc;
+    bool any = false;
+    unsigned int j;
+
+    for(j = 0; j < avfc->nb_streams; j++)
+        if ( r->stored.tracks[j] && track_wanted(r->stored.tracks[j]) ) {
+            any = true;
+            break;
+        }
+
+    for(j = 0; j < avfc->nb_streams; j++) {
+        if ( r->stored.tracks[j] == NULL )
+            continue;
+
+        avfc->streams[j]->discard =
+            !any || track_wanted(r->stored.tracks[j]) ?
+            AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+}
+
 static int avf_read_packet(Resource * r)
 {
     int ret = RESOURCE_OK;
@@ -366,47 +703,78 @@ static int avf_read_packet(Resource * r)
     AVStream *stream;
     AVBitStreamFilterContext *bsfc;
     Track *tr;
+    ParseJob job;
+    double dts;
+
+    avf_select_streams(r);
+    avf_cache_attach(r);
+
+    if ( r->stored.cache_gop >= 0 &&
+         (ret = avf_play_cached(r)) != 1 )
+        return ret;
+
+    ret = RESOURCE_OK;
 
 // get a packet
 retry:
-    if(av_read_frame(r->stored.avfc, &pkt) < 0)
+    if(av_read_frame(r->stored.avfc, &pkt) < 0) {
+        avf_drain(r);
         return RESOURCE_EOF; //FIXME
+    }
 
-    if ( (tr = r->stored.tracks[pkt.stream_index]) == NULL )
+    /* not all the demuxers honour the discard setting */
+    if ( (tr = r->stored.tracks[pkt.stream_index]) == NULL ||
+         r->stored.avfc->streams[pkt.stream_index]->discard == AVDISCARD_ALL ) {
+        av_free_packet(&pkt);
         goto retry;
+    }
 
     // push it to the framer
     stream = r->stored.avfc->streams[pkt.stream_index];
 
+    if ( avf_clip(r, tr, stream, &pkt, &dts) ) {
+        av_free_packet(&pkt);
+        if ( tr->clipped && avf_clip_reached(r, dts) ) {
+            avf_drain(r);
+            return RESOURCE_CLIP_END;
+        }
+        goto retry;
+    }
+
     fnc_log(FNC_LOG_VERBOSE, "[avf] Parsing track %s",
             tr->name);
+
+    job.pts = job.dts = job.duration = NAN;
+
     if(pkt.dts != AV_NOPTS_VALUE) {
-        tr->dts = pkt.dts * av_q2d(stream->time_base);
+        job.dts = pkt.dts * av_q2d(stream->time_base) +
+            r->stored.timeline_offset;
         fnc_log(FNC_LOG_VERBOSE,
                 "[avf] delivery timestamp %f",
-                tr->dts);
+                job.dts);
     } else {
         fnc_log(FNC_LOG_VERBOSE,
                 "[avf] missing delivery timestamp");
     }
 
     if(pkt.pts != AV_NOPTS_VALUE) {
-        tr->pts = pkt.pts * av_q2d(stream->time_base);
+        job.pts = pkt.pts * av_q2d(stream->time_base) +
+            r->stored.timeline_offset;
         fnc_log(FNC_LOG_VERBOSE,
                 "[avf] presentation timestamp %f",
-                tr->pts);
+                job.pts);
     } else {
         fnc_log(FNC_LOG_VERBOSE, "[avf] missing presentation timestamp");
     }
 
     if (pkt.duration) {
-        tr->frame_duration = pkt.duration *
+        job.duration = pkt.duration *
             av_q2d(stream->time_base);
     } else { // welcome to the wonderland ehm, hackland...
         switch (stream->codec->codec_id) {
         case AV_CODEC_ID_MP2:
         case AV_CODEC_ID_MP3:
-            tr->frame_duration = 1152.0/
+            job.duration = 1152.0/
                 stream->codec->sample_rate;
             break;
         default: break;
@@ -414,7 +782,7 @@ retry:
     }
 
     fnc_log(FNC_LOG_VERBOSE, "[avf] packet duration %f",
-            tr->frame_duration);
+            job.duration);
 
     bsfc = stream->codec->opaque;
     if (bsfc) {
@@ -424,22 +792,65 @@ retry:
                                    &data, &size,
                                    pkt.data, pkt.size,
                                    pkt.flags & AV_PKT_FLAG_KEY);
-        ret = tr->parse(tr, pkt.data, pkt.size);
-    } else {
-        ret = tr->parse(tr, pkt.data, pkt.size);
+        if ( data != pkt.data )
+            av_free(data);
     }
 
-    av_free_packet(&pkt);
+    if ( r->stored.mux ) {
+        ret = mp2t_mux(r->stored.mux, tr, pkt.data, pkt.size,
+                       job.dts, job.pts, pkt.flags & AV_PKT_FLAG_KEY);
+        av_free_packet(&pkt);
+        return ret;
+    }
 
-    return ret;
+    if ( r->stored.hls ) {
+        ret = hls_capture(r->stored.hls, tr, pkt.data, pkt.size,
+                          job.dts, job.pts, job.duration,
+                          pkt.flags & AV_PKT_FLAG_KEY);
+        av_free_packet(&pkt);
+        return ret;
+    }
+
+    /* the packet is parsed by another thread, make sure it does not
+       refer to the demuxer's internal buffers */
+    if ( av_dup_packet(&pkt) < 0 ) {
+        av_free_packet(&pkt);
+        return RESOURCE_ERR;
+    }
+
+    job.packet = g_slice_dup(AVPacket, &pkt);
+    job.free_packet = avf_packet_free;
+    job.data = pkt.data;
+    job.len = pkt.size;
+
+    return pipeline_submit(tr, &job);
 }
 
-static int avf_seek(Resource * r, double time_sec)
+static int avf_seek(Resource * r, double *time_sec)
 {
     int flags = 0;
-    int64_t time_msec = time_sec * AV_TIME_BASE;
+    int64_t time_msec;
+
+    fnc_log(FNC_LOG_DEBUG, "Seeking to %f", *time_sec);
+
+    avf_flush(r);
+    avf_cache_attach(r);
+
+    g_list_foreach(r->tracks, (GFunc)pcache_track_reset, NULL);
+    r->stored.cache_gop = -1;
+    r->stored.cache_hit = false;
 
-    fnc_log(FNC_LOG_DEBUG, "Seeking to %f", time_sec);
+    if ( kfi_seek(r->stored.kfindex, r->stored.avfc, time_sec) ) {
+        fnc_log(FNC_LOG_DEBUG, "Seeked to keyframe at %f", *time_sec);
+
+        /* landed at the start of a GOP, which might be cached */
+        if ( r->stored.pcache )
+            r->stored.cache_gop = pcache_file_gop(r->stored.pcache,
+                                                  *time_sec + avf_start_time(r));
+        return 0;
+    }
+
+    time_msec = *time_sec * AV_TIME_BASE;
     if (r->stored.avfc->start_time != AV_NOPTS_VALUE)
         time_msec += r->stored.avfc->start_time;
     if (time_msec < 0) flags = AVSEEK_FLAG_BACKWARD;
@@ -450,8 +861,14 @@ static void avf_uninit(gpointer rgen)
 {
     Resource *r = rgen;
 
-    if ( r->stored.avfc != NULL )
-        avformat_close_input(&r->stored.avfc);
+    /* the parsers might still refer to the codec data */
+    avf_flush(r);
+
+    avf_close_input(&r->stored.avfc);
+
+    kfi_release(r->stored.kfindex);
+    pcache_file_free(r->stored.pcache);
+    mp2t_free(r->stored.mux);
 
     g_free(r->stored.tracks);
 }
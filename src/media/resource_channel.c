@@ -0,0 +1,402 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Scheduled channels
+ *
+ * A scheduled channel is a virtual resource that plays stored files
+ * as if they were a live broadcast. Its schedule is a ".channel" file
+ * in the virtuals root, in the edit list format (see @ref
+ * editlist.c), listing segments of files of the document root; the
+ * list is played over and over, aligned on the wall clock: a list
+ * lasting a day plays the same segment at the same UTC time every
+ * day.
+ *
+ * The channel is shared by all its clients like the other live
+ * resources: a single thread demuxes the files, with the stored
+ * resources' demuxer and parsers, and relays the buffers to the
+ * channel's tracks in real time. Their timestamps continue across
+ * the segments and the loops; at each cut the next segment is
+ * started where the schedule is at that time, from the keyframe
+ * preceding it, so that the channel never drifts from its schedule.
+ *
+ * Nothing is read while the channel has no client; when a client
+ * comes, the channel restarts where the schedule is.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+extern Resource *avf_open(const char *url);
+extern double avf_start_time(Resource *r);
+
+/** Seconds of media relayed ahead of the wall clock */
+#define CHANNEL_LEAD 1.0
+/** Shortest part of a segment worth starting from */
+#define CHANNEL_MIN_REMAINING 0.5
+/** Time to wait while there is no client, or after an error */
+#define CHANNEL_IDLE_USEC 200000
+
+typedef struct ChannelSchedule {
+    EditList *edl;
+
+    /** Wall clock time of the channel's time zero */
+    double origin;
+
+    /** Channel time where the data relayed so far ends */
+    double end;
+
+    /** Demuxer reading the segment being played, or NULL */
+    Resource *demuxer;
+} ChannelSchedule;
+
+/**
+ * @brief Create a track of the channel after a track of a file
+ */
+static Track *channel_track_new(Resource *r, Track *inner)
+{
+    Track *track = track_new(g_strdup(inner->name));
+
+    track->parent = r;
+    track->payload_type = inner->payload_type;
+    track->clock_rate = inner->clock_rate;
+    track->encoding_name = g_strdup(inner->encoding_name);
+    track->media_type = inner->media_type;
+    track->audio_channels = inner->audio_channels;
+    track->frame_duration = inner->frame_duration;
+
+    g_string_assign(track->sdp_description, inner->sdp_description->str);
+
+    return track;
+}
+
+/**
+ * @brief Check that the tracks of a file match the ones of the channel
+ *
+ * The tracks of the channel are created after the ones of the first
+ * file opened; the following files need to have the same tracks, in
+ * the same order, with the same encodings.
+ */
+static gboolean channel_demuxer_link(Resource *r, Resource *demuxer)
+{
+    GList *outer, *inner;
+
+    if ( r->tracks == NULL )
+        for ( inner = demuxer->tracks; inner; inner = inner->next )
+            r->tracks = g_list_append(r->tracks,
+                                      channel_track_new(r, inner->data));
+
+    for ( outer = r->tracks, inner = demuxer->tracks;
+          outer && inner;
+          outer = outer->next, inner = inner->next )
+        if ( strcmp(((Track*)outer->data)->encoding_name,
+                    ((Track*)inner->data)->encoding_name) != 0 )
+            return false;
+
+    return outer == NULL && inner == NULL;
+}
+
+/**
+ * @brief Get a demuxer for a file of the schedule
+ *
+ * The demuxer of the previous segment is kept if it reads the same
+ * file.
+ */
+static Resource *channel_demuxer_take(Resource *r, const char *path)
+{
+    ChannelSchedule *ch = r->live.channel;
+    gchar *mrl = g_strjoin("/", feng_default_vhost->document_root, path, NULL);
+    Resource *demuxer = ch->demuxer;
+
+    if ( demuxer && strcmp(demuxer->mrl, mrl) != 0 ) {
+        r_close(demuxer);
+        demuxer = NULL;
+    }
+
+    g_free(mrl);
+    ch->demuxer = NULL;
+
+    if ( demuxer == NULL && (demuxer = avf_open(path)) != NULL &&
+         !channel_demuxer_link(r, demuxer) ) {
+        fnc_log(FNC_LOG_ERR, "[channel] %s: tracks do not match %s",
+                path, r->mrl);
+        r_close(demuxer);
+        demuxer = NULL;
+    }
+
+    return demuxer;
+}
+
+/**
+ * @brief Start the segment the schedule is at, where the data relayed
+ *        so far ends
+ *
+ * @return false if the file of the segment cannot be played.
+ */
+static gboolean channel_start(Resource *r)
+{
+    ChannelSchedule *ch = r->live.channel;
+    double time = ch->origin + ch->end;
+    guint i = edl_loop_segment(ch->edl, &time);
+    EditListSegment *segment = g_ptr_array_index(ch->edl->segments, i);
+    Resource *demuxer;
+
+    /* too close to the end of the segment, skip to the next one */
+    if ( segment->end - time < CHANNEL_MIN_REMAINING ) {
+        ch->end += segment->end - time;
+        i = (i + 1) % ch->edl->segments->len;
+        segment = g_ptr_array_index(ch->edl->segments, i);
+        time = segment->start;
+    }
+
+    if ( (demuxer = channel_demuxer_take(r, segment->path)) == NULL )
+        return false;
+
+    if ( demuxer->seek ) {
+        if ( demuxer->seek(demuxer, &time) != 0 ) {
+            fnc_log(FNC_LOG_ERR, "[channel] %s: unable to seek %s to %f",
+                    r->mrl, segment->path, time);
+            r_close(demuxer);
+            return false;
+        }
+    } else if ( time > 0 ) {
+        fnc_log(FNC_LOG_ERR, "[channel] %s: %s is not seekable",
+                r->mrl, segment->path);
+        r_close(demuxer);
+        return false;
+    }
+
+    g_list_foreach(demuxer->tracks, (GFunc)track_reset_queue, NULL);
+
+    /* the keyframe landed on goes right where the data relayed ends;
+       the packets carry stream times, not times from the start */
+    r_set_clip(demuxer, time, segment->end,
+               ch->end - time - avf_start_time(demuxer));
+    ch->demuxer = demuxer;
+
+    fnc_log(FNC_LOG_DEBUG, "[channel] %s: playing %s from %f at %f",
+            r->mrl, segment->path, time, ch->end);
+
+    return true;
+}
+
+/**
+ * @brief Tells whether any track of the channel is used
+ */
+static gboolean channel_wanted(Resource *r)
+{
+    GList *item;
+
+    for ( item = r->tracks; item; item = item->next )
+        if ( live_track_wanted(item->data) )
+            return true;
+
+    return false;
+}
+
+/**
+ * @brief Relay the buffers parsed so far to the tracks of the channel
+ *
+ * Each buffer is relayed once the wall clock is within @ref
+ * CHANNEL_LEAD of its delivery time.
+ */
+static void channel_relay(Resource *r)
+{
+    ChannelSchedule *ch = r->live.channel;
+    GList *outer, *inner;
+
+    for ( outer = r->tracks, inner = ch->demuxer->tracks;
+          outer && inner;
+          outer = outer->next, inner = inner->next ) {
+        Track *tr = outer->data;
+        struct MParserBuffer *buffer;
+
+        while ( (buffer = track_pop(inner->data)) != NULL ) {
+            const double delivery = isnan(buffer->delivery) ?
+                buffer->timestamp : buffer->delivery;
+            const double wait = ch->origin + delivery - CHANNEL_LEAD - ev_time();
+
+            if ( wait > 0 )
+                g_usleep(wait * G_USEC_PER_SEC);
+
+            if ( buffer->duration > 0 )
+                ch->end = MAX(ch->end, delivery + buffer->duration);
+            else
+                ch->end = MAX(ch->end, delivery);
+
+            /* the channel's track numbers its own buffers */
+            buffer->seq_no = 0;
+            buffer->seen = 0;
+            buffer->rtp_timestamp = llrint(buffer->timestamp * tr->clock_rate);
+
+            tr->frame_duration = ((Track*)inner->data)->frame_duration;
+
+            live_track_write(tr, buffer);
+        }
+    }
+}
+
+static gpointer channel_thread(gpointer r_p)
+{
+    Resource *r = r_p;
+    ChannelSchedule *ch = r->live.channel;
+
+    while ( true ) {
+        int res;
+
+        if ( !channel_wanted(r) ) {
+            r_close(ch->demuxer);
+            ch->demuxer = NULL;
+            g_usleep(CHANNEL_IDLE_USEC);
+            continue;
+        }
+
+        if ( ch->demuxer == NULL ) {
+            /* restart where the schedule is, never going back */
+            ch->end = MAX(ch->end, ev_time() - ch->origin);
+
+            if ( !channel_start(r) ) {
+                g_usleep(CHANNEL_IDLE_USEC);
+                continue;
+            }
+        }
+
+        res = ch->demuxer->read_packet(ch->demuxer);
+        channel_relay(r);
+
+        switch ( res ) {
+        case RESOURCE_OK:
+            break;
+        case RESOURCE_CLIP_END:
+        case RESOURCE_EOF:
+            media_stat_add(MEDIA_STAT_CHANNEL_CUTS, 1);
+
+            if ( !channel_start(r) )
+                ch->demuxer = NULL;
+            break;
+        default:
+            fnc_log(FNC_LOG_ERR, "[channel] %s: unable to read %s",
+                    r->mrl, ch->demuxer->mrl);
+            media_stat_add(MEDIA_STAT_CHANNEL_ERRORS, 1);
+
+            r_close(ch->demuxer);
+            ch->demuxer = NULL;
+            g_usleep(CHANNEL_IDLE_USEC);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Open a scheduled channel
+ *
+ * @param url The name of the channel within the virtual/ path
+ *
+ * @return The channel resource, or NULL if there is no schedule for
+ *         the channel, or it cannot be played.
+ *
+ * The first segment is opened right away, to describe the tracks of
+ * the channel.
+ */
+Resource *channel_open(const char *url)
+{
+    Resource *r;
+    ChannelSchedule *ch;
+    gchar *mrl, *contents = NULL;
+    EditList *edl;
+    guint i;
+
+    mrl = g_strdup_printf("%s/%s.channel",
+                          feng_default_vhost->virtuals_root, url);
+
+    if ( !g_file_test(mrl, G_FILE_TEST_IS_REGULAR) ) {
+        g_free(mrl);
+        return NULL;
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "[channel] opening schedule '%s'", mrl);
+
+    if ( !g_file_get_contents(mrl, &contents, NULL, NULL) ) {
+        fnc_log(FNC_LOG_ERR, "[channel] Cannot read %s", mrl);
+        goto err_alloc;
+    }
+
+    edl = edl_parse(contents);
+    g_free(contents);
+
+    if ( edl == NULL ) {
+        fnc_log(FNC_LOG_ERR, "[channel] %s: invalid schedule", mrl);
+        goto err_alloc;
+    }
+
+    for ( i = 0; i < edl->segments->len; i++ ) {
+        EditListSegment *segment = g_ptr_array_index(edl->segments, i);
+
+        if ( !feng_path_is_safe(segment->path) ) {
+            fnc_log(FNC_LOG_ERR, "[channel] %s: invalid path %s",
+                    mrl, segment->path);
+            edl_free(edl);
+            goto err_alloc;
+        }
+    }
+
+    r = g_slice_new0(Resource);
+    r->mrl = mrl;
+    r->source = LIVE_SOURCE;
+    r->duration = HUGE_VAL;
+
+    ch = r->live.channel = g_slice_new0(ChannelSchedule);
+    ch->edl = edl;
+    ch->origin = ev_time();
+
+    if ( !channel_start(r) ) {
+        g_list_foreach(r->tracks, (GFunc)track_free, NULL);
+        g_list_free(r->tracks);
+        edl_free(edl);
+        g_slice_free(ChannelSchedule, ch);
+        g_slice_free(Resource, r);
+        goto err_alloc;
+    }
+
+    r->lock = g_mutex_new();
+
+    fnc_log(FNC_LOG_DEBUG, "[channel] %s: %u segments, looping every %f",
+            mrl, edl->segments->len, edl->duration);
+
+    g_thread_create(channel_thread, r, false, NULL);
+
+    return r;
+
+ err_alloc:
+    g_free(mrl);
+    return NULL;
+}
@@ -0,0 +1,596 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Playback of edit list resources
+ *
+ * An edit list resource is played by reading, one after the other,
+ * the segments of the files it lists; the tracks of the files are
+ * "sunk" into the tracks of the edit list resource, and their
+ * timestamps are rewritten so that they form a single, continuous
+ * timeline.
+ *
+ * To avoid stalls at the cuts, while a segment is played the demuxer
+ * for the following one is opened and seeked in background; the last
+ * few demuxers whose segment is over are kept open, so that segments
+ * of the same file reuse them rather than opening the file again.
+ *
+ * The start of each segment is moved back to the keyframe preceding
+ * it when the resource is opened, so that each segment can be decoded
+ * from its first frame; the timeline is laid out after that, so that
+ * no gap nor overlap is introduced. The files are only opened one at
+ * a time for that, their demuxers are opened again when their segment
+ * is about to be played.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+extern Resource *avf_open(const char *url);
+extern double avf_start_time(Resource *r);
+
+/**
+ * @brief Demuxers kept open once their segment is over
+ */
+#define EDL_IDLE_DEMUXERS 2
+
+typedef struct EDLPlayback {
+    EditList *edl;
+
+    /** Directory of the edit list, relative to the document root */
+    gchar *dirname;
+
+    /** Segment being played */
+    guint current;
+
+    /** Demuxer reading the segment being played */
+    Resource *demuxer;
+
+    /**
+     * @brief Demuxer ready for the following segment
+     *
+     * @note Protected by @ref lock
+     */
+    Resource *next;
+    guint next_segment;
+    gboolean prefetching;
+
+    /**
+     * @brief Demuxers whose segment is over, available for reuse, the
+     *        most recently used first
+     *
+     * At most @ref EDL_IDLE_DEMUXERS are kept.
+     *
+     * @note Protected by @ref lock
+     */
+    GList *idle;
+
+    GThreadPool *prefetch_pool;
+    GMutex *lock;
+    GCond *prefetched;
+} EDLPlayback;
+
+/**
+ * @brief Create a track of the edit list after a track of a segment
+ */
+static Track *edl_track_new(Resource *r, Track *inner)
+{
+    Track *track = track_new(g_strdup(inner->name));
+
+    track->parent = r;
+    track->payload_type = inner->payload_type;
+    track->clock_rate = inner->clock_rate;
+    track->encoding_name = g_strdup(inner->encoding_name);
+    track->media_type = inner->media_type;
+    track->audio_channels = inner->audio_channels;
+    track->frame_duration = inner->frame_duration;
+
+    g_string_assign(track->sdp_description, inner->sdp_description->str);
+
+    return track;
+}
+
+/**
+ * @brief Sink the tracks of a segment's demuxer in the edit list tracks
+ *
+ * @return false if the tracks of the demuxer do not match the ones of
+ *         the edit list.
+ *
+ * The tracks of the edit list are created after the tracks of the first
+ * demuxer linked; the following files need to have the same tracks,
+ * in the same order, with the same encodings.
+ *
+ * @todo The SDP description of the first file is used for the whole
+ *       edit list, so the files should also share the same codec
+ *       configuration.
+ */
+static bool edl_demuxer_link(Resource *r, Resource *demuxer)
+{
+    GList *outer, *inner;
+
+    if ( r->tracks == NULL )
+        for ( inner = demuxer->tracks; inner; inner = inner->next )
+            r->tracks = g_list_append(r->tracks,
+                                      edl_track_new(r, inner->data));
+
+    for ( outer = r->tracks, inner = demuxer->tracks;
+          outer && inner;
+          outer = outer->next, inner = inner->next ) {
+        Track *o = outer->data, *i = inner->data;
+
+        if ( strcmp(o->encoding_name, i->encoding_name) != 0 )
+            return false;
+
+        i->sink = o;
+    }
+
+    return outer == NULL && inner == NULL;
+}
+
+/**
+ * @brief Get a demuxer for a file of the edit list
+ *
+ * @return An idle demuxer for the file if available, or a newly opened
+ *         one; NULL if the file cannot be opened or does not match
+ *         the edit list.
+ */
+static Resource *edl_demuxer_take(Resource *r, const char *path)
+{
+    EDLPlayback *pb = r->stored.edl;
+    Resource *demuxer = NULL;
+    gchar *url, *mrl;
+    GList *item;
+
+    url = g_build_filename(pb->dirname, path, NULL);
+    mrl = g_strjoin("/", feng_default_vhost->document_root, url, NULL);
+
+    g_mutex_lock(pb->lock);
+    for ( item = pb->idle; item; item = item->next )
+        if ( strcmp(((Resource*)item->data)->mrl, mrl) == 0 ) {
+            demuxer = item->data;
+            pb->idle = g_list_delete_link(pb->idle, item);
+            break;
+        }
+    g_mutex_unlock(pb->lock);
+
+    if ( demuxer == NULL && (demuxer = avf_open(url)) != NULL ) {
+        if ( !edl_demuxer_link(r, demuxer) ) {
+            fnc_log(FNC_LOG_ERR, "[edl] %s: tracks do not match %s",
+                    url, r->mrl);
+            r_close(demuxer);
+            demuxer = NULL;
+        }
+    }
+
+    g_free(mrl);
+    g_free(url);
+
+    return demuxer;
+}
+
+/**
+ * @brief Put back a demuxer among the idle ones
+ *
+ * The least recently used one is closed if there are too many.
+ */
+static void edl_demuxer_give(Resource *r, Resource *demuxer)
+{
+    EDLPlayback *pb = r->stored.edl;
+    Resource *evicted = NULL;
+    GList *last;
+
+    if ( demuxer == NULL )
+        return;
+
+    g_mutex_lock(pb->lock);
+    pb->idle = g_list_prepend(pb->idle, demuxer);
+    if ( g_list_length(pb->idle) > EDL_IDLE_DEMUXERS ) {
+        last = g_list_last(pb->idle);
+        evicted = last->data;
+        pb->idle = g_list_delete_link(pb->idle, last);
+    }
+    g_mutex_unlock(pb->lock);
+
+    r_close(evicted);
+}
+
+/**
+ * @brief Get the demuxer of a segment, seeked within it and with its
+ *        clip window set
+ *
+ * @param r The edit list resource
+ * @param segment The segment to prepare the demuxer for
+ * @param time Time within the timeline to start from; replaced with
+ *             the time it was actually seeked to.
+ *
+ * @return The demuxer, or NULL if the file of the segment cannot be
+ *         opened or seeked.
+ */
+static Resource *edl_demuxer_prepare(Resource *r,
+                                     EditListSegment *segment,
+                                     double *time)
+{
+    double start = segment->start + (*time - segment->offset);
+    Resource *demuxer;
+
+    if ( (demuxer = edl_demuxer_take(r, segment->path)) == NULL )
+        return NULL;
+
+    if ( demuxer->seek ) {
+        if ( demuxer->seek(demuxer, &start) != 0 )
+            goto error;
+    } else if ( start > 0 )
+        goto error;
+
+    r_set_clip(demuxer, segment->start, segment->end,
+               edl_stream_offset(segment, avf_start_time(demuxer)));
+
+    *time = edl_to_timeline(segment, start);
+
+    return demuxer;
+
+ error:
+    edl_demuxer_give(r, demuxer);
+    return NULL;
+}
+
+/**
+ * @brief Open and seek the demuxer of the following segment
+ *
+ * @param segment_p The index of the segment, plus one
+ * @param resource_p The edit list resource
+ */
+static void edl_prefetch_cb(gpointer segment_p, gpointer resource_p)
+{
+    Resource *r = resource_p;
+    EDLPlayback *pb = r->stored.edl;
+    guint i = GPOINTER_TO_UINT(segment_p) - 1;
+    EditListSegment *segment = g_ptr_array_index(pb->edl->segments, i);
+    double time = segment->offset;
+    Resource *demuxer = edl_demuxer_prepare(r, segment, &time);
+
+    g_mutex_lock(pb->lock);
+    pb->next = demuxer;
+    pb->next_segment = i;
+    pb->prefetching = false;
+    g_cond_broadcast(pb->prefetched);
+    g_mutex_unlock(pb->lock);
+}
+
+/**
+ * @brief Wait for the prefetch in progress and take its demuxer
+ *
+ * @return The demuxer prepared for segment @p i, or NULL if none was
+ *         prepared for it; demuxers prepared for other segments are
+ *         put back among the idle ones.
+ */
+static Resource *edl_prefetch_wait(Resource *r, guint i)
+{
+    EDLPlayback *pb = r->stored.edl;
+    Resource *demuxer;
+
+    g_mutex_lock(pb->lock);
+    while ( pb->prefetching )
+        g_cond_wait(pb->prefetched, pb->lock);
+
+    demuxer = pb->next;
+    pb->next = NULL;
+    g_mutex_unlock(pb->lock);
+
+    if ( demuxer && pb->next_segment != i ) {
+        edl_demuxer_give(r, demuxer);
+        demuxer = NULL;
+    }
+
+    return demuxer;
+}
+
+/**
+ * @brief Start preparing the demuxer for the segment following the
+ *        current one
+ */
+static void edl_prefetch(Resource *r)
+{
+    EDLPlayback *pb = r->stored.edl;
+
+    if ( pb->current + 1 >= pb->edl->segments->len )
+        return;
+
+    g_mutex_lock(pb->lock);
+    pb->prefetching = true;
+    g_mutex_unlock(pb->lock);
+
+    g_thread_pool_push(pb->prefetch_pool,
+                       GUINT_TO_POINTER(pb->current + 2), NULL);
+}
+
+/**
+ * @brief Timeline time where the data of a demuxer ends
+ */
+static double edl_demuxer_end(Resource *demuxer)
+{
+    double end = 0;
+    GList *item;
+
+    for ( item = demuxer->tracks; item; item = item->next ) {
+        Track *tr = item->data;
+
+        end = MAX(end, tr->dts + tr->frame_duration);
+    }
+
+    return end;
+}
+
+/**
+ * @brief Switch playback to the following segment
+ *
+ * The time spent waiting for the demuxer, and the time left without
+ * media on the timeline, are accounted in @ref MEDIA_STAT_EDL_STALL_USEC
+ * and @ref MEDIA_STAT_EDL_GAP_USEC respectively.
+ */
+static int edl_cut(Resource *r)
+{
+    EDLPlayback *pb = r->stored.edl;
+    guint i = pb->current + 1;
+    EditListSegment *segment = g_ptr_array_index(pb->edl->segments, i);
+    ev_tstamp start = ev_time();
+    double time = segment->offset, gap;
+    Resource *demuxer;
+
+    if ( (demuxer = edl_prefetch_wait(r, i)) == NULL ) {
+        fnc_log(FNC_LOG_DEBUG, "[edl] segment %u of %s not prefetched",
+                i, r->mrl);
+
+        if ( (demuxer = edl_demuxer_prepare(r, segment, &time)) == NULL )
+            return RESOURCE_ERR;
+    }
+
+    gap = segment->offset - edl_demuxer_end(pb->demuxer);
+    if ( gap > 0 )
+        media_stat_add(MEDIA_STAT_EDL_GAP_USEC, gap * 1000000);
+
+    edl_demuxer_give(r, pb->demuxer);
+    pb->demuxer = demuxer;
+    pb->current = i;
+
+    edl_prefetch(r);
+
+    media_stat_add(MEDIA_STAT_EDL_CUTS, 1);
+    media_stat_add(MEDIA_STAT_EDL_STALL_USEC, (ev_time() - start) * 1000000);
+
+    return RESOURCE_OK;
+}
+
+static int edl_read_packet(Resource *r)
+{
+    EDLPlayback *pb = r->stored.edl;
+    int res;
+
+    if ( pb->demuxer == NULL )
+        return RESOURCE_ERR;
+
+    switch ( (res = pb->demuxer->read_packet(pb->demuxer)) ) {
+    case RESOURCE_CLIP_END:
+    case RESOURCE_EOF:
+        if ( pb->current + 1 >= pb->edl->segments->len )
+            return RESOURCE_EOF;
+
+        return edl_cut(r);
+    default:
+        return res;
+    }
+}
+
+static int edl_seek(Resource *r, double *time_sec)
+{
+    EDLPlayback *pb = r->stored.edl;
+    guint i = edl_find_segment(pb->edl, *time_sec);
+    EditListSegment *segment = g_ptr_array_index(pb->edl->segments, i);
+    Resource *demuxer = edl_prefetch_wait(r, i);
+
+    /* put back the current demuxer first, so that it is reused if the
+       segment is from the same file */
+    edl_demuxer_give(r, pb->demuxer);
+    pb->demuxer = NULL;
+
+    /* the prefetched demuxer is at the start of the segment */
+    edl_demuxer_give(r, demuxer);
+
+    if ( (demuxer = edl_demuxer_prepare(r, segment, time_sec)) == NULL )
+        return -1;
+
+    pb->demuxer = demuxer;
+    pb->current = i;
+
+    edl_prefetch(r);
+
+    return 0;
+}
+
+static void edl_demuxer_close(gpointer demuxer,
+                              ATTR_UNUSED gpointer user_data)
+{
+    r_close(demuxer);
+}
+
+static void edl_uninit(gpointer rgen)
+{
+    Resource *r = rgen;
+    EDLPlayback *pb = r->stored.edl;
+
+    if ( pb->prefetch_pool )
+        g_thread_pool_free(pb->prefetch_pool, false, true);
+
+    r_close(pb->demuxer);
+    r_close(pb->next);
+
+    g_list_foreach(pb->idle, edl_demuxer_close, NULL);
+    g_list_free(pb->idle);
+
+    g_cond_free(pb->prefetched);
+    g_mutex_free(pb->lock);
+
+    edl_free(pb->edl);
+    g_free(pb->dirname);
+    g_slice_free(EDLPlayback, pb);
+}
+
+/**
+ * @brief Move the start of each segment to the preceding keyframe
+ *
+ * @return false if a segment could not be opened or seeked.
+ *
+ * Only one file is open at a time; consecutive segments of the same
+ * file share its demuxer.
+ */
+static bool edl_snap_segments(Resource *r)
+{
+    EDLPlayback *pb = r->stored.edl;
+    Resource *demuxer = NULL;
+    const char *path = NULL;
+    bool ret = true;
+    guint i;
+
+    for ( i = 0; ret && i < pb->edl->segments->len; i++ ) {
+        EditListSegment *segment = g_ptr_array_index(pb->edl->segments, i);
+        double start = segment->start;
+
+        if ( path == NULL || strcmp(path, segment->path) != 0 ) {
+            r_close(demuxer);
+            path = segment->path;
+
+            if ( (demuxer = edl_demuxer_take(r, path)) == NULL )
+                return false;
+        }
+
+        if ( demuxer->seek ) {
+            if ( demuxer->seek(demuxer, &start) == 0 && start < segment->start )
+                segment->start = MAX(start, 0);
+        } else if ( segment->start > 0 ) {
+            fnc_log(FNC_LOG_ERR, "[edl] %s: %s is not seekable",
+                    r->mrl, segment->path);
+            ret = false;
+        }
+    }
+
+    r_close(demuxer);
+
+    edl_layout(pb->edl);
+
+    return ret;
+}
+
+Resource *edl_open(const char *url)
+{
+    Resource *r = NULL;
+    EDLPlayback *pb;
+    gchar *mrl, *contents = NULL;
+    struct stat filestat;
+    EditList *edl;
+    double time = 0;
+    guint i;
+
+    fnc_log(FNC_LOG_DEBUG, "opening edit list '%s'", url);
+
+    mrl = g_strjoin("/", feng_default_vhost->document_root, url, NULL);
+
+    if ( stat(mrl, &filestat) < 0 ) {
+        fnc_perror("stat");
+        goto err_alloc;
+    }
+
+    if ( !g_file_get_contents(mrl, &contents, NULL, NULL) ) {
+        fnc_log(FNC_LOG_ERR, "[edl] Cannot read %s", mrl);
+        goto err_alloc;
+    }
+
+    edl = edl_parse(contents);
+    g_free(contents);
+
+    if ( edl == NULL ) {
+        fnc_log(FNC_LOG_ERR, "[edl] %s: invalid edit list", mrl);
+        goto err_alloc;
+    }
+
+    for ( i = 0; i < edl->segments->len; i++ ) {
+        EditListSegment *segment = g_ptr_array_index(edl->segments, i);
+
+        if ( !feng_path_is_safe(segment->path) ) {
+            fnc_log(FNC_LOG_ERR, "[edl] %s: invalid path %s",
+                    mrl, segment->path);
+            edl_free(edl);
+            goto err_alloc;
+        }
+    }
+
+    r = g_slice_new0(Resource);
+    r->mrl = mrl;
+    r->mtime = filestat.st_mtime;
+    r->source = STORED_SOURCE;
+
+    pb = r->stored.edl = g_slice_new0(EDLPlayback);
+    pb->edl = edl;
+    pb->dirname = g_path_get_dirname(url);
+    pb->lock = g_mutex_new();
+    pb->prefetched = g_cond_new();
+
+    r->uninit = edl_uninit;
+
+    if ( !edl_snap_segments(r) )
+        goto err_resource;
+
+    pb->prefetch_pool = g_thread_pool_new(edl_prefetch_cb, r,
+                                          1, true, NULL);
+
+    if ( (pb->demuxer = edl_demuxer_prepare(r, g_ptr_array_index(edl->segments, 0),
+                                            &time)) == NULL )
+        goto err_resource;
+
+    edl_prefetch(r);
+
+    r->lock = g_mutex_new();
+    r->read_packet = edl_read_packet;
+    r->seek = edl_seek;
+    r->duration = edl->duration;
+    r_set_clip(r, 0, HUGE_VAL, 0);
+
+    fnc_log(FNC_LOG_DEBUG, "[edl] %u segments, duration %f",
+            edl->segments->len, r->duration);
+
+    return r;
+
+ err_resource:
+    r_close(r);
+    return NULL;
+
+ err_alloc:
+    g_free(mrl);
+    return NULL;
+}
@@ -0,0 +1,977 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Resource I/O backends
+ *
+ * Two strategies are implemented here:
+ *
+ * @li local files are mapped in memory, and the kernel is asked to
+ *     read ahead of the current position by @ref ResourceIO::window
+ *     bytes;
+ *
+ * @li files on network filesystems are read in large, aligned blocks
+ *     by a shared pool of threads, two blocks per resource, so that
+ *     the next block is being read while the current one is consumed
+ *     by the demuxer, and the fill thread never waits on the network
+ *     for the small reads libavformat issues.
+ *
+ * Files that are seldom requested by the clients (see @ref rio_is_cold
+ * and @ref rio_count_open) are read by
+ * the same pool of threads, but bypassing the page cache, so that
+ * streaming the long tail of a catalogue does not evict the data of
+ * the popular resources from memory.
+ *
+ * When the virtual host has an origin configured, the files of its
+ * document root are instead read through the pull-through @ref
+ * segment_cache, shared by all the resources.
+ */
+
+/* for O_DIRECT */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <config.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sys/vfs.h>
+#endif
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+#define RIO_ALIGNMENT 4096
+#define RIO_WINDOW_MIN (256*1024)
+#define RIO_WINDOW_MAX (16*1024*1024)
+#define RIO_WINDOW_DEFAULT (1024*1024)
+
+/** Period over which the opens of a file are counted, in seconds */
+#define RIO_POPULARITY_PERIOD 3600
+/** Opens after which the expired counts are dropped */
+#define RIO_POPULARITY_PRUNE 256
+
+/**
+ * @brief Round a size up to the I/O alignment
+ */
+static inline size_t rio_align(size_t size)
+{
+    return (size + RIO_ALIGNMENT - 1) & ~((size_t)RIO_ALIGNMENT - 1);
+}
+
+/**
+ * @brief Check whether a file resides on a network filesystem
+ *
+ * @param fd The file descriptor of the opened file
+ *
+ * @return true if the file is on NFS, SMB/CIFS, FUSE or other
+ *         filesystems where every read is a network round-trip.
+ */
+static gboolean rio_is_remote(int fd)
+{
+#ifdef __linux__
+    struct statfs fsstat;
+
+    if ( fstatfs(fd, &fsstat) < 0 )
+        return false;
+
+    switch ( (unsigned long)fsstat.f_type ) {
+    case 0x6969:        /* NFS */
+    case 0x517B:        /* SMB */
+    case 0xFF534D42:    /* CIFS */
+    case 0xFE534D42:    /* SMB2 */
+    case 0x65735546:    /* FUSE */
+    case 0x00C36400:    /* Ceph */
+    case 0x01021997:    /* 9p */
+        return true;
+    default:
+        return false;
+    }
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Opens of a file during the current period
+ */
+typedef struct {
+    guint opens;
+    time_t since;
+} RIOPopularity;
+
+static GHashTable *rio_popularity;
+static guint rio_popularity_opens;
+static GStaticMutex rio_popularity_lock = G_STATIC_MUTEX_INIT;
+
+static gboolean rio_popularity_expired(ATTR_UNUSED gpointer path,
+                                       gpointer pop_p, gpointer now_p)
+{
+    const RIOPopularity *pop = pop_p;
+
+    return *(const time_t*)now_p - pop->since >= RIO_POPULARITY_PERIOD;
+}
+
+static void rio_popularity_free(gpointer pop)
+{
+    g_slice_free(RIOPopularity, pop);
+}
+
+/**
+ * @brief Count a request of a file by a client
+ *
+ * @param path The full path of the file
+ *
+ * Only the opens made on behalf of the clients are counted (see @ref
+ * r_open_client): the server opening a file by itself, to index it,
+ * to play a list or a channel, or to generate HLS segments, says
+ * nothing about how popular it is.
+ */
+void rio_count_open(const char *path)
+{
+    const time_t now = time(NULL);
+    RIOPopularity *pop;
+
+    if ( feng_default_vhost->direct_io_opens == 0 )
+        return;
+
+    g_static_mutex_lock(&rio_popularity_lock);
+
+    if ( rio_popularity == NULL )
+        rio_popularity = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, rio_popularity_free);
+
+    if ( ++rio_popularity_opens % RIO_POPULARITY_PRUNE == 0 )
+        g_hash_table_foreach_remove(rio_popularity, rio_popularity_expired,
+                                    (gpointer)&now);
+
+    if ( (pop = g_hash_table_lookup(rio_popularity, path)) == NULL ) {
+        pop = g_slice_new0(RIOPopularity);
+        g_hash_table_insert(rio_popularity, g_strdup(path), pop);
+    }
+
+    if ( pop->opens == 0 ||
+         now - pop->since >= RIO_POPULARITY_PERIOD ) {
+        pop->opens = 0;
+        pop->since = now;
+    }
+
+    pop->opens++;
+
+    g_static_mutex_unlock(&rio_popularity_lock);
+}
+
+/**
+ * @brief Tell whether a file is to be read bypassing the page cache
+ *
+ * @param path The full path of the file
+ *
+ * @retval true The virtual host reads all its files directly, or the
+ *              file was requested by the clients no more than
+ *              @ref cfg_vhost_t::direct_io_opens times (the request
+ *              being served included) in the last hour.
+ * @retval false The file is popular enough for the page cache.
+ */
+static gboolean rio_is_cold(const char *path)
+{
+    cfg_vhost_t *vhost = feng_default_vhost;
+    const time_t now = time(NULL);
+    RIOPopularity *pop;
+    gboolean cold;
+
+    if ( vhost->direct_io )
+        return true;
+
+    if ( vhost->direct_io_opens == 0 )
+        return false;
+
+    g_static_mutex_lock(&rio_popularity_lock);
+
+    cold = rio_popularity == NULL ||
+        (pop = g_hash_table_lookup(rio_popularity, path)) == NULL ||
+        now - pop->since >= RIO_POPULARITY_PERIOD ||
+        pop->opens <= vhost->direct_io_opens;
+
+    g_static_mutex_unlock(&rio_popularity_lock);
+
+    return cold;
+}
+
+/**
+ * @defgroup rio_mmap Memory-mapped backend
+ *
+ * @{
+ */
+
+typedef struct {
+    int fd;
+    uint8_t *map;
+
+    /** Size of the mapping, the size of the file when it was opened */
+    size_t length;
+
+    /**
+     * @brief End of the range the kernel has been asked to read ahead
+     */
+    int64_t advised;
+} RIOMap;
+
+static int rio_mmap_read(ResourceIO *rio, uint8_t *buf, int size)
+{
+    RIOMap *map = rio->priv;
+    struct stat st;
+    int len;
+
+    /* touching the pages past the end of a file truncated while it is
+       mapped raises SIGBUS: stop at its current end instead */
+    if ( fstat(map->fd, &st) == 0 && st.st_size < rio->size ) {
+        fnc_log(FNC_LOG_WARN, "[rio] %s: truncated while being read",
+                rio->path);
+        rio->size = st.st_size;
+    }
+
+    len = MIN((int64_t)size, rio->size - rio->pos);
+
+    if ( len <= 0 )
+        return 0;
+
+    if ( rio->pos + len > map->advised ) {
+        int64_t start = rio->pos & ~((int64_t)RIO_ALIGNMENT - 1);
+        size_t window = MIN((int64_t)rio->window, rio->size - start);
+
+        madvise(map->map + start, window, MADV_WILLNEED);
+        map->advised = start + window;
+
+        media_stat_add(MEDIA_STAT_IO_READS, 1);
+        media_stat_add(MEDIA_STAT_IO_BYTES, window);
+    }
+
+    memcpy(buf, map->map + rio->pos, len);
+
+    return len;
+}
+
+static void rio_mmap_seek(ResourceIO *rio)
+{
+    RIOMap *map = rio->priv;
+
+    /* make sure that the next read asks again for readahead from
+       the new position. */
+    map->advised = rio->pos;
+}
+
+static void rio_mmap_close(ResourceIO *rio)
+{
+    RIOMap *map = rio->priv;
+
+    munmap(map->map, map->length);
+    close(map->fd);
+    g_slice_free(RIOMap, map);
+}
+
+static const ResourceIOBackend rio_mmap_backend = {
+    .name = "mmap",
+    .read = rio_mmap_read,
+    .seek = rio_mmap_seek,
+    .close = rio_mmap_close
+};
+
+static gboolean rio_mmap_open(ResourceIO *rio, int fd)
+{
+    RIOMap *map;
+    void *addr;
+
+    if ( rio->size == 0 || (uint64_t)rio->size > SIZE_MAX )
+        return false;
+
+    if ( (addr = mmap(NULL, rio->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+        fnc_log(FNC_LOG_DEBUG, "[rio] unable to map %s: %s",
+                rio->path, strerror(errno));
+        return false;
+    }
+
+    madvise(addr, rio->size, MADV_SEQUENTIAL);
+
+    map = g_slice_new0(RIOMap);
+    map->fd = fd;
+    map->map = addr;
+    map->length = rio->size;
+
+    rio->priv = map;
+    rio->backend = &rio_mmap_backend;
+
+    return true;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup rio_readahead Asynchronous readahead backend
+ *
+ * @{
+ */
+
+typedef enum {
+    RIO_BLOCK_EMPTY,
+    RIO_BLOCK_LOADING,
+    RIO_BLOCK_READY
+} RIOBlockState;
+
+typedef struct RIOReadahead RIOReadahead;
+
+typedef struct {
+    RIOReadahead *parent;
+    uint8_t *data;
+    size_t capacity;
+
+    int64_t offset;
+    size_t len;         /*!< requested while loading, actual once ready */
+    RIOBlockState state;
+} RIOBlock;
+
+struct RIOReadahead {
+    int fd;
+
+    /**
+     * @brief The file was opened with O_DIRECT
+     *
+     * Only cleared, by the loading threads, if the filesystem turns
+     * out not to support it; protected by @ref lock, like the flags of
+     * @ref fd.
+     */
+    gboolean direct;
+
+    /**
+     * @brief Lock for the blocks' state
+     *
+     * The data of a block is only ever touched outside of the lock by
+     * the thread loading it, while in @ref RIO_BLOCK_LOADING state.
+     */
+    GMutex *lock;
+    GCond *cond;
+
+    RIOBlock blocks[2];
+};
+
+/**
+ * @brief Shared pool of threads loading the readahead blocks
+ */
+static GThreadPool *rio_pool;
+static GStaticMutex rio_pool_lock = G_STATIC_MUTEX_INIT;
+
+#define RIO_POOL_THREADS 4
+
+static void rio_load_cb(gpointer block_p, ATTR_UNUSED gpointer user_data)
+{
+    RIOBlock *block = block_p;
+    RIOReadahead *ra = block->parent;
+    gboolean direct;
+    size_t len, done = 0;
+
+    g_mutex_lock(ra->lock);
+    direct = ra->direct;
+    g_mutex_unlock(ra->lock);
+
+    /* direct reads have to be a multiple of the alignment, the last
+       block of the file is read short */
+    len = direct ? rio_align(block->len) : block->len;
+
+    while ( done < len ) {
+        ssize_t res = pread(ra->fd, block->data + done,
+                            len - done, block->offset + done);
+        if ( res < 0 && errno == EINTR )
+            continue;
+#ifdef O_DIRECT
+        if ( res < 0 && errno == EINVAL && direct ) {
+            /* the other block might be loading as well */
+            g_mutex_lock(ra->lock);
+            if ( ra->direct ) {
+                fnc_log(FNC_LOG_DEBUG, "[rio] direct reads not supported, "
+                        "using the page cache");
+                fcntl(ra->fd, F_SETFL, fcntl(ra->fd, F_GETFL) & ~O_DIRECT);
+                ra->direct = false;
+            }
+            g_mutex_unlock(ra->lock);
+
+            direct = false;
+            continue;
+        }
+#endif
+        if ( res <= 0 ) {
+            if ( res < 0 )
+                fnc_perror("pread");
+            break;
+        }
+        done += res;
+    }
+
+    done = MIN(done, block->len);
+
+    media_stat_add(MEDIA_STAT_IO_READS, 1);
+    media_stat_add(MEDIA_STAT_IO_BYTES, done);
+    if ( direct )
+        media_stat_add(MEDIA_STAT_IO_DIRECT_BYTES, done);
+
+    g_mutex_lock(ra->lock);
+    block->len = done;
+    block->state = RIO_BLOCK_READY;
+    g_cond_broadcast(ra->cond);
+    g_mutex_unlock(ra->lock);
+}
+
+/**
+ * @brief Start loading a block
+ *
+ * @note Call with the @ref RIOReadahead::lock held, and only for a
+ *       block that is not loading.
+ */
+static gboolean rio_block_load(ResourceIO *rio, RIOBlock *block, int64_t offset)
+{
+    RIOReadahead *ra = rio->priv;
+    size_t size = rio_align(rio->window);
+
+    if ( block->capacity < size ) {
+        void *data;
+
+        if ( posix_memalign(&data, RIO_ALIGNMENT, size) != 0 ) {
+            fnc_log(FNC_LOG_ERR, "[rio] unable to allocate %zu bytes", size);
+            return false;
+        }
+
+        free(block->data);
+        block->data = data;
+        block->capacity = size;
+    }
+
+    block->offset = offset;
+    block->len = MIN((int64_t)block->capacity, rio->size - offset);
+    block->state = RIO_BLOCK_LOADING;
+
+#ifdef POSIX_FADV_WILLNEED
+    if ( !ra->direct )
+        posix_fadvise(ra->fd, offset, block->len, POSIX_FADV_WILLNEED);
+#endif
+
+    g_static_mutex_lock(&rio_pool_lock);
+    if ( rio_pool == NULL )
+        rio_pool = g_thread_pool_new(rio_load_cb, NULL,
+                                     RIO_POOL_THREADS, false, NULL);
+    g_thread_pool_push(rio_pool, block, NULL);
+    g_static_mutex_unlock(&rio_pool_lock);
+
+    return true;
+}
+
+static inline gboolean rio_block_covers(const RIOBlock *block, int64_t pos)
+{
+    return block->state != RIO_BLOCK_EMPTY &&
+        pos >= block->offset && pos < block->offset + (int64_t)block->len;
+}
+
+static int rio_readahead_read(ResourceIO *rio, uint8_t *buf, int size)
+{
+    RIOReadahead *ra = rio->priv;
+    RIOBlock *block, *other;
+    int64_t next;
+    int len;
+
+    if ( rio->pos >= rio->size )
+        return 0;
+
+    g_mutex_lock(ra->lock);
+
+    while ( true ) {
+        if ( rio_block_covers(&ra->blocks[0], rio->pos) )
+            block = &ra->blocks[0];
+        else if ( rio_block_covers(&ra->blocks[1], rio->pos) )
+            block = &ra->blocks[1];
+        else if ( ra->blocks[0].state != RIO_BLOCK_LOADING ||
+                  ra->blocks[1].state != RIO_BLOCK_LOADING ) {
+            block = ra->blocks[0].state != RIO_BLOCK_LOADING ?
+                &ra->blocks[0] : &ra->blocks[1];
+
+            if ( !rio_block_load(rio, block,
+                                 rio->pos & ~((int64_t)RIO_ALIGNMENT - 1)) ) {
+                g_mutex_unlock(ra->lock);
+                return -1;
+            }
+            continue;
+        } else {
+            /* both blocks are busy with data we don't need */
+            g_cond_wait(ra->cond, ra->lock);
+            continue;
+        }
+
+        if ( block->state == RIO_BLOCK_LOADING ) {
+            g_cond_wait(ra->cond, ra->lock);
+            continue;
+        }
+
+        break;
+    }
+
+    /* short read, most likely an I/O error */
+    if ( block->len == 0 ) {
+        block->state = RIO_BLOCK_EMPTY;
+        g_mutex_unlock(ra->lock);
+        return -1;
+    }
+
+    len = MIN((int64_t)size, block->offset + (int64_t)block->len - rio->pos);
+    memcpy(buf, block->data + (rio->pos - block->offset), len);
+
+    /* make sure the other block is reading what comes next */
+    other = (block == &ra->blocks[0]) ? &ra->blocks[1] : &ra->blocks[0];
+    next = block->offset + block->len;
+    if ( next < rio->size &&
+         other->state != RIO_BLOCK_LOADING &&
+         !rio_block_covers(other, next) )
+        rio_block_load(rio, other, next);
+
+    g_mutex_unlock(ra->lock);
+
+    return len;
+}
+
+static void rio_readahead_close(ResourceIO *rio)
+{
+    RIOReadahead *ra = rio->priv;
+
+    /* wait for the pool to be done with our blocks */
+    g_mutex_lock(ra->lock);
+    while ( ra->blocks[0].state == RIO_BLOCK_LOADING ||
+            ra->blocks[1].state == RIO_BLOCK_LOADING )
+        g_cond_wait(ra->cond, ra->lock);
+    g_mutex_unlock(ra->lock);
+
+    free(ra->blocks[0].data);
+    free(ra->blocks[1].data);
+
+    g_mutex_free(ra->lock);
+    g_cond_free(ra->cond);
+
+    close(ra->fd);
+    g_slice_free(RIOReadahead, ra);
+}
+
+static const ResourceIOBackend rio_readahead_backend = {
+    .name = "readahead",
+    .read = rio_readahead_read,
+    .close = rio_readahead_close
+};
+
+static const ResourceIOBackend rio_direct_backend = {
+    .name = "direct",
+    .read = rio_readahead_read,
+    .close = rio_readahead_close
+};
+
+/**
+ * @param direct The file was opened with O_DIRECT
+ */
+static gboolean rio_readahead_open(ResourceIO *rio, int fd, gboolean direct)
+{
+    RIOReadahead *ra = g_slice_new0(RIOReadahead);
+
+    ra->fd = fd;
+    ra->direct = direct;
+    ra->lock = g_mutex_new();
+    ra->cond = g_cond_new();
+    ra->blocks[0].parent = ra;
+    ra->blocks[1].parent = ra;
+
+    rio->priv = ra;
+    rio->backend = direct ? &rio_direct_backend : &rio_readahead_backend;
+
+    return true;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup rio_origin Pull-through cache backend
+ *
+ * @{
+ */
+
+typedef struct {
+    SegmentCache *sc;
+
+    /** Path of the file, relative to the origin */
+    const char *path;
+
+    /** Index of the segment read last, see @ref segcache_touch */
+    gint64 cursor;
+} RIOOrigin;
+
+static SegmentCache *rio_segcache;
+static gboolean rio_segcache_tried;
+static GStaticMutex rio_segcache_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Get the segment cache of the default virtual host
+ *
+ * @return The cache, created at the first call, or NULL if the virtual
+ *         host has no (valid) origin.
+ *
+ * A virtual host with a cache directory but no origin caches the files
+ * of its own document root, so that a directory on faster storage
+ * fronts the one of the resources.
+ */
+SegmentCache *rio_segment_cache(void)
+{
+    cfg_vhost_t *vhost = feng_default_vhost;
+    const char *origin = vhost->origin ? vhost->origin :
+        vhost->cache_dir ? vhost->document_root : NULL;
+
+    g_static_mutex_lock(&rio_segcache_lock);
+
+    if ( !rio_segcache_tried && origin != NULL ) {
+        rio_segcache_tried = true;
+
+        rio_segcache = segcache_new(origin, vhost->cache_dir,
+                                    (size_t)vhost->cache_segment_size * 1024,
+                                    (size_t)vhost->cache_memory * 1024 * 1024,
+                                    vhost->cache_prefetch);
+        if ( rio_segcache == NULL )
+            fnc_log(FNC_LOG_ERR, "[rio] invalid origin %s", origin);
+        else
+            segcache_set_disk_policy(rio_segcache,
+                                     (size_t)vhost->cache_disk_size * 1024 * 1024,
+                                     vhost->cache_disk_admit);
+    }
+
+    g_static_mutex_unlock(&rio_segcache_lock);
+
+    return rio_segcache;
+}
+
+/**
+ * @brief Get the segment cache of the default virtual host, if it was
+ *        created already
+ *
+ * Unlike @ref rio_segment_cache, this never creates the cache, so that
+ * reporting its state does not scan the cache directory nor start its
+ * threads.
+ */
+SegmentCache *rio_segment_cache_peek(void)
+{
+    SegmentCache *sc;
+
+    g_static_mutex_lock(&rio_segcache_lock);
+    sc = rio_segcache;
+    g_static_mutex_unlock(&rio_segcache_lock);
+
+    return sc;
+}
+
+/**
+ * @brief Find the path of a file relative to the origin
+ *
+ * @return A pointer within @p path, or NULL if the file is not within
+ *         the document root, and is then read locally.
+ */
+static const char *rio_origin_path(const char *path)
+{
+    const char *root = feng_default_vhost->document_root;
+    const size_t len = strlen(root);
+
+    if ( strncmp(path, root, len) != 0 ||
+         (path[len] != '/' && path[len] != '\0') )
+        return NULL;
+
+    path += len;
+    while ( *path == '/' )
+        path++;
+
+    return path;
+}
+
+static int rio_origin_read(ResourceIO *rio, uint8_t *buf, int size)
+{
+    RIOOrigin *origin = rio->priv;
+    int len;
+
+    segcache_touch(origin->sc, origin->path, rio->mtime, rio->pos,
+                   &origin->cursor);
+    len = segcache_read(origin->sc, origin->path, rio->mtime,
+                        rio->size, rio->pos, buf, size);
+
+    if ( len < 0 )
+        fnc_log(FNC_LOG_ERR, "[rio] unable to fetch %s at %" G_GINT64_FORMAT,
+                origin->path, (gint64)rio->pos);
+
+    return len;
+}
+
+static void rio_origin_close(ResourceIO *rio)
+{
+    g_slice_free(RIOOrigin, rio->priv);
+}
+
+static const ResourceIOBackend rio_origin_backend = {
+    .name = "origin",
+    .read = rio_origin_read,
+    .close = rio_origin_close
+};
+
+static ResourceIO *rio_origin_open(SegmentCache *sc, const char *path,
+                                   const char *relative)
+{
+    ResourceIO *rio;
+    RIOOrigin *origin;
+    int64_t size;
+    time_t mtime;
+
+    if ( !segcache_stat(sc, relative, &size, &mtime) ) {
+        fnc_log(FNC_LOG_ERR, "[rio] %s not found on the origin", relative);
+        return NULL;
+    }
+
+    rio = g_slice_new0(ResourceIO);
+    rio->path = g_strdup(path);
+    rio->size = size;
+    rio->mtime = mtime;
+    rio->window = RIO_WINDOW_DEFAULT;
+
+    origin = g_slice_new(RIOOrigin);
+    origin->sc = sc;
+    origin->path = rio_origin_path(rio->path);
+    origin->cursor = -1;
+
+    rio->priv = origin;
+    rio->backend = &rio_origin_backend;
+
+    fnc_log(FNC_LOG_DEBUG, "[rio] %s opened through the origin", path);
+
+    return rio;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @brief Check that a stored resource exists
+ *
+ * @param path The full path of the resource
+ * @param mtime Set to the modification time of the resource
+ *
+ * @retval true The resource is a regular file, on the origin of the
+ *              virtual host if there is one, or local otherwise.
+ * @retval false The resource cannot be found or is not a file.
+ */
+gboolean rio_stat(const char *path, time_t *mtime)
+{
+    SegmentCache *sc = rio_segment_cache();
+    const char *relative;
+    struct stat filestat;
+    int64_t size;
+
+    if ( sc && (relative = rio_origin_path(path)) ) {
+        if ( !segcache_stat(sc, relative, &size, mtime) ) {
+            fnc_log(FNC_LOG_ERR, "[rio] %s not found on the origin", relative);
+            return false;
+        }
+
+        return true;
+    }
+
+    if ( stat(path, &filestat) < 0 ) {
+        fnc_perror("stat");
+        return false;
+    }
+
+    if ( !S_ISREG(filestat.st_mode) ) {
+        fnc_log(FNC_LOG_ERR, "%s: not a file", path);
+        return false;
+    }
+
+    *mtime = filestat.st_mtime;
+
+    return true;
+}
+
+/**
+ * @brief Open a stored resource for reading
+ *
+ * @param path The full path to the file to open
+ *
+ * @return A new ResourceIO instance, or NULL if the file cannot be
+ *         opened.
+ *
+ * Files within the document root of a virtual host with an origin go
+ * through the segment cache; otherwise, seldom requested files are read
+ * bypassing the page cache where supported, files on network
+ * filesystems use the readahead backend, any other file is
+ * memory-mapped (falling back to readahead if that fails).
+ */
+ResourceIO *rio_open(const char *path)
+{
+    ResourceIO *rio;
+    SegmentCache *sc;
+    const char *relative;
+    struct stat filestat;
+    gboolean direct = false;
+    int fd = -1;
+
+    if ( (sc = rio_segment_cache()) && (relative = rio_origin_path(path)) )
+        return rio_origin_open(sc, path, relative);
+
+#ifdef O_DIRECT
+    if ( rio_is_cold(path) &&
+         (fd = open(path, O_RDONLY | O_DIRECT)) >= 0 ) {
+        direct = true;
+        media_stat_add(MEDIA_STAT_IO_DIRECT_OPENS, 1);
+    }
+#endif
+
+    if ( fd < 0 && (fd = open(path, O_RDONLY)) < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[rio] unable to open %s: %s",
+                path, strerror(errno));
+        return NULL;
+    }
+
+    if ( fstat(fd, &filestat) < 0 ) {
+        fnc_perror("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    rio = g_slice_new0(ResourceIO);
+    rio->path = g_strdup(path);
+    rio->size = filestat.st_size;
+    rio->mtime = filestat.st_mtime;
+    rio->window = RIO_WINDOW_DEFAULT;
+
+    if ( direct ) {
+        rio_readahead_open(rio, fd, true);
+    } else {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        if ( rio_is_remote(fd) || !rio_mmap_open(rio, fd) )
+            rio_readahead_open(rio, fd, false);
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "[rio] %s opened with %s backend",
+            path, rio->backend->name);
+
+    return rio;
+}
+
+/**
+ * @brief Read data from a resource
+ *
+ * @return The amount of bytes read, zero at the end of file or a
+ *         negative value in case of error.
+ */
+int rio_read(ResourceIO *rio, uint8_t *buf, int size)
+{
+    int len = rio->backend->read(rio, buf, size);
+
+    if ( len > 0 )
+        rio->pos += len;
+
+    return len;
+}
+
+/**
+ * @brief Change the position of a resource
+ *
+ * @param offset The offset, interpreted as per @p whence
+ * @param whence One of SEEK_SET, SEEK_CUR or SEEK_END
+ *
+ * @return The new position, or -1 if the position is invalid.
+ */
+int64_t rio_seek(ResourceIO *rio, int64_t offset, int whence)
+{
+    int64_t pos;
+
+    switch ( whence ) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = rio->pos + offset; break;
+    case SEEK_END: pos = rio->size + offset; break;
+    default: return -1;
+    }
+
+    if ( pos < 0 )
+        return -1;
+
+    rio->pos = pos;
+
+    if ( rio->backend->seek )
+        rio->backend->seek(rio);
+
+    return pos;
+}
+
+/**
+ * @brief Size the readahead after the bitrate of the resource
+ *
+ * @param bit_rate The overall bitrate of the resource, in bits per
+ *                 second; zero if unknown.
+ *
+ * The readahead window covers @ref cfg_options_t::readahead_time
+ * milliseconds of data, clamped so that neither tiny nor huge
+ * reads are issued.
+ */
+void rio_set_bitrate(ResourceIO *rio, int64_t bit_rate)
+{
+    int64_t window;
+
+    if ( bit_rate <= 0 )
+        return;
+
+    window = bit_rate / 8 * feng_srv.readahead_time / 1000;
+    window = CLAMP(window, RIO_WINDOW_MIN, RIO_WINDOW_MAX);
+
+    rio->window = rio_align(window);
+
+    fnc_log(FNC_LOG_DEBUG, "[rio] %s readahead set to %zu bytes",
+            rio->path, rio->window);
+}
+
+void rio_close(ResourceIO *rio)
+{
+    if ( rio == NULL )
+        return;
+
+    rio->backend->close(rio);
+
+    g_free(rio->path);
+    g_slice_free(ResourceIO, rio);
+}
@@ -57,6 +57,53 @@ struct flux_msg {
 
 static gpointer flux_read_messages(gpointer ptr);
 
+/**
+ * @brief Tells whether the buffers of a live track are used
+ *
+ * Besides the RTSP clients, the buffers can be archived (see @ref
+ * archive_write) or segmented for HLS (see @ref hls_live_write).
+ */
+gboolean live_track_wanted(Track *tr)
+{
+    if ( tr->consumers > 0 || tr->archive != NULL )
+        return true;
+
+#ifdef HAVE_AVFORMAT
+    return hls_live_wanted(tr);
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Hand a buffer of a live track to its archive, its HLS
+ *        segmenter and its clients
+ *
+ * @param tr The live track the buffer was produced for
+ * @param buffer The buffer, owned by the function afterwards
+ */
+void live_track_write(Track *tr, struct MParserBuffer *buffer)
+{
+    /* the archive and the segmenter read the data of the buffer */
+    if ( tr->archive || tr->hls )
+        mparser_buffer_flatten(buffer);
+
+    if ( tr->archive )
+        archive_write(tr, buffer);
+
+#ifdef HAVE_AVFORMAT
+    if ( tr->hls )
+        hls_live_write(tr, buffer);
+#endif
+
+    if ( tr->consumers == 0 ) {
+        mparser_buffer_free(buffer);
+        return;
+    }
+
+    track_write(tr, buffer);
+}
+
 /**
  * @brief Uninitialisation function for the demuxer_sd fake parser
  *
@@ -401,8 +448,11 @@ static gpointer flux_read_messages(gpointer ptr) {
              * Note that we don't need to use atomic operations
              * because, even if there are no consumers but we did keep
              * the loop running, we'd just be creating extra objects.
+             *
+             * Tracks that are archived or segmented for HLS are read
+             * anyway.
              */
-            if ( tr->consumers == 0 )
+            if ( !live_track_wanted(tr) )
                 continue;
 
             delta = ev_time() - message->insertion_time;
@@ -458,7 +508,7 @@ static gpointer flux_read_messages(gpointer ptr) {
                     ev_time() - buffer->delivery);
 #endif
 
-            track_write(tr, buffer);
+            live_track_write(tr, buffer);
         }
 
     error:
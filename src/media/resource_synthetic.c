@@ -0,0 +1,695 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Synthetic resources
+ *
+ * Resources under the /synthetic/ path are not read from any file:
+ * their frames are generated in memory, already packetized, with the
+ * timing and the sizes a real stream with the requested parameters
+ * would have. They are meant for load testing, to measure the cost of
+ * scheduling and sending the packets without any I/O or demuxing
+ * involved.
+ *
+ * The path describes the tracks, separated by '+', each one being the
+ * name of a codec optionally followed by ':'-separated parameters:
+ *
+ * @code
+ * /synthetic/h264:bitrate=8M:fps=60:gop=2s+aac:bitrate=128k
+ * @endcode
+ *
+ * The parameters are not passed as an URL query since the track names
+ * are appended to the presentation URL by the clients.
+ *
+ * Supported parameters are bitrate (with k, M, G suffixes), fps and
+ * gop (in seconds, or with an ms suffix) for video; bitrate, rate and
+ * channels for audio; duration (in seconds) for any track, applying to
+ * the whole resource.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/** Duration of synthetic resources unless requested otherwise */
+#define SYNTH_DEFAULT_DURATION 3600.0
+
+/** Highest bitrate a synthetic track can be requested with */
+#define SYNTH_MAX_BITRATE 200e6
+
+/** Highest frame rate a synthetic video track can be requested with */
+#define SYNTH_MAX_FPS 240.0
+
+/** Size of a keyframe compared to the other frames of the GOP */
+#define SYNTH_KEYFRAME_WEIGHT 8
+
+/** Size of the data the payloads are copied from */
+#define SYNTH_NOISE_SIZE 65536
+
+typedef struct SyntheticTrack SyntheticTrack;
+
+/**
+ * @brief Codec a synthetic track can be generated for
+ */
+typedef struct SyntheticCodec {
+    const char *name;
+    const char *encoding_name;
+    MediaType media_type;
+
+    /** Static payload type, or -1 for a dynamic one */
+    int payload_type;
+
+    /** Default bitrate, in bits per second */
+    double bitrate;
+
+    /** Samples per frame for audio codecs */
+    int samples;
+
+    /** Bits per sample for uncompressed audio, zero otherwise */
+    int bits;
+
+    /** Default sample rate and channels for audio codecs */
+    int rate;
+    int channels;
+
+    /** Append the format parameters to the SDP description */
+    gboolean (*describe)(SyntheticTrack *st);
+
+    /** Write the RTP payloads of a frame to the track */
+    void (*packetize)(SyntheticTrack *st, double time,
+                      size_t size, gboolean key);
+} SyntheticCodec;
+
+struct SyntheticTrack {
+    const SyntheticCodec *codec;
+    Track *track;
+
+    double bitrate;
+    double fps;
+
+    /** Frames between two keyframes, video only */
+    guint gop_frames;
+
+    int rate;
+    int channels;
+
+    /** Next frame to generate */
+    gint64 frame;
+};
+
+/**
+ * @brief State of a synthetic resource
+ *
+ * @see Resource::stored::synthetic
+ */
+struct SyntheticSource {
+    SyntheticTrack *tracks;
+    guint count;
+};
+
+static uint8_t synth_noise[SYNTH_NOISE_SIZE];
+
+static gpointer synth_noise_init(ATTR_UNUSED gpointer data)
+{
+    guint32 x = 0x12345678;
+    size_t i;
+
+    for ( i = 0; i < SYNTH_NOISE_SIZE; i++ ) {
+        x = x * 1103515245 + 12345;
+        synth_noise[i] = x >> 24;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Variation of the size of a frame, between 0.8 and 1.2
+ *
+ * Derived from the frame number only, so that the same frames are
+ * generated again after a seek.
+ */
+static double synth_jitter(gint64 frame)
+{
+    const guint32 x = (guint32)frame * 2654435761u;
+
+    return 0.8 + 0.4 * ((x >> 16) & 0xffff) / 65535.0;
+}
+
+/**
+ * @brief Queue a payload of a frame on the track
+ *
+ * @param header Bytes the payload starts with
+ * @param header_len Length of @p header
+ * @param size Total size of the payload, including the header
+ */
+static void synth_write(SyntheticTrack *st, double time, gboolean marker,
+                        const uint8_t *header, size_t header_len,
+                        size_t size)
+{
+    struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+    const size_t offset = (st->frame * 7919 + size) %
+        (SYNTH_NOISE_SIZE - DEFAULT_MTU);
+
+    buffer->timestamp = time;
+    buffer->delivery = time;
+    buffer->duration = 1 / st->fps;
+    buffer->marker = marker;
+
+    buffer->data_size = size;
+    buffer->data = g_malloc(size);
+
+    memcpy(buffer->data, header, header_len);
+    memcpy(buffer->data + header_len, synth_noise + offset,
+           size - header_len);
+
+    track_write(st->track, buffer);
+}
+
+static gboolean synth_h264_describe(SyntheticTrack *st)
+{
+    sdp_descr_append_rtpmap(st->track);
+    g_string_append_printf(st->track->sdp_description,
+                           "a=fmtp:%u packetization-mode=1;"
+                           "profile-level-id=42e01f\r\n",
+                           st->track->payload_type);
+
+    return true;
+}
+
+/**
+ * @brief Packetize a frame as a single NAL, fragmented with FU-A when
+ *        it does not fit the MTU
+ */
+static void synth_h264_packetize(SyntheticTrack *st, double time,
+                                 size_t size, gboolean key)
+{
+    const uint8_t nal = key ? 0x65 : 0x41;
+    uint8_t header[2] = { (nal & 0xe0) | 28, (nal & 0x1f) | (1<<7) };
+
+    if ( size <= DEFAULT_MTU ) {
+        synth_write(st, time, true, &nal, 1, size);
+        return;
+    }
+
+    /* the NAL header is carried by the FU headers */
+    size--;
+
+    while ( size > 0 ) {
+        const size_t fraglen = MIN(DEFAULT_MTU - 2, size);
+
+        if ( fraglen == size )
+            header[1] |= (1<<6);
+
+        synth_write(st, time, fraglen == size, header, 2, fraglen + 2);
+
+        header[1] &= ~(1<<7);
+        size -= fraglen;
+    }
+}
+
+static gboolean synth_mp4v_describe(SyntheticTrack *st)
+{
+    sdp_descr_append_rtpmap(st->track);
+    g_string_append_printf(st->track->sdp_description,
+                           "a=fmtp:%u profile-level-id=1;\r\n",
+                           st->track->payload_type);
+
+    return true;
+}
+
+/**
+ * @brief Packetize a VOP, split at the MTU
+ */
+static void synth_mp4v_packetize(SyntheticTrack *st, double time,
+                                 size_t size, gboolean key)
+{
+    const uint8_t vop[5] = { 0x00, 0x00, 0x01, 0xb6, key ? 0x00 : 0x40 };
+    gboolean start = true;
+
+    size = MAX(size, sizeof(vop));
+
+    while ( size > 0 ) {
+        const size_t len = MIN(DEFAULT_MTU, size);
+
+        synth_write(st, time, len == size, vop, start ? sizeof(vop) : 0, len);
+
+        start = false;
+        size -= len;
+    }
+}
+
+static gboolean synth_aac_describe(SyntheticTrack *st)
+{
+    static const int rates[] = {
+        96000, 88200, 64000, 48000, 44100, 32000,
+        24000, 22050, 16000, 12000, 11025, 8000, 7350
+    };
+    unsigned int i;
+
+    for ( i = 0; i < G_N_ELEMENTS(rates); i++ )
+        if ( rates[i] == st->rate )
+            break;
+
+    if ( i == G_N_ELEMENTS(rates) || st->channels > 7 )
+        return false;
+
+    sdp_descr_append_rtpmap(st->track);
+    g_string_append_printf(st->track->sdp_description,
+                           "a=fmtp:%u streamtype=5;profile-level-id=1;"
+                           "mode=AAC-hbr;sizeLength=13;indexLength=3;"
+                           "indexDeltaLength=3; config=%04X;\r\n",
+                           st->track->payload_type,
+                           /* AAC LC AudioSpecificConfig */
+                           (2 << 11) | (i << 7) | (st->channels << 3));
+
+    return true;
+}
+
+/**
+ * @brief Packetize an access unit with its AU header, as aac_parse
+ *        does
+ */
+static void synth_aac_packetize(SyntheticTrack *st, double time,
+                                size_t size, ATTR_UNUSED gboolean key)
+{
+    const uint8_t header[4] = { 0x00, 0x10,
+                                (size & 0x1fe0) >> 5, (size & 0x1f) << 3 };
+
+    while ( size > 0 ) {
+        const size_t len = MIN(DEFAULT_MTU - sizeof(header), size);
+
+        synth_write(st, time, len == size, header, sizeof(header),
+                    len + sizeof(header));
+
+        size -= len;
+    }
+}
+
+static gboolean synth_pcmu_describe(SyntheticTrack *st)
+{
+    if ( st->rate != 8000 || st->channels != 1 )
+        sdp_descr_append_rtpmap(st->track);
+
+    return true;
+}
+
+/**
+ * @brief Packetize a frame of silence
+ */
+static void synth_pcmu_packetize(SyntheticTrack *st, double time,
+                                 size_t size, ATTR_UNUSED gboolean key)
+{
+    struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+
+    buffer->timestamp = time;
+    buffer->delivery = time;
+    buffer->duration = 1 / st->fps;
+
+    buffer->data_size = size;
+    buffer->data = g_malloc(size);
+    memset(buffer->data, 0xff, size);
+
+    track_write(st->track, buffer);
+}
+
+static const SyntheticCodec synth_codecs[] = {
+    { "h264", "H264", MP_video, -1, 2e6, 0, 0, 0, 0,
+      synth_h264_describe, synth_h264_packetize },
+    { "mp4v", "MP4V-ES", MP_video, -1, 1e6, 0, 0, 0, 0,
+      synth_mp4v_describe, synth_mp4v_packetize },
+    { "aac", "mpeg4-generic", MP_audio, -1, 128e3, 1024, 0, 48000, 2,
+      synth_aac_describe, synth_aac_packetize },
+    /* 20ms frames at 8kHz */
+    { "pcmu", "PCMU", MP_audio, 0, 0, 160, 8, 8000, 1,
+      synth_pcmu_describe, synth_pcmu_packetize },
+};
+
+/**
+ * @brief Parse a value with an optional k, M or G multiplier
+ */
+static gboolean synth_parse_rate(const char *str, double *value)
+{
+    char *end;
+
+    *value = g_ascii_strtod(str, &end);
+
+    switch ( *end ) {
+    case 'k': case 'K': *value *= 1e3; end++; break;
+    case 'M': *value *= 1e6; end++; break;
+    case 'G': *value *= 1e9; end++; break;
+    }
+
+    return end != str && *end == '\0' && *value > 0;
+}
+
+/**
+ * @brief Parse a time in seconds, with an optional s or ms suffix
+ */
+static gboolean synth_parse_time(const char *str, double *value)
+{
+    char *end;
+
+    *value = g_ascii_strtod(str, &end);
+
+    if ( strcmp(end, "ms") == 0 ) {
+        *value /= 1000;
+        end += 2;
+    } else if ( *end == 's' )
+        end++;
+
+    return end != str && *end == '\0' && *value > 0;
+}
+
+/**
+ * @brief Set up a synthetic track from its description
+ *
+ * @param st The track to set up
+ * @param spec The codec name followed by its parameters
+ * @param duration Set to the requested duration, if any
+ *
+ * @return true if the description is valid.
+ */
+static gboolean synth_track_parse(SyntheticTrack *st, const char *spec,
+                                  double *duration)
+{
+    gchar **params = g_strsplit(spec, ":", 0);
+    double gop = 2.0, value;
+    gboolean ok = false;
+    unsigned int i;
+
+    for ( i = 0; i < G_N_ELEMENTS(synth_codecs); i++ )
+        if ( strcmp(params[0], synth_codecs[i].name) == 0 )
+            st->codec = &synth_codecs[i];
+
+    if ( st->codec == NULL ) {
+        fnc_log(FNC_LOG_ERR, "[synthetic] unknown codec '%s'", params[0]);
+        goto end;
+    }
+
+    st->bitrate = st->codec->bitrate;
+    st->fps = 25;
+    st->rate = st->codec->rate;
+    st->channels = st->codec->channels;
+
+    for ( i = 1; params[i]; i++ ) {
+        char *val = strchr(params[i], '=');
+        gboolean valid = false;
+
+        if ( val == NULL )
+            goto invalid;
+
+        *val++ = '\0';
+
+        if ( strcmp(params[i], "bitrate") == 0 )
+            valid = st->codec->bits == 0 &&
+                synth_parse_rate(val, &st->bitrate) &&
+                st->bitrate <= SYNTH_MAX_BITRATE;
+        else if ( strcmp(params[i], "fps") == 0 )
+            valid = st->codec->media_type == MP_video &&
+                synth_parse_rate(val, &st->fps) && st->fps <= SYNTH_MAX_FPS;
+        else if ( strcmp(params[i], "gop") == 0 )
+            valid = st->codec->media_type == MP_video &&
+                synth_parse_time(val, &gop);
+        else if ( strcmp(params[i], "rate") == 0 )
+            valid = st->codec->media_type == MP_audio &&
+                synth_parse_rate(val, &value) &&
+                (st->rate = value) > 0 && st->rate <= 192000;
+        else if ( strcmp(params[i], "channels") == 0 )
+            valid = st->codec->media_type == MP_audio &&
+                (st->channels = atoi(val)) > 0 && st->channels <= 8;
+        else if ( strcmp(params[i], "duration") == 0 )
+            valid = synth_parse_time(val, duration);
+
+        if ( valid )
+            continue;
+
+    invalid:
+        fnc_log(FNC_LOG_ERR, "[synthetic] invalid parameter '%s' for %s",
+                params[i], params[0]);
+        goto end;
+    }
+
+    if ( st->codec->bits )
+        st->bitrate = st->rate * st->channels * st->codec->bits;
+
+    if ( st->codec->media_type == MP_audio )
+        st->fps = (double)st->rate / st->codec->samples;
+    else
+        st->gop_frames = MAX(1, lrint(gop * st->fps));
+
+    ok = true;
+
+ end:
+    g_strfreev(params);
+    return ok;
+}
+
+/**
+ * @brief Size of the next frame of a track, in bytes
+ *
+ * The bitrate is spread over the GOP so that keyframes are
+ * @ref SYNTH_KEYFRAME_WEIGHT times the other frames.
+ */
+static size_t synth_frame_size(SyntheticTrack *st, gboolean key)
+{
+    const double frame = st->bitrate / 8 / st->fps;
+    double size;
+
+    if ( st->codec->bits )
+        return lrint(frame);
+
+    /* the size of an AU header is 13 bits */
+    if ( st->codec->media_type == MP_audio )
+        return CLAMP(lrint(frame * (0.9 + synth_jitter(st->frame) / 8)),
+                     1, 8191);
+
+    size = frame * st->gop_frames /
+        (st->gop_frames - 1 + SYNTH_KEYFRAME_WEIGHT);
+
+    if ( key )
+        return MAX(2, lrint(size * SYNTH_KEYFRAME_WEIGHT));
+
+    return MAX(2, lrint(size * synth_jitter(st->frame)));
+}
+
+/**
+ * @brief Generate the next frame of the resource
+ *
+ * The frames of the tracks are interleaved by time; tracks with no
+ * consumers are skipped, unless no track is consumed at all.
+ */
+static int synth_read_packet(Resource *r)
+{
+    struct SyntheticSource *src = r->stored.synthetic;
+    gboolean any = false;
+    guint i;
+
+    for ( i = 0; i < src->count; i++ )
+        any = any || track_wanted(src->tracks[i].track);
+
+    while ( true ) {
+        SyntheticTrack *st = NULL;
+        double time = HUGE_VAL, t;
+        gboolean key;
+
+        for ( i = 0; i < src->count; i++ ) {
+            SyntheticTrack *cand = &src->tracks[i];
+
+            if ( cand->track->clipped ||
+                 (any && !track_wanted(cand->track)) )
+                continue;
+
+            if ( (t = cand->frame / cand->fps) < time ) {
+                time = t;
+                st = cand;
+            }
+        }
+
+        if ( st == NULL )
+            return RESOURCE_CLIP_END;
+
+        if ( time >= r->duration )
+            return RESOURCE_EOF;
+
+        if ( time >= r->stored.clip_end ) {
+            st->track->clipped = true;
+            continue;
+        }
+
+        key = st->gop_frames && st->frame % st->gop_frames == 0;
+
+        /* as for the demuxed resources, video is kept from the
+           keyframe the resource was seeked to */
+        if ( st->codec->media_type != MP_video &&
+             time < r->stored.clip_start ) {
+            st->frame++;
+            continue;
+        }
+
+        st->codec->packetize(st, time + r->stored.timeline_offset,
+                             synth_frame_size(st, key), key);
+        st->frame++;
+
+        return RESOURCE_OK;
+    }
+}
+
+/**
+ * @brief Move the tracks to the keyframe preceding the requested time
+ */
+static int synth_seek(Resource *r, double *time_sec)
+{
+    struct SyntheticSource *src = r->stored.synthetic;
+    const double requested = MAX(0, *time_sec);
+    double time = requested;
+    guint i;
+
+    for ( i = 0; i < src->count; i++ ) {
+        SyntheticTrack *st = &src->tracks[i];
+
+        if ( st->gop_frames ) {
+            const gint64 frame = floor(requested * st->fps + 1e-9);
+
+            time = MIN(time, (frame - frame % st->gop_frames) / st->fps);
+        }
+    }
+
+    for ( i = 0; i < src->count; i++ ) {
+        SyntheticTrack *st = &src->tracks[i];
+
+        st->frame = ceil(time * st->fps - 1e-9);
+    }
+
+    *time_sec = time;
+
+    return 0;
+}
+
+static void synth_uninit(gpointer rgen)
+{
+    Resource *r = rgen;
+
+    g_free(r->stored.synthetic->tracks);
+    g_slice_free(struct SyntheticSource, r->stored.synthetic);
+}
+
+/**
+ * @brief Open a synthetic resource
+ *
+ * @param url The description of the tracks, the path following
+ *            /synthetic/
+ *
+ * @return A new resource, or NULL if synthetic resources are not
+ *         enabled or the description is not valid.
+ */
+Resource *synth_open(const char *url)
+{
+    static GOnce noise_once = G_ONCE_INIT;
+    struct SyntheticSource *src;
+    gchar **specs;
+    double duration = SYNTH_DEFAULT_DURATION;
+    int next_dynamic_payload = 96;
+    Resource *r;
+    guint i;
+
+    if ( !feng_default_vhost->synthetic_resources ) {
+        fnc_log(FNC_LOG_ERR, "[synthetic] synthetic resources not enabled");
+        return NULL;
+    }
+
+    g_once(&noise_once, synth_noise_init, NULL);
+
+    specs = g_strsplit(url, "+", 0);
+
+    src = g_slice_new0(struct SyntheticSource);
+    src->count = g_strv_length(specs);
+    src->tracks = g_new0(SyntheticTrack, src->count);
+
+    r = g_slice_new0(Resource);
+    r->mrl = g_strconcat("synthetic:", url, NULL);
+    r->source = STORED_SOURCE;
+    r->stored.synthetic = src;
+    r->uninit = synth_uninit;
+
+    if ( src->count == 0 )
+        goto error;
+
+    for ( i = 0; i < src->count; i++ ) {
+        SyntheticTrack *st = &src->tracks[i];
+        Track *track;
+
+        if ( !synth_track_parse(st, specs[i], &duration) )
+            goto error;
+
+        /* the same codec can be used by more tracks */
+        track = r_find_track(r, st->codec->name) ?
+            track_new(g_strdup_printf("%s%u", st->codec->name, i)) :
+            track_new(g_strdup(st->codec->name));
+
+        st->track = track;
+        track->parent = r;
+        r->tracks = g_list_append(r->tracks, track);
+
+        track->encoding_name = g_strdup(st->codec->encoding_name);
+        track->media_type = st->codec->media_type;
+        track->payload_type = st->codec->payload_type >= 0 ?
+            st->codec->payload_type : next_dynamic_payload++;
+        track->frame_duration = 1 / st->fps;
+
+        if ( track->media_type == MP_audio ) {
+            track->clock_rate = st->rate;
+            track->audio_channels = st->channels;
+        } else
+            track->clock_rate = 90000;
+
+        if ( !st->codec->describe(st) ) {
+            fnc_log(FNC_LOG_ERR, "[synthetic] unsupported parameters for %s",
+                    specs[i]);
+            goto error;
+        }
+    }
+
+    g_strfreev(specs);
+
+    r->lock = g_mutex_new();
+    r->read_packet = synth_read_packet;
+    r->seek = synth_seek;
+    r->duration = duration;
+    r_set_clip(r, 0, HUGE_VAL, 0);
+
+    fnc_log(FNC_LOG_DEBUG, "[synthetic] %u tracks, duration %f",
+            src->count, r->duration);
+
+    return r;
+
+ error:
+    g_strfreev(specs);
+    r_close(r);
+    return NULL;
+}
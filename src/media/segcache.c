@@ -0,0 +1,1329 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Pull-through cache of file segments fetched from an origin
+ *
+ * Files are split in segments of a fixed size, fetched on demand from
+ * the origin, which is either a directory or an HTTP server honouring
+ * byte ranges, and kept in memory and, optionally, in a local cache
+ * directory.
+ *
+ * Concurrent misses for the same segment are coalesced: the first
+ * reader fetches it while the others wait for it. The first read of a
+ * segment following one already read also schedules the next ones to
+ * be fetched in background, so that sequential playback rarely waits
+ * on the origin, while random access does not read ahead.
+ *
+ * The segments are ranked by how many times the readers entered them
+ * (see @ref segcache_touch), with the counts halved over time: the
+ * least accessed among the least recently used segments are the ones
+ * evicted from memory, and only segments accessed often enough are
+ * promoted to the cache directory, which is bounded in size as well.
+ * This way a local directory on faster storage (such as an SSD) can
+ * front an origin on slower one (such as spinning disks).
+ *
+ * This file does not depend on the rest of the server, so that it can
+ * be tested against a local directory standing in for the origin.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "media/media.h"
+
+/** Seconds to wait for the HTTP origin before giving up */
+#define SEGCACHE_HTTP_TIMEOUT 10
+/** Maximum size of the headers of an HTTP response */
+#define SEGCACHE_HTTP_MAX_HEADERS 16384
+/** Threads fetching the segments ahead of the readers */
+#define SEGCACHE_PREFETCH_THREADS 4
+/** Least recently used segments considered for each eviction */
+#define SEGCACHE_EVICT_SAMPLES 8
+/** Accesses after which the access counts are halved */
+#define SEGCACHE_AGING_TOUCHES 4096
+
+typedef enum {
+    SEGMENT_LOADING,
+    SEGMENT_READY,
+    SEGMENT_FAILED
+} SegmentState;
+
+typedef struct {
+    char *key;
+    uint8_t *data;
+    size_t len;
+    SegmentState state;
+
+    /**
+     * @brief Readers and loaders using the segment
+     *
+     * Only segments with no references are evicted; failed segments
+     * are removed from the table right away, and freed by the last
+     * reference.
+     */
+    gint refs;
+
+    /** The following segments were scheduled for prefetching */
+    gboolean prefetched;
+
+    /** The segment is being stored in the cache directory */
+    gboolean storing;
+
+    /** Link in @ref SegmentCache::lru, once ready */
+    GList *link;
+} Segment;
+
+/**
+ * @brief A segment file in the cache directory
+ */
+typedef struct {
+    /** Name of the file, also the key in @ref SegmentCache::disk */
+    char *name;
+    size_t len;
+
+    /** Link in @ref SegmentCache::disk_lru */
+    GList *link;
+} DiskSegment;
+
+struct SegmentCache {
+    /** Origin directory, NULL for an HTTP origin */
+    char *origin_dir;
+    char *http_host;
+    char *http_port;
+    char *http_prefix;
+
+    /** Local directory to keep the segments in, or NULL */
+    char *cache_dir;
+    size_t segment_size;
+    size_t memory;
+    guint prefetch;
+
+    /** Size of the cache directory, zero for no limit */
+    size_t disk_size;
+    /** Accesses for a segment to be stored in the cache directory */
+    guint disk_admit;
+
+    /**
+     * @brief Lock for the table, the LRU queue, the counters and the
+     *        state of the segments
+     *
+     * The data of a ready segment is never changed, and is read
+     * outside of the lock while holding a reference.
+     */
+    GMutex *lock;
+    GCond *cond;
+    GHashTable *segments;
+    GQueue lru;
+    size_t bytes;
+
+    /** Access counts, by segment key */
+    GHashTable *heat;
+    guint touches;
+
+    /** Files in the cache directory, of type @ref DiskSegment */
+    GHashTable *disk;
+    GQueue disk_lru;
+    size_t disk_bytes;
+
+    GThreadPool *pool;
+
+    SegmentCacheStats stats;
+};
+
+typedef struct {
+    Segment *seg;
+    char *path;
+    int64_t offset;
+    size_t len;
+
+    /** Store the ready segment in the cache directory, not fetch it */
+    gboolean store;
+} SegmentJob;
+
+static void segment_free(Segment *seg)
+{
+    g_free(seg->key);
+    g_free(seg->data);
+    g_slice_free(Segment, seg);
+}
+
+/**
+ * @defgroup segcache_origin Origin access
+ *
+ * @{
+ */
+
+static int segcache_http_connect(SegmentCache *sc)
+{
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv = { SEGCACHE_HTTP_TIMEOUT, 0 };
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ( getaddrinfo(sc->http_host, sc->http_port, &hints, &res) != 0 )
+        return -1;
+
+    for ( ai = res; ai; ai = ai->ai_next ) {
+        if ( (fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0 )
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        if ( connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 )
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+/**
+ * @brief Parse an HTTP date (RFC 1123 format)
+ *
+ * @return The time, or 0 if the date cannot be parsed.
+ */
+static time_t segcache_http_date(const char *date)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4];
+    const char *found;
+    int day, year, hour, min, sec, m;
+    gint64 era, yoe, doy, days;
+
+    if ( sscanf(date, "%*[^,], %d %3s %d %d:%d:%d",
+                &day, month, &year, &hour, &min, &sec) != 6 ||
+         (found = strstr(months, month)) == NULL ||
+         (found - months) % 3 != 0 )
+        return 0;
+
+    m = (found - months) / 3 + 1;
+
+    /* days since the epoch of the proleptic gregorian date, counting
+       years from March so that the leap day is the last one */
+    year -= m <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+    days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+
+    return days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+static gboolean segcache_write_all(int fd, const void *data, size_t len)
+{
+    size_t done = 0;
+
+    while ( done < len ) {
+        ssize_t res = write(fd, (const uint8_t*)data + done, len - done);
+
+        if ( res < 0 && errno == EINTR )
+            continue;
+        if ( res <= 0 )
+            return false;
+
+        done += res;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Fetch a range of a file from the HTTP origin
+ *
+ * @param sc The cache
+ * @param path The path of the file, relative to the origin
+ * @param offset The offset of the range
+ * @param buf The buffer to store the range in
+ * @param len The length of the range, which has to be within the file
+ * @param size Set to the size of the whole file, if not NULL
+ * @param mtime Set to the modification time of the file, if not NULL;
+ *              if the server does not report it, to a value derived
+ *              from the entity tag instead, or to 0 if there is none
+ *              either.
+ *
+ * @return 0 on success, -1 on error.
+ *
+ * A single request is issued per range, on a new connection; the
+ * server has to reply with partial content, starting at @p offset.
+ */
+static int segcache_http_fetch(SegmentCache *sc, const char *path,
+                               int64_t offset, uint8_t *buf, size_t len,
+                               int64_t *size, time_t *mtime)
+{
+    char headers[SEGCACHE_HTTP_MAX_HEADERS + 1];
+    char *escaped, *end, *body, *line, *saveptr;
+    GString *request;
+    size_t got = 0, done;
+    int64_t total = -1, start = -1;
+    time_t modified = 0, tag = 0;
+    int fd, status;
+
+    if ( (fd = segcache_http_connect(sc)) < 0 )
+        return -1;
+
+    escaped = g_uri_escape_string(path, "/", false);
+    request = g_string_new(NULL);
+    g_string_printf(request,
+                    "GET %s/%s HTTP/1.1\r\n"
+                    "Host: %s:%s\r\n"
+                    "Range: bytes=%" G_GINT64_FORMAT "-%" G_GINT64_FORMAT "\r\n"
+                    "Connection: close\r\n"
+                    "\r\n",
+                    sc->http_prefix, escaped,
+                    sc->http_host, sc->http_port,
+                    offset, offset + (int64_t)len - 1);
+    g_free(escaped);
+
+    if ( !segcache_write_all(fd, request->str, request->len) ) {
+        g_string_free(request, true);
+        goto error;
+    }
+    g_string_free(request, true);
+
+    while ( (end = g_strstr_len(headers, got, "\r\n\r\n")) == NULL ) {
+        ssize_t res;
+
+        if ( got == SEGCACHE_HTTP_MAX_HEADERS )
+            goto error;
+
+        res = read(fd, headers + got, SEGCACHE_HTTP_MAX_HEADERS - got);
+        if ( res < 0 && errno == EINTR )
+            continue;
+        if ( res <= 0 )
+            goto error;
+
+        got += res;
+    }
+
+    body = end + 4;
+    *end = '\0';
+
+    if ( sscanf(headers, "HTTP/1.%*d %d", &status) != 1 || status != 206 )
+        goto error;
+
+    for ( line = strtok_r(headers, "\r\n", &saveptr); line;
+          line = strtok_r(NULL, "\r\n", &saveptr) ) {
+        if ( g_ascii_strncasecmp(line, "Content-Range:", 14) == 0 ) {
+            const char *range = line + 14;
+            const char *slash = strchr(line, '/');
+
+            while ( *range == ' ' )
+                range++;
+
+            if ( g_ascii_strncasecmp(range, "bytes ", 6) == 0 )
+                start = g_ascii_strtoll(range + 6, NULL, 10);
+            if ( slash )
+                total = g_ascii_strtoll(slash + 1, NULL, 10);
+        } else if ( g_ascii_strncasecmp(line, "Last-Modified:", 14) == 0 ) {
+            modified = segcache_http_date(line + 14);
+        } else if ( g_ascii_strncasecmp(line, "ETag:", 5) == 0 ) {
+            tag = g_str_hash(g_strstrip(line + 5));
+        }
+    }
+
+    /* a server ignoring part of the range would have the wrong bytes
+       cached for the segment */
+    if ( total <= 0 || start != offset )
+        goto error;
+
+    done = MIN((size_t)(headers + got - body), len);
+    memcpy(buf, body, done);
+
+    while ( done < len ) {
+        ssize_t res = read(fd, buf + done, len - done);
+
+        if ( res < 0 && errno == EINTR )
+            continue;
+        if ( res <= 0 )
+            goto error;
+
+        done += res;
+    }
+
+    close(fd);
+
+    if ( size )
+        *size = total;
+    if ( mtime )
+        *mtime = modified ? modified : tag;
+
+    return 0;
+
+ error:
+    close(fd);
+    return -1;
+}
+
+static int segcache_dir_fetch(SegmentCache *sc, const char *path,
+                              int64_t offset, uint8_t *buf, size_t len)
+{
+    char *full = g_build_filename(sc->origin_dir, path, NULL);
+    size_t done = 0;
+    int fd = open(full, O_RDONLY);
+
+    g_free(full);
+
+    if ( fd < 0 )
+        return -1;
+
+    while ( done < len ) {
+        ssize_t res = pread(fd, buf + done, len - done, offset + done);
+
+        if ( res < 0 && errno == EINTR )
+            continue;
+        if ( res <= 0 )
+            break;
+
+        done += res;
+    }
+
+    close(fd);
+
+    return done == len ? 0 : -1;
+}
+
+/**
+ * @brief Get the size and modification time of a file on the origin
+ *
+ * @param mtime Set to the modification time of the file, which is
+ *              part of the key of its segments; for an HTTP server not
+ *              reporting it, to a value derived from the entity tag,
+ *              or to the current time if there is none either, so that
+ *              the segments cached by the previous opens, which might
+ *              be of another version of the file, are never used.
+ *
+ * @retval true The file exists and is a regular file
+ * @retval false The file cannot be found, or the origin is unreachable
+ */
+gboolean segcache_stat(SegmentCache *sc, const char *path,
+                       int64_t *size, time_t *mtime)
+{
+    uint8_t byte;
+
+    if ( sc->origin_dir ) {
+        char *full = g_build_filename(sc->origin_dir, path, NULL);
+        struct stat filestat;
+        int res = stat(full, &filestat);
+
+        g_free(full);
+
+        if ( res < 0 || !S_ISREG(filestat.st_mode) )
+            return false;
+
+        *size = filestat.st_size;
+        *mtime = filestat.st_mtime;
+        return true;
+    }
+
+    if ( segcache_http_fetch(sc, path, 0, &byte, 1, size, mtime) < 0 )
+        return false;
+
+    if ( *mtime == 0 )
+        *mtime = time(NULL);
+
+    return true;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup segcache_disk Local cache directory
+ *
+ * @{
+ */
+
+static void disk_segment_free(DiskSegment *ds)
+{
+    g_free(ds->name);
+    g_slice_free(DiskSegment, ds);
+}
+
+static char *segcache_disk_name(const char *key)
+{
+    return g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+}
+
+/**
+ * @note Call with @ref SegmentCache::lock held.
+ */
+static void segcache_disk_forget(SegmentCache *sc, DiskSegment *ds)
+{
+    g_queue_delete_link(&sc->disk_lru, ds->link);
+    g_hash_table_remove(sc->disk, ds->name);
+    sc->disk_bytes -= ds->len;
+    disk_segment_free(ds);
+}
+
+/**
+ * @brief Forget the least recently used files over the size limit
+ *
+ * @return The paths of the files, to remove with
+ *         @ref segcache_disk_unlink.
+ *
+ * @note Call with @ref SegmentCache::lock held.
+ */
+static GSList *segcache_disk_trim(SegmentCache *sc)
+{
+    GSList *victims = NULL;
+
+    while ( sc->disk_size && sc->disk_bytes > sc->disk_size ) {
+        DiskSegment *old = sc->disk_lru.head->data;
+
+        victims = g_slist_prepend(victims,
+                                  g_build_filename(sc->cache_dir, old->name, NULL));
+        segcache_disk_forget(sc, old);
+        sc->stats.disk_evictions++;
+    }
+
+    return victims;
+}
+
+/**
+ * @brief Account a file of the cache directory
+ *
+ * @param name The name of the file, owned by the cache afterwards
+ * @param len The size of the file
+ *
+ * @return The files to remove, see @ref segcache_disk_trim.
+ *
+ * @note Call with @ref SegmentCache::lock held.
+ */
+static GSList *segcache_disk_add(SegmentCache *sc, char *name, size_t len)
+{
+    DiskSegment *ds = g_hash_table_lookup(sc->disk, name);
+
+    if ( ds )
+        segcache_disk_forget(sc, ds);
+
+    ds = g_slice_new(DiskSegment);
+    ds->name = name;
+    ds->len = len;
+
+    g_queue_push_tail(&sc->disk_lru, ds);
+    ds->link = sc->disk_lru.tail;
+    g_hash_table_insert(sc->disk, ds->name, ds);
+    sc->disk_bytes += len;
+
+    return segcache_disk_trim(sc);
+}
+
+/**
+ * @brief Remove the files evicted from the cache directory
+ *
+ * This is done without holding the lock of the cache, as it can block
+ * on the disk; readers that opened the files already are unaffected.
+ */
+static void segcache_disk_unlink(GSList *victims)
+{
+    GSList *item;
+
+    for ( item = victims; item; item = item->next ) {
+        unlink(item->data);
+        g_free(item->data);
+    }
+
+    g_slist_free(victims);
+}
+
+/**
+ * @brief A file found in the cache directory when starting
+ */
+typedef struct {
+    char *name;
+    size_t len;
+    time_t mtime;
+} DiskScanEntry;
+
+static gint segcache_disk_mtime_cmp(gconstpointer a, gconstpointer b)
+{
+    const DiskScanEntry *ea = a, *eb = b;
+
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/**
+ * @brief Account the files left in the cache directory by a previous
+ *        run, least recently modified first
+ */
+static void segcache_disk_scan(SegmentCache *sc)
+{
+    GDir *dir = g_dir_open(sc->cache_dir, 0, NULL);
+    GSList *found = NULL, *item, *victims = NULL;
+    const char *name;
+
+    if ( dir == NULL )
+        return;
+
+    while ( (name = g_dir_read_name(dir)) != NULL ) {
+        char *path = g_build_filename(sc->cache_dir, name, NULL);
+        struct stat filestat;
+
+        /* temporary files of stores interrupted by the previous run */
+        if ( strchr(name, '.') ) {
+            unlink(path);
+        } else if ( stat(path, &filestat) == 0 && S_ISREG(filestat.st_mode) ) {
+            DiskScanEntry *entry = g_slice_new(DiskScanEntry);
+
+            entry->name = g_strdup(name);
+            entry->len = filestat.st_size;
+            entry->mtime = filestat.st_mtime;
+            found = g_slist_prepend(found, entry);
+        }
+
+        g_free(path);
+    }
+
+    g_dir_close(dir);
+
+    found = g_slist_sort(found, segcache_disk_mtime_cmp);
+
+    for ( item = found; item; item = item->next ) {
+        DiskScanEntry *entry = item->data;
+
+        victims = g_slist_concat(segcache_disk_add(sc, entry->name, entry->len),
+                                 victims);
+        g_slice_free(DiskScanEntry, entry);
+    }
+
+    g_slist_free(found);
+
+    segcache_disk_unlink(victims);
+}
+
+/**
+ * @brief Load a segment from the local cache directory
+ *
+ * @return true if the segment was found, with the expected size.
+ */
+static gboolean segcache_disk_load(SegmentCache *sc, const char *key,
+                                   uint8_t *buf, size_t len)
+{
+    char *name = segcache_disk_name(key);
+    char *path;
+    DiskSegment *ds;
+    struct stat filestat;
+    size_t done = 0;
+    int fd;
+
+    /* only the files known to be there are looked for */
+    g_mutex_lock(sc->lock);
+    if ( (ds = g_hash_table_lookup(sc->disk, name)) != NULL ) {
+        g_queue_unlink(&sc->disk_lru, ds->link);
+        g_queue_push_tail_link(&sc->disk_lru, ds->link);
+    }
+    g_mutex_unlock(sc->lock);
+
+    if ( ds == NULL ) {
+        g_free(name);
+        return false;
+    }
+
+    path = g_build_filename(sc->cache_dir, name, NULL);
+    fd = open(path, O_RDONLY);
+    g_free(path);
+
+    if ( fd < 0 )
+        goto error;
+
+    if ( fstat(fd, &filestat) < 0 || (size_t)filestat.st_size != len ) {
+        close(fd);
+        goto error;
+    }
+
+    while ( done < len ) {
+        ssize_t res = read(fd, buf + done, len - done);
+
+        if ( res < 0 && errno == EINTR )
+            continue;
+        if ( res <= 0 )
+            break;
+
+        done += res;
+    }
+
+    close(fd);
+
+    if ( done == len ) {
+        g_free(name);
+        return true;
+    }
+
+ error:
+    g_mutex_lock(sc->lock);
+    if ( (ds = g_hash_table_lookup(sc->disk, name)) != NULL )
+        segcache_disk_forget(sc, ds);
+    g_mutex_unlock(sc->lock);
+
+    g_free(name);
+    return false;
+}
+
+/**
+ * @brief Store a segment in the local cache directory
+ *
+ * The segment is written to a temporary file first, so that readers
+ * never find a partial segment.
+ */
+static void segcache_disk_store(SegmentCache *sc, const char *key,
+                                const uint8_t *data, size_t len)
+{
+    char *name = segcache_disk_name(key);
+    char *path = g_build_filename(sc->cache_dir, name, NULL);
+    char *tmppath = g_strconcat(path, ".XXXXXX", NULL);
+    GSList *victims;
+    int fd;
+
+    if ( (fd = g_mkstemp(tmppath)) < 0 )
+        goto error;
+
+    if ( !segcache_write_all(fd, data, len) ) {
+        close(fd);
+        unlink(tmppath);
+        goto error;
+    }
+
+    close(fd);
+
+    if ( rename(tmppath, path) < 0 ) {
+        unlink(tmppath);
+        goto error;
+    }
+
+    g_mutex_lock(sc->lock);
+    victims = segcache_disk_add(sc, name, len);
+    sc->stats.disk_stores++;
+    g_mutex_unlock(sc->lock);
+
+    segcache_disk_unlink(victims);
+
+    g_free(tmppath);
+    g_free(path);
+    return;
+
+ error:
+    g_free(name);
+    g_free(tmppath);
+    g_free(path);
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup segcache_heat Access counts
+ *
+ * @{
+ */
+
+static gboolean segcache_cool_cb(ATTR_UNUSED gpointer key, gpointer hits_p,
+                                 ATTR_UNUSED gpointer user_data)
+{
+    guint *hits = hits_p;
+
+    return (*hits /= 2) == 0;
+}
+
+/**
+ * @note Call with @ref SegmentCache::lock held.
+ */
+static guint segcache_heat(SegmentCache *sc, const char *key)
+{
+    guint *hits = g_hash_table_lookup(sc->heat, key);
+
+    return hits ? *hits : 0;
+}
+
+/**
+ * @brief Tell whether a segment is to be kept in the cache directory
+ *
+ * @note Call with @ref SegmentCache::lock held.
+ */
+static gboolean segcache_admit(SegmentCache *sc, const char *key)
+{
+    return sc->disk_admit <= 1 || segcache_heat(sc, key) >= sc->disk_admit;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @brief Free the least used segments over the memory limit
+ *
+ * Each segment to free is the least accessed among the least recently
+ * used ones, so that a single pass over a file does not push the
+ * segments requested by many sessions out of memory.
+ *
+ * @note Call with @ref SegmentCache::lock held.
+ */
+static void segcache_evict(SegmentCache *sc)
+{
+    while ( sc->bytes > sc->memory ) {
+        Segment *victim = NULL;
+        guint victim_heat = 0, samples = 0;
+        GList *item;
+
+        for ( item = sc->lru.head;
+              item && samples < SEGCACHE_EVICT_SAMPLES;
+              item = item->next ) {
+            Segment *seg = item->data;
+            guint heat;
+
+            if ( seg->refs > 0 )
+                continue;
+
+            heat = segcache_heat(sc, seg->key);
+            if ( victim == NULL || heat < victim_heat ) {
+                victim = seg;
+                victim_heat = heat;
+            }
+
+            samples++;
+        }
+
+        if ( victim == NULL )
+            break;
+
+        g_queue_delete_link(&sc->lru, victim->link);
+        g_hash_table_remove(sc->segments, victim->key);
+        sc->bytes -= victim->len;
+        segment_free(victim);
+    }
+}
+
+/**
+ * @note Call with @ref SegmentCache::lock held.
+ */
+static void segcache_unref(SegmentCache *sc, Segment *seg)
+{
+    if ( --seg->refs > 0 )
+        return;
+
+    if ( seg->state == SEGMENT_FAILED )
+        segment_free(seg);
+    else
+        segcache_evict(sc);
+}
+
+static char *segcache_key(const char *path, time_t mtime, gint64 index)
+{
+    return g_strdup_printf("%s:%ld:%" G_GINT64_FORMAT,
+                           path, (long)mtime, index);
+}
+
+/**
+ * @brief Find a segment, or add it to be loaded
+ *
+ * @param created Set to true if the segment was not in the cache; the
+ *                caller then has to load it.
+ *
+ * @return The segment, with a new reference.
+ *
+ * @note Call with @ref SegmentCache::lock held.
+ */
+static Segment *segcache_lookup(SegmentCache *sc, const char *path,
+                                time_t mtime, gint64 index,
+                                gboolean *created)
+{
+    char *key = segcache_key(path, mtime, index);
+    Segment *seg = g_hash_table_lookup(sc->segments, key);
+
+    if ( (*created = (seg == NULL)) ) {
+        seg = g_slice_new0(Segment);
+        seg->key = key;
+        seg->state = SEGMENT_LOADING;
+        g_hash_table_insert(sc->segments, seg->key, seg);
+    } else
+        g_free(key);
+
+    seg->refs++;
+
+    return seg;
+}
+
+/**
+ * @brief Load a segment from the local cache directory or the origin
+ *
+ * The readers waiting for the segment are woken up once it is ready,
+ * or once it failed to load.
+ */
+static void segcache_load(SegmentCache *sc, Segment *seg, const char *path,
+                          int64_t offset, size_t len)
+{
+    uint8_t *data = g_malloc(len);
+    gboolean disk = false, ok;
+
+    if ( sc->cache_dir && segcache_disk_load(sc, seg->key, data, len) ) {
+        ok = disk = true;
+    } else {
+        ok = (sc->origin_dir ?
+              segcache_dir_fetch(sc, path, offset, data, len) :
+              segcache_http_fetch(sc, path, offset, data, len,
+                                  NULL, NULL)) == 0;
+
+        if ( ok && sc->cache_dir ) {
+            gboolean admit;
+
+            g_mutex_lock(sc->lock);
+            admit = segcache_admit(sc, seg->key);
+            g_mutex_unlock(sc->lock);
+
+            if ( admit )
+                segcache_disk_store(sc, seg->key, data, len);
+        }
+    }
+
+    g_mutex_lock(sc->lock);
+
+    if ( ok ) {
+        seg->data = data;
+        seg->len = len;
+        seg->state = SEGMENT_READY;
+
+        g_queue_push_tail(&sc->lru, seg);
+        seg->link = sc->lru.tail;
+        sc->bytes += len;
+
+        if ( disk ) {
+            sc->stats.disk_hits++;
+        } else {
+            sc->stats.misses++;
+            sc->stats.origin_bytes += len;
+        }
+    } else {
+        g_free(data);
+        seg->state = SEGMENT_FAILED;
+        g_hash_table_remove(sc->segments, seg->key);
+        sc->stats.errors++;
+    }
+
+    g_cond_broadcast(sc->cond);
+
+    g_mutex_unlock(sc->lock);
+}
+
+static void segcache_prefetch_cb(gpointer job_p, gpointer sc_p)
+{
+    SegmentJob *job = job_p;
+    SegmentCache *sc = sc_p;
+
+    /* the data of a ready segment does not change while referenced */
+    if ( job->store )
+        segcache_disk_store(sc, job->seg->key, job->seg->data, job->seg->len);
+    else
+        segcache_load(sc, job->seg, job->path, job->offset, job->len);
+
+    g_mutex_lock(sc->lock);
+    job->seg->storing = false;
+    segcache_unref(sc, job->seg);
+    g_mutex_unlock(sc->lock);
+
+    g_free(job->path);
+    g_slice_free(SegmentJob, job);
+}
+
+/**
+ * @brief Schedule the segments after a given one to be fetched
+ */
+static void segcache_prefetch(SegmentCache *sc, const char *path,
+                              time_t mtime, int64_t size, gint64 index)
+{
+    gint64 i;
+
+    for ( i = index + 1; i <= index + (gint64)sc->prefetch; i++ ) {
+        const int64_t offset = i * sc->segment_size;
+        SegmentJob *job;
+        Segment *seg;
+        gboolean created;
+
+        if ( offset >= size )
+            break;
+
+        g_mutex_lock(sc->lock);
+        seg = segcache_lookup(sc, path, mtime, i, &created);
+        if ( !created ) {
+            segcache_unref(sc, seg);
+            g_mutex_unlock(sc->lock);
+            continue;
+        }
+        sc->stats.prefetches++;
+        g_mutex_unlock(sc->lock);
+
+        job = g_slice_new0(SegmentJob);
+        job->seg = seg;
+        job->path = g_strdup(path);
+        job->offset = offset;
+        job->len = MIN((int64_t)sc->segment_size, size - offset);
+
+        g_thread_pool_push(sc->pool, job, NULL);
+    }
+}
+
+/**
+ * @brief Read data from a file through the cache
+ *
+ * @param sc The cache
+ * @param path The path of the file, relative to the origin
+ * @param mtime The modification time of the file, part of the key
+ * @param size The size of the file
+ * @param offset The position to read from
+ * @param buf The buffer to read into
+ * @param len The size of @p buf
+ *
+ * @return The amount of bytes read, which does not cross the end of
+ *         the segment @p offset is in; zero at the end of the file, or
+ *         -1 if the segment cannot be fetched.
+ *
+ * If the segment is being fetched by another reader, or prefetched,
+ * this waits for it rather than fetching it again. The segments after
+ * it are prefetched the first time it is read, if the one before it
+ * was read as well.
+ */
+int segcache_read(SegmentCache *sc, const char *path, time_t mtime,
+                  int64_t size, int64_t offset, uint8_t *buf, int len)
+{
+    const gint64 index = offset / sc->segment_size;
+    const int64_t start = index * sc->segment_size;
+    gboolean created, prefetch;
+    Segment *seg;
+    int res = -1;
+
+    if ( offset >= size )
+        return 0;
+
+    g_mutex_lock(sc->lock);
+
+    seg = segcache_lookup(sc, path, mtime, index, &created);
+    if ( !created ) {
+        if ( seg->state == SEGMENT_LOADING )
+            sc->stats.coalesced++;
+        else
+            sc->stats.ram_hits++;
+    }
+
+    /* read ahead only of sequential readers */
+    if ( (prefetch = !seg->prefetched && sc->prefetch > 0) && index > 0 ) {
+        char *prev = segcache_key(path, mtime, index - 1);
+
+        prefetch = g_hash_table_lookup(sc->segments, prev) != NULL;
+        g_free(prev);
+    }
+
+    if ( prefetch )
+        seg->prefetched = true;
+
+    g_mutex_unlock(sc->lock);
+
+    if ( prefetch )
+        segcache_prefetch(sc, path, mtime, size, index);
+
+    if ( created )
+        segcache_load(sc, seg, path, start,
+                      MIN((int64_t)sc->segment_size, size - start));
+
+    g_mutex_lock(sc->lock);
+
+    while ( seg->state == SEGMENT_LOADING )
+        g_cond_wait(sc->cond, sc->lock);
+
+    if ( seg->state == SEGMENT_READY ) {
+        g_queue_unlink(&sc->lru, seg->link);
+        g_queue_push_tail_link(&sc->lru, seg->link);
+
+        g_mutex_unlock(sc->lock);
+
+        res = MIN((int64_t)len, start + (int64_t)seg->len - offset);
+        memcpy(buf, seg->data + (offset - start), res);
+
+        g_mutex_lock(sc->lock);
+    }
+
+    segcache_unref(sc, seg);
+
+    g_mutex_unlock(sc->lock);
+
+    return res;
+}
+
+/**
+ * @brief Record the access of a reader to a segment
+ *
+ * @param sc The cache
+ * @param path The path of the file, relative to the origin
+ * @param mtime The modification time of the file, part of the key
+ * @param offset The position the reader reads from
+ * @param cursor The index of the segment the reader accessed last,
+ *               initialised to -1 and updated by this function
+ *
+ * Only entering a segment counts as an access, rather than each read
+ * within it. A segment in memory that becomes accessed often enough
+ * is stored in the cache directory in background.
+ */
+void segcache_touch(SegmentCache *sc, const char *path, time_t mtime,
+                    int64_t offset, gint64 *cursor)
+{
+    const gint64 index = offset / sc->segment_size;
+    SegmentJob *job = NULL;
+    Segment *seg;
+    guint *hits;
+    char *key;
+
+    if ( index == *cursor )
+        return;
+
+    *cursor = index;
+    key = segcache_key(path, mtime, index);
+
+    g_mutex_lock(sc->lock);
+
+    /* older accesses count less and less */
+    if ( ++sc->touches >= SEGCACHE_AGING_TOUCHES ) {
+        g_hash_table_foreach_remove(sc->heat, segcache_cool_cb, NULL);
+        sc->touches = 0;
+    }
+
+    if ( (hits = g_hash_table_lookup(sc->heat, key)) == NULL ) {
+        hits = g_new0(guint, 1);
+        g_hash_table_insert(sc->heat, g_strdup(key), hits);
+    }
+    (*hits)++;
+
+    seg = g_hash_table_lookup(sc->segments, key);
+    if ( sc->cache_dir && sc->disk_admit > 1 && *hits >= sc->disk_admit &&
+         seg && seg->state == SEGMENT_READY && !seg->storing ) {
+        char *name = segcache_disk_name(key);
+
+        if ( g_hash_table_lookup(sc->disk, name) == NULL ) {
+            seg->storing = true;
+            seg->refs++;
+
+            job = g_slice_new0(SegmentJob);
+            job->seg = seg;
+            job->store = true;
+        }
+
+        g_free(name);
+    }
+
+    g_mutex_unlock(sc->lock);
+
+    if ( job )
+        g_thread_pool_push(sc->pool, job, NULL);
+
+    g_free(key);
+}
+
+/**
+ * @brief Set how the cache directory is used
+ *
+ * @param sc The cache
+ * @param disk_size The maximum size of the cache directory, in bytes,
+ *                  or zero for no limit
+ * @param disk_admit The accesses to a segment (see @ref segcache_touch)
+ *                   for it to be stored in the cache directory; with
+ *                   one or less every segment fetched is stored
+ *
+ * By default the cache directory has no limit, and every segment is
+ * stored.
+ */
+void segcache_set_disk_policy(SegmentCache *sc, size_t disk_size,
+                              guint disk_admit)
+{
+    GSList *victims;
+
+    g_mutex_lock(sc->lock);
+
+    sc->disk_size = disk_size;
+    sc->disk_admit = disk_admit;
+    victims = segcache_disk_trim(sc);
+
+    g_mutex_unlock(sc->lock);
+
+    segcache_disk_unlink(victims);
+}
+
+/**
+ * @brief Create a new segment cache
+ *
+ * @param origin Either the path of the origin directory, or an
+ *               http:// URL the paths are appended to
+ * @param cache_dir The local directory to keep the segments in, or
+ *                  NULL to keep them only in memory
+ * @param segment_size The size of the segments, in bytes
+ * @param memory The amount of memory to keep the segments in, in bytes
+ * @param prefetch The amount of segments to fetch ahead of the readers
+ *
+ * @return A new cache, or NULL if the origin is not valid.
+ */
+SegmentCache *segcache_new(const char *origin, const char *cache_dir,
+                           size_t segment_size, size_t memory,
+                           guint prefetch)
+{
+    SegmentCache *sc;
+
+    if ( segment_size == 0 )
+        return NULL;
+
+    sc = g_slice_new0(SegmentCache);
+
+    if ( g_str_has_prefix(origin, "http://") ) {
+        const char *host = origin + strlen("http://");
+        const char *prefix = strchr(host, '/');
+        char *hostport = prefix ?
+            g_strndup(host, prefix - host) : g_strdup(host);
+        char *colon = strrchr(hostport, ':');
+
+        if ( colon ) {
+            *colon = '\0';
+            sc->http_port = g_strdup(colon + 1);
+        } else
+            sc->http_port = g_strdup("80");
+
+        sc->http_host = hostport;
+        sc->http_prefix = g_strdup(prefix ? prefix : "");
+
+        /* the paths are joined with a slash already */
+        if ( g_str_has_suffix(sc->http_prefix, "/") )
+            sc->http_prefix[strlen(sc->http_prefix) - 1] = '\0';
+
+        if ( *sc->http_host == '\0' ) {
+            segcache_free(sc);
+            return NULL;
+        }
+    } else if ( strstr(origin, "://") == NULL ) {
+        sc->origin_dir = g_strdup(origin);
+    } else {
+        segcache_free(sc);
+        return NULL;
+    }
+
+    sc->segment_size = segment_size;
+    sc->memory = memory;
+    sc->prefetch = prefetch;
+    sc->disk_admit = 1;
+
+    sc->lock = g_mutex_new();
+    sc->cond = g_cond_new();
+    sc->segments = g_hash_table_new(g_str_hash, g_str_equal);
+    sc->heat = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    sc->disk = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( cache_dir ) {
+        sc->cache_dir = g_strdup(cache_dir);
+        g_mkdir_with_parents(cache_dir, 0755);
+        segcache_disk_scan(sc);
+    }
+    sc->pool = g_thread_pool_new(segcache_prefetch_cb, sc,
+                                 SEGCACHE_PREFETCH_THREADS, false, NULL);
+
+    return sc;
+}
+
+static void segcache_free_segment(ATTR_UNUSED gpointer key,
+                                  gpointer seg_p,
+                                  ATTR_UNUSED gpointer user_data)
+{
+    segment_free(seg_p);
+}
+
+static void segcache_free_disk_segment(gpointer ds_p,
+                                       ATTR_UNUSED gpointer user_data)
+{
+    disk_segment_free(ds_p);
+}
+
+/**
+ * @brief Free a segment cache
+ *
+ * Waits for the segments being prefetched; there must be no reader
+ * left.
+ */
+void segcache_free(SegmentCache *sc)
+{
+    if ( sc == NULL )
+        return;
+
+    if ( sc->pool )
+        g_thread_pool_free(sc->pool, false, true);
+
+    if ( sc->segments ) {
+        g_hash_table_foreach(sc->segments, segcache_free_segment, NULL);
+        g_hash_table_destroy(sc->segments);
+        g_queue_clear(&sc->lru);
+    }
+
+    if ( sc->heat )
+        g_hash_table_destroy(sc->heat);
+
+    if ( sc->disk ) {
+        g_queue_foreach(&sc->disk_lru, segcache_free_disk_segment, NULL);
+        g_queue_clear(&sc->disk_lru);
+        g_hash_table_destroy(sc->disk);
+    }
+
+    if ( sc->lock ) {
+        g_mutex_free(sc->lock);
+        g_cond_free(sc->cond);
+    }
+
+    g_free(sc->origin_dir);
+    g_free(sc->http_host);
+    g_free(sc->http_port);
+    g_free(sc->http_prefix);
+    g_free(sc->cache_dir);
+    g_slice_free(SegmentCache, sc);
+}
+
+/**
+ * @brief Get a snapshot of the counters of a cache
+ */
+void segcache_get_stats(SegmentCache *sc, SegmentCacheStats *stats)
+{
+    g_mutex_lock(sc->lock);
+    *stats = sc->stats;
+    stats->disk_bytes = sc->disk_bytes;
+    g_mutex_unlock(sc->lock);
+}
@@ -0,0 +1,215 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief Start code scanning
+ *
+ * The H.264 (Annex B) and MPEG video bitstreams are split by 00 00 01
+ * start codes; looking for them is the bulk of the work of their
+ * parsers. The scanners below compare 16 or 32 positions at once
+ * when the CPU allows it; the best one available is chosen the first
+ * time a start code is looked for.
+ */
+
+#include <config.h>
+
+#include <glib.h>
+
+#include "media/media.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+# define STARTCODE_X86 1
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# define STARTCODE_NEON 1
+# include <arm_neon.h>
+#endif
+
+/**
+ * @brief Portable scanner
+ *
+ * The position looked at is the one of the last byte of a possible
+ * start code; whenever it is above one, no start code can end in the
+ * next two positions either.
+ */
+static const uint8_t *startcode_find_c(const uint8_t *p, const uint8_t *end)
+{
+    const uint8_t *q = p + 2;
+
+    while ( q < end ) {
+        if ( q[0] > 1 )
+            q += 3;
+        else if ( q[-1] )
+            q += 2;
+        else if ( q[0] == 1 && q[-2] == 0 )
+            return q - 2;
+        else
+            q++;
+    }
+
+    return end;
+}
+
+#ifdef STARTCODE_X86
+__attribute__((target("sse2")))
+static const uint8_t *startcode_find_sse2(const uint8_t *p, const uint8_t *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    /* every start code beginning in the block is checked at once */
+    while ( end - p >= 16 + 2 ) {
+        const __m128i b0 = _mm_loadu_si128((const __m128i*)p);
+        const __m128i b1 = _mm_loadu_si128((const __m128i*)(p + 1));
+        const __m128i b2 = _mm_loadu_si128((const __m128i*)(p + 2));
+        const unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+                                        _mm_cmpeq_epi8(b1, zero)),
+                          _mm_cmpeq_epi8(b2, one)));
+
+        if ( mask )
+            return p + __builtin_ctz(mask);
+
+        p += 16;
+    }
+
+    return startcode_find_c(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *startcode_find_avx2(const uint8_t *p, const uint8_t *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+
+    while ( end - p >= 32 + 2 ) {
+        const __m256i b0 = _mm256_loadu_si256((const __m256i*)p);
+        const __m256i b1 = _mm256_loadu_si256((const __m256i*)(p + 1));
+        const __m256i b2 = _mm256_loadu_si256((const __m256i*)(p + 2));
+        const unsigned int mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero),
+                                              _mm256_cmpeq_epi8(b1, zero)),
+                             _mm256_cmpeq_epi8(b2, one)));
+
+        if ( mask )
+            return p + __builtin_ctz(mask);
+
+        p += 32;
+    }
+
+    return startcode_find_sse2(p, end);
+}
+
+static gboolean startcode_have_sse2()
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static gboolean startcode_have_avx2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef STARTCODE_NEON
+static const uint8_t *startcode_find_neon(const uint8_t *p, const uint8_t *end)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    while ( end - p >= 16 + 2 ) {
+        const uint8x16_t match =
+            vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(p), zero),
+                              vceqq_u8(vld1q_u8(p + 1), zero)),
+                     vceqq_u8(vld1q_u8(p + 2), one));
+
+        /* there is no cheap movemask, find the position in the block */
+        if ( vmaxvq_u8(match) )
+            return startcode_find_c(p, p + 16 + 2);
+
+        p += 16;
+    }
+
+    return startcode_find_c(p, end);
+}
+#endif
+
+static gboolean startcode_always()
+{
+    return true;
+}
+
+static const struct {
+    StartcodeScanner scanner;
+    gboolean (*supported)();
+} startcode_all[] = {
+#ifdef STARTCODE_X86
+    { { "avx2", startcode_find_avx2 }, startcode_have_avx2 },
+    { { "sse2", startcode_find_sse2 }, startcode_have_sse2 },
+#endif
+#ifdef STARTCODE_NEON
+    { { "neon", startcode_find_neon }, startcode_always },
+#endif
+    { { "c", startcode_find_c }, startcode_always },
+};
+
+static gpointer startcode_detect(gpointer unused)
+{
+    StartcodeScanner *available =
+        g_new0(StartcodeScanner, G_N_ELEMENTS(startcode_all) + 1);
+    guint i, n = 0;
+
+    for ( i = 0; i < G_N_ELEMENTS(startcode_all); i++ )
+        if ( startcode_all[i].supported() )
+            available[n++] = startcode_all[i].scanner;
+
+    return available;
+}
+
+/**
+ * @brief List the start code scanners the CPU can run
+ *
+ * @return An array of scanners, terminated by one with NULL name,
+ *         best one first; the portable one is always present.
+ */
+const StartcodeScanner *startcode_scanners()
+{
+    static GOnce detect_once = G_ONCE_INIT;
+
+    return g_once(&detect_once, startcode_detect, NULL);
+}
+
+/**
+ * @brief Find the first 00 00 01 start code of a buffer
+ *
+ * @param p The start of the buffer
+ * @param end The end of the buffer
+ *
+ * @return The first byte of the start code, or @p end if there is
+ *         none.
+ */
+const uint8_t *startcode_find(const uint8_t *p, const uint8_t *end)
+{
+    return startcode_scanners()[0].find(p, end);
+}
@@ -58,6 +58,9 @@
  * gets incremented. Once the seen count reaches the amount of
  * consumers, the element is deleted from the queue.
  *
+ * The parsers write the packets of each frame together (see @ref
+ * track_write_frame), so the queue only ever holds whole frames.
+ *
  * @{
  */
 
@@ -111,17 +114,108 @@ static inline struct MParserBuffer *BQ_OBJECT(RTP_session *consumer)
     return c_cep ? GLIST_TO_BQELEM(c_cep) : NULL;
 }
 
+/**
+ * @brief A demuxed packet shared by the buffers referencing it
+ *
+ * @see MParserBuffer::ref
+ */
+struct PacketRef {
+    gint refs;
+    gpointer packet;
+    GDestroyNotify free_packet;
+};
 
-static void mparser_buffer_free(struct MParserBuffer *buffer)
+/**
+ * @brief Wrap a demuxed packet for the buffers to reference it
+ *
+ * @param packet The packet, owned by the reference afterwards
+ * @param free_packet The function freeing @p packet once the last
+ *                    reference is dropped
+ *
+ * @return A new reference to the packet.
+ */
+struct PacketRef *packet_ref_new(gpointer packet, GDestroyNotify free_packet)
+{
+    struct PacketRef *ref = g_slice_new(struct PacketRef);
+
+    ref->refs = 1;
+    ref->packet = packet;
+    ref->free_packet = free_packet;
+
+    return ref;
+}
+
+struct PacketRef *packet_ref(struct PacketRef *ref)
+{
+    g_atomic_int_inc(&ref->refs);
+
+    return ref;
+}
+
+void packet_unref(struct PacketRef *ref)
+{
+    if ( !g_atomic_int_dec_and_test(&ref->refs) )
+        return;
+
+    ref->free_packet(ref->packet);
+    g_slice_free(struct PacketRef, ref);
+}
+
+/**
+ * @brief Free a buffer, releasing the packet it references if any
+ */
+void mparser_buffer_free(struct MParserBuffer *buffer)
 {
     bq_debug("Free object %p %lu",
              buffer,
              buffer->seen);
 
+    if ( buffer->ref )
+        packet_unref(buffer->ref);
+
     g_free(buffer->data);
     g_slice_free(struct MParserBuffer, buffer);
 }
 
+/**
+ * @brief Copy the whole packet of a buffer
+ *
+ * @param buffer The buffer to copy
+ * @param dest Where to copy @ref MParserBuffer::data_size bytes
+ */
+void mparser_buffer_copy(const struct MParserBuffer *buffer, uint8_t *dest)
+{
+    if ( buffer->ref == NULL ) {
+        memcpy(dest, buffer->data, buffer->data_size);
+        return;
+    }
+
+    memcpy(dest, buffer->header, buffer->header_size);
+    memcpy(dest + buffer->header_size, buffer->payload,
+           buffer->data_size - buffer->header_size);
+}
+
+/**
+ * @brief Turn a buffer referencing a demuxed packet in one holding
+ *        its own copy of the packet, in @ref MParserBuffer::data
+ *
+ * This is needed by the users of the buffers reading @ref
+ * MParserBuffer::data directly.
+ */
+void mparser_buffer_flatten(struct MParserBuffer *buffer)
+{
+    if ( buffer->ref == NULL )
+        return;
+
+    buffer->data = g_malloc(buffer->data_size);
+    mparser_buffer_copy(buffer, buffer->data);
+
+    packet_unref(buffer->ref);
+    buffer->ref = NULL;
+    buffer->payload = NULL;
+    buffer->header_size = 0;
+}
+
 /**
  * @brief Destroy one by one the elements in
  *        Track::queue.
@@ -165,6 +259,9 @@ static void bq_producer_reset_queue_internal(Track *producer) {
 
     producer->queue = g_queue_new();
     producer->queue_serial++;
+
+    media_stat_sub(MEDIA_STAT_BUFFER_BYTES, producer->queue_bytes);
+    producer->queue_bytes = 0;
 }
 
 /**
@@ -219,6 +316,9 @@ static void bq_producer_destroy_head(Track *producer) {
     if ( g_queue_get_length(producer->queue) == 0 )
         producer->queue_serial++;
 
+    producer->queue_bytes -= elem->data_size;
+    media_stat_sub(MEDIA_STAT_BUFFER_BYTES, elem->data_size);
+
     mparser_buffer_free(elem);
 }
 
@@ -384,6 +484,80 @@ gulong bq_consumer_unseen(RTP_session *consumer) {
     return unseen;
 }
 
+/**
+ * @brief Tells how much media is queued to be seen
+ *
+ * @param consumer The consumer object to check
+ *
+ * @return The time, in seconds, from the next buffer to be sent to the
+ *         consumer to the end of the last buffer queued.
+ *
+ * @note This function will require exclusive access to the producer,
+ *       and will thus lock its mutex.
+ */
+double bq_consumer_buffered(RTP_session *consumer) {
+    Track *producer = consumer->track;
+    struct MParserBuffer *last;
+    GList *first;
+    double buffered = 0;
+
+    if (bq_consumer_stopped(consumer))
+        return buffered;
+
+    /* Ensure we have the exclusive access */
+    g_mutex_lock(producer->lock);
+
+    if ( (first = bq_consumer_confirm_pointer(consumer)) == NULL ) {
+        first = producer->queue->head;
+
+        /* skip what was seen already, but not by all the consumers */
+        if ( consumer->queue_serial == producer->queue_serial )
+            while ( first != NULL &&
+                    GLIST_TO_BQELEM(first)->seq_no <= consumer->last_element_serial )
+                first = first->next;
+    }
+
+    if ( first != NULL ) {
+        last = g_queue_peek_tail(producer->queue);
+        buffered = last->delivery + last->duration -
+            GLIST_TO_BQELEM(first)->delivery;
+    }
+
+    /* Leave the exclusive access */
+    g_mutex_unlock(producer->lock);
+
+    return buffered;
+}
+
+/**
+ * @brief Tells how much media is queued on a track
+ *
+ * @param tr The track to check
+ *
+ * @return The time, in seconds, from the first buffer in the queue to
+ *         the end of the last one.
+ *
+ * @note This function will require exclusive access to the producer,
+ *       and will thus lock its mutex.
+ */
+double track_buffered(Track *tr) {
+    struct MParserBuffer *first, *last;
+    double buffered = 0;
+
+    /* Ensure we have the exclusive access */
+    g_mutex_lock(tr->lock);
+
+    if ( (first = g_queue_peek_head(tr->queue)) != NULL ) {
+        last = g_queue_peek_tail(tr->queue);
+        buffered = last->delivery + last->duration - first->delivery;
+    }
+
+    /* Leave the exclusive access */
+    g_mutex_unlock(tr->lock);
+
+    return buffered;
+}
+
 /**
  * @brief Move to the next element in a consumer
  *
@@ -541,6 +715,25 @@ Track *track_new(char *name)
     return t;
 }
 
+/**
+ * @brief Tells whether the buffers of a track are going to be consumed
+ *
+ * @param tr The track to check
+ *
+ * @return true if at least one consumer is registered for the track,
+ *         or for the track its buffers are sunk into.
+ *
+ * Demuxers use this to avoid reading and parsing the tracks that no
+ * client has set up.
+ */
+bool track_wanted(Track *tr)
+{
+    if ( tr->sink )
+        tr = tr->sink;
+
+    return g_atomic_int_get(&tr->consumers) > 0;
+}
+
 /**
  * @brief Frees the resources of a Track object
  *
@@ -551,6 +744,10 @@ void track_free(Track *track)
     if (!track)
         return;
 
+    pipeline_free(track);
+    pcache_track_free(track);
+    aggr_free(track);
+
     g_mutex_free(track->lock);
 
     g_free(track->name);
@@ -566,6 +763,8 @@ void track_free(Track *track)
                         bq_element_free_internal,
                         NULL);
         g_queue_free(track->queue);
+
+        media_stat_sub(MEDIA_STAT_BUFFER_BYTES, track->queue_bytes);
     }
 
     if ( track->sdp_description )
@@ -578,13 +777,31 @@ void track_free(Track *track)
 }
 
 /**
- * @brief Queue a new RTP buffer into the track's queue
+ * @brief Queue all the RTP buffers of a frame into the track's queue
  *
- * @param tr The track to queue the buffer onto
- * @param buffer The RTP buffer to queue
+ * @param tr The track to queue the buffers onto
+ * @param frame The buffers of the frame, in order; they are moved to
+ *              the track's queue and @p frame is left empty
+ *
+ * The buffers are appended with a single locked operation, so the
+ * consumers never find part of a frame in the queue: a fragmented
+ * frame is either not there yet, or there up to its last packet.
  */
-void track_write(Track *tr, struct MParserBuffer *buffer)
+void track_write_frame(Track *tr, GQueue *frame)
 {
+    GList *item;
+    size_t bytes = 0;
+
+    if ( g_queue_is_empty(frame) )
+        return;
+
+    if ( tr->recorder )
+        for ( item = frame->head; item; item = item->next )
+            pcache_record(tr, item->data);
+
+    if ( tr->sink )
+        tr = tr->sink;
+
     /* Make sure the producer is not stopped */
     g_assert(g_atomic_int_get(&tr->stopped) == 0);
 
@@ -592,16 +809,153 @@ void track_write(Track *tr, struct MParserBuffer *buffer)
     g_mutex_lock(tr->lock);
 
     /* do this inside the lock so that next_serial does not change */
-    if ( ! buffer->seq_no )
-        buffer->seq_no = tr->next_serial;
+    for ( item = frame->head; item; item = item->next ) {
+        struct MParserBuffer *buffer = item->data;
+
+        if ( ! buffer->seq_no )
+            buffer->seq_no = tr->next_serial;
+
+        tr->next_serial = buffer->seq_no + 1;
+        bytes += buffer->data_size;
+
+        bq_debug("P:%p PQH:%p elem: %p (%hu)",
+                 tr, tr->queue->head, buffer, buffer->seq_no);
+    }
 
-    tr->next_serial = buffer->seq_no + 1;
+    /* the links are moved over as they are */
+    if ( tr->queue->tail ) {
+        tr->queue->tail->next = frame->head;
+        frame->head->prev = tr->queue->tail;
+    } else
+        tr->queue->head = frame->head;
 
-    bq_debug("P:%p PQH:%p elem: %p (%hu)",
-             tr, tr->queue->head, buffer, buffer->seq_no);
+    tr->queue->tail = frame->tail;
+    tr->queue->length += frame->length;
 
-    g_queue_push_tail(tr->queue, buffer);
+    tr->queue_bytes += bytes;
+    media_stat_add(MEDIA_STAT_BUFFER_BYTES, bytes);
 
     /* Leave the exclusive access */
     g_mutex_unlock(tr->lock);
+
+    g_queue_init(frame);
+}
+
+/**
+ * @brief Create a buffer holding a copy of a packet
+ *
+ * @param tr The track the packet is built for
+ * @param data The packet, which is copied
+ * @param size The size of @p data
+ *
+ * @return A new buffer with the timestamps of the track.
+ *
+ * This is for the packets built by the parsers, which are not part of
+ * the demuxed packet; see @ref track_buffer_new otherwise.
+ */
+struct MParserBuffer *track_buffer_copy(Track *tr,
+                                        const uint8_t *data, size_t size)
+{
+    struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+
+    buffer->timestamp = tr->pts;
+    buffer->delivery = tr->dts;
+    buffer->duration = tr->frame_duration;
+
+    buffer->data_size = size;
+    buffer->data = g_memdup(data, size);
+
+    return buffer;
+}
+
+/**
+ * @brief Create a buffer for the packet being parsed on a track
+ *
+ * @param tr The track parsing the packet
+ * @param header The payload header, at most @ref MPARSER_HEADER_MAX
+ *               bytes, or NULL
+ * @param header_size The size of @p header
+ * @param payload The rest of the packet, inside the demuxed packet
+ *                being parsed
+ * @param payload_size The size of @p payload
+ *
+ * @return A new buffer with the timestamps of the track.
+ *
+ * When the demuxed packet can be referenced (see @ref Track::packet),
+ * @p payload is not copied: the buffer points to it, and keeps the
+ * packet alive until it is freed, once sent to the last consumer.
+ */
+struct MParserBuffer *track_buffer_new(Track *tr,
+                                       const uint8_t *header, size_t header_size,
+                                       const uint8_t *payload, size_t payload_size)
+{
+    struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+
+    buffer->timestamp = tr->pts;
+    buffer->delivery = tr->dts;
+    buffer->duration = tr->frame_duration;
+    buffer->data_size = header_size + payload_size;
+
+    if ( tr->packet && header_size <= MPARSER_HEADER_MAX ) {
+        buffer->ref = packet_ref(tr->packet);
+        buffer->payload = payload;
+        buffer->header_size = header_size;
+        if ( header_size )
+            memcpy(buffer->header, header, header_size);
+
+        media_stat_add(MEDIA_STAT_ZERO_COPY_BYTES, payload_size);
+    } else {
+        buffer->data = g_malloc(buffer->data_size);
+        if ( header_size )
+            memcpy(buffer->data, header, header_size);
+        memcpy(buffer->data + header_size, payload, payload_size);
+    }
+
+    return buffer;
+}
+
+/**
+ * @brief Queue a new RTP buffer into the track's queue
+ *
+ * @param tr The track to queue the buffer onto
+ * @param buffer The RTP buffer to queue, a frame of its own
+ *
+ * @see track_write_frame
+ */
+void track_write(Track *tr, struct MParserBuffer *buffer)
+{
+    GQueue frame = G_QUEUE_INIT;
+
+    g_queue_push_tail(&frame, buffer);
+    track_write_frame(tr, &frame);
+}
+
+/**
+ * @brief Take the oldest buffer out of a track's queue
+ *
+ * @param tr The track to take the buffer from, which must have no
+ *           consumer
+ *
+ * @return The buffer, owned by the caller, or NULL if the queue is
+ *         empty.
+ *
+ * This lets a resource relay the buffers produced by the parsers of
+ * another one, see @ref channel_open.
+ */
+struct MParserBuffer *track_pop(Track *tr)
+{
+    struct MParserBuffer *buffer;
+
+    g_mutex_lock(tr->lock);
+
+    g_assert_cmpint(tr->consumers, ==, 0);
+
+    if ( (buffer = g_queue_pop_head(tr->queue)) != NULL ) {
+        tr->queue_bytes -= buffer->data_size;
+        media_stat_sub(MEDIA_STAT_BUFFER_BYTES, buffer->data_size);
+    }
+
+    g_mutex_unlock(tr->lock);
+
+    return buffer;
 }
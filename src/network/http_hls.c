@@ -0,0 +1,310 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file
+ * @brief HTTP requests for HLS playlists and segments
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "network/rtsp.h"
+#include "media/media.h"
+
+/**
+ * @brief Split the object of an HTTP request into resource path and
+ *        HLS file name
+ *
+ * @param object The object of the request, either a path or an
+ *               absolute URL
+ * @param path Filled in with the unescaped path of the resource
+ * @param name Filled in with the name of the file
+ *
+ * @retval true The object names an HLS file.
+ * @retval false The object is something else.
+ */
+static gboolean http_hls_parse_object(const char *object,
+                                      char **path, char **name)
+{
+    const char *start, *slash;
+    char *file_path;
+    size_t len;
+
+    if ( (start = strstr(object, "://")) != NULL ) {
+        if ( (start = strchr(start + 3, '/')) == NULL )
+            return false;
+    } else
+        start = object;
+
+    len = strcspn(start, "?#");
+    file_path = g_strndup(start, len);
+
+    if ( (slash = strrchr(file_path, '/')) == NULL || slash == file_path ||
+         !(strcmp(slash + 1, "index.m3u8") == 0 ||
+           strcmp(slash + 1, "init.mp4") == 0 ||
+           (g_ascii_isdigit(slash[1]) && g_str_has_suffix(slash, ".m4s"))) ) {
+        g_free(file_path);
+        return false;
+    }
+
+    *name = g_strdup(slash + 1);
+    /* escaped slashes are refused, like in the RTSP requests */
+    *path = g_uri_unescape_string(file_path, "/");
+    g_free(file_path);
+
+    if ( *path == NULL ) {
+        g_free(*name);
+        return false;
+    }
+
+    /* drop the file name from the unescaped path */
+    *strrchr(*path, '/') = '\0';
+
+    return true;
+}
+
+/**
+ * @brief HLS response being generated for a client
+ *
+ * It is shared by the client and the thread generating the file,
+ * under @ref http_hls_lock: once the file is ready, the latter wakes
+ * the client up through @ref HTTP_HLS_Reply::ready, unless the client
+ * is gone already, in which case it frees the response.
+ */
+typedef struct HTTP_HLS_Reply {
+    /** The client the response is for, NULL once it disconnected */
+    RTSP_Client *client;
+
+    RFC822_Request *req;
+    char *name;
+
+    ev_async ready;
+
+    /** The file was generated, and @ref ret and @ref file are set */
+    gboolean done;
+    int ret;
+    HLSFile *file;
+} HTTP_HLS_Reply;
+
+static GStaticMutex http_hls_lock = G_STATIC_MUTEX_INIT;
+
+static void http_hls_reply_free(HTTP_HLS_Reply *reply)
+{
+    rfc822_free_request(reply->req);
+    hls_file_unref(reply->file);
+    g_free(reply->name);
+    g_slice_free(HTTP_HLS_Reply, reply);
+}
+
+/**
+ * @brief Send the response to an HLS request
+ *
+ * @param client The client the request came from
+ * @param req The request
+ * @param name The name of the file requested
+ * @param ret The result of @ref hls_get
+ * @param file The file, if @p ret is @ref HLS_OK
+ */
+static void http_hls_respond(RTSP_Client *client, RFC822_Request *req,
+                             const char *name, int ret, HLSFile *file)
+{
+    RFC822_Response *response;
+
+    switch ( ret ) {
+    case HLS_NOT_FOUND:
+        rfc822_quick_response(client, req, req->proto, HTTP_NotFound);
+        return;
+    case HLS_NOT_READY:
+        rfc822_quick_response(client, req, req->proto, HTTP_ServiceUnavailable);
+        return;
+    }
+
+    response = rfc822_response_new(req, HTTP_Ok);
+    response->binary = true;
+    response->body = g_string_new_len((const char*)file->data->data,
+                                      file->data->len);
+
+    rfc822_headers_set(response->headers,
+                       HTTP_Header_Content_Type,
+                       g_strdup(file->content_type));
+
+    /* the playlist of a live resource changes with every segment */
+    rfc822_headers_set(response->headers,
+                       HTTP_Header_Cache_Control,
+                       g_strdup(file->live &&
+                                strcmp(name, "index.m3u8") == 0 ?
+                                "no-cache" : "max-age=3600"));
+
+    /* players in web pages fetch the files from other origins */
+    rfc822_headers_set(response->headers,
+                       HTTP_Header_Access_Control_Allow_Origin,
+                       g_strdup("*"));
+
+    rfc822_response_send(client, response);
+}
+
+/**
+ * @brief Receive a generated file, in the thread that generated it
+ */
+static void http_hls_ready_cb(int ret, HLSFile *file, gpointer reply_p)
+{
+    HTTP_HLS_Reply *reply = reply_p;
+    RTSP_Client *client;
+
+    g_static_mutex_lock(&http_hls_lock);
+
+    reply->ret = ret;
+    reply->file = file;
+    reply->done = true;
+
+    if ( (client = reply->client) != NULL )
+        ev_async_send(client->loop, &reply->ready);
+
+    g_static_mutex_unlock(&http_hls_lock);
+
+    if ( client == NULL )
+        http_hls_reply_free(reply);
+}
+
+/**
+ * @brief Send a generated file, in the thread of the client
+ *
+ * The requests that came meanwhile are then processed.
+ */
+static void http_hls_async_cb(struct ev_loop *loop, ev_async *w,
+                              ATTR_UNUSED int revents)
+{
+    HTTP_HLS_Reply *reply = w->data;
+    RTSP_Client *client = reply->client;
+
+    ev_async_stop(loop, w);
+    client->hls_reply = NULL;
+
+    http_hls_respond(client, reply->req, reply->name,
+                     reply->ret, reply->file);
+    http_hls_reply_free(reply);
+
+    client->status = RFC822_State_Begin;
+    RTSP_handler(client);
+}
+
+/**
+ * @brief Drop the HLS response a client is waiting for
+ *
+ * @param client The client being disconnected
+ *
+ * Called by the client thread once its loop is over, before the loop
+ * is destroyed.
+ */
+void http_hls_cancel(RTSP_Client *client)
+{
+    HTTP_HLS_Reply *reply = client->hls_reply;
+    gboolean done;
+
+    if ( reply == NULL )
+        return;
+
+    client->hls_reply = NULL;
+    ev_async_stop(client->loop, &reply->ready);
+
+    g_static_mutex_lock(&http_hls_lock);
+    reply->client = NULL;
+    done = reply->done;
+    g_static_mutex_unlock(&http_hls_lock);
+
+    /* otherwise it is freed once the file is generated */
+    if ( done )
+        http_hls_reply_free(reply);
+}
+
+/**
+ * @brief Answer an HTTP request for an HLS file
+ *
+ * @param client The client the request came from
+ * @param req The request, of which only the headers were read
+ *
+ * @retval true The request was for an HLS file, and a response was
+ *              either sent or, if the file is being generated, is
+ *              going to be; in the latter case the client is left in
+ *              @ref RFC822_State_HTTP_Pending, owning @p req.
+ * @retval false The request is not for HLS, and has to be handled
+ *               otherwise.
+ */
+gboolean http_hls_request(RTSP_Client *client, RFC822_Request *req)
+{
+    HTTP_HLS_Reply *reply;
+    HLSFile *file = NULL;
+    char *path, *name;
+    int ret;
+
+    /* requests carrying a session cookie open an RTSP tunnel */
+    if ( req->method_id != HTTP_Method_GET ||
+         rfc822_headers_lookup(req->headers, HTTP_Header_x_sessioncookie) ||
+         !http_hls_parse_object(req->object, &path, &name) )
+        return false;
+
+    /* the same check as the RTSP requests */
+    if ( !feng_path_is_safe(path) ) {
+        rfc822_quick_response(client, req, req->proto, HTTP_Forbidden);
+        goto end;
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "[hls] %s of %s", name, path);
+
+    /* the file can be generated before hls_get() returns, the reply
+       has to be ready to be signalled by then */
+    reply = g_slice_new0(HTTP_HLS_Reply);
+    reply->client = client;
+    reply->req = req;
+    reply->name = name;
+
+    reply->ready.data = reply;
+    ev_async_init(&reply->ready, http_hls_async_cb);
+    ev_async_start(client->loop, &reply->ready);
+
+    if ( (ret = hls_get(path, name, &file,
+                        http_hls_ready_cb, reply)) != HLS_PENDING ) {
+        ev_async_stop(client->loop, &reply->ready);
+        g_slice_free(HTTP_HLS_Reply, reply);
+
+        http_hls_respond(client, req, name, ret, file);
+        hls_file_unref(file);
+        goto end;
+    }
+
+    /* the reply is sent by http_hls_async_cb() */
+    client->hls_reply = reply;
+    client->pending_request = NULL;
+    client->status = RFC822_State_HTTP_Pending;
+
+    name = NULL;
+
+ end:
+    g_free(path);
+    g_free(name);
+    return true;
+}
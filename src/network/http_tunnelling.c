@@ -132,6 +132,21 @@ gboolean HTTP_handle_headers(RTSP_Client *rtsp)
     if (!rtsp_connection_limit(rtsp, rtsp->pending_request))
         return false;
 
+#ifdef HAVE_AVFORMAT
+    /* HLS requests are answered on the same connection, which is then
+       ready for the next request; a response still being generated
+       keeps the request until it is sent */
+    if ( http_hls_request(rtsp, rtsp->pending_request) ) {
+        if ( rtsp->status == RFC822_State_HTTP_Pending )
+            return false;
+
+        rfc822_free_request(rtsp->pending_request);
+        rtsp->pending_request = NULL;
+        rtsp->status = RFC822_State_Begin;
+        return true;
+    }
+#endif
+
 #ifdef HAVE_JSON
     if ( rtsp->pending_request->method_id == HTTP_Method_GET &&
          strstr(rtsp->pending_request->object, "stats") ) {
@@ -235,6 +250,15 @@ gboolean HTTP_handle_idle(ATTR_UNUSED RTSP_Client *rtsp)
     return false;
 }
 
+/**
+ * @brief Keep the requests that follow one still being answered in
+ *        the input buffer, so that the responses are sent in order
+ */
+gboolean HTTP_handle_pending(ATTR_UNUSED RTSP_Client *rtsp)
+{
+    return false;
+}
+
 void http_tunnel_initialise()
 {
     http_tunnel_pairs = g_hash_table_new_full(g_str_hash, g_str_equal,
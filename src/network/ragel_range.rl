@@ -165,3 +165,19 @@ gboolean ragel_parse_range_header(const char *header,
 
     return range_supported;
 }
+
+/**
+ * @brief Check a parsed range against the resource it is for
+ *
+ * @param range The range as filled in by @ref ragel_parse_range_header,
+ *              starting from a begin time of 0 and a negative end time
+ * @param seekable Whether the resource can be seeked
+ *
+ * @retval true The range can be played.
+ * @retval false The range is not valid for a resource that cannot
+ *               be seeked: only "0-" is accepted on those.
+ */
+gboolean rtsp_range_allowed(const RTSP_Range *range, gboolean seekable)
+{
+    return seekable || (range->begin_time == 0 && range->end_time < 0);
+}
@@ -187,11 +187,14 @@ void rfc822_response_send(RTSP_Client *client, RFC822_Response *response)
     if ( response->body )
         g_string_append_printf(str, "%s: %zu" ENDLINE,
                                rfc822_header_to_string(RFC822_Header_Content_Length),
-                               response->body->len + 2);
+                               response->body->len +
+                               (response->binary ? 0 : 2));
 
     g_string_append(str, ENDLINE);
 
-    if ( response->body ) {
+    if ( response->body && response->binary ) {
+        g_string_append_len(str, response->body->str, response->body->len);
+    } else if ( response->body ) {
         g_string_append(str, response->body->str);
         /* Make sure we add a final ENDLINE here since the body string might
          * not have it at all. */
@@ -48,7 +48,9 @@ typedef enum RFC822_Parser_State {
     /** HTTP headers read, reading content */
     RFC822_State_HTTP_Content,
     /** HTTP GET request read, idling (output only) */
-    RFC822_State_HTTP_Idle
+    RFC822_State_HTTP_Idle,
+    /** HTTP request read, waiting for its response to be ready */
+    RFC822_State_HTTP_Pending
 } RFC822_Parser_State;
 
 typedef struct RFC822_Request {
@@ -90,6 +92,7 @@ typedef struct RFC822_Request {
 } RFC822_Request;
 
 gboolean rfc822_request_check_url(struct RTSP_Client *client, RFC822_Request *req);
+void rfc822_free_request(RFC822_Request *req);
 
 typedef struct RFC822_Response {
     /** Protocol used by the response */
@@ -110,6 +113,13 @@ typedef struct RFC822_Response {
     /** Eventual body for the response */
     GString *body;
 
+    /**
+     * @brief The body is sent as it is, and may contain NUL bytes
+     *
+     * Textual bodies are terminated with an extra line ending.
+     */
+    gboolean binary;
+
     /** Original request triggering the response */
     const RFC822_Request *request;
 } RFC822_Response;
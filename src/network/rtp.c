@@ -251,12 +251,14 @@ static void rtp_packet_send(RTP_session *session, struct MParserBuffer *buffer)
 
     fnc_log(FNC_LOG_VERBOSE, "[RTP] Timestamp: %u", ntohl(timestamp));
 
-    memcpy(packet->data, buffer->data, buffer->data_size);
+    mparser_buffer_copy(buffer, packet->data);
 
     if (session->send_rtp(session, outbuf)) {
         session->last_timestamp = buffer->timestamp;
         session->pkt_count++;
+        session->starved = false;
         session->octet_count += buffer->data_size;
+        media_stat_add(MEDIA_STAT_BYTES_DELIVERED, buffer->data_size);
 
         session->last_packet_send_time = time(NULL);
     } else {
@@ -264,6 +266,21 @@ static void rtp_packet_send(RTP_session *session, struct MParserBuffer *buffer)
     }
 }
 
+/**
+ * @brief Report an underrun when the queue of a session runs dry
+ *
+ * Only the first empty poll after a packet was sent counts, so that a
+ * stall lasting several frames is a single underrun.
+ */
+static void rtp_session_starved(RTP_session *session, Resource *resource)
+{
+    if ( session->starved )
+        return;
+
+    session->starved = true;
+    r_buffer_underrun(resource);
+}
+
 /**
  * Send pending RTP packets to a session.
  *
@@ -297,7 +314,7 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
      * no extra frames we have a problem, since we're going to send
      * one packet at least.
      */
-    if (g_atomic_int_get(&resource->eor))
+    if (r_ended(resource))
         fnc_log(FNC_LOG_INFO,
             "[%s] end of resource %d packets to be fetched",
             session->track->encoding_name,
@@ -310,12 +327,17 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
          */
         double sleep_for = 0.1;
 
-        if (resource->eor) {
+        /* the resource or the last range ended, and everything was sent */
+        if (r_ended(resource)) {
             fnc_log(FNC_LOG_INFO, "[rtp] Stream Finished");
             rtcp_send_sr(session, BYE);
             return;
         }
 
+        /* the queue ran dry while playing */
+        if (session->pkt_count)
+            rtp_session_starved(session, resource);
+
         if (session->track->frame_duration > 0)
             sleep_for = session->track->frame_duration; // assumed to be enough
 
@@ -348,6 +370,8 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
             /* Wait a bit of time to recover from buffer underrun */
             double sleep_for = duration ? duration : 0.1;
 
+            rtp_session_starved(session, resource);
+
             next_time += sleep_for;
             fnc_log(FNC_LOG_INFO, "[%s] next packet not available, waiting %f...",
                     session->track->encoding_name, sleep_for);
@@ -103,6 +103,14 @@ typedef struct RTP_session {
     uint32_t octet_count;
     uint32_t pkt_count;
 
+    /**
+     * @brief The queue ran dry since the last packet sent
+     *
+     * A stall is reported once to @ref r_buffer_underrun, however
+     * many times the queue is found empty before it ends.
+     */
+    gboolean starved;
+
     rtp_send_cb send_rtp;
     rtp_send_cb send_rtcp;
     rtp_close_cb close_transport;
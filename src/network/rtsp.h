@@ -75,9 +75,9 @@ typedef struct RTSP_session {
      * @brief List of playback requests (of type @ref RTSP_Range)
      *
      * RFC 2326 Section 10.5 defines queues of PLAY requests, which
-     * allows precise editing by the client; we keep a list here to
-     * make it easier to actually implement the (currently missing)
-     * feature.
+     * allows precise editing by the client; the head is the range
+     * the timeline of the session starts from, the following ones
+     * are queued on the resource with @ref r_queue_range.
      */
     GQueue *play_requests;
 } RTSP_session;
@@ -171,6 +171,27 @@ typedef struct RTSP_Client {
 
     struct cfg_vhost_t *vhost;
 
+    /**
+     * @brief Resource described to the client, warmed up for SETUP
+     *
+     * It is dropped when @ref prefetch_timeout expires before a SETUP
+     * for @ref prefetched_path.
+     *
+     * @see rtsp_prefetch_keep
+     */
+    struct Resource *prefetched;
+    char *prefetched_path;
+    ev_timer prefetch_timeout;
+
+    /**
+     * @brief HLS response being generated for the client
+     *
+     * Set while @ref status is @ref RFC822_State_HTTP_Pending.
+     *
+     * @see http_hls_cancel
+     */
+    struct HTTP_HLS_Reply *hls_reply;
+
     /**
      * @brief Local host bound to the socket
      *
@@ -267,6 +288,11 @@ void rtsp_session_editlist_free(RTSP_session *session);
 
 void rtsp_do_pause(RTSP_Client *rtsp);
 
+gboolean rtsp_prefetch_keep(RTSP_Client *client, struct Resource *resource,
+                            const char *path);
+struct Resource *rtsp_prefetch_take(RTSP_Client *client, const char *path);
+void rtsp_prefetch_drop(RTSP_Client *client);
+
 /**
  * @defgroup ragel Ragel parsing
  *
@@ -301,6 +327,7 @@ struct RTSP_Range;
 
 gboolean ragel_parse_range_header(const char *header,
                                   RTSP_Range *range);
+gboolean rtsp_range_allowed(const RTSP_Range *range, gboolean seekable);
 
 /**
  *@}
@@ -319,6 +346,11 @@ int ragel_read_http_headers(GHashTable *headers, const char *msg,
 gboolean HTTP_handle_headers(RTSP_Client *rtsp);
 gboolean HTTP_handle_content(RTSP_Client *rtsp);
 gboolean HTTP_handle_idle(RTSP_Client *rtsp);
+gboolean HTTP_handle_pending(RTSP_Client *rtsp);
+#ifdef HAVE_AVFORMAT
+gboolean http_hls_request(RTSP_Client *client, RFC822_Request *req);
+void http_hls_cancel(RTSP_Client *client);
+#endif
 void http_tunnel_initialise();
 
 #ifdef HAVE_JSON
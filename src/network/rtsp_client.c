@@ -270,6 +270,11 @@ static void client_loop(gpointer client_p,
 
         ev_timer_stop(loop, &client->ev_timeout);
 
+        rtsp_prefetch_drop(client);
+#ifdef HAVE_AVFORMAT
+        http_hls_cancel(client);
+#endif
+
         /* As soon as we're out of here, remove the client from the list! */
         g_mutex_lock(clients_list_lock);
         g_ptr_array_remove_fast(clients_list, client);
@@ -73,6 +73,9 @@ static void sdp_track_descr(gpointer element, gpointer user_data)
         [MP_control] = "m=control"
     };
 
+    if ( track->muxed )
+        return;
+
     type = track->media_type;
 
     /* MP_undef is the only case we don't handle. */
@@ -125,12 +128,11 @@ static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
     path = g_uri_unescape_string(uri->path, "/");
 
     fnc_log(FNC_LOG_DEBUG, "[SDP] opening %s", path);
-    if ( !(resource = r_open(path)) ) {
+    if ( !(resource = r_open_client(path)) ) {
         fnc_log(FNC_LOG_ERR, "[SDP] %s not found", path);
         g_free(path);
         return NULL;
     }
-    g_free(path);
 
     descr = g_string_new("v=0"SDP_EL);
 
@@ -172,7 +174,10 @@ static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
                    sdp_track_descr,
                    descr);
 
-    r_close(resource);
+    /* most clients set up and play the resource right away */
+    if ( !rtsp_prefetch_keep(rtsp, resource, path) )
+        r_close(resource);
+    g_free(path);
 
     fnc_log(FNC_LOG_INFO, "[SDP] description:\n%s", descr->str);
 
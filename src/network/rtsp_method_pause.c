@@ -27,6 +27,7 @@
 #include "feng.h"
 #include "rtsp.h"
 #include "rtp.h"
+#include "media/media.h"
 
 /**
  *  Actually pause playing the media using mediathread
@@ -39,8 +40,19 @@ void rtsp_do_pause(RTSP_Client *rtsp)
     RTSP_session *rtsp_sess = rtsp->session;
     /* Get the first range, so that we can record the pause point */
     RTSP_Range *range = g_queue_peek_head(rtsp_sess->play_requests);
+    double pause_time = range->begin_time +
+        ev_now(rtsp->loop) - range->playback_time;
+    guint played;
 
-    range->begin_time += ev_now(rtsp->loop) - range->playback_time;
+    /* The pause point is on the timeline of the ranges played since
+     * the first one; drop those that are over and make the pause
+     * point relative to the stream. */
+    played = r_range_at(rtsp_sess->resource, &pause_time);
+    while ( played-- && g_queue_get_length(rtsp_sess->play_requests) > 1 )
+        g_slice_free(RTSP_Range, g_queue_pop_head(rtsp_sess->play_requests));
+
+    range = g_queue_peek_head(rtsp_sess->play_requests);
+    range->begin_time = pause_time;
     range->playback_time = -0.1;
 
     rtp_session_gslist_pause(rtsp_sess->rtp_sessions);
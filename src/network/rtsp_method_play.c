@@ -34,6 +34,19 @@
 #include "fnc_log.h"
 #include "media/media.h"
 
+/**
+ * @brief Stream time to stop a range at
+ *
+ * Ranges ending at the end of the resource are not clipped, so that
+ * the whole resource is played even if the duration reported by the
+ * demuxer is not exact.
+ */
+static double play_range_end(Resource *resource, RTSP_Range *range)
+{
+    return range->end_time < resource->duration ?
+        range->end_time : HUGE_VAL;
+}
+
 /**
  * Actually starts playing the media using mediathread
  *
@@ -44,16 +57,36 @@
  */
 static RTSP_ResponseCode do_play(RTSP_session * rtsp_sess)
 {
+    Resource *resource = rtsp_sess->resource;
     RTSP_Range *range = g_queue_peek_head(rtsp_sess->play_requests);
+    GList *queued;
 
     /* Don't try to seek if the source is not seekable;
      * parse_range_header() would have already ensured the range is
      * valid for the resource, and in particular ensured that if the
      * resource is not seekable we only have the “0-” range selected.
+     *
+     * The seek updates begin_time with the time we actually landed
+     * on, so that both the Range header of the reply and the RTP
+     * timestamps refer to the first frame that is going to be sent.
      */
-    if ( rtsp_sess->resource->seek != NULL &&
-         r_seek(rtsp_sess->resource, range->begin_time) )
-        return RTSP_InvalidRange;
+    if ( resource->seek != NULL ) {
+        if ( r_seek(resource, &range->begin_time) )
+            return RTSP_InvalidRange;
+
+        r_set_clip(resource, range->begin_time,
+                   play_range_end(resource, range), 0);
+
+        /* The ranges queued after the first one are played back to
+         * back with it, see RFC 2326 Section 10.5. */
+        for ( queued = rtsp_sess->play_requests->head->next;
+              queued; queued = queued->next ) {
+            RTSP_Range *next = queued->data;
+
+            r_queue_range(resource, next->begin_time,
+                          play_range_end(resource, next));
+        }
+    }
 
     rtsp_sess->cur_state = RTSP_SERVER_PLAYING;
 
@@ -104,7 +137,9 @@ static void send_play_reply(RTSP_Client *client,
     /* temporary string used for creating headers */
     GString *str = g_string_new("npt=");
 
-    RTSP_Range *range = g_queue_peek_head(rtsp_session->play_requests);
+    /* The reply describes the range requested by this PLAY, which
+     * might be queued after the one being played. */
+    RTSP_Range *range = g_queue_peek_tail(rtsp_session->play_requests);
 
     /* Create Range header */
     if (range->begin_time >= 0)
@@ -230,9 +265,7 @@ static RTSP_ResponseCode parse_range_header(RTSP_Client *client,
          * mere presence of the Range header in this condition would
          * trigger that response.
          */
-        if ( session->resource->seek != NULL &&
-             range->begin_time != 0 &&
-             range->end_time != -0.1 ) {
+        if ( !rtsp_range_allowed(range, session->resource->seek != NULL) ) {
             g_slice_free(RTSP_Range, range);
             return RTSP_HeaderFieldNotValidforResource;
         }
@@ -258,6 +291,12 @@ static RTSP_ResponseCode parse_range_header(RTSP_Client *client,
 
     rtsp_session_editlist_append(session, range);
 
+    /* A PLAY received while playing is queued after the current
+     * ranges, see RFC 2326 Section 10.5. */
+    if ( session->cur_state == RTSP_SERVER_PLAYING )
+        r_queue_range(session->resource, range->begin_time,
+                      play_range_end(session->resource, range));
+
     fnc_log(FNC_LOG_VERBOSE,
             "PLAY [%f]: %f %f %f\n", ev_now(client->loop),
             range->begin_time, range->end_time, range->playback_time);
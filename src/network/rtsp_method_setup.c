@@ -90,7 +90,8 @@ static Track *select_requested_track(RTSP_Client *client, RFC822_Request *req, R
                     path,
                     rtsp_s->resource_uri);
 
-        if (!(rtsp_s->resource = r_open(path))) {
+        if (!(rtsp_s->resource = rtsp_prefetch_take(client, path)) &&
+            !(rtsp_s->resource = r_open_client(path))) {
             fnc_log(FNC_LOG_DEBUG, "Resource for %s not found", path);
 
             g_free(path);
@@ -38,7 +38,7 @@
  *
  * @param req Request to free
  */
-static void rfc822_free_request(RFC822_Request *req)
+void rfc822_free_request(RFC822_Request *req)
 {
     if ( req == NULL )
         return;
@@ -411,6 +411,9 @@ void RTSP_handler(RTSP_Client * rtsp)
         case RFC822_State_HTTP_Idle:
             ret = HTTP_handle_idle(rtsp);
             break;
+        case RFC822_State_HTTP_Pending:
+            ret = HTTP_handle_pending(rtsp);
+            break;
         }
     } while(ret);
 #else
@@ -423,7 +426,8 @@ void RTSP_handler(RTSP_Client * rtsp)
         [RFC822_State_Interleaved] = RTSP_handle_interleaved,
         [RFC822_State_HTTP_Headers] = HTTP_handle_headers,
         [RFC822_State_HTTP_Content] = HTTP_handle_content,
-        [RFC822_State_HTTP_Idle] = HTTP_handle_idle
+        [RFC822_State_HTTP_Idle] = HTTP_handle_idle,
+        [RFC822_State_HTTP_Pending] = HTTP_handle_pending
     };
 
     while ( handlers[rtsp->status](rtsp) );
@@ -29,10 +29,12 @@
  */
 
 #include <stdbool.h>
+#include <string.h>
 
 #include <glib.h>
 
 #include "feng.h"
+#include "fnc_log.h"
 #include "rtsp.h"
 #include "rtp.h"
 #include "uri.h"
@@ -132,6 +134,105 @@ void rtsp_session_free(RTSP_session *session)
     g_slice_free(RTSP_session, session);
 }
 
+/**
+ * @brief Detach the warmed up resource from a client
+ *
+ * @return The resource, which is not closed, or NULL.
+ */
+static Resource *rtsp_prefetch_release(RTSP_Client *client)
+{
+    Resource *resource = client->prefetched;
+
+    if ( resource == NULL )
+        return NULL;
+
+    ev_timer_stop(client->loop, &client->prefetch_timeout);
+
+    g_free(client->prefetched_path);
+    client->prefetched_path = NULL;
+    client->prefetched = NULL;
+
+    return resource;
+}
+
+static void rtsp_prefetch_timeout_cb(ATTR_UNUSED struct ev_loop *loop,
+                                     ev_timer *w,
+                                     ATTR_UNUSED int revents)
+{
+    RTSP_Client *client = w->data;
+
+    fnc_log(FNC_LOG_DEBUG, "[prefetch] %s was not set up in time",
+            client->prefetched_path);
+
+    media_stat_add(MEDIA_STAT_PREFETCH_EXPIRED, 1);
+    rtsp_prefetch_drop(client);
+}
+
+/**
+ * @brief Keep a described resource open and warm it up
+ *
+ * @param client The client that described the resource
+ * @param resource The resource opened for DESCRIBE
+ * @param path The path the resource was opened from
+ *
+ * @retval true The resource is now owned by the client, and is warmed
+ *              up from its start until SETUP takes it (see @ref
+ *              rtsp_prefetch_take) or the prefetch-timeout expires.
+ * @retval false The resource cannot be warmed up, or too many are
+ *               already; the caller has to close it.
+ *
+ * Only one resource is kept per client, and none once a resource is
+ * set up already. The resource is seeked and read by the warm-up
+ * threads, the client does not wait for it.
+ */
+gboolean rtsp_prefetch_keep(RTSP_Client *client, Resource *resource,
+                            const char *path)
+{
+    if ( client->session && client->session->resource )
+        return false;
+
+    rtsp_prefetch_drop(client);
+
+    if ( !r_prefetch(resource, 0) )
+        return false;
+
+    client->prefetched = resource;
+    client->prefetched_path = g_strdup(path);
+
+    ev_timer_init(&client->prefetch_timeout, rtsp_prefetch_timeout_cb,
+                  feng_srv.prefetch_timeout / 1000.0, 0);
+    client->prefetch_timeout.data = client;
+    ev_timer_start(client->loop, &client->prefetch_timeout);
+
+    return true;
+}
+
+/**
+ * @brief Take the warmed up resource of a client
+ *
+ * @param client The client setting up a resource
+ * @param path The path of the resource being set up
+ *
+ * @return The resource warmed up for @p path, now owned by the caller,
+ *         or NULL if there is none; a resource warmed up for a
+ *         different path is left in place.
+ */
+Resource *rtsp_prefetch_take(RTSP_Client *client, const char *path)
+{
+    if ( client->prefetched == NULL ||
+         strcmp(client->prefetched_path, path) != 0 )
+        return NULL;
+
+    return rtsp_prefetch_release(client);
+}
+
+/**
+ * @brief Close the warmed up resource of a client, if any
+ */
+void rtsp_prefetch_drop(RTSP_Client *client)
+{
+    r_close(rtsp_prefetch_release(client));
+}
 
 /**
  * RTSP Header and request parsing and validation functions
@@ -150,15 +251,18 @@ void rtsp_session_free(RTSP_session *session)
  * @retval false The URL contains forbidden sequences that might have malicious
  *         intent.
  *
- * @todo This function should be moved to netembryo.
- * @todo This function does not check properly for paths.
+ * The path is checked as it will be opened: unescaped, with escaped
+ * slashes refused, like the methods do.
+ *
+ * @see feng_path_is_safe
  */
 static gboolean check_forbidden_path(URI *uri)
 {
-    if ( strstr(uri->path, "../") || strstr(uri->path, "./") )
-        return false;
+    char *path = g_uri_unescape_string(uri->path, "/");
+    const gboolean safe = feng_path_is_safe(path);
 
-    return true;
+    g_free(path);
+    return safe;
 }
 
 /**
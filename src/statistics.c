@@ -93,6 +93,85 @@ static void client_stats(gpointer c, gpointer s)
     json_object_array_add(clients_stats, stats);
 }
 
+/**
+ * @brief Produce the media backend counters
+ *
+ * @return A new JSON object with one member per @ref MediaStat.
+ */
+static json_object *media_stats()
+{
+    json_object *media = json_object_new_object();
+    time_t uptime = time(NULL) - stats_start_time;
+    guint64 delivered = media_stat_get(MEDIA_STAT_BYTES_DELIVERED);
+    guint64 lookups = media_stat_get(MEDIA_STAT_PCACHE_HITS) +
+        media_stat_get(MEDIA_STAT_PCACHE_MISSES);
+#ifdef HAVE_AVFORMAT
+    SegmentCache *sc;
+#endif
+    MediaStat i;
+
+    for ( i = 0; i < MEDIA_STAT_COUNT; i++ )
+        json_object_object_add(media, media_stat_name(i),
+            json_object_new_int64(media_stat_get(i)));
+
+    json_object_object_add(media, "io_reads_per_second",
+        json_object_new_double(uptime ?
+                               (double)media_stat_get(MEDIA_STAT_IO_READS) / uptime : 0));
+
+    json_object_object_add(media, "io_bytes_per_delivered_byte",
+        json_object_new_double(delivered ?
+                               (double)media_stat_get(MEDIA_STAT_IO_BYTES) / delivered : 0));
+
+    json_object_object_add(media, "packet_cache_hit_ratio",
+        json_object_new_double(lookups ?
+                               (double)media_stat_get(MEDIA_STAT_PCACHE_HITS) / lookups : 0));
+
+#ifdef HAVE_AVFORMAT
+    /* the cache is only reported once the media backend created it */
+    if ( (sc = rio_segment_cache_peek()) != NULL ) {
+        SegmentCacheStats sstats;
+        guint64 reads, loads;
+
+        segcache_get_stats(sc, &sstats);
+        reads = sstats.ram_hits + sstats.coalesced + sstats.disk_hits +
+            sstats.misses;
+        loads = sstats.disk_hits + sstats.misses;
+
+        json_object_object_add(media, "segment_cache_ram_hits",
+            json_object_new_int64(sstats.ram_hits));
+        json_object_object_add(media, "segment_cache_disk_hits",
+            json_object_new_int64(sstats.disk_hits));
+        json_object_object_add(media, "segment_cache_misses",
+            json_object_new_int64(sstats.misses));
+        json_object_object_add(media, "segment_cache_coalesced",
+            json_object_new_int64(sstats.coalesced));
+        json_object_object_add(media, "segment_cache_prefetches",
+            json_object_new_int64(sstats.prefetches));
+        json_object_object_add(media, "segment_cache_errors",
+            json_object_new_int64(sstats.errors));
+        json_object_object_add(media, "segment_cache_origin_bytes",
+            json_object_new_int64(sstats.origin_bytes));
+        json_object_object_add(media, "segment_cache_disk_stores",
+            json_object_new_int64(sstats.disk_stores));
+        json_object_object_add(media, "segment_cache_disk_evictions",
+            json_object_new_int64(sstats.disk_evictions));
+        json_object_object_add(media, "segment_cache_disk_bytes",
+            json_object_new_int64(sstats.disk_bytes));
+        json_object_object_add(media, "segment_cache_hit_ratio",
+            json_object_new_double(reads ?
+                                   1 - (double)sstats.misses / reads : 0));
+        json_object_object_add(media, "segment_cache_ram_hit_ratio",
+            json_object_new_double(reads ?
+                                   (double)(reads - loads) / reads : 0));
+        json_object_object_add(media, "segment_cache_disk_hit_ratio",
+            json_object_new_double(loads ?
+                                   (double)sstats.disk_hits / loads : 0));
+    }
+#endif
+
+    return media;
+}
+
 /**
  * @brief Report instant statistics
  */
@@ -120,6 +199,8 @@ void feng_send_statistics(RTSP_Client *rtsp)
 
     json_object_object_add(stats, "per_client", clients_stats);
 
+    json_object_object_add(stats, "media", media_stats());
+
     response->body = g_string_new(json_object_to_json_string(stats));
 
     rfc822_headers_set(response->headers,
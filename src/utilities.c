@@ -20,6 +20,7 @@
 
 #include <glib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "feng.h"
 
 /**
@@ -116,3 +117,33 @@ gboolean feng_str_is_unreserved(const char *string)
 
     return true;
 }
+
+/**
+ * @brief Ensures that an unescaped path does not leave the directory
+ *        it is resolved in
+ *
+ * @param path NULL-terminated path to verify, already unescaped
+ *
+ * @retval true No segment of the path is "." or ".."
+ * @retval false The path is NULL, or one of its segments is "." or
+ *               ".." (wherever it is, including at its end)
+ */
+gboolean feng_path_is_safe(const char *path)
+{
+    const char *segment;
+
+    if ( path == NULL )
+        return false;
+
+    for ( segment = path; ; segment++ ) {
+        const size_t len = strcspn(segment, "/");
+
+        if ( (len == 1 && segment[0] == '.') ||
+             (len == 2 && segment[0] == '.' && segment[1] == '.') )
+            return false;
+
+        segment += len;
+        if ( *segment == '\0' )
+            return true;
+    }
+}
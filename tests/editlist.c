@@ -0,0 +1,217 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <math.h>
+
+#include "src/media/media.h"
+#include <glib.h>
+#include "gtest-extra.h"
+
+static const char h264_ds[] =
+    "# Version 1 - EDL di testtc.mov 0.0 10.0\n"
+    "test.mov 0.0 1.0\n"
+    "test.mov 1.0 3.0\n"
+    "test.mov 3.0 4.0\n";
+
+static const char scramble_ds[] =
+    "# Version 1 - EDL di testtc.mov 0.0 10.0\n"
+    "test.mov 1.0 2.0\n"
+    "test.mov 1.0 3.0\n"
+    "test.mov 0.0 3.0\n";
+
+#define SEGMENT(edl, i) ((EditListSegment*)g_ptr_array_index((edl)->segments, i))
+
+void test_edl_parse_merge()
+{
+    EditList *edl = edl_parse(h264_ds);
+
+    g_assert(edl != NULL);
+    g_assert_cmpuint(edl->segments->len, ==, 1);
+    g_assert_cmpstr(SEGMENT(edl, 0)->path, ==, "test.mov");
+    g_assert_cmpfloat(SEGMENT(edl, 0)->start, ==, 0.0);
+    g_assert_cmpfloat(SEGMENT(edl, 0)->end, ==, 4.0);
+    g_assert_cmpfloat(edl->duration, ==, 4.0);
+
+    edl_free(edl);
+}
+
+void test_edl_parse_layout()
+{
+    EditList *edl = edl_parse(scramble_ds);
+
+    g_assert(edl != NULL);
+    g_assert_cmpuint(edl->segments->len, ==, 3);
+    g_assert_cmpfloat(SEGMENT(edl, 0)->offset, ==, 0.0);
+    g_assert_cmpfloat(SEGMENT(edl, 1)->offset, ==, 1.0);
+    g_assert_cmpfloat(SEGMENT(edl, 2)->offset, ==, 3.0);
+    g_assert_cmpfloat(edl->duration, ==, 6.0);
+
+    g_assert_cmpfloat(edl_to_timeline(SEGMENT(edl, 1), 2.5), ==, 2.5);
+    g_assert_cmpfloat(edl_to_timeline(SEGMENT(edl, 2), 0.5), ==, 3.5);
+
+    edl_free(edl);
+}
+
+void test_edl_parse_spaces()
+{
+    EditList *edl = edl_parse("my file.mov\t0.5 1.5\n\n");
+
+    g_assert(edl != NULL);
+    g_assert_cmpstr(SEGMENT(edl, 0)->path, ==, "my file.mov");
+    g_assert_cmpfloat(SEGMENT(edl, 0)->start, ==, 0.5);
+    g_assert_cmpfloat(edl->duration, ==, 1.0);
+
+    edl_free(edl);
+}
+
+void test_edl_parse_invalid()
+{
+    g_assert(edl_parse("") == NULL);
+    g_assert(edl_parse("# only a comment\n") == NULL);
+    g_assert(edl_parse("test.mov 2.0 1.0\n") == NULL);
+    g_assert(edl_parse("test.mov 1.0\n") == NULL);
+    g_assert(edl_parse("test.mov a b\n") == NULL);
+    g_assert(edl_parse("test.mov -1.0 1.0\n") == NULL);
+}
+
+void test_edl_find_segment()
+{
+    EditList *edl = edl_parse(scramble_ds);
+
+    g_assert_cmpuint(edl_find_segment(edl, 0.0), ==, 0);
+    g_assert_cmpuint(edl_find_segment(edl, 0.99), ==, 0);
+    g_assert_cmpuint(edl_find_segment(edl, 1.0), ==, 1);
+    g_assert_cmpuint(edl_find_segment(edl, 2.5), ==, 1);
+    g_assert_cmpuint(edl_find_segment(edl, 3.0), ==, 2);
+    g_assert_cmpuint(edl_find_segment(edl, 10.0), ==, 2);
+
+    edl_free(edl);
+}
+
+/**
+ * Simulate the playback of an edit list of a 25fps video with a
+ * keyframe every 12 frames: the start of the segments is moved to the
+ * preceding keyframe as resource_edl.c does, then the frames played
+ * for each segment are mapped onto the timeline, which has to be
+ * monotonic with no gap nor overlap at the cuts.
+ */
+void test_edl_cut_gaps()
+{
+    static const double frame = 0.04, gop = 12 * 0.04;
+    EditList *edl = edl_parse("a.mov 1.0 2.0\n"
+                              "b.mov 0.3 2.1\n"
+                              "a.mov 0.0 3.0\n"
+                              "a.mov 5.5 5.9\n");
+    double last = -1, max_gap = 0;
+    guint i;
+
+    g_assert(edl != NULL);
+    g_assert_cmpuint(edl->segments->len, ==, 4);
+
+    for ( i = 0; i < edl->segments->len; i++ )
+        SEGMENT(edl, i)->start = floor(SEGMENT(edl, i)->start / gop + 1e-9) * gop;
+    edl_layout(edl);
+
+    for ( i = 0; i < edl->segments->len; i++ ) {
+        EditListSegment *segment = SEGMENT(edl, i);
+        double t;
+
+        for ( t = segment->start; t < segment->end - 1e-9; t += frame ) {
+            double timeline = edl_to_timeline(segment, t);
+
+            if ( last >= 0 ) {
+                g_assert_cmpfloat(timeline, >, last);
+                max_gap = MAX(max_gap, timeline - last - frame);
+            }
+
+            last = timeline;
+        }
+    }
+
+    g_assert_cmpfloat(max_gap, <, frame);
+    g_assert_cmpfloat(last + frame, <=, edl->duration + frame);
+
+    edl_free(edl);
+}
+
+void test_edl_loop()
+{
+    EditList *edl = edl_parse("a.mov 0 10\nb.mov 5 15\n");
+    double time;
+
+    g_assert(edl != NULL);
+
+    time = 25;
+    g_assert_cmpuint(edl_loop_segment(edl, &time), ==, 0);
+    g_assert_cmpfloat(fabs(time - 5), <, 1e-9);
+
+    time = 33;
+    g_assert_cmpuint(edl_loop_segment(edl, &time), ==, 1);
+    g_assert_cmpfloat(fabs(time - 8), <, 1e-9);
+
+    time = -1;
+    g_assert_cmpuint(edl_loop_segment(edl, &time), ==, 1);
+    g_assert_cmpfloat(fabs(time - 14), <, 1e-9);
+
+    edl_free(edl);
+}
+
+/**
+ * Map the packets of files whose stream times do not start at 0, as
+ * MPEG-TS files do, onto the timeline: each segment has to start where
+ * the previous one ended.
+ */
+void test_edl_stream_offset()
+{
+    static const double frame = 0.04;
+    static const double start_times[] = { 1.4, 0.0, 1.4 };
+    EditList *edl = edl_parse("a.ts 1.0 2.0\n"
+                              "b.mov 0.0 1.0\n"
+                              "a.ts 3.0 4.0\n");
+    double last = -1;
+    guint i;
+
+    g_assert(edl != NULL);
+    g_assert_cmpuint(edl->segments->len, ==, 3);
+
+    for ( i = 0; i < edl->segments->len; i++ ) {
+        EditListSegment *segment = SEGMENT(edl, i);
+        const double offset = edl_stream_offset(segment, start_times[i]);
+        double t;
+
+        for ( t = segment->start; t < segment->end - 1e-9; t += frame ) {
+            /* the time the demuxer reports for the frame */
+            const double timeline = start_times[i] + t + offset;
+
+            g_assert_cmpfloat(fabs(timeline - edl_to_timeline(segment, t)), <, 1e-9);
+
+            if ( last >= 0 )
+                g_assert_cmpfloat(fabs(timeline - last - frame), <, 1e-9);
+
+            last = timeline;
+        }
+    }
+
+    g_assert_cmpfloat(fabs(last + frame - edl->duration), <, 1e-9);
+
+    edl_free(edl);
+}
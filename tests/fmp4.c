@@ -0,0 +1,197 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "src/media/media.h"
+#include <glib.h>
+#include "gtest-extra.h"
+
+/* Baseline profile, 1920x1088 cropped to 1080 lines */
+static const uint8_t sps[] = {
+    0x67, 0x42, 0x00, 0x28, 0x56, 0x80, 0x78, 0x02, 0x27, 0x54, 0xa8
+};
+
+static const uint8_t pps[] = { 0x68, 0xce, 0x38, 0x80 };
+
+/* AAC LC, 44100Hz, stereo */
+static const uint8_t asc[] = { 0x12, 0x10 };
+
+static uint32_t read_u32(const uint8_t *data)
+{
+    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+/**
+ * Find the n-th box of the given type, looking at every offset; the
+ * payloads of the tests never contain box names.
+ */
+static const uint8_t *find_box(const GByteArray *b, const char *type, int n)
+{
+    size_t pos;
+
+    for ( pos = 4; pos + 4 <= b->len; pos++ )
+        if ( memcmp(b->data + pos, type, 4) == 0 && n-- == 0 )
+            return b->data + pos - 4;
+
+    return NULL;
+}
+
+static FMP4Track *video_track_new()
+{
+    FMP4Track *t = fmp4_track_new(1, MP_video);
+
+    g_assert(fmp4_track_set_h264(t, sps, sizeof(sps), pps, sizeof(pps)));
+    return t;
+}
+
+static FMP4Track *audio_track_new()
+{
+    FMP4Track *t = fmp4_track_new(2, MP_audio);
+
+    g_assert(fmp4_track_set_aac(t, asc, sizeof(asc)));
+    return t;
+}
+
+void test_fmp4_sps_size()
+{
+    int width, height;
+
+    g_assert(fmp4_h264_sps_size(sps, sizeof(sps), &width, &height));
+    g_assert_cmpint(width, ==, 1920);
+    g_assert_cmpint(height, ==, 1080);
+
+    g_assert(!fmp4_h264_sps_size(sps, 5, &width, &height));
+    g_assert(!fmp4_h264_sps_size(pps, sizeof(pps), &width, &height));
+}
+
+void test_fmp4_aac_config()
+{
+    FMP4Track *t = audio_track_new();
+
+    g_assert_cmpint(t->sample_rate, ==, 44100);
+    g_assert_cmpint(t->channels, ==, 2);
+    g_assert_cmpuint(t->timescale, ==, 44100);
+
+    fmp4_track_free(t);
+}
+
+void test_fmp4_init_segment()
+{
+    FMP4Track *tracks[2] = { video_track_new(), audio_track_new() };
+    GByteArray *b = fmp4_init_segment(tracks, 2);
+    const uint8_t *moov;
+    uint32_t ftyp_size;
+
+    g_assert_cmpint(memcmp(b->data + 4, "ftyp", 4), ==, 0);
+
+    /* the movie box follows, and takes the rest of the file */
+    ftyp_size = read_u32(b->data);
+    moov = b->data + ftyp_size;
+    g_assert_cmpint(memcmp(moov + 4, "moov", 4), ==, 0);
+    g_assert_cmpuint(ftyp_size + read_u32(moov), ==, b->len);
+
+    g_assert(find_box(b, "avcC", 0) != NULL);
+    g_assert(find_box(b, "esds", 0) != NULL);
+    g_assert(find_box(b, "trak", 1) != NULL);
+    g_assert(find_box(b, "trex", 1) != NULL);
+    g_assert(find_box(b, "trak", 2) == NULL);
+
+    g_byte_array_free(b, true);
+    fmp4_track_free(tracks[0]);
+    fmp4_track_free(tracks[1]);
+}
+
+void test_fmp4_media_segment()
+{
+    FMP4Track *tracks[2] = { video_track_new(), audio_track_new() };
+    const uint8_t video[] = { 0, 0, 0, 2, 0x65, 0x88 };
+    const uint8_t audio[] = { 0x21, 0x10, 0x05 };
+    const uint8_t *moof, *trun;
+    GByteArray *b;
+
+    fmp4_track_add_sample(tracks[0], 0, 0.1, NAN, true, video, sizeof(video));
+    fmp4_track_add_sample(tracks[0], 0.04, 0.04, 0.04, false, video, sizeof(video));
+    fmp4_track_add_sample(tracks[1], 0, 0, 1024.0/44100, true, audio, sizeof(audio));
+
+    b = fmp4_media_segment(tracks, 2, 1, INFINITY);
+    g_assert(b != NULL);
+
+    moof = b->data;
+    g_assert_cmpint(memcmp(moof + 4, "moof", 4), ==, 0);
+    g_assert_cmpint(memcmp(moof + read_u32(moof) + 4, "mdat", 4), ==, 0);
+    g_assert_cmpuint(read_u32(moof) + read_u32(moof + read_u32(moof)), ==, b->len);
+
+    /* the data offsets are relative to the moof box */
+    trun = find_box(b, "trun", 0);
+    g_assert_cmpuint(read_u32(trun + 12), ==, 2);
+    g_assert_cmpint(memcmp(moof + read_u32(trun + 16), video, sizeof(video)), ==, 0);
+    g_assert_cmpint(memcmp(moof + read_u32(trun + 16) + sizeof(video),
+                           video, sizeof(video)), ==, 0);
+
+    /* first sample: duration up to the next one, sync, and shown
+       later than decoded */
+    g_assert_cmpuint(read_u32(trun + 20), ==, 3600);
+    g_assert_cmpuint(read_u32(trun + 24), ==, sizeof(video));
+    g_assert_cmpuint(read_u32(trun + 28), ==, 0x02000000);
+    g_assert_cmpuint(read_u32(trun + 32), ==, 9000);
+
+    trun = find_box(b, "trun", 1);
+    g_assert_cmpuint(read_u32(trun + 12), ==, 1);
+    g_assert_cmpint(memcmp(moof + read_u32(trun + 16), audio, sizeof(audio)), ==, 0);
+    g_assert_cmpuint(read_u32(trun + 20), ==, 1024);
+
+    g_byte_array_free(b, true);
+
+    /* all the samples were written */
+    g_assert(fmp4_media_segment(tracks, 2, 2, INFINITY) == NULL);
+
+    fmp4_track_free(tracks[0]);
+    fmp4_track_free(tracks[1]);
+}
+
+void test_fmp4_segment_end()
+{
+    FMP4Track *t = video_track_new();
+    const uint8_t nal[] = { 0, 0, 0, 1, 0x41 };
+    GByteArray *b;
+    int i;
+
+    for ( i = 0; i < 10; i++ )
+        fmp4_track_add_sample(t, i, i, 1, i % 5 == 0, nal, sizeof(nal));
+
+    b = fmp4_media_segment(&t, 1, 1, 5);
+    g_assert(b != NULL);
+    g_assert_cmpuint(read_u32(find_box(b, "trun", 0) + 12), ==, 5);
+    g_byte_array_free(b, true);
+
+    g_assert_cmpfloat(fmp4_track_start(t), ==, 5);
+
+    fmp4_track_trim(t, 7);
+    g_assert_cmpfloat(fmp4_track_start(t), ==, 7);
+
+    fmp4_track_trim(t, INFINITY);
+    g_assert(isnan(fmp4_track_start(t)));
+
+    fmp4_track_free(t);
+}
@@ -0,0 +1,276 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <string.h>
+
+#include "src/media/media.h"
+#include <glib.h>
+#include "gtest-extra.h"
+
+/* VP9 profile 0 keyframe header, 352x288 */
+static const uint8_t vp9_key[] = {
+    0x82, 0x49, 0x83, 0x42, 0x00, 0x15, 0xf0, 0x11, 0xf0
+};
+
+/* VP9 interframe header */
+static const uint8_t vp9_inter[] = { 0x86, 0x00, 0x00 };
+
+static GByteArray *sample_frame(const uint8_t *header, size_t header_len,
+                                size_t len)
+{
+    GByteArray *frame = g_byte_array_sized_new(len);
+    size_t i;
+
+    g_byte_array_append(frame, header, header_len);
+    for ( i = header_len; i < len; i++ ) {
+        const uint8_t byte = i * 7;
+        g_byte_array_append(frame, &byte, 1);
+    }
+
+    return frame;
+}
+
+/**
+ * Check the VP9 descriptors and put the frame back together.
+ */
+static void check_vp9(GQueue *packets, const GByteArray *frame,
+                      gboolean keyframe, uint16_t picture_id)
+{
+    GByteArray *rebuilt = g_byte_array_new();
+    GList *item;
+
+    for ( item = packets->head; item; item = item->next ) {
+        const struct MParserBuffer *buffer = item->data;
+        const uint8_t *d = buffer->data;
+        size_t header = 3;
+
+        g_assert_cmpuint(buffer->data_size, <=, DEFAULT_MTU);
+        g_assert(buffer->keyframe == keyframe);
+        g_assert(buffer->marker == (item->next == NULL));
+
+        g_assert_cmpuint(d[0] & 0x80, ==, 0x80);                    /* I */
+        g_assert_cmpuint(d[0] & 0x40, ==, keyframe ? 0 : 0x40);     /* P */
+        g_assert_cmpuint(d[0] & 0x08, ==, item->prev ? 0 : 0x08);   /* B */
+        g_assert_cmpuint(d[0] & 0x04, ==, item->next ? 0 : 0x04);   /* E */
+        g_assert_cmpuint(((d[1] & 0x7f) << 8) | d[2], ==, picture_id);
+
+        if ( d[0] & 0x02 ) {
+            g_assert(keyframe && item->prev == NULL);
+            g_assert_cmpuint(d[3], ==, 0x10);
+            g_assert_cmpuint((d[4] << 8) | d[5], ==, 352);
+            g_assert_cmpuint((d[6] << 8) | d[7], ==, 288);
+            header += 5;
+        } else
+            g_assert(!keyframe || item->prev != NULL);
+
+        g_byte_array_append(rebuilt, d + header, buffer->data_size - header);
+    }
+
+    g_assert_cmpuint(rebuilt->len, ==, frame->len);
+    g_assert(memcmp(rebuilt->data, frame->data, frame->len) == 0);
+
+    g_byte_array_free(rebuilt, true);
+}
+
+void test_vp9_payload()
+{
+    GByteArray *key = sample_frame(vp9_key, sizeof(vp9_key), 4000);
+    GByteArray *inter = sample_frame(vp9_inter, sizeof(vp9_inter), 200);
+    GQueue packets = G_QUEUE_INIT;
+
+    vp9_payload(&packets, key->data, key->len, 0x1234);
+    g_assert_cmpuint(packets.length, ==, 3);
+    check_vp9(&packets, key, true, 0x1234);
+    payload_free(&packets);
+
+    vp9_payload(&packets, inter->data, inter->len, 0x7fff);
+    g_assert_cmpuint(packets.length, ==, 1);
+    check_vp9(&packets, inter, false, 0x7fff);
+    payload_free(&packets);
+
+    g_byte_array_free(key, true);
+    g_byte_array_free(inter, true);
+}
+
+static void append_obu(GByteArray *tu, uint8_t type, int layer,
+                       size_t size, uint8_t first)
+{
+    uint8_t header[2] = { (type << 3) | 0x02, 0 };
+    uint8_t length[8];
+    size_t n = 0, i;
+
+    if ( layer >= 0 ) {
+        header[0] |= 0x04;
+        header[1] = layer << 3;
+    }
+    g_byte_array_append(tu, header, layer >= 0 ? 2 : 1);
+
+    i = size;
+    do {
+        length[n] = (i & 0x7f) | (i > 0x7f ? 0x80 : 0);
+        i >>= 7;
+        n++;
+    } while ( i );
+    g_byte_array_append(tu, length, n);
+
+    for ( i = 0; i < size; i++ ) {
+        const uint8_t byte = i ? i * 13 : first;
+        g_byte_array_append(tu, &byte, 1);
+    }
+}
+
+/**
+ * Rebuild the OBUs sent, without their size field, checking the
+ * aggregation headers on the way.
+ */
+static GPtrArray *depacketize_av1(GQueue *packets)
+{
+    GPtrArray *obus = g_ptr_array_new();
+    GByteArray *obu = NULL;
+    GList *item;
+
+    for ( item = packets->head; item; item = item->next ) {
+        const struct MParserBuffer *buffer = item->data;
+        const uint8_t *p = buffer->data + 1, *end = buffer->data + buffer->data_size;
+        const uint8_t aggregation = buffer->data[0];
+
+        g_assert_cmpuint(buffer->data_size, <=, DEFAULT_MTU);
+        g_assert(buffer->marker == (item->next == NULL));
+        g_assert_cmpuint(aggregation & 0x30, ==, 0);                /* W */
+        g_assert_cmpuint(aggregation & 0x80, ==, obu ? 0x80 : 0);   /* Z */
+
+        while ( p < end ) {
+            size_t len = 0, shift = 0;
+
+            do {
+                len |= (size_t)(*p & 0x7f) << shift;
+                shift += 7;
+            } while ( *p++ & 0x80 );
+
+            g_assert_cmpuint(len, <=, (size_t)(end - p));
+
+            if ( obu == NULL )
+                obu = g_byte_array_new();
+            g_byte_array_append(obu, p, len);
+            p += len;
+
+            if ( p < end || !(aggregation & 0x40) ) {
+                g_ptr_array_add(obus, obu);
+                obu = NULL;
+            }
+        }
+    }
+
+    g_assert(obu == NULL);
+    return obus;
+}
+
+static void free_obus(GPtrArray *obus)
+{
+    guint i;
+
+    for ( i = 0; i < obus->len; i++ )
+        g_byte_array_free(g_ptr_array_index(obus, i), true);
+    g_ptr_array_free(obus, true);
+}
+
+void test_av1_payload()
+{
+    GByteArray *tu = g_byte_array_new();
+    GQueue packets = G_QUEUE_INIT;
+    GPtrArray *obus;
+    const GByteArray *frame;
+
+    /* keyframe: temporal delimiter, sequence header and a large frame */
+    append_obu(tu, 2, -1, 0, 0);
+    append_obu(tu, 1, -1, 10, 0x00);
+    append_obu(tu, 6, -1, 3000, 0x10);
+
+    g_assert(av1_payload(&packets, tu->data, tu->len, NULL, 0));
+    g_assert_cmpuint(packets.length, ==, 3);
+    g_assert(((struct MParserBuffer*)packets.head->data)->keyframe);
+    g_assert(((struct MParserBuffer*)packets.head->data)->data[0] & 0x08);  /* N */
+    g_assert(!(((struct MParserBuffer*)packets.head->next->data)->data[0] & 0x08));
+
+    obus = depacketize_av1(&packets);
+    g_assert_cmpuint(obus->len, ==, 2);
+
+    frame = g_ptr_array_index(obus, 1);
+    g_assert_cmpuint(frame->len, ==, 1 + 3000);
+    g_assert_cmpuint(frame->data[0], ==, 6 << 3);       /* no size field */
+    g_assert(memcmp(frame->data + 1, tu->data + tu->len - 3000, 3000) == 0);
+
+    free_obus(obus);
+    payload_free(&packets);
+    g_byte_array_set_size(tu, 0);
+
+    /* interframe in two spatial layers: one packet per layer */
+    append_obu(tu, 2, -1, 0, 0);
+    append_obu(tu, 6, 0, 100, 0x30);
+    append_obu(tu, 6, 1, 100, 0x30);
+
+    g_assert(av1_payload(&packets, tu->data, tu->len, NULL, 0));
+    g_assert_cmpuint(packets.length, ==, 2);
+    g_assert(!((struct MParserBuffer*)packets.head->data)->keyframe);
+    g_assert_cmpuint(((struct MParserBuffer*)packets.head->data)->spatial_id, ==, 0);
+    g_assert_cmpuint(((struct MParserBuffer*)packets.tail->data)->spatial_id, ==, 1);
+    g_assert(!(((struct MParserBuffer*)packets.head->data)->data[0] & 0x08));
+
+    obus = depacketize_av1(&packets);
+    g_assert_cmpuint(obus->len, ==, 2);
+    free_obus(obus);
+    payload_free(&packets);
+
+    /* truncated OBU */
+    g_byte_array_set_size(tu, tu->len - 1);
+    g_assert(!av1_payload(&packets, tu->data, tu->len, NULL, 0));
+    g_assert(g_queue_is_empty(&packets));
+
+    g_byte_array_free(tu, true);
+}
+
+/**
+ * Keyframes without a sequence header get the one of the av1C box.
+ */
+void test_av1_payload_config()
+{
+    GByteArray *tu = g_byte_array_new();
+    GByteArray *config = g_byte_array_new();
+    GQueue packets = G_QUEUE_INIT;
+    GPtrArray *obus;
+
+    append_obu(config, 1, -1, 10, 0x00);
+    append_obu(tu, 6, -1, 50, 0x10);
+
+    g_assert(av1_payload(&packets, tu->data, tu->len, config->data, config->len));
+    g_assert_cmpuint(packets.length, ==, 1);
+    g_assert(((struct MParserBuffer*)packets.head->data)->data[0] & 0x08);
+
+    obus = depacketize_av1(&packets);
+    g_assert_cmpuint(obus->len, ==, 2);
+    g_assert_cmpuint(((GByteArray*)g_ptr_array_index(obus, 0))->data[0], ==, 1 << 3);
+    free_obus(obus);
+    payload_free(&packets);
+
+    g_byte_array_free(tu, true);
+    g_byte_array_free(config, true);
+}
@@ -0,0 +1,68 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include "rtsp.h"
+
+/* the same starting values as the PLAY method */
+static void parse_range(const char *header, RTSP_Range *range)
+{
+    range->begin_time = 0;
+    range->end_time = -0.1;
+    range->playback_time = -0.1;
+
+    g_assert(ragel_parse_range_header(header, range));
+}
+
+void test_range_header_bounded_seekable()
+{
+    RTSP_Range range;
+
+    parse_range("npt=10-20", &range);
+
+    g_assert_cmpfloat(range.begin_time, ==, 10);
+    g_assert_cmpfloat(range.end_time, ==, 20);
+    g_assert(rtsp_range_allowed(&range, true));
+}
+
+void test_range_header_open_seekable()
+{
+    RTSP_Range range;
+
+    parse_range("npt=10-", &range);
+
+    g_assert_cmpfloat(range.begin_time, ==, 10);
+    g_assert(rtsp_range_allowed(&range, true));
+}
+
+void test_range_header_live()
+{
+    RTSP_Range range;
+
+    parse_range("npt=0-", &range);
+    g_assert(rtsp_range_allowed(&range, false));
+
+    parse_range("npt=0-20", &range);
+    g_assert(!rtsp_range_allowed(&range, false));
+
+    parse_range("npt=10-", &range);
+    g_assert(!rtsp_range_allowed(&range, false));
+}
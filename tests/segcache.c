@@ -0,0 +1,499 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "src/media/media.h"
+#include <glib.h>
+#include "gtest-extra.h"
+
+#define FILE_SIZE 10000
+#define SEGMENT_SIZE 4096
+#define READERS 4
+
+static uint8_t file_byte(int64_t pos)
+{
+    return (pos * 7 + pos / 251) & 0xff;
+}
+
+/**
+ * Create a directory standing in for the origin, holding a single
+ * file of FILE_SIZE bytes.
+ */
+static char *origin_new()
+{
+    char *dir = g_strdup("/tmp/feng-origin-XXXXXX");
+    char *path;
+    uint8_t *data = g_malloc(FILE_SIZE);
+    int64_t i;
+
+    g_assert(mkdtemp(dir) != NULL);
+
+    for ( i = 0; i < FILE_SIZE; i++ )
+        data[i] = file_byte(i);
+
+    path = g_build_filename(dir, "test.mov", NULL);
+    g_assert(g_file_set_contents(path, (char*)data, FILE_SIZE, NULL));
+
+    g_free(path);
+    g_free(data);
+
+    return dir;
+}
+
+static void dir_remove(char *dir)
+{
+    GDir *gdir = g_dir_open(dir, 0, NULL);
+    const char *name;
+
+    while ( gdir && (name = g_dir_read_name(gdir)) != NULL ) {
+        char *path = g_build_filename(dir, name, NULL);
+        unlink(path);
+        g_free(path);
+    }
+
+    if ( gdir )
+        g_dir_close(gdir);
+
+    rmdir(dir);
+    g_free(dir);
+}
+
+/**
+ * Read the whole test file through the cache, checking its contents.
+ */
+static void read_all(SegmentCache *sc, time_t mtime)
+{
+    uint8_t buf[1000];
+    int64_t pos = 0;
+
+    while ( pos < FILE_SIZE ) {
+        int len = segcache_read(sc, "test.mov", mtime, FILE_SIZE,
+                                pos, buf, sizeof(buf));
+        int i;
+
+        g_assert_cmpint(len, >, 0);
+        /* reads never cross the end of a segment */
+        g_assert_cmpint(pos / SEGMENT_SIZE, ==, (pos + len - 1) / SEGMENT_SIZE);
+
+        for ( i = 0; i < len; i++ )
+            g_assert_cmpuint(buf[i], ==, file_byte(pos + i));
+
+        pos += len;
+    }
+
+    g_assert_cmpint(segcache_read(sc, "test.mov", mtime, FILE_SIZE,
+                                  pos, buf, sizeof(buf)), ==, 0);
+}
+
+void test_segcache_read()
+{
+    char *origin = origin_new();
+    SegmentCache *sc = segcache_new(origin, NULL, SEGMENT_SIZE, 1024*1024, 2);
+    SegmentCacheStats stats;
+    int64_t size;
+    time_t mtime;
+
+    g_assert(sc != NULL);
+    g_assert(segcache_stat(sc, "test.mov", &size, &mtime));
+    g_assert_cmpint(size, ==, FILE_SIZE);
+
+    read_all(sc, mtime);
+    read_all(sc, mtime);
+
+    /* each segment is fetched once, prefetched or not */
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.misses, ==, 3);
+    g_assert_cmpuint(stats.origin_bytes, ==, FILE_SIZE);
+    g_assert_cmpuint(stats.errors, ==, 0);
+
+    segcache_free(sc);
+    dir_remove(origin);
+}
+
+void test_segcache_disk()
+{
+    char *origin = origin_new();
+    char *cache_dir = g_strdup("/tmp/feng-cache-XXXXXX");
+    char *path = g_build_filename(origin, "test.mov", NULL);
+    SegmentCache *sc;
+    SegmentCacheStats stats;
+
+    g_assert(mkdtemp(cache_dir) != NULL);
+
+    sc = segcache_new(origin, cache_dir, SEGMENT_SIZE, 1024*1024, 2);
+    read_all(sc, 1);
+    segcache_free(sc);
+
+    /* the origin is gone, the segments are all on the local disk */
+    unlink(path);
+
+    sc = segcache_new(origin, cache_dir, SEGMENT_SIZE, 1024*1024, 2);
+    read_all(sc, 1);
+
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.disk_hits, ==, 3);
+    g_assert_cmpuint(stats.misses, ==, 0);
+
+    segcache_free(sc);
+
+    g_free(path);
+    dir_remove(cache_dir);
+    dir_remove(origin);
+}
+
+void test_segcache_evict()
+{
+    char *origin = origin_new();
+    SegmentCache *sc = segcache_new(origin, NULL, SEGMENT_SIZE, SEGMENT_SIZE, 0);
+    SegmentCacheStats stats;
+    uint8_t buf[16];
+
+    g_assert_cmpint(segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf)), ==, sizeof(buf));
+    g_assert_cmpint(segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf)), ==, sizeof(buf));
+    g_assert_cmpint(segcache_read(sc, "test.mov", 1, FILE_SIZE, SEGMENT_SIZE, buf, sizeof(buf)), ==, sizeof(buf));
+    g_assert_cmpint(segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf)), ==, sizeof(buf));
+
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.ram_hits, ==, 1);
+    g_assert_cmpuint(stats.misses, ==, 3);
+
+    segcache_free(sc);
+    dir_remove(origin);
+}
+
+void test_segcache_hot()
+{
+    char *origin = origin_new();
+    SegmentCache *sc = segcache_new(origin, NULL, SEGMENT_SIZE, SEGMENT_SIZE, 0);
+    SegmentCacheStats stats;
+    gint64 first = -1, second = -1;
+    uint8_t buf[16];
+
+    /* two readers of the first segment, one of the second */
+    segcache_touch(sc, "test.mov", 1, 0, &first);
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf));
+    segcache_touch(sc, "test.mov", 1, 0, &second);
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf));
+    segcache_touch(sc, "test.mov", 1, SEGMENT_SIZE, &first);
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, SEGMENT_SIZE, buf, sizeof(buf));
+
+    /* the most accessed segment stays in memory */
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf));
+
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.ram_hits, ==, 2);
+    g_assert_cmpuint(stats.misses, ==, 2);
+
+    segcache_free(sc);
+    dir_remove(origin);
+}
+
+void test_segcache_admit()
+{
+    char *origin = origin_new();
+    char *cache_dir = g_strdup("/tmp/feng-cache-XXXXXX");
+    SegmentCache *sc;
+    SegmentCacheStats stats;
+    gint64 first = -1, second = -1;
+    uint8_t buf[16];
+
+    g_assert(mkdtemp(cache_dir) != NULL);
+
+    sc = segcache_new(origin, cache_dir, SEGMENT_SIZE, 1024*1024, 0);
+    segcache_set_disk_policy(sc, 0, 2);
+
+    segcache_touch(sc, "test.mov", 1, 0, &first);
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf));
+    segcache_touch(sc, "test.mov", 1, SEGMENT_SIZE, &first);
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, SEGMENT_SIZE, buf, sizeof(buf));
+
+    /* reading the same segment again is not a new access */
+    segcache_touch(sc, "test.mov", 1, SEGMENT_SIZE + 1, &first);
+
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.disk_stores, ==, 0);
+
+    /* the second reader makes the first segment worth keeping */
+    segcache_touch(sc, "test.mov", 1, 0, &second);
+
+    /* freeing waits for the segment being stored */
+    segcache_free(sc);
+
+    sc = segcache_new(origin, cache_dir, SEGMENT_SIZE, 1024*1024, 0);
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf));
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, SEGMENT_SIZE, buf, sizeof(buf));
+
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.disk_hits, ==, 1);
+    g_assert_cmpuint(stats.misses, ==, 1);
+    g_assert_cmpuint(stats.disk_bytes, ==, 2 * SEGMENT_SIZE);
+
+    segcache_free(sc);
+
+    dir_remove(cache_dir);
+    dir_remove(origin);
+}
+
+void test_segcache_disk_size()
+{
+    char *origin = origin_new();
+    char *cache_dir = g_strdup("/tmp/feng-cache-XXXXXX");
+    SegmentCache *sc;
+    SegmentCacheStats stats;
+
+    g_assert(mkdtemp(cache_dir) != NULL);
+
+    sc = segcache_new(origin, cache_dir, SEGMENT_SIZE, 1024*1024, 0);
+    segcache_set_disk_policy(sc, SEGMENT_SIZE, 1);
+    read_all(sc, 1);
+
+    /* only the last segment fits */
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.disk_stores, ==, 3);
+    g_assert_cmpuint(stats.disk_evictions, ==, 2);
+    g_assert_cmpuint(stats.disk_bytes, ==, FILE_SIZE - 2 * SEGMENT_SIZE);
+
+    segcache_free(sc);
+
+    /* the files left are accounted again */
+    sc = segcache_new(origin, cache_dir, SEGMENT_SIZE, 1024*1024, 0);
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.disk_bytes, ==, FILE_SIZE - 2 * SEGMENT_SIZE);
+    segcache_free(sc);
+
+    dir_remove(cache_dir);
+    dir_remove(origin);
+}
+
+void test_segcache_mtime()
+{
+    char *origin = origin_new();
+    SegmentCache *sc = segcache_new(origin, NULL, SEGMENT_SIZE, 1024*1024, 0);
+    SegmentCacheStats stats;
+    uint8_t buf[16];
+
+    /* a changed file does not reuse the old segments */
+    segcache_read(sc, "test.mov", 1, FILE_SIZE, 0, buf, sizeof(buf));
+    segcache_read(sc, "test.mov", 2, FILE_SIZE, 0, buf, sizeof(buf));
+
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.misses, ==, 2);
+
+    segcache_free(sc);
+    dir_remove(origin);
+}
+
+static gpointer reader_thread(gpointer sc)
+{
+    uint8_t buf[SEGMENT_SIZE];
+
+    return GINT_TO_POINTER(segcache_read(sc, "test.mov", 1, FILE_SIZE,
+                                         0, buf, sizeof(buf)));
+}
+
+void test_segcache_coalesce()
+{
+    char *origin = origin_new();
+    SegmentCache *sc = segcache_new(origin, NULL, SEGMENT_SIZE, 1024*1024, 0);
+    SegmentCacheStats stats;
+    GThread *threads[READERS];
+    int i;
+
+    for ( i = 0; i < READERS; i++ )
+        threads[i] = g_thread_create(reader_thread, sc, true, NULL);
+
+    for ( i = 0; i < READERS; i++ )
+        g_assert_cmpint(GPOINTER_TO_INT(g_thread_join(threads[i])), ==, SEGMENT_SIZE);
+
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.misses, ==, 1);
+    g_assert_cmpuint(stats.ram_hits + stats.coalesced, ==, READERS - 1);
+
+    segcache_free(sc);
+    dir_remove(origin);
+}
+
+void test_segcache_missing()
+{
+    char *origin = origin_new();
+    SegmentCache *sc = segcache_new(origin, NULL, SEGMENT_SIZE, 1024*1024, 0);
+    SegmentCacheStats stats;
+    uint8_t buf[16];
+    int64_t size;
+    time_t mtime;
+
+    g_assert(!segcache_stat(sc, "missing.mov", &size, &mtime));
+    g_assert_cmpint(segcache_read(sc, "missing.mov", 1, FILE_SIZE, 0, buf, sizeof(buf)), ==, -1);
+
+    segcache_get_stats(sc, &stats);
+    g_assert_cmpuint(stats.errors, ==, 1);
+
+    segcache_free(sc);
+    dir_remove(origin);
+}
+
+void test_segcache_invalid_origin()
+{
+    g_assert(segcache_new("ftp://example.com/", NULL, SEGMENT_SIZE, 0, 0) == NULL);
+    g_assert(segcache_new("http:///media", NULL, SEGMENT_SIZE, 0, 0) == NULL);
+}
+
+/**
+ * Listen on a local port standing in for an HTTP origin, which gives
+ * the same canned response to each request.
+ */
+typedef struct {
+    int fd;
+    const char *response;
+    int requests;
+} HTTPOrigin;
+
+static gpointer http_origin_thread(gpointer origin_p)
+{
+    HTTPOrigin *origin = origin_p;
+    int i;
+
+    for ( i = 0; i < origin->requests; i++ ) {
+        char request[4096];
+        size_t got = 0;
+        int fd = accept(origin->fd, NULL, NULL);
+
+        g_assert(fd >= 0);
+
+        while ( g_strstr_len(request, got, "\r\n\r\n") == NULL ) {
+            ssize_t res = read(fd, request + got, sizeof(request) - got);
+            g_assert(res > 0);
+            got += res;
+        }
+
+        g_assert(write(fd, origin->response, strlen(origin->response)) ==
+                 (ssize_t)strlen(origin->response));
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static SegmentCache *http_origin_new(HTTPOrigin *origin, GThread **thread)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    SegmentCache *sc;
+    char *url;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    origin->fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(origin->fd >= 0);
+    g_assert(bind(origin->fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    g_assert(listen(origin->fd, 1) == 0);
+    g_assert(getsockname(origin->fd, (struct sockaddr*)&addr, &len) == 0);
+
+    url = g_strdup_printf("http://127.0.0.1:%d/media", ntohs(addr.sin_port));
+    sc = segcache_new(url, NULL, SEGMENT_SIZE, 1024*1024, 0);
+    g_free(url);
+
+    *thread = g_thread_create(http_origin_thread, origin, true, NULL);
+
+    return sc;
+}
+
+static void http_origin_free(HTTPOrigin *origin, GThread *thread,
+                             SegmentCache *sc)
+{
+    g_thread_join(thread);
+    close(origin->fd);
+    segcache_free(sc);
+}
+
+void test_segcache_http_range_mismatch()
+{
+    HTTPOrigin origin = {
+        .response = "HTTP/1.1 206 Partial Content\r\n"
+                    "Content-Range: bytes 5-5/10\r\n"
+                    "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                    "\r\n"
+                    "x",
+        .requests = 1
+    };
+    GThread *thread;
+    SegmentCache *sc = http_origin_new(&origin, &thread);
+    int64_t size;
+    time_t mtime;
+
+    /* the range asked for starts at 0 */
+    g_assert(!segcache_stat(sc, "test.mov", &size, &mtime));
+
+    http_origin_free(&origin, thread, sc);
+}
+
+void test_segcache_http_etag()
+{
+    HTTPOrigin origin = {
+        .response = "HTTP/1.1 206 Partial Content\r\n"
+                    "Content-Range: bytes 0-0/10\r\n"
+                    "ETag: \"1234\"\r\n"
+                    "\r\n"
+                    "x",
+        .requests = 2
+    };
+    GThread *thread;
+    SegmentCache *sc = http_origin_new(&origin, &thread);
+    int64_t size;
+    time_t first, second;
+
+    g_assert(segcache_stat(sc, "test.mov", &size, &first));
+    g_assert(segcache_stat(sc, "test.mov", &size, &second));
+    g_assert_cmpint(size, ==, 10);
+    g_assert(first != 0);
+    g_assert(first == second);
+
+    http_origin_free(&origin, thread, sc);
+}
+
+void test_segcache_http_unversioned()
+{
+    HTTPOrigin origin = {
+        .response = "HTTP/1.1 206 Partial Content\r\n"
+                    "Content-Range: bytes 0-0/10\r\n"
+                    "\r\n"
+                    "x",
+        .requests = 1
+    };
+    GThread *thread;
+    SegmentCache *sc = http_origin_new(&origin, &thread);
+    int64_t size;
+    time_t mtime;
+
+    /* never the same key for all the versions of the file */
+    g_assert(segcache_stat(sc, "test.mov", &size, &mtime));
+    g_assert(mtime != 0);
+
+    http_origin_free(&origin, thread, sc);
+}
@@ -0,0 +1,155 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <string.h>
+
+#include "src/media/media.h"
+#include <glib.h>
+#include "gtest-extra.h"
+
+/** The byte by byte search the parsers used to do */
+static const uint8_t *reference_find(const uint8_t *p, const uint8_t *end)
+{
+    for ( ; end - p >= 3; p++ )
+        if ( p[0] == 0 && p[1] == 0 && p[2] == 1 )
+            return p;
+
+    return end;
+}
+
+/**
+ * Check a scanner against the reference, finding every start code of
+ * the buffer in turn.
+ */
+static void check_scanner(const StartcodeScanner *s,
+                          const uint8_t *p, const uint8_t *end)
+{
+    while ( true ) {
+        const uint8_t *expected = reference_find(p, end);
+        const uint8_t *found = s->find(p, end);
+
+        gte_fail_unless(found == expected,
+                        "%s: start code found at %d instead of %d\n",
+                        s->name, (int)(found - p), (int)(expected - p));
+
+        if ( found == end )
+            break;
+
+        p = found + 1;
+    }
+}
+
+void test_startcode_known()
+{
+    static const uint8_t data[] = {
+        0x00, 0x00, 0x00, 0x01, 0x67, 0x00, 0x00, 0x02,
+        0x00, 0x00, 0x01, 0x68, 0x01, 0x00, 0x00
+    };
+    const uint8_t *end = data + sizeof(data);
+    const StartcodeScanner *s;
+
+    for ( s = startcode_scanners(); s->name; s++ ) {
+        g_assert(s->find(data, end) == data + 1);
+        g_assert(s->find(data + 2, end) == data + 8);
+        g_assert(s->find(data + 9, end) == end);
+        g_assert(s->find(data, data + 3) == data + 3);
+        g_assert(s->find(data, data + 4) == data + 1);
+        g_assert(s->find(end, end) == end);
+
+        check_scanner(s, data, end);
+    }
+
+    g_assert(startcode_find(data + 2, end) == data + 8);
+}
+
+/**
+ * Random buffers, dense in zeros and ones so that start codes and
+ * near misses are frequent, of any length and alignment.
+ */
+void test_startcode_random()
+{
+    uint8_t *data = g_malloc(4096 + 64);
+    guint round;
+
+    for ( round = 0; round < 2000; round++ ) {
+        const guint start = g_test_rand_int_range(0, 64);
+        const guint len = round % 10 == 0 ?
+            g_test_rand_int_range(0, 4096) : g_test_rand_int_range(0, 160);
+        const StartcodeScanner *s;
+        guint i;
+
+        for ( i = 0; i < len; i++ ) {
+            const gint32 r = g_test_rand_int_range(0, 8);
+
+            data[start + i] = r < 5 ? 0 : r < 7 ? 1 : g_test_rand_int();
+        }
+
+        for ( s = startcode_scanners(); s->name; s++ )
+            check_scanner(s, data + start, data + start + len);
+    }
+
+    g_free(data);
+}
+
+/**
+ * Throughput of the scanners on a buffer looking like a coded slice,
+ * with a start code every 64KiB; run with -m perf.
+ */
+void test_startcode_perf()
+{
+    const size_t len = 16 << 20;
+    uint8_t *data;
+    const StartcodeScanner *s;
+    size_t i;
+
+    if ( !g_test_perf() )
+        return;
+
+    data = g_malloc(len);
+    for ( i = 0; i < len; i++ )
+        data[i] = g_test_rand_int_range(2, 256);
+    for ( i = 0; i + 3 < len; i += 65536 )
+        memcpy(data + i, "\x00\x00\x01", 3);
+
+    for ( s = startcode_scanners(); s->name; s++ ) {
+        GTimer *timer = g_timer_new();
+        guint rounds, codes = 0;
+        double rate;
+
+        for ( rounds = 0; rounds < 8; rounds++ ) {
+            const uint8_t *p = data, *end = data + len;
+
+            while ( (p = s->find(p, end)) != end ) {
+                codes++;
+                p++;
+            }
+        }
+
+        g_assert_cmpuint(codes, ==, 8 * ((len - 4) / 65536 + 1));
+
+        rate = 8 * len / g_timer_elapsed(timer, NULL) / 1e6;
+        g_test_maximized_result(rate, "%s: %.0f MB/s", s->name, rate);
+        g_timer_destroy(timer);
+    }
+
+    g_free(data);
+}
@@ -31,3 +31,17 @@ void test_is_unreserved()
     g_assert(!feng_str_is_unreserved("abc*"));
     g_assert(!feng_str_is_unreserved("abcò"));
 }
+
+void test_path_is_safe()
+{
+    g_assert(feng_path_is_safe("/movies/test.mov"));
+    g_assert(feng_path_is_safe("/movies/..test/test..mov"));
+    g_assert(feng_path_is_safe("/movies//test.mov"));
+    g_assert(!feng_path_is_safe(NULL));
+    g_assert(!feng_path_is_safe("/movies/../test.mov"));
+    g_assert(!feng_path_is_safe("/movies/./test.mov"));
+    g_assert(!feng_path_is_safe("/movies/.."));
+    g_assert(!feng_path_is_safe("/movies/."));
+    g_assert(!feng_path_is_safe("../test.mov"));
+    g_assert(!feng_path_is_safe(".."));
+}